@@ -0,0 +1,77 @@
+/*
+ ## Cypress USB 3.0 Platform header file (cyfxdelta.h)
+ ## ===========================
+ ##
+ ##  Copyright Cypress Semiconductor Corporation, 2010-2011,
+ ##  All Rights Reserved
+ ##  UNPUBLISHED, LICENSED SOFTWARE.
+ ##
+ ##  CONFIDENTIAL AND PROPRIETARY INFORMATION
+ ##  WHICH IS THE PROPERTY OF CYPRESS.
+ ##
+ ##  Use of this file is governed
+ ##  by the license agreement included in the file
+ ##
+ ##     <install>/license/license.txt
+ ##
+ ##  where <install> is the Cypress software
+ ##  installation root directory path.
+ ##
+ ## ===========================
+*/
+
+/* This file describes the delta update format applied by the flash programmer. It only uses
+   plain C types, so that the imgdelta utility can include it on the host as well. */
+
+#ifndef _INCLUDED_CYFXDELTA_H_
+#define _INCLUDED_CYFXDELTA_H_
+
+/* Summary
+   Block level delta between two SPI flash images.
+
+   Description
+   A delta file starts with a CyFxDeltaHeader_t and is followed by hdr.opCount operations, in
+   increasing order of destination block. Each operation is a CyFxDeltaOp_t, followed by
+   CY_FX_DELTA_BLOCK_SIZE bytes of data for CY_FX_DELTA_OP_DATA. Blocks of the new image that
+   no operation refers to are left as they are in flash.
+
+   A copy operation reads its source block from the flash as it was before the update. It is
+   only valid if the source block is in the same or a later flash sector than the destination
+   block, because earlier sectors have already been rewritten when it is applied.
+
+   All fields are little endian. The CRCs are the usual CRC-32 (as used by zlib) of the first
+   oldLen / newLen bytes of the flash.
+ */
+
+#define CY_FX_DELTA_MAGIC               (0x44335846)    /* "FX3D" */
+#define CY_FX_DELTA_VERSION             (1)
+#define CY_FX_DELTA_BLOCK_SIZE          (0x1000)        /* Granularity of the delta. */
+#define CY_FX_DELTA_SECTOR_SIZE         (0x10000)       /* SPI flash erase sector size. */
+
+#define CY_FX_DELTA_OP_DATA             (1)             /* Write the block from the data that follows. */
+#define CY_FX_DELTA_OP_COPY             (2)             /* Copy the block from an old block. */
+
+typedef struct CyFxDeltaHeader_t
+{
+    unsigned int   magic;               /* CY_FX_DELTA_MAGIC */
+    unsigned short version;             /* CY_FX_DELTA_VERSION */
+    unsigned short blockSize;           /* CY_FX_DELTA_BLOCK_SIZE */
+    unsigned int   oldLen;              /* Length of the image the delta applies to. */
+    unsigned int   oldCrc;              /* CRC of the image the delta applies to. */
+    unsigned int   newLen;              /* Length of the updated image. */
+    unsigned int   newCrc;              /* CRC of the updated image. */
+    unsigned int   opCount;             /* Number of operations that follow. */
+    unsigned int   reserved;
+} CyFxDeltaHeader_t;
+
+typedef struct CyFxDeltaOp_t
+{
+    unsigned short type;                /* CY_FX_DELTA_OP_DATA or CY_FX_DELTA_OP_COPY */
+    unsigned short block;               /* Destination block index. */
+    unsigned int   source;              /* Source block index for a copy, 0 otherwise. */
+} CyFxDeltaOp_t;
+
+#endif /* _INCLUDED_CYFXDELTA_H_ */
+
+/*[]*/
+
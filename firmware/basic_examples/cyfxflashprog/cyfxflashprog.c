@@ -35,6 +35,7 @@
 #include "cyu3spi.h"
 #include "cyu3uart.h"
 #include "cyfxflashprog.h"
+#include "cyfxdelta.h"
 
 CyU3PThread appThread;                  /* Application thread object. */
 CyBool_t glIsApplnActive = CyFalse;
@@ -52,6 +53,15 @@ CyU3PDmaChannel glI2cRxHandle;   /* I2C Rx channel handle */
 CyU3PDmaChannel glSpiTxHandle;   /* SPI Tx channel handle */
 CyU3PDmaChannel glSpiRxHandle;   /* SPI Rx channel handle */
 
+/* A flash sector is updated in two DMA buffers, as buffer sizes are limited to 16 bits. */
+#define CY_FX_DELTA_BUF_SIZE    (0x8000)
+#define CY_FX_DELTA_BUF_COUNT   (CY_FX_DELTA_SECTOR_SIZE / CY_FX_DELTA_BUF_SIZE)
+
+CyFxDeltaHeader_t glDeltaHdr;                           /* Header of the delta being applied. */
+uint8_t  *glDeltaBuf[CY_FX_DELTA_BUF_COUNT] = { NULL };  /* Contents of the sector being updated. */
+int32_t   glDeltaSector = -1;                           /* Sector held in glDeltaBuf, or -1. */
+CyBool_t  glDeltaActive = CyFalse;                      /* Whether a delta update is in progress. */
+
 /* Initialize the debug module with UART. */
 CyU3PReturnStatus_t
 CyFxDebugInit (
@@ -508,7 +518,11 @@ CyFxFlashProgSpiTransfer (
         buf_p.buffer += glSpiPageSize;
         pageCount --;
 
-        CyU3PThreadSleep (10);
+        /* Reads need no delay: the status is polled before every page anyway. */
+        if (!isRead)
+        {
+            CyU3PThreadSleep (10);
+        }
     }
     return CY_U3P_SUCCESS;
 }
@@ -569,6 +583,277 @@ CyFxFlashProgEraseSector (
     return status;
 }
 
+/* Read or write a range of SPI flash, in pieces of at most one vendor request. */
+static CyU3PReturnStatus_t
+CyFxFlashProgSpiAccess (
+        uint32_t  byteAddress,
+        uint32_t  byteCount,
+        uint8_t  *buffer,
+        CyBool_t  isRead)
+{
+    uint16_t size;
+    CyU3PReturnStatus_t status = CY_U3P_SUCCESS;
+
+    while ((byteCount != 0) && (status == CY_U3P_SUCCESS))
+    {
+        size   = (byteCount > sizeof (glEp0Buffer)) ? sizeof (glEp0Buffer) : byteCount;
+        status = CyFxFlashProgSpiTransfer (byteAddress / glSpiPageSize, size, buffer, isRead);
+
+        byteAddress += size;
+        buffer      += size;
+        byteCount   -= size;
+    }
+
+    return status;
+}
+
+/* CRC-32 as used by zlib, computed a bit at a time to avoid a table. */
+static uint32_t
+CyFxFlashProgCrc32 (
+        uint32_t       crc,
+        const uint8_t *buffer,
+        uint32_t       length)
+{
+    uint32_t i;
+
+    crc = ~crc;
+    while (length--)
+    {
+        crc ^= *buffer++;
+        for (i = 0; i < 8; i++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+
+    return ~crc;
+}
+
+/* Sector buffers are released and the update is dropped. The flash is left as it is. */
+static void
+CyFxFlashProgDeltaAbort (
+        void)
+{
+    uint32_t i;
+
+    for (i = 0; i < CY_FX_DELTA_BUF_COUNT; i++)
+    {
+        if (glDeltaBuf[i] != NULL)
+        {
+            CyU3PDmaBufferFree (glDeltaBuf[i]);
+            glDeltaBuf[i] = NULL;
+        }
+    }
+
+    glDeltaSector = -1;
+    glDeltaActive = CyFalse;
+}
+
+/* Read or write the sector held in the delta buffers. */
+static CyU3PReturnStatus_t
+CyFxFlashProgDeltaSector (
+        CyBool_t isRead)
+{
+    uint32_t i;
+    CyU3PReturnStatus_t status = CY_U3P_SUCCESS;
+
+    if (glDeltaSector < 0)
+    {
+        return CY_U3P_SUCCESS;
+    }
+    if (!isRead)
+    {
+        status = CyFxFlashProgEraseSector (CyTrue, glDeltaSector, NULL);
+    }
+
+    for (i = 0; (i < CY_FX_DELTA_BUF_COUNT) && (status == CY_U3P_SUCCESS); i++)
+    {
+        status = CyFxFlashProgSpiAccess (glDeltaSector * CY_FX_DELTA_SECTOR_SIZE + i * CY_FX_DELTA_BUF_SIZE,
+                CY_FX_DELTA_BUF_SIZE, glDeltaBuf[i], isRead);
+    }
+
+    return status;
+}
+
+/* CRC of the first length bytes of the SPI flash. The first sector buffer is used for the reads. */
+static CyU3PReturnStatus_t
+CyFxFlashProgSpiCrc (
+        uint32_t  length,
+        uint32_t *crc)
+{
+    uint32_t address = 0, size;
+    CyU3PReturnStatus_t status = CY_U3P_SUCCESS;
+
+    *crc = 0;
+    while ((address < length) && (status == CY_U3P_SUCCESS))
+    {
+        size   = ((length - address) > CY_FX_DELTA_BUF_SIZE) ? CY_FX_DELTA_BUF_SIZE : (length - address);
+        status = CyFxFlashProgSpiAccess (address, size, glDeltaBuf[0], CyTrue);
+        if (status == CY_U3P_SUCCESS)
+        {
+            *crc = CyFxFlashProgCrc32 (*crc, glDeltaBuf[0], size);
+        }
+        address += size;
+    }
+
+    return status;
+}
+
+/* Start a delta update: check the header and the image currently in flash. */
+static CyU3PReturnStatus_t
+CyFxFlashProgDeltaStart (
+        uint8_t  *data,
+        uint16_t  length)
+{
+    uint32_t i, crc;
+    CyU3PReturnStatus_t status;
+
+    CyFxFlashProgDeltaAbort ();
+
+    if (length < sizeof (CyFxDeltaHeader_t))
+    {
+        return CY_U3P_ERROR_BAD_ARGUMENT;
+    }
+    CyU3PMemCopy ((uint8_t *)&glDeltaHdr, data, sizeof (CyFxDeltaHeader_t));
+    if ((glDeltaHdr.magic != CY_FX_DELTA_MAGIC) || (glDeltaHdr.version != CY_FX_DELTA_VERSION) ||
+            (glDeltaHdr.blockSize != CY_FX_DELTA_BLOCK_SIZE))
+    {
+        CyU3PDebugPrint (2, "Delta header not supported\r\n");
+        return CY_U3P_ERROR_BAD_ARGUMENT;
+    }
+
+    /* A 64 KB sector does not fit in one DMA buffer. */
+    for (i = 0; i < CY_FX_DELTA_BUF_COUNT; i++)
+    {
+        glDeltaBuf[i] = (uint8_t *)CyU3PDmaBufferAlloc (CY_FX_DELTA_BUF_SIZE);
+        if (glDeltaBuf[i] == NULL)
+        {
+            CyU3PDebugPrint (2, "Failed to allocate delta sector buffer\r\n");
+            CyFxFlashProgDeltaAbort ();
+            return CY_U3P_ERROR_MEMORY_ERROR;
+        }
+    }
+
+    status = CyFxFlashProgSpiCrc (glDeltaHdr.oldLen, &crc);
+    if ((status == CY_U3P_SUCCESS) && (crc != glDeltaHdr.oldCrc))
+    {
+        CyU3PDebugPrint (2, "Flash CRC 0x%x does not match delta base 0x%x\r\n", crc, glDeltaHdr.oldCrc);
+        status = CY_U3P_ERROR_FAILURE;
+    }
+    if (status != CY_U3P_SUCCESS)
+    {
+        CyFxFlashProgDeltaAbort ();
+        return status;
+    }
+
+    glDeltaActive = CyTrue;
+    return CY_U3P_SUCCESS;
+}
+
+/* Apply one delta operation to the sector buffers, writing back the previous sector first when
+   the operation moves on to a new one. */
+static CyU3PReturnStatus_t
+CyFxFlashProgDeltaBlock (
+        uint16_t  type,
+        uint16_t  block,
+        uint8_t  *data,
+        uint16_t  length)
+{
+    uint32_t offset = block * CY_FX_DELTA_BLOCK_SIZE;
+    int32_t  sector = offset / CY_FX_DELTA_SECTOR_SIZE;
+    uint32_t source, i;
+    uint8_t *dest;
+    CyU3PReturnStatus_t status = CY_U3P_SUCCESS;
+
+    if (!glDeltaActive)
+    {
+        return CY_U3P_ERROR_NOT_STARTED;
+    }
+    if (sector < glDeltaSector)
+    {
+        return CY_U3P_ERROR_INVALID_SEQUENCE;
+    }
+
+    if (sector != glDeltaSector)
+    {
+        status = CyFxFlashProgDeltaSector (CyFalse);
+        if (status == CY_U3P_SUCCESS)
+        {
+            glDeltaSector = sector;
+            status = CyFxFlashProgDeltaSector (CyTrue);
+        }
+        if (status != CY_U3P_SUCCESS)
+        {
+            return status;
+        }
+    }
+
+    offset %= CY_FX_DELTA_SECTOR_SIZE;
+    dest    = glDeltaBuf[offset / CY_FX_DELTA_BUF_SIZE] + (offset % CY_FX_DELTA_BUF_SIZE);
+
+    switch (type)
+    {
+        case CY_FX_DELTA_OP_DATA:
+            if (length != CY_FX_DELTA_BLOCK_SIZE)
+            {
+                return CY_U3P_ERROR_BAD_ARGUMENT;
+            }
+            CyU3PMemCopy (dest, data, CY_FX_DELTA_BLOCK_SIZE);
+            break;
+
+        case CY_FX_DELTA_OP_COPY:
+            if (length != 4)
+            {
+                return CY_U3P_ERROR_BAD_ARGUMENT;
+            }
+            source = data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+            i      = source * CY_FX_DELTA_BLOCK_SIZE;
+
+            /* Sectors before the current one have been rewritten already. The current one is
+               only rewritten once all of its operations are applied, so the flash still holds
+               the old data. */
+            if ((int32_t)(i / CY_FX_DELTA_SECTOR_SIZE) < sector)
+            {
+                return CY_U3P_ERROR_BAD_ARGUMENT;
+            }
+            status = CyFxFlashProgSpiAccess (i, CY_FX_DELTA_BLOCK_SIZE, dest, CyTrue);
+            break;
+
+        default:
+            status = CY_U3P_ERROR_BAD_ARGUMENT;
+            break;
+    }
+
+    return status;
+}
+
+/* Complete a delta update: write back the last sector and compute the CRC of the new image. */
+static CyU3PReturnStatus_t
+CyFxFlashProgDeltaEnd (
+        uint32_t *result)
+{
+    CyU3PReturnStatus_t status;
+
+    if (!glDeltaActive)
+    {
+        return CY_U3P_ERROR_NOT_STARTED;
+    }
+
+    status = CyFxFlashProgDeltaSector (CyFalse);
+    if (status == CY_U3P_SUCCESS)
+    {
+        status = CyFxFlashProgSpiCrc (glDeltaHdr.newLen, &result[0]);
+    }
+    if (status == CY_U3P_SUCCESS)
+    {
+        result[1] = (result[0] == glDeltaHdr.newCrc) ? 0 : 1;
+        CyU3PDebugPrint (2, "Delta applied, CRC 0x%x (expected 0x%x)\r\n", result[0], glDeltaHdr.newCrc);
+    }
+
+    CyFxFlashProgDeltaAbort ();
+    return status;
+}
+
 CyBool_t
 CyFxUSBSetupCB (
         uint32_t setupdat0,
@@ -699,6 +984,34 @@ CyFxUSBSetupCB (
                 }
                 break;
 
+            case CY_FX_RQT_DELTA_START:
+                status = CyU3PUsbGetEP0Data (wLength, glEp0Buffer, NULL);
+                if (status == CY_U3P_SUCCESS)
+                {
+                    status = CyFxFlashProgDeltaStart (glEp0Buffer, wLength);
+                }
+                break;
+
+            case CY_FX_RQT_DELTA_BLOCK:
+                status = CyU3PUsbGetEP0Data (wLength, glEp0Buffer, NULL);
+                if (status == CY_U3P_SUCCESS)
+                {
+                    status = CyFxFlashProgDeltaBlock (wValue, wIndex, glEp0Buffer, wLength);
+                }
+                if (status != CY_U3P_SUCCESS)
+                {
+                    CyFxFlashProgDeltaAbort ();
+                }
+                break;
+
+            case CY_FX_RQT_DELTA_END:
+                status = CyFxFlashProgDeltaEnd ((uint32_t *)glEp0Buffer);
+                if (status == CY_U3P_SUCCESS)
+                {
+                    status = CyU3PUsbSendEP0Data ((wLength > 8) ? 8 : wLength, glEp0Buffer);
+                }
+                break;
+
             default:
                 /* This is unknown request. */
                 isHandled = CyFalse;
@@ -738,6 +1051,8 @@ CyFxUSBEventCB (
             CyU3PDmaChannelReset (&glI2cRxHandle);
             CyU3PDmaChannelReset (&glSpiTxHandle);
             CyU3PDmaChannelReset (&glSpiRxHandle);
+            /* A delta update cannot be resumed after a reset. */
+            CyFxFlashProgDeltaAbort ();
             break;
 
         default:
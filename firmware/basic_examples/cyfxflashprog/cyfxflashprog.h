@@ -76,6 +76,22 @@
  * be 0 before issuing any further transactions. */
 #define CY_FX_RQT_SPI_FLASH_ERASE_POLL          (0xC4)
 
+/* USB vendor request to start a delta update of the SPI flash. The data phase carries the
+ * CyFxDeltaHeader_t of the delta. The request fails if the CRC of the image in flash does not
+ * match the one the delta was computed against. */
+#define CY_FX_RQT_DELTA_START                   (0xC5)
+
+/* USB vendor request to apply one delta operation. The operation type is provided in the value
+ * field and the destination block in the index field. The data phase carries the block data
+ * for a data operation, or the 32-bit source block index for a copy. Operations have to come in
+ * increasing order of destination block. */
+#define CY_FX_RQT_DELTA_BLOCK                   (0xC6)
+
+/* USB vendor request to complete a delta update. Writes back the last sector and returns 8
+ * bytes: the CRC of the updated image as read back from flash, and a status word that is zero
+ * if the CRC matches the one in the delta header. */
+#define CY_FX_RQT_DELTA_END                     (0xC7)
+
 /* Extern definitions for the USB Descriptors */
 extern const uint8_t CyFxUSB20DeviceDscr[];
 extern const uint8_t CyFxUSB30DeviceDscr[];
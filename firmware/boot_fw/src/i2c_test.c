@@ -23,10 +23,9 @@
 #include <cyfx3i2c.h>
 #include <cyfx3device.h>
 #include <cyfx3utils.h>
+#include "mem_copy.h"
 
 static uint32_t i2c_bitrate[] = {400000,350000,300000,250000,200000,150000,100000, 1000000};
-extern void myMemSet (uint8_t *d, uint8_t c, int32_t cnt);
-
 #define I2C_REG_XFER_SIZE       (32)    /*8,16,32,64 sizes tested*/
 #define I2C_PAGE_SIZE           (64)
 #define I2C_DMA_XFER_SIZE       (16)
@@ -0,0 +1,106 @@
+/*
+ ## Cypress FX3 Boot Firmware Example Source file (img_unpack.c)
+ ## ===========================
+ ##
+ ##  Copyright Cypress Semiconductor Corporation, 2011-2012,
+ ##  All Rights Reserved
+ ##  UNPUBLISHED, LICENSED SOFTWARE.
+ ##
+ ##  CONFIDENTIAL AND PROPRIETARY INFORMATION
+ ##  WHICH IS THE PROPERTY OF CYPRESS.
+ ##
+ ##  Use of this file is governed
+ ##  by the license agreement included in the file
+ ##
+ ##     <install>/license/license.txt
+ ##
+ ##  where <install> is the Cypress software
+ ##  installation root directory path.
+ ##
+ ## ===========================
+*/
+
+/* Decoder for the LZ4 records of packed boot images. This file only uses plain C types so that
+   the elf2img utility can build it on the host as well. */
+
+#include "img_unpack.h"
+
+/* Read the extension bytes of a literal or match length. Returns -1 if the input runs out. */
+static int
+imgUnpackLength (
+        const unsigned char **src,
+        const unsigned char  *srcEnd,
+        unsigned int         *len)
+{
+    unsigned int b;
+
+    do
+    {
+        if (*src >= srcEnd)
+            return -1;
+        b     = *(*src)++;
+        *len += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+int
+imgUnpackLz4 (
+        const unsigned char *src,
+        int                  srcLen,
+        unsigned char       *dst,
+        int                  dstLen)
+{
+    const unsigned char *srcEnd = src + srcLen;
+    const unsigned char *match;
+    unsigned char       *d      = dst;
+    unsigned char       *dstEnd = dst + dstLen;
+    unsigned int         token, len, offset;
+
+    while (src < srcEnd)
+    {
+        token = *src++;
+
+        /* Literal run. */
+        len = token >> 4;
+        if ((len == 15) && (imgUnpackLength (&src, srcEnd, &len) != 0))
+            return -1;
+        if ((len > (unsigned int)(srcEnd - src)) || (len > (unsigned int)(dstEnd - d)))
+            return -1;
+        while (len--)
+        {
+            *d++ = *src++;
+        }
+
+        /* The last sequence of a block has no match. */
+        if (src == srcEnd)
+            break;
+
+        if ((srcEnd - src) < 2)
+            return -1;
+        offset = src[0] | (src[1] << 8);
+        src   += 2;
+        if ((offset == 0) || (offset > (unsigned int)(d - dst)))
+            return -1;
+
+        len = token & 0x0F;
+        if ((len == 15) && (imgUnpackLength (&src, srcEnd, &len) != 0))
+            return -1;
+        len += 4;
+        if (len > (unsigned int)(dstEnd - d))
+            return -1;
+
+        /* Copy a byte at a time: a match may overlap the data it produces. */
+        match = d - offset;
+        while (len--)
+        {
+            *d++ = *match++;
+        }
+    }
+
+    return (int)(d - dst);
+}
+
+/*[]*/
+
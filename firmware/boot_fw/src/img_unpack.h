@@ -0,0 +1,83 @@
+/*
+ ## Cypress FX3 Boot Firmware Example Header file (img_unpack.h)
+ ## ===========================
+ ##
+ ##  Copyright Cypress Semiconductor Corporation, 2011-2012,
+ ##  All Rights Reserved
+ ##  UNPUBLISHED, LICENSED SOFTWARE.
+ ##
+ ##  CONFIDENTIAL AND PROPRIETARY INFORMATION
+ ##  WHICH IS THE PROPERTY OF CYPRESS.
+ ##
+ ##  Use of this file is governed
+ ##  by the license agreement included in the file
+ ##
+ ##     <install>/license/license.txt
+ ##
+ ##  where <install> is the Cypress software
+ ##  installation root directory path.
+ ##
+ ## ===========================
+*/
+
+#ifndef _INCLUDED_IMG_UNPACK_H_
+#define _INCLUDED_IMG_UNPACK_H_
+
+/* Summary
+   Packed boot image format.
+
+   Description
+   A packed image starts with the same four byte header as a normal boot image, with the
+   image type byte set to IMG_TYPE_PACKED. Each record that follows has a three word header:
+
+       word 0 : Length of the record in 32-bit words once expanded. 0 marks the end of the image.
+       word 1 : Load address.
+       word 2 : Record type in bits 31:24, and the number of payload bytes in bits 23:0.
+
+   The payload follows the header and is padded to a multiple of four bytes. Zero-fill records
+   have no payload. LZ4 records expand to at most IMG_LZ4_BLOCK_SIZE bytes, so that the packed
+   data always fits in the 4 KB scratch buffer of the boot firmware.
+
+   The end record carries the program entry in word 1 and, in word 2, the sum of all the
+   expanded words of the image, computed as for a normal image.
+
+   This header and img_unpack.c are also built into the elf2img utility, which checks every
+   record it compresses with this decoder.
+ */
+
+#define IMG_TYPE_NORMAL         (0xB0)          /* Normal firmware image with checksum. */
+#define IMG_TYPE_PACKED         (0xB4)          /* Packed image, expanded by the boot firmware. */
+
+#define IMG_REC_RAW             (0)             /* Payload is the data itself. */
+#define IMG_REC_ZERO            (1)             /* Fill with zeros; no payload. */
+#define IMG_REC_LZ4             (2)             /* Payload is an LZ4 block. */
+
+#define IMG_REC_HDR_SIZE        (12)            /* Size of a record header in bytes. */
+#define IMG_LZ4_BLOCK_SIZE      (4096)          /* Largest expanded size of an LZ4 record. */
+
+#define IMG_REC_TYPE(w)         ((w) >> 24)
+#define IMG_REC_PAYLOAD(w)      ((w) & 0x00FFFFFF)
+#define IMG_REC_CODING(t,n)     (((unsigned int)(t) << 24) | ((unsigned int)(n) & 0x00FFFFFF))
+#define IMG_REC_PADDED(n)       (((n) + 3) & ~3)
+
+/* Summary
+   Decode an LZ4 block.
+
+   Description
+   Expands srcLen bytes of LZ4 block data into dst, which has room for dstLen bytes.
+   Matches may only refer back to data written by the same call.
+
+   Return Value
+   Number of bytes written to dst, or -1 if the block is malformed or does not fit.
+ */
+extern int
+imgUnpackLz4 (
+        const unsigned char *src,
+        int                  srcLen,
+        unsigned char       *dst,
+        int                  dstLen);
+
+#endif /* _INCLUDED_IMG_UNPACK_H_ */
+
+/*[]*/
+
@@ -48,33 +48,10 @@ extern CyFx3BootErrorCode_t initSpi (void);
 extern CyBool_t bootFromSpi (void);
 #endif
 
-void 
-myMemCopy (
-        uint8_t *d, 
-        uint8_t *s, 
-        int32_t cnt
-        )
-{
-    int32_t i;
-    for (i = 0; i < cnt; i++)
-    {
-        *d++ = *s++;
-    }
-}
-
-void 
-myMemSet (
-	uint8_t *d, 
-	uint8_t c, 
-	int32_t cnt
-	)
-{
-    int32_t i;
-    for (i = 0; i < cnt; i++)
-    {
-        *d++ = c;
-    }
-}
+/* Defined when building with "make MEM_BENCH=1" */
+#ifdef MEM_BENCH
+extern void benchMemOps (void);
+#endif
 
 /****************************************************************************
  * main:
@@ -121,6 +98,11 @@ int main (
     /* Initialize the GPIO module. Force GPIO[21]/CTL4 low. Then request to retain GPIO state across boot. */
     CyFx3BootGpioInit ();
 
+#ifdef MEM_BENCH
+    /* Time the memory copy and fill routines; see mem_bench.c */
+    benchMemOps ();
+#endif
+
     gpioCfg.outValue    = CyFalse;
     gpioCfg.driveLowEn  = CyTrue;
     gpioCfg.driveHighEn = CyTrue;
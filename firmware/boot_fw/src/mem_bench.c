@@ -0,0 +1,185 @@
+/*
+ ## Cypress FX3 Boot Firmware Example Source file (mem_bench.c)
+ ## ===========================
+ ##
+ ##  Copyright Cypress Semiconductor Corporation, 2011-2012,
+ ##  All Rights Reserved
+ ##  UNPUBLISHED, LICENSED SOFTWARE.
+ ##
+ ##  CONFIDENTIAL AND PROPRIETARY INFORMATION
+ ##  WHICH IS THE PROPERTY OF CYPRESS.
+ ##
+ ##  Use of this file is governed
+ ##  by the license agreement included in the file
+ ##
+ ##     <install>/license/license.txt
+ ##
+ ##  where <install> is the Cypress software
+ ##  installation root directory path.
+ ##
+ ## ===========================
+*/
+
+/* Cycle count benchmark of myMemCopy and myMemSet, built with "make MEM_BENCH=1".
+
+   The ARM926 core has no cycle counter, so the timer of one complex GPIO is used as the time
+   base. It runs from the GPIO fast clock, which CyFx3BootGpioInit sets to a quarter of the
+   system clock. Only the timer is used: the pin itself is neither driven nor sampled.
+
+   Each operation is run MEM_BENCH_REPEAT times for every size and alignment, and the ticks
+   taken, less the cost of reading the timer, are left in glMemBenchTicks. They can be read
+   back with vendor request 0xA0 from the address given for the array in the map file. The
+   byte loops that the boot firmware used before are timed as well, for comparison. */
+
+#include <cyfx3device.h>
+#include "mem_copy.h"
+
+#define MEM_BENCH_TIMER_GPIO    (7)             /* Complex GPIO whose timer is used. */
+#define MEM_BENCH_REPEAT        (16)
+#define MEM_BENCH_MAX_SIZE      (1024)
+
+#define MEM_BENCH_PIN_STATUS    (*(uvint32_t *)(0xE0001000 + MEM_BENCH_TIMER_GPIO * 0x10))
+#define MEM_BENCH_PIN_TIMER     (*(uvint32_t *)(0xE0001004 + MEM_BENCH_TIMER_GPIO * 0x10))
+#define MEM_BENCH_PIN_PERIOD    (*(uvint32_t *)(0xE0001008 + MEM_BENCH_TIMER_GPIO * 0x10))
+#define MEM_BENCH_PIN_THRESHOLD (*(uvint32_t *)(0xE000100C + MEM_BENCH_TIMER_GPIO * 0x10))
+
+#define MEM_BENCH_GPIO_ENABLE   (1u << 31)      /* Enable the GPIO logic of the pin. */
+#define MEM_BENCH_TIMER_FAST    (1u << 28)      /* Timer counts the GPIO fast clock. */
+#define MEM_BENCH_MODE_SAMPLE   (2u << 8)       /* Sample the timer into the threshold register. */
+#define MEM_BENCH_MODE_MASK     (0x00000F00)
+#define MEM_BENCH_INTR          (1u << 27)
+
+typedef enum MemBenchOp_t
+{
+    MEM_BENCH_COPY = 0,                         /* myMemCopy. */
+    MEM_BENCH_COPY_BYTES,                       /* Byte by byte copy. */
+    MEM_BENCH_SET,                              /* myMemSet. */
+    MEM_BENCH_SET_BYTES,                        /* Byte by byte fill. */
+    MEM_BENCH_NUM_OPS
+} MemBenchOp_t;
+
+static const int32_t glMemBenchSize[] = { 16, 64, 256, MEM_BENCH_MAX_SIZE };
+#define MEM_BENCH_NUM_SIZES     (sizeof (glMemBenchSize) / sizeof (glMemBenchSize[0]))
+
+/* Destination and source offsets from a word boundary: both aligned, both misaligned by the
+   same amount, and misaligned with respect to each other. */
+static const uint8_t glMemBenchAlign[][2] = { { 0, 0 }, { 1, 1 }, { 0, 1 } };
+#define MEM_BENCH_NUM_ALIGNS    (sizeof (glMemBenchAlign) / sizeof (glMemBenchAlign[0]))
+
+uint32_t glMemBenchOverhead;
+uint32_t glMemBenchTicks[MEM_BENCH_NUM_OPS][MEM_BENCH_NUM_SIZES][MEM_BENCH_NUM_ALIGNS];
+
+static uint32_t glMemBenchDst[(MEM_BENCH_MAX_SIZE + 4) / 4];
+static uint32_t glMemBenchSrc[(MEM_BENCH_MAX_SIZE + 4) / 4];
+
+static uint32_t
+benchTicks (
+        void)
+{
+    uint32_t status = MEM_BENCH_PIN_STATUS & ~MEM_BENCH_INTR;
+
+    MEM_BENCH_PIN_STATUS = status | MEM_BENCH_MODE_SAMPLE;
+    while (MEM_BENCH_PIN_STATUS & MEM_BENCH_MODE_MASK);
+
+    return MEM_BENCH_PIN_THRESHOLD;
+}
+
+static void
+benchByteCopy (
+        uint8_t *d,
+        uint8_t *s,
+        int32_t cnt
+        )
+{
+    int32_t i;
+    for (i = 0; i < cnt; i++)
+    {
+        *d++ = *s++;
+    }
+}
+
+static void
+benchByteSet (
+        uint8_t *d,
+        uint8_t c,
+        int32_t cnt
+        )
+{
+    int32_t i;
+    for (i = 0; i < cnt; i++)
+    {
+        *d++ = c;
+    }
+}
+
+static uint32_t
+benchRun (
+        MemBenchOp_t op,
+        uint8_t *d,
+        uint8_t *s,
+        int32_t cnt
+        )
+{
+    uint32_t start, ticks;
+    int      i;
+
+    start = benchTicks ();
+    for (i = 0; i < MEM_BENCH_REPEAT; i++)
+    {
+        switch (op)
+        {
+            case MEM_BENCH_COPY:
+                myMemCopy (d, s, cnt);
+                break;
+            case MEM_BENCH_COPY_BYTES:
+                benchByteCopy (d, s, cnt);
+                break;
+            case MEM_BENCH_SET:
+                myMemSet (d, (uint8_t)i, cnt);
+                break;
+            default:
+                benchByteSet (d, (uint8_t)i, cnt);
+                break;
+        }
+    }
+    ticks = benchTicks () - start;
+
+    return (ticks > glMemBenchOverhead) ? (ticks - glMemBenchOverhead) : 0;
+}
+
+/* Runs the benchmark. The GPIO block has to be initialized (CyFx3BootGpioInit) first, and
+   the complex GPIO MEM_BENCH_TIMER_GPIO must not be in use. */
+void
+benchMemOps (
+        void)
+{
+    uint8_t *d, *s;
+    uint32_t op, size, align;
+
+    MEM_BENCH_PIN_STATUS = 0;
+    MEM_BENCH_PIN_TIMER  = 0;
+    MEM_BENCH_PIN_PERIOD = 0xFFFFFFFF;
+    MEM_BENCH_PIN_STATUS = MEM_BENCH_GPIO_ENABLE | MEM_BENCH_TIMER_FAST;
+
+    glMemBenchOverhead = 0;
+    glMemBenchOverhead = benchTicks ();
+    glMemBenchOverhead = benchTicks () - glMemBenchOverhead;
+
+    for (op = 0; op < MEM_BENCH_NUM_OPS; op++)
+    {
+        for (size = 0; size < MEM_BENCH_NUM_SIZES; size++)
+        {
+            for (align = 0; align < MEM_BENCH_NUM_ALIGNS; align++)
+            {
+                d = (uint8_t *)glMemBenchDst + glMemBenchAlign[align][0];
+                s = (uint8_t *)glMemBenchSrc + glMemBenchAlign[align][1];
+                glMemBenchTicks[op][size][align] = benchRun ((MemBenchOp_t)op, d, s,
+                        glMemBenchSize[size]);
+            }
+        }
+    }
+
+    MEM_BENCH_PIN_STATUS = 0;
+}
+
+/*[]*/
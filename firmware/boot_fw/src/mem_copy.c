@@ -0,0 +1,162 @@
+/*
+ ## Cypress FX3 Boot Firmware Example Source file (mem_copy.c)
+ ## ===========================
+ ##
+ ##  Copyright Cypress Semiconductor Corporation, 2011-2012,
+ ##  All Rights Reserved
+ ##  UNPUBLISHED, LICENSED SOFTWARE.
+ ##
+ ##  CONFIDENTIAL AND PROPRIETARY INFORMATION
+ ##  WHICH IS THE PROPERTY OF CYPRESS.
+ ##
+ ##  Use of this file is governed
+ ##  by the license agreement included in the file
+ ##
+ ##     <install>/license/license.txt
+ ##
+ ##  where <install> is the Cypress software
+ ##  installation root directory path.
+ ##
+ ## ===========================
+*/
+
+#include "mem_copy.h"
+
+/* The copy and fill below move eight words per iteration once the destination is word
+   aligned: as LDM/STM bursts with GCC, and as an unrolled word loop that armcc turns into
+   LDM/STM otherwise. Unaligned heads and tails are handled a byte at a time, as are copies
+   whose source and destination can never be word aligned together. */
+#define MEM_BURST_WORDS         (8)
+#define MEM_BURST_SIZE          (MEM_BURST_WORDS * 4)
+
+/* Low address bits of a pointer. Going through unsigned long keeps this free of warnings when
+   the file is built for the host test, where pointers are 64 bits wide. */
+#define MEM_ADDR_BITS(p)        ((uint32_t)(unsigned long)(p) & 3)
+
+void 
+myMemCopy (
+        uint8_t *d, 
+        uint8_t *s, 
+        int32_t cnt
+        )
+{
+    uint32_t *dw, *sw;
+    int32_t   n;
+
+    if (MEM_ADDR_BITS (d) == MEM_ADDR_BITS (s))
+    {
+        while ((cnt > 0) && (MEM_ADDR_BITS (d) != 0))
+        {
+            *d++ = *s++;
+            cnt--;
+        }
+
+        dw  = (uint32_t *)d;
+        sw  = (uint32_t *)s;
+        n   = cnt / MEM_BURST_SIZE;
+        cnt = cnt % MEM_BURST_SIZE;
+
+#if defined (__arm__) && !defined (__CC_ARM)
+        if (n > 0)
+        {
+            __asm__ volatile
+                (
+                 "1:\n\t"
+                 "ldmia %1!, {r3, r4, r5, r6}\n\t"
+                 "stmia %0!, {r3, r4, r5, r6}\n\t"
+                 "ldmia %1!, {r3, r4, r5, r6}\n\t"
+                 "stmia %0!, {r3, r4, r5, r6}\n\t"
+                 "subs %2, %2, #1\n\t"
+                 "bne 1b\n\t"
+                 : "+r" (dw), "+r" (sw), "+r" (n)
+                 :
+                 : "r3", "r4", "r5", "r6", "cc", "memory"
+                );
+        }
+#else
+        for (; n > 0; n--)
+        {
+            dw[0] = sw[0]; dw[1] = sw[1]; dw[2] = sw[2]; dw[3] = sw[3];
+            dw[4] = sw[4]; dw[5] = sw[5]; dw[6] = sw[6]; dw[7] = sw[7];
+            dw += MEM_BURST_WORDS;
+            sw += MEM_BURST_WORDS;
+        }
+#endif
+
+        for (; cnt >= 4; cnt -= 4)
+        {
+            *dw++ = *sw++;
+        }
+
+        d = (uint8_t *)dw;
+        s = (uint8_t *)sw;
+    }
+
+    while (cnt-- > 0)
+    {
+        *d++ = *s++;
+    }
+}
+
+void 
+myMemSet (
+        uint8_t *d, 
+        uint8_t c, 
+        int32_t cnt
+        )
+{
+    uint32_t *dw;
+    uint32_t  w = (uint32_t)c * 0x01010101;
+    int32_t   n;
+
+    while ((cnt > 0) && (MEM_ADDR_BITS (d) != 0))
+    {
+        *d++ = c;
+        cnt--;
+    }
+
+    dw  = (uint32_t *)d;
+    n   = cnt / MEM_BURST_SIZE;
+    cnt = cnt % MEM_BURST_SIZE;
+
+#if defined (__arm__) && !defined (__CC_ARM)
+    if (n > 0)
+    {
+        __asm__ volatile
+            (
+             "mov r3, %2\n\t"
+             "mov r4, %2\n\t"
+             "mov r5, %2\n\t"
+             "mov r6, %2\n\t"
+             "1:\n\t"
+             "stmia %0!, {r3, r4, r5, r6}\n\t"
+             "stmia %0!, {r3, r4, r5, r6}\n\t"
+             "subs %1, %1, #1\n\t"
+             "bne 1b\n\t"
+             : "+r" (dw), "+r" (n)
+             : "r" (w)
+             : "r3", "r4", "r5", "r6", "cc", "memory"
+            );
+    }
+#else
+    for (; n > 0; n--)
+    {
+        dw[0] = w; dw[1] = w; dw[2] = w; dw[3] = w;
+        dw[4] = w; dw[5] = w; dw[6] = w; dw[7] = w;
+        dw += MEM_BURST_WORDS;
+    }
+#endif
+
+    for (; cnt >= 4; cnt -= 4)
+    {
+        *dw++ = w;
+    }
+
+    d = (uint8_t *)dw;
+    while (cnt-- > 0)
+    {
+        *d++ = c;
+    }
+}
+
+/*[]*/
@@ -0,0 +1,48 @@
+/*
+ ## Cypress FX3 Boot Firmware Example Header file (mem_copy.h)
+ ## ===========================
+ ##
+ ##  Copyright Cypress Semiconductor Corporation, 2011-2012,
+ ##  All Rights Reserved
+ ##  UNPUBLISHED, LICENSED SOFTWARE.
+ ##
+ ##  CONFIDENTIAL AND PROPRIETARY INFORMATION
+ ##  WHICH IS THE PROPERTY OF CYPRESS.
+ ##
+ ##  Use of this file is governed
+ ##  by the license agreement included in the file
+ ##
+ ##     <install>/license/license.txt
+ ##
+ ##  where <install> is the Cypress software
+ ##  installation root directory path.
+ ##
+ ## ===========================
+*/
+
+#ifndef _INCLUDED_MEM_COPY_H_
+#define _INCLUDED_MEM_COPY_H_
+
+#include "cyu3types.h"
+
+/* Summary
+   Copy cnt bytes from s to d. The areas must not overlap.
+ */
+extern void
+myMemCopy (
+        uint8_t *d,
+        uint8_t *s,
+        int32_t  cnt);
+
+/* Summary
+   Fill cnt bytes at d with the value c.
+ */
+extern void
+myMemSet (
+        uint8_t *d,
+        uint8_t  c,
+        int32_t  cnt);
+
+#endif /* _INCLUDED_MEM_COPY_H_ */
+
+/*[]*/
@@ -23,11 +23,14 @@
 #include <cyfx3spi.h>
 #include <cyfx3device.h>
 #include <cyfx3utils.h>
+#include "img_unpack.h"
+#include "mem_copy.h"
 
 /*
  * Note: Address of 4 KB DMA scratch buffer used for SPI data transfers. This is located outside of the
  * 32 KB region allocated for the boot firmware code and data, and is expected to overlap the DMA buffer
- * region used by the full FX3 firmware image.
+ * region used by the full FX3 firmware image. ITCM data and LZ4 records pass through it, so the image
+ * should not load anything here; elf2img warns about sections that do.
  *
  * Turn on the CYMEM_256K pre-processor definition to build this binary for the CYUSB3011/CYUSB3012 devices
  * that only have 256 KB of System RAM.
@@ -40,6 +43,27 @@
 
 #define SPI_DMA_XFER_SIZE (64)
 #define SPI_REG_XFER_SIZE (256)
+#define SPI_DMA_BUF_SIZE  (4096)
+#define SPI_DMA_CHUNK_SIZE (0x4000)     /* Size of the image reads done directly to System Memory. */
+#define SPI_DMA_TIMEOUT   (20000)       /* 200 ms, enough for 16 KB at 1 MHz. */
+
+/*
+ * The boot library only waits for SPI DMA transfers inside CyFx3BootSpiDmaXferData, which does not
+ * return before the transfer is complete. To overlap reads with the checksum, the transfer is started
+ * with CyFx3BootDmaXferData and its end is polled for in the SPI interrupt register.
+ */
+#define SPI_INTR_REG            (*(uvint32_t *)(0xE0000C08))
+#define SPI_INTR_RX_DONE        (1u << 0)
+#define SPI_INTR_ERROR          (1u << 6)
+#define SPI_PROD_SOCKET         (0x0007)        /* LPP socket that carries SPI data to memory. */
+
+/*
+ * SPI clock in Hz used to load the image once its header has been validated. When this is left at 0, the
+ * frequency selected by bits 5:4 of the image control byte in the header (10, 20 or 30 MHz) is used.
+ */
+#ifndef SPI_BOOT_CLOCK
+#define SPI_BOOT_CLOCK    (0)
+#endif
 
 /*
    Summary
@@ -66,6 +90,13 @@ static uint32_t spiDmaBitrate[] = {
     1000000
     };
 
+static uint32_t spiBootClock[] = {
+    10000000,
+    20000000,
+    30000000,
+    30000000
+    };
+
 static uint32_t spiBitrate[] = {
     10000000,
     8000000,
@@ -77,7 +108,20 @@ static uint32_t spiBitrate[] = {
     1000000
     };
 
-extern void myMemCopy(uint8_t *d, uint8_t *s, int cnt);
+extern int myCheckAddress(uint32_t address, uint32_t len);
+
+/* Exported by the boot library, but not declared in its headers. Sets up a DMA transfer on an LPP
+   socket and returns without waiting for it. */
+extern void CyFx3BootDmaXferData (CyBool_t isRead, uint16_t socket, uint32_t address, uint32_t length);
+
+/* A chunk of image data that has been read from the SPI flash, but not yet copied from the
+   scratch buffer (if buffer differs from dest) and checksummed. */
+typedef struct SpiChunk_t
+{
+    uint32_t dest;
+    uint32_t buffer;
+    uint32_t length;
+} SpiChunk_t;
 
 CyFx3BootErrorCode_t 
 spiWriteEnable()
@@ -144,17 +188,19 @@ spiReadBytes (
     uint8_t addr[5];
 
     /* TODO: Modify this according to the SPI devices */
-    addr[0] = 0x03;
+    /* Fast read, which unlike 0x03 works at every clock rate used for booting. */
+    addr[0] = 0x0B;
     addr[1] = (address >> 16) & 0xFF;
 
     /* */
     addr[2] = (address >> 8) & 0xFF;
     addr[3] = (address) & 0xFF;
+    addr[4] = 0;
 
     CyFx3BootSpiSetSsnLine(CyFalse);
 
     /* TODO: Modify the length according to the SPI devices */
-    status = CyFx3BootSpiTransmitWords(addr, 4);
+    status = CyFx3BootSpiTransmitWords(addr, 5);
     if (status != CY_FX3_BOOT_SUCCESS)
     {
         return status;
@@ -274,173 +320,405 @@ spiWriteBytes (
     return CY_FX3_BOOT_SUCCESS;
 }
 
-CyBool_t
-bootFromSpi()
+/* Configure the SPI block for flash access at the given clock rate. */
+static CyFx3BootErrorCode_t
+spiSetClock (
+        uint32_t clock)
 {
-    uint8_t buffer[64];
+    CyFx3BootSpiConfig_t spiConfig;
 
-    uint32_t spiAddress = 0;
-    int32_t firmwareImagePtr = 0;
-    int32_t sectionLength;
-    int32_t sectionAddress;
-    int32_t downloadAddress;
-    int32_t bytesLeftToDownload;
-    CyBool_t isTrue = CyTrue;
+    spiConfig.isLsbFirst = CyFalse;
+    spiConfig.cpol       = CyFalse;
+    spiConfig.cpha       = CyFalse;
+    spiConfig.leadTime   = CY_FX3_BOOT_SPI_SSN_LAG_LEAD_HALF_CLK;
+    spiConfig.lagTime    = CY_FX3_BOOT_SPI_SSN_LAG_LEAD_HALF_CLK;
+    spiConfig.ssnCtrl    = CY_FX3_BOOT_SPI_SSN_CTRL_FW;
+    spiConfig.ssnPol     = CyFalse;
+    spiConfig.clock      = clock;
+    spiConfig.wordLen    = 8;
+
+    return CyFx3BootSpiSetConfig(&spiConfig);
+}
+
+/* Start reading length bytes, a multiple of 4 and at most SPI_DMA_CHUNK_SIZE, from the SPI flash
+   into System Memory at address dest, using a fast read command and a DMA transfer. The read
+   is completed with spiFastReadWait. */
+static CyFx3BootErrorCode_t
+spiFastReadStart (
+        uint32_t spiAddress,
+        uint32_t dest,
+        uint32_t length)
+{
     CyFx3BootErrorCode_t status;
-    uint8_t addr[4];
+    uint8_t cmd[5];
 
-    /* Read 4 bytes from the SPI
-       Check "CY" signature (0x43,0x59)
-       */
-    spiAddress = 0;
-    status = spiReadBytes (spiAddress, 4, buffer);
+    /* Fast read command, followed by a 24 bit address and a dummy byte. */
+    cmd[0] = 0x0B;
+    cmd[1] = (spiAddress >> 16) & 0xFF;
+    cmd[2] = (spiAddress >> 8) & 0xFF;
+    cmd[3] = (spiAddress) & 0xFF;
+    cmd[4] = 0;
+
+    CyFx3BootSpiSetSsnLine (CyFalse);
+
+    status = CyFx3BootSpiTransmitWords (cmd, 5);
     if (status != CY_FX3_BOOT_SUCCESS)
     {
-        return CyFalse;
+        CyFx3BootSpiSetSsnLine (CyTrue);
+        return status;
     }
-    status = waitForSpiStatus ();
+
+    SPI_INTR_REG = SPI_INTR_RX_DONE | SPI_INTR_ERROR;
+    CyFx3BootSpiSetBlockXfer (0, length);
+    CyFx3BootDmaXferData (CyTrue, SPI_PROD_SOCKET, dest, length);
+
+    return CY_FX3_BOOT_SUCCESS;
+}
+
+/* Wait for the read started by spiFastReadStart to complete, and return the SPI block to
+   register mode. */
+static CyFx3BootErrorCode_t
+spiFastReadWait (
+        void)
+{
+    CyFx3BootErrorCode_t status = CY_FX3_BOOT_ERROR_TIMEOUT;
+    uint32_t timeout = SPI_DMA_TIMEOUT;
+    uint32_t intr;
+
+    do
+    {
+        intr = SPI_INTR_REG;
+        if ((intr & SPI_INTR_RX_DONE) != 0)
+        {
+            status = CY_FX3_BOOT_SUCCESS;
+            break;
+        }
+
+        if ((intr & SPI_INTR_ERROR) != 0)
+        {
+            status = CY_FX3_BOOT_ERROR_XFER_FAILURE;
+            break;
+        }
+
+        CyFx3BootBusyWait (10);
+    } while (--timeout != 0);
+
+    SPI_INTR_REG = SPI_INTR_RX_DONE | SPI_INTR_ERROR;
+
+    CyFx3BootSpiDisableBlockXfer ();
+    CyFx3BootSpiSetSsnLine (CyTrue);
+
+    return status;
+}
+
+/* Read length bytes from the SPI flash into System Memory and wait for them. */
+static CyFx3BootErrorCode_t
+spiDmaRead (
+        uint32_t spiAddress,
+        uint32_t dest,
+        uint32_t length)
+{
+    CyFx3BootErrorCode_t status;
+
+    status = spiFastReadStart (spiAddress, dest, length);
     if (status != CY_FX3_BOOT_SUCCESS)
     {
         return status;
     }
 
-    /* validate the signature */
-    if ((buffer[firmwareImagePtr] != 0x43) || (buffer[firmwareImagePtr + 1] != 0x59))
-    {	
-        return CyFalse;
+    return spiFastReadWait ();
+}
+
+/* Copy a chunk that has been read into the scratch buffer to its destination, and return the
+   checksum of its data. The chunk is marked as done. */
+static uint32_t
+spiChunkDone (
+        SpiChunk_t *chunk)
+{
+    uint32_t *data = (uint32_t *)chunk->buffer;
+    uint32_t checksum = 0;
+    uint32_t i;
+
+    if (chunk->buffer != chunk->dest)
+    {
+        myMemCopy ((uint8_t *)chunk->dest, (uint8_t *)chunk->buffer, chunk->length);
     }
 
-    /* Skip the next two bytes. */
+    for (i = 0; i < (chunk->length >> 2); i++)
+    {
+        checksum += data[i];
+    }
 
-    /* Download one section at a time to the device.
-       Optional: Checksum can be computed on the section being downloaded,
-       after downloading the section, it can be read back and the checksum 
-       can be verified.
-     */
-    spiAddress += 4;
+    chunk->length = 0;
+    return checksum;
+}
 
-    while (isTrue)
+/* Read length bytes of image data at spiAddress to address. Each read is started before the
+   chunk read last is checksummed, so that the CPU work overlaps the flash transfer. The last
+   chunk is left in *pending, to be finished while the next section is streaming in.
+
+   ITCM is not reachable by DMA, so data for it goes through the scratch buffer. A pending chunk
+   that the next read would overwrite, such as the previous ITCM chunk, is finished first. */
+static CyFx3BootErrorCode_t
+spiStreamSection (
+        uint32_t    spiAddress,
+        uint32_t    address,
+        uint32_t    length,
+        SpiChunk_t *pending,
+        uint32_t   *checksum)
+{
+    CyFx3BootErrorCode_t status;
+    SpiChunk_t next;
+
+    while (length != 0)
     {
-        /* Read 8 bytes from the SPI */
-        status = spiReadBytes (spiAddress, 8, buffer);
-        if (status != CY_FX3_BOOT_SUCCESS)
+        next.dest = address;
+        if (address < CY_FX3_BOOT_ITCM_END)
         {
-            return CyFalse;
+            next.length = (length < SPI_DMA_BUF_SIZE) ? length : SPI_DMA_BUF_SIZE;
+            next.buffer = SPI_DMA_BUF_ADDRESS;
+        }
+        else
+        {
+            next.length = (length < SPI_DMA_CHUNK_SIZE) ? length : SPI_DMA_CHUNK_SIZE;
+            next.buffer = address;
+        }
+
+        if ((next.buffer < pending->buffer + pending->length) && (next.buffer + next.length > pending->buffer))
+        {
+            *checksum += spiChunkDone (pending);
         }
 
-        status = waitForSpiStatus ();
+        status = spiFastReadStart (spiAddress, next.buffer, next.length);
         if (status != CY_FX3_BOOT_SUCCESS)
         {
             return status;
         }
 
-        /* Get section length (4 bytes) and convert it from 32-bit word count to byte count */
-
-        sectionLength = (CY_U3P_MAKEDWORD(buffer[3], buffer[2], buffer[1], buffer[0]));
-        sectionLength = sectionLength << 2;
+        *checksum += spiChunkDone (pending);
 
-        /* If length = 0, the transfer is complete */
-        if (sectionLength == 0)
+        status = spiFastReadWait ();
+        if (status != CY_FX3_BOOT_SUCCESS)
         {
-            break;
+            return status;
         }
 
-        /* Get section address (4 bytes) */
-        sectionAddress = (*(uint32_t *)&buffer[4]);
-
-        bytesLeftToDownload = sectionLength;
-        downloadAddress = sectionAddress;
+        *pending = next;
 
-        spiAddress += 8;
+        spiAddress += next.length;
+        address    += next.length;
+        length     -= next.length;
+    }
 
-        while (bytesLeftToDownload > 0)
-        {
-            int32_t bytesToTransfer = SPI_DMA_XFER_SIZE;
-            if (bytesLeftToDownload < SPI_DMA_XFER_SIZE)
-            {
-                bytesToTransfer = bytesLeftToDownload;
-            }
+    return CY_FX3_BOOT_SUCCESS;
+}
 
-            bytesToTransfer = bytesToTransfer - (spiAddress % SPI_DMA_XFER_SIZE);
+/* Set the SPI clock used while loading the image, once the image header has been validated.
+   SPI_BOOT_CLOCK takes precedence over the frequency selected in the header. */
+static CyFx3BootErrorCode_t
+spiRampClock (
+        uint8_t imageCtl)
+{
+    if (SPI_BOOT_CLOCK != 0)
+    {
+        return spiSetClock (SPI_BOOT_CLOCK);
+    }
 
-            /* Configure the SPI for the dma transfer by sending down the
-             * address of the data to be transferred. 
-             * */
-            status = spiWriteEnable();
-            if (status != CY_FX3_BOOT_SUCCESS)
-            {
-                return status;
-            }
+    return spiSetClock (spiBootClock[(imageCtl >> 4) & 3]);
+}
 
-            CyFx3BootSpiSetSsnLine(CyFalse);
+/* Load a packed image (see img_unpack.h) whose first record is at spiAddress. Zero-fill records
+   cost one header read, and LZ4 records only their packed size. The image checksum is verified
+   over the expanded data before jumping to the program entry. */
+static CyBool_t
+bootPackedFromSpi (
+        uint32_t spiAddress)
+{
+    uint32_t hdr[IMG_REC_HDR_SIZE / 4];
+    uint32_t length, address, payload;
+    uint32_t checksum = 0;
+    uint32_t i;
+    SpiChunk_t pending = { 0, 0, 0 };
+    CyFx3BootErrorCode_t status;
 
-            addr[0] = 0x03;
-            addr[1] = (spiAddress >> 16) & 0xFF;
-            addr[2] = (spiAddress >> 8) & 0xFF;
-            addr[3] = (spiAddress) & 0xFF;
+    while (1)
+    {
+        status = spiReadBytes (spiAddress, IMG_REC_HDR_SIZE, (uint8_t *)hdr);
+        if (status != CY_FX3_BOOT_SUCCESS)
+        {
+            return CyFalse;
+        }
+        spiAddress += IMG_REC_HDR_SIZE;
 
-            status = CyFx3BootSpiTransmitWords (addr, 4);
-            if (status != CY_FX3_BOOT_SUCCESS)
-            {
-                return status;
-            }
+        length  = hdr[0] << 2;
+        address = hdr[1];
+        payload = IMG_REC_PAYLOAD (hdr[2]);
 
-            /* Invoke the SPI function to do the DMA transfer */
-            CyFx3BootSpiSetBlockXfer (0, SPI_DMA_XFER_SIZE);
+        /* A zero length marks the end record, with the entry point and the checksum. */
+        if (length == 0)
+        {
+            break;
+        }
 
-            /* Validate ITCM Memory */
-            if ((downloadAddress + bytesToTransfer) < CY_FX3_BOOT_ITCM_END)
-            {
-                /* Set up the SPI DMA transfer to System Memory */
-                status = CyFx3BootSpiDmaXferData (CyTrue, SPI_DMA_BUF_ADDRESS, SPI_DMA_XFER_SIZE, 100);
-            }
-            else
-            {
-                /* Set up the SPI DMA transfer to System Memory */
-                status = CyFx3BootSpiDmaXferData (CyTrue, downloadAddress, SPI_DMA_XFER_SIZE, 100);
-            }
+        if (myCheckAddress (address, length) != 0)
+        {
+            return CyFalse;
+        }
 
-            if (status != CY_FX3_BOOT_SUCCESS)
-            {
+        switch (IMG_REC_TYPE (hdr[2]))
+        {
+            case IMG_REC_ZERO:
+                myMemSet ((uint8_t *)address, 0, length);
+                break;
+
+            case IMG_REC_RAW:
+                if (payload != length)
+                {
+                    return CyFalse;
+                }
+
+                status = spiStreamSection (spiAddress, address, length, &pending, &checksum);
+                if (status != CY_FX3_BOOT_SUCCESS)
+                {
+                    return CyFalse;
+                }
+                break;
+
+            case IMG_REC_LZ4:
+                if ((payload > SPI_DMA_BUF_SIZE) || (length > IMG_LZ4_BLOCK_SIZE))
+                {
+                    return CyFalse;
+                }
+
+                /* The packed data must not be overwritten while it is being expanded. */
+                if ((address < SPI_DMA_BUF_ADDRESS + SPI_DMA_BUF_SIZE) && (address + length > SPI_DMA_BUF_ADDRESS))
+                {
+                    return CyFalse;
+                }
+
+                /* The packed data goes to the scratch buffer, which may still hold a pending chunk. */
+                checksum += spiChunkDone (&pending);
+
+                status = spiDmaRead (spiAddress, SPI_DMA_BUF_ADDRESS, IMG_REC_PADDED (payload));
+                if (status != CY_FX3_BOOT_SUCCESS)
+                {
+                    return CyFalse;
+                }
+
+                if (imgUnpackLz4 ((uint8_t *)SPI_DMA_BUF_ADDRESS, payload, (uint8_t *)address, length) != (int)length)
+                {
+                    return CyFalse;
+                }
+
+                for (i = 0; i < length; i += 4)
+                {
+                    checksum += *(uint32_t *)(address + i);
+                }
+                break;
+
+            default:
                 return CyFalse;
-            }
+        }
 
-            /* Validate ITCM Memory */
-            if ((downloadAddress + bytesToTransfer) < CY_FX3_BOOT_ITCM_END)
-            {
-                /* Waiting for about 1 ms for the DMA transfer to be completed before copying the data to the ITCM. */
-                myMemCopy((uint8_t*)downloadAddress, (uint8_t *)SPI_DMA_BUF_ADDRESS, bytesToTransfer); 
-            }
+        spiAddress += IMG_REC_PADDED (payload);
+    }
 
-            CyFx3BootSpiSetSsnLine(CyTrue);
+    checksum += spiChunkDone (&pending);
+    if (hdr[2] != checksum)
+    {
+        return CyFalse;
+    }
 
-            CyFx3BootSpiDisableBlockXfer ();
+    CyFx3BootJumpToProgramEntry (address);
+    return CyTrue;
+}
 
-            downloadAddress += bytesToTransfer;
-            bytesLeftToDownload -= bytesToTransfer;
-            spiAddress += bytesToTransfer;
-        }
-    }
+CyBool_t
+bootFromSpi()
+{
+    uint32_t hdr[3];
+    uint8_t *buffer = (uint8_t *)hdr;
+    uint32_t spiAddress = 0;
+    uint32_t sectionLength;
+    uint32_t sectionAddress;
+    uint32_t checksum = 0;
+    SpiChunk_t pending = { 0, 0, 0 };
+    CyFx3BootErrorCode_t status;
 
-    /* Read 4 bytes from the SPI */
-    status = spiReadBytes (spiAddress, 8, buffer);
+    /* Read 4 bytes from the SPI
+       Check "CY" signature (0x43,0x59)
+       */
+    status = spiReadBytes (spiAddress, 4, buffer);
     if (status != CY_FX3_BOOT_SUCCESS)
     {
         return CyFalse;
     }
 
-    status = waitForSpiStatus ();
+    /* validate the signature */
+    if ((buffer[0] != 0x43) || (buffer[1] != 0x59))
+    {	
+        return CyFalse;
+    }
+
+    /* The rest of the image is read at the clock rate it asks for. */
+    status = spiRampClock (buffer[2]);
     if (status != CY_FX3_BOOT_SUCCESS)
     {
-        return status;
+        return CyFalse;
+    }
+
+    /* Packed images are expanded record by record. */
+    if (buffer[3] == IMG_TYPE_PACKED)
+    {
+        return bootPackedFromSpi (spiAddress + 4);
+    }
+
+    /* Download one section at a time to the device. The last chunk of each section is
+       checksummed while the first chunk of the next one is being read.
+     */
+    spiAddress += 4;
+
+    while (1)
+    {
+        /* Read the section length, the section address and, for the end record, the checksum. */
+        status = spiReadBytes (spiAddress, 12, buffer);
+        if (status != CY_FX3_BOOT_SUCCESS)
+        {
+            return CyFalse;
+        }
+
+        /* Convert the section length from 32-bit word count to byte count. */
+        sectionLength  = hdr[0] << 2;
+        sectionAddress = hdr[1];
+
+        /* If length = 0, the transfer is complete */
+        if (sectionLength == 0)
+        {
+            break;
+        }
+
+        if (myCheckAddress (sectionAddress, sectionLength) != 0)
+        {
+            return CyFalse;
+        }
+
+        status = spiStreamSection (spiAddress + 8, sectionAddress, sectionLength, &pending, &checksum);
+        if (status != CY_FX3_BOOT_SUCCESS)
+        {
+            return CyFalse;
+        }
+
+        spiAddress += 8 + sectionLength;
     }
 
-    if (CY_U3P_MAKEDWORD(buffer[3], buffer[2], buffer[1], buffer[0]) == 0)
+    checksum += spiChunkDone (&pending);
+    if (hdr[2] != checksum)
     {
-        /* Jump to the program entry */
-        CyFx3BootJumpToProgramEntry ((*(uint32_t *)&buffer[4]));
+        return CyFalse;
     }
 
+    /* Jump to the program entry */
+    CyFx3BootJumpToProgramEntry (hdr[1]);
     return CyTrue;
 }
 
@@ -581,7 +859,6 @@ testSpiDmaMode ()
 CyFx3BootErrorCode_t 
 initSpi (void)
 {
-    CyFx3BootSpiConfig_t spiConfig;
     CyFx3BootErrorCode_t stat;
 
     static uint16_t spiBitrateIndex = 0;
@@ -590,17 +867,7 @@ initSpi (void)
     if (stat != CY_FX3_BOOT_SUCCESS)
         return stat;
 
-    spiConfig.isLsbFirst = CyFalse;
-    spiConfig.cpol       = CyFalse;
-    spiConfig.cpha       = CyFalse;
-    spiConfig.leadTime   = CY_FX3_BOOT_SPI_SSN_LAG_LEAD_HALF_CLK;
-    spiConfig.lagTime    = CY_FX3_BOOT_SPI_SSN_LAG_LEAD_HALF_CLK;
-    spiConfig.ssnCtrl    = CY_FX3_BOOT_SPI_SSN_CTRL_FW;
-    spiConfig.ssnPol     = CyFalse;
-    spiConfig.clock      = spiBitrate[spiBitrateIndex];
-    spiConfig.wordLen    = 8;
-    
-    return CyFx3BootSpiSetConfig(&spiConfig);
+    return spiSetClock (spiBitrate[spiBitrateIndex]);
 }
 
 CyFx3BootErrorCode_t 
@@ -23,6 +23,8 @@
 #include "cyfx3usb.h"
 #include "cyfx3device.h"
 #include "cyfx3utils.h"
+#include "img_unpack.h"
+#include "mem_copy.h"
 
 /*
  * Note: Address of 4 KB DMA scratch buffer used for USB data transfers. This is located outside of the
@@ -78,6 +80,9 @@ uint16_t gDevStatus __attribute__ ((aligned (4))) = 0;
 #define gpUSBData                   (uint8_t*)(USB_DMA_BUF_ADDRESS)
 #define USB_DATA_BUF_SIZE           (1024*4)
 
+/* The interrupt vectors of the running boot firmware are below this ITCM address. */
+#define USB_VECTOR_AREA_END         (0xFF)
+
 CyU3PUsbDescrPtrs   *gpUsbDescPtr; /* Pointer to the USB Descriptors */
 CyFx3BootUsbEp0Pkt_t gEP0;
 
@@ -93,8 +98,6 @@ extern uint8_t gbBosDesc[];
 extern uint8_t gbSsConfigDesc[];
 extern uint8_t gbFsConfigDesc[];
 
-extern void myMemCopy(uint8_t *d, uint8_t *s, int cnt);
-
 /* Function to handle the GET_STATUS Standard request. */
 int 
 myGetStatus (
@@ -515,14 +518,15 @@ myCheckAddress (
         return -1; 
     }
 
-    len += address;
-
-    if ((address >= CY_FX3_BOOT_SYSMEM_BASE1) && (len <= CY_FX3_BOOT_SYSMEM_END))
+    /* The length is compared with the room left above the address, as adding the two could
+       wrap around. */
+    if ((address >= CY_FX3_BOOT_SYSMEM_BASE1) && (address <= CY_FX3_BOOT_SYSMEM_END) &&
+            (len <= CY_FX3_BOOT_SYSMEM_END - address))
     {
         return 0;
     }
 
-    if (len <= CY_FX3_BOOT_ITCM_END)
+    if ((address <= CY_FX3_BOOT_ITCM_END) && (len <= CY_FX3_BOOT_ITCM_END - address))
     {
         return 0;
     }
@@ -530,6 +534,70 @@ myCheckAddress (
     return -1;
 }
 
+/* Expand a zero-fill or LZ4 record of a packed image (see img_unpack.h), received with its
+   header in the control buffer.
+   Return Value:
+    0 - Record has been expanded
+   -1 - Record is not valid
+*/
+static int
+myUnpackRecord (
+        uint8_t  *rec,
+        uint32_t  len
+        )
+{
+    uint32_t *hdr    = (uint32_t *)rec;
+    uint32_t length  = hdr[0] << 2;
+    uint32_t address = hdr[1];
+    uint32_t payload = IMG_REC_PAYLOAD (hdr[2]);
+
+    if ((length == 0) || (myCheckAddress (address, length) != 0) || (len < IMG_REC_HDR_SIZE + payload))
+    {
+        return -1;
+    }
+
+    switch (IMG_REC_TYPE (hdr[2]))
+    {
+        case IMG_REC_ZERO:
+            /* Avoid writing to the interrupt table, as for vendor command 0xA0. */
+            if (address < USB_VECTOR_AREA_END)
+            {
+                if (address + length <= USB_VECTOR_AREA_END)
+                {
+                    return 0;
+                }
+                length -= USB_VECTOR_AREA_END - address;
+                address = USB_VECTOR_AREA_END;
+            }
+            myMemSet ((uint8_t *)address, 0, length);
+            return 0;
+
+        case IMG_REC_LZ4:
+            /* An LZ4 record cannot be expanded partially, so one that would overwrite the interrupt
+               table is refused. elf2img stores the data at these addresses as raw records. */
+            if (address < USB_VECTOR_AREA_END)
+            {
+                return -1;
+            }
+
+            /* The packed data must not be overwritten while it is being expanded. */
+            if ((address < USB_DMA_BUF_ADDRESS + USB_DATA_BUF_SIZE) && (address + length > USB_DMA_BUF_ADDRESS))
+            {
+                return -1;
+            }
+            if (imgUnpackLz4 (rec + IMG_REC_HDR_SIZE, payload, (uint8_t *)address, length) != (int)length)
+            {
+                return -1;
+            }
+            return 0;
+
+        default:
+            break;
+    }
+
+    return -1;
+}
+
 /* Function to handle the vendor commands. */
 void 
 myVendorCmdHandler (
@@ -625,10 +693,10 @@ myVendorCmdHandler (
             if ((address + gEP0.wLen) <= CY_FX3_BOOT_ITCM_END)
             {
                 /* Avoid writing to the interrupt table. */
-                if (address < 0xFF) {
-                    gEP0.pData += 0xFF-address;
-                    gEP0.wLen -= 0xFF-address;
-                    address = 0xFF;
+                if (address < USB_VECTOR_AREA_END) {
+                    gEP0.pData += USB_VECTOR_AREA_END-address;
+                    gEP0.wLen -= USB_VECTOR_AREA_END-address;
+                    address = USB_VECTOR_AREA_END;
                 }
                 myMemCopy((uint8_t *)address, gEP0.pData, gEP0.wLen); 
             }
@@ -636,6 +704,27 @@ myVendorCmdHandler (
         return;
     }
 
+    /* Vendor Command 0xA2 handling: the data stage carries one zero-fill or LZ4 record of a
+       packed image, header included, which is expanded in place. Raw records are still
+       written with 0xA0. */
+    if ((bReq == 0xA2) && (stage == eDataOut))
+    {
+        if (len < IMG_REC_HDR_SIZE)
+        {
+            CyFx3BootUsbStall (0, CyTrue, CyFalse);
+            return;
+        }
+
+        CyFx3BootUsbAckSetup ();
+
+        status = CyFx3BootUsbDmaXferData (0x00, (uint32_t)gpUSBData, len, CY_FX3_BOOT_WAIT_FOREVER);
+        if ((status != CY_FX3_BOOT_SUCCESS) || (myUnpackRecord (gpUSBData, len) != 0))
+        {
+            CyFx3BootUsbStall (0, CyTrue, CyFalse);
+        }
+        return;
+    }
+
     /* No other requests are supported. Stall the Endpoint */
     CyFx3BootUsbStall (0, CyTrue, CyFalse);
     return;
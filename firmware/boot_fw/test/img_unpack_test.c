@@ -0,0 +1,230 @@
+/*
+ ## Cypress FX3 Boot Firmware Example Source file (img_unpack_test.c)
+ ## ===========================
+ ##
+ ##  Copyright Cypress Semiconductor Corporation, 2011-2012,
+ ##  All Rights Reserved
+ ##  UNPUBLISHED, LICENSED SOFTWARE.
+ ##
+ ##  CONFIDENTIAL AND PROPRIETARY INFORMATION
+ ##  WHICH IS THE PROPERTY OF CYPRESS.
+ ##
+ ##  Use of this file is governed
+ ##  by the license agreement included in the file
+ ##
+ ##     <install>/license/license.txt
+ ##
+ ##  where <install> is the Cypress software
+ ##  installation root directory path.
+ ##
+ ## ===========================
+*/
+
+/* Host test of the LZ4 decoder used for packed boot images (img_unpack.c). Data of several
+   kinds is compressed with the encoder of elf2img (util/elf2img/lz4_pack.c) and expanded
+   again, and the decoder is fed truncated, malformed and random blocks, which it must reject
+   without writing outside its output buffer. Build and run with "make check". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/img_unpack.h"
+#include "../../../util/elf2img/lz4_pack.h"
+
+#define MAX_BLOCK       (IMG_LZ4_BLOCK_SIZE)
+#define MAX_PACKED      (MAX_BLOCK + MAX_BLOCK / 255 + 16)
+#define GUARD_SIZE      (64)
+#define GUARD_BYTE      (0xA5)
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                \
+{                                                       \
+    if (!(cond))                                        \
+    {                                                   \
+        fprintf (stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        fprintf (stderr, __VA_ARGS__);                  \
+        fprintf (stderr, "\n");                         \
+        failures++;                                     \
+    }                                                   \
+}
+
+/* Expand a block into a buffer of dstLen bytes followed by guard bytes. Returns the decoder
+   result, after checking that the guard is intact. */
+static int
+Decode (
+        const unsigned char *src,
+        int                  srcLen,
+        unsigned char       *dst,
+        int                  dstLen)
+{
+    int i, r;
+
+    memset (dst + dstLen, GUARD_BYTE, GUARD_SIZE);
+    r = imgUnpackLz4 (src, srcLen, dst, dstLen);
+    for (i = 0; i < GUARD_SIZE; i++)
+    {
+        if (dst[dstLen + i] != GUARD_BYTE)
+        {
+            CHECK (0, "write past the end of a %d byte output buffer", dstLen);
+            break;
+        }
+    }
+
+    return r;
+}
+
+static void
+FillData (
+        unsigned char *buf,
+        int            len,
+        int            kind)
+{
+    static const char text[] = "The quick brown fox jumps over the lazy dog. ";
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        switch (kind)
+        {
+            case 0:  buf[i] = 0;                                    break;
+            case 1:  buf[i] = (unsigned char)rand ();               break;
+            case 2:  buf[i] = (unsigned char)(i % 7);               break;
+            case 3:  buf[i] = (unsigned char)text[i % (sizeof (text) - 1)]; break;
+            default: buf[i] = (rand () % 8) ? buf[(i > 0) ? i - 1 : 0] : (unsigned char)rand (); break;
+        }
+    }
+}
+
+static void
+TestRoundTrip (
+        void)
+{
+    static const int sizes[] = { 0, 1, 2, 3, 4, 5, 12, 13, 16, 100, 255, 256, 1000, 4095, 4096 };
+    unsigned char data[MAX_BLOCK], packed[MAX_PACKED + GUARD_SIZE], out[MAX_BLOCK + GUARD_SIZE];
+    int s, kind, n, r, len;
+
+    for (s = 0; s < (int)(sizeof (sizes) / sizeof (sizes[0])); s++)
+    {
+        for (kind = 0; kind < 5; kind++)
+        {
+            len = sizes[s];
+            FillData (data, len, kind);
+            n = Lz4Compress (data, len, packed, MAX_PACKED);
+            CHECK (n > 0, "%d bytes of kind %d did not compress", len, kind);
+
+            r = Decode (packed, n, out, len);
+            CHECK ((r == len) && (memcmp (out, data, len) == 0),
+                    "round trip of %d bytes of kind %d returned %d", len, kind, r);
+
+            /* The encoder must stop at the end of its output buffer. */
+            memset (packed + n - 1, GUARD_BYTE, GUARD_SIZE);
+            r = Lz4Compress (data, len, packed, n - 1);
+            CHECK ((r == -1) && (packed[n - 1] == GUARD_BYTE),
+                    "%d bytes of kind %d into %d of %d bytes returned %d", len, kind, n - 1, n, r);
+
+            /* Output that does not fit must be refused. */
+            if (len > 0)
+            {
+                r = Decode (packed, n, out, len - 1);
+                CHECK (r == -1, "%d bytes of kind %d into %d bytes returned %d", len, kind, len - 1, r);
+            }
+        }
+    }
+}
+
+/* Every prefix of a valid block either fails or yields a prefix of the data. */
+static void
+TestTruncated (
+        void)
+{
+    unsigned char data[MAX_BLOCK], packed[MAX_PACKED], out[MAX_BLOCK + GUARD_SIZE];
+    int kind, n, r, cut;
+
+    for (kind = 1; kind < 5; kind++)
+    {
+        FillData (data, 2048, kind);
+        n = Lz4Compress (data, 2048, packed, MAX_PACKED);
+
+        for (cut = 0; cut < n; cut++)
+        {
+            r = Decode (packed, cut, out, MAX_BLOCK);
+            CHECK ((r == -1) || ((r >= 0) && (r < 2048) && (memcmp (out, data, r) == 0)),
+                    "block of kind %d cut to %d of %d bytes returned %d", kind, cut, n, r);
+        }
+    }
+}
+
+static void
+TestMalformed (
+        void)
+{
+    static const struct
+    {
+        const char    *name;
+        unsigned char  data[8];
+        int            len;
+    } cases[] = {
+        { "zero offset",                { 0x10, 'a', 0x00, 0x00, 0x00 },       5 },
+        { "offset before the output",   { 0x10, 'a', 0x02, 0x00, 0x00 },       5 },
+        { "offset without output",      { 0x00, 0x01, 0x00 },                  3 },
+        { "one offset byte",            { 0x10, 'a', 0x01 },                   3 },
+        { "literal length runs out",    { 0xF0, 0xFF },                        2 },
+        { "literals run out",           { 0x40, 'a', 'b' },                    3 },
+        { "match length runs out",      { 0x1F, 'a', 0x01, 0x00, 0xFF },       5 },
+        { "match past the output",      { 0x1F, 'a', 0x01, 0x00, 0xFF, 0x10 }, 6 }
+    };
+    unsigned char out[256 + GUARD_SIZE];
+    int i, r;
+
+    for (i = 0; i < (int)(sizeof (cases) / sizeof (cases[0])); i++)
+    {
+        r = Decode (cases[i].data, cases[i].len, out, 256);
+        CHECK (r == -1, "%s: returned %d", cases[i].name, r);
+    }
+}
+
+/* Random input must never make the decoder write outside the output buffer. */
+static void
+TestRandom (
+        void)
+{
+    unsigned char data[512], out[MAX_BLOCK + GUARD_SIZE];
+    int i, j, len, r;
+
+    for (i = 0; i < 20000; i++)
+    {
+        len = rand () % sizeof (data);
+        for (j = 0; j < len; j++)
+        {
+            data[j] = (unsigned char)rand ();
+        }
+
+        r = Decode (data, len, out, rand () % MAX_BLOCK);
+        CHECK (r >= -1, "random block returned %d", r);
+    }
+}
+
+int
+main (
+        void)
+{
+    srand (1);
+
+    TestRoundTrip ();
+    TestTruncated ();
+    TestMalformed ();
+    TestRandom ();
+
+    if (failures != 0)
+    {
+        printf ("img_unpack_test: %d failures\n", failures);
+        return 1;
+    }
+
+    printf ("img_unpack_test: passed\n");
+    return 0;
+}
+
+/*[]*/
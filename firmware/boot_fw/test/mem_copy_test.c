@@ -0,0 +1,201 @@
+/*
+ ## Cypress FX3 Boot Firmware Example Source file (mem_copy_test.c)
+ ## ===========================
+ ##
+ ##  Copyright Cypress Semiconductor Corporation, 2011-2012,
+ ##  All Rights Reserved
+ ##  UNPUBLISHED, LICENSED SOFTWARE.
+ ##
+ ##  CONFIDENTIAL AND PROPRIETARY INFORMATION
+ ##  WHICH IS THE PROPERTY OF CYPRESS.
+ ##
+ ##  Use of this file is governed
+ ##  by the license agreement included in the file
+ ##
+ ##     <install>/license/license.txt
+ ##
+ ##  where <install> is the Cypress software
+ ##  installation root directory path.
+ ##
+ ## ===========================
+*/
+
+/* Host test of the boot firmware copy and fill routines (mem_copy.c). Every combination of
+   source and destination alignment is run over a range of lengths, and the whole buffer,
+   including the bytes around the area written, is compared with the result of memcpy or
+   memset. The host build uses the C burst loop, not the ARM assembly. Build and run with
+   "make check". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/mem_copy.h"
+
+#define MAX_ALIGN       (8)
+#define MAX_SWEEP       (300)
+#define MAX_LENGTH      (16384 + 3)
+#define BUF_SIZE        (MAX_LENGTH + 2 * MAX_ALIGN + 64)
+#define GUARD_OFFSET    (32)
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                \
+{                                                       \
+    if (!(cond))                                        \
+    {                                                   \
+        fprintf (stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        fprintf (stderr, __VA_ARGS__);                  \
+        fprintf (stderr, "\n");                         \
+        failures++;                                     \
+    }                                                   \
+}
+
+/* Buffers are word aligned, so that the offsets below are the alignment seen by the routines. */
+static unsigned int srcWords[BUF_SIZE / 4 + 1];
+static unsigned int dstWords[BUF_SIZE / 4 + 1];
+static unsigned int expWords[BUF_SIZE / 4 + 1];
+
+#define SRC     ((unsigned char *)srcWords)
+#define DST     ((unsigned char *)dstWords)
+#define EXP     ((unsigned char *)expWords)
+
+static void
+FillRandom (
+        unsigned char *buf,
+        int            len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        buf[i] = (unsigned char)rand ();
+    }
+}
+
+static void
+CheckCopy (
+        int dstAlign,
+        int srcAlign,
+        int len)
+{
+    unsigned char *d = DST + GUARD_OFFSET + dstAlign;
+    unsigned char *s = SRC + GUARD_OFFSET + srcAlign;
+    int            range = GUARD_OFFSET + MAX_ALIGN + len + GUARD_OFFSET;
+
+    FillRandom (SRC, range);
+    FillRandom (DST, range);
+    memcpy (EXP, DST, range);
+
+    memcpy (EXP + GUARD_OFFSET + dstAlign, s, len);
+    myMemCopy (d, s, len);
+
+    CHECK (memcmp (DST, EXP, range) == 0,
+            "copy of %d bytes, destination offset %d, source offset %d", len, dstAlign, srcAlign);
+}
+
+static void
+CheckSet (
+        int           dstAlign,
+        unsigned char c,
+        int           len)
+{
+    unsigned char *d = DST + GUARD_OFFSET + dstAlign;
+    int            range = GUARD_OFFSET + MAX_ALIGN + len + GUARD_OFFSET;
+
+    FillRandom (DST, range);
+    memcpy (EXP, DST, range);
+
+    memset (EXP + GUARD_OFFSET + dstAlign, c, len);
+    myMemSet (d, c, len);
+
+    CHECK (memcmp (DST, EXP, range) == 0,
+            "fill of %d bytes with 0x%02X, destination offset %d", len, c, dstAlign);
+}
+
+static void
+TestCopy (
+        void)
+{
+    static const int sizes[] = { 511, 512, 513, 1000, 4095, 4096, 4097, MAX_LENGTH };
+    int d, s, len, i;
+
+    for (d = 0; d < MAX_ALIGN; d++)
+    {
+        for (s = 0; s < MAX_ALIGN; s++)
+        {
+            for (len = 0; len <= MAX_SWEEP; len++)
+            {
+                CheckCopy (d, s, len);
+            }
+
+            for (i = 0; i < (int)(sizeof (sizes) / sizeof (sizes[0])); i++)
+            {
+                CheckCopy (d, s, sizes[i]);
+            }
+        }
+    }
+}
+
+static void
+TestSet (
+        void)
+{
+    static const int           sizes[] = { 511, 512, 513, 1000, 4095, 4096, 4097, MAX_LENGTH };
+    static const unsigned char values[] = { 0x00, 0xFF, 0x5A, 0x80 };
+    int d, v, len, i;
+
+    for (d = 0; d < MAX_ALIGN; d++)
+    {
+        for (v = 0; v < (int)sizeof (values); v++)
+        {
+            for (len = 0; len <= MAX_SWEEP; len++)
+            {
+                CheckSet (d, values[v], len);
+            }
+
+            for (i = 0; i < (int)(sizeof (sizes) / sizeof (sizes[0])); i++)
+            {
+                CheckSet (d, values[v], sizes[i]);
+            }
+        }
+    }
+}
+
+/* A negative count, which the callers never pass, must not write anything. */
+static void
+TestNegative (
+        void)
+{
+    int range = 2 * GUARD_OFFSET + MAX_ALIGN;
+
+    FillRandom (SRC, range);
+    FillRandom (DST, range);
+    memcpy (EXP, DST, range);
+
+    myMemCopy (DST + GUARD_OFFSET, SRC + GUARD_OFFSET, -1);
+    myMemSet (DST + GUARD_OFFSET + 1, 0, -5);
+    CHECK (memcmp (DST, EXP, range) == 0, "negative count wrote to the buffer");
+}
+
+int
+main (
+        void)
+{
+    srand (1);
+
+    TestCopy ();
+    TestSet ();
+    TestNegative ();
+
+    if (failures != 0)
+    {
+        printf ("mem_copy_test: %d failures\n", failures);
+        return 1;
+    }
+
+    printf ("mem_copy_test: passed\n");
+    return 0;
+}
+
+/*[]*/
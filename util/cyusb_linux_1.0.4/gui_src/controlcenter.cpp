@@ -24,4 +24,18 @@ ControlCenter::ControlCenter(QWidget *parent) : QWidget(parent)
 	cb7_numpkts->addItems(list);
 	rb7_enable->setChecked(FALSE); /* disabled by default for maximum performance */
 	rb7_disable->setChecked(TRUE); /* disabled by default for maximum performance */
+
+	model6_out = new HexModel(this);
+	model6_in  = new HexModel(this);
+	lw6_out->setModel(model6_out);
+	lw6->setModel(model6_in);
+
+	worker6 = new TransferWorker(this);
+	connect(worker6, SIGNAL(finished()), this, SLOT(bulk6_finished()));
+	timer6 = new QTimer(this);
+	timer6->setInterval(250);
+	connect(timer6, SIGNAL(timeout()), this, SLOT(bulk6_tick()));
+
+	worker7 = new TransferWorker(this);
+	connect(worker7, SIGNAL(finished()), this, SLOT(iso7_finished()));
 }
@@ -1,7 +1,8 @@
 TEMPLATE	= app
-HEADERS		= ../include/controlcenter.h
+HEADERS		= ../include/controlcenter.h ../include/transferworker.h ../include/dataviews.h ../include/cyusb.hpp
 FORMS		= controlcenter.ui
-SOURCES		= controlcenter.cpp main.cpp fx2_download.cpp fx3_download.cpp
+SOURCES		= controlcenter.cpp main.cpp fx2_download.cpp fx3_download.cpp transferworker.cpp dataviews.cpp
 LIBS		+= -L../lib -lcyusb -lusb-1.0
 QT		+= network
+QMAKE_CXXFLAGS	+= -std=c++11
 TARGET		= ../bin/cyusb_linux
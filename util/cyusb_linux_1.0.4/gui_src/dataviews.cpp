@@ -0,0 +1,177 @@
+/***********************************************************************************************************************\
+ * Program Name		:	dataviews.cpp										*
+ * License		:	GPL Ver 2.0										*
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS							*
+ * Modification Notes	:												*
+ * 															*
+ * Views used by the Bulk tab: a hex dump model that only formats the rows on screen, and a			*
+ * throughput / error rate strip chart.										*
+\***********************************************************************************************************************/
+#include <QtCore>
+#include <QtGui>
+
+#include <stdio.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "../include/dataviews.h"
+
+#define HEX_ROW		8		/* Bytes per row of the hex dump */
+#define PLOT_SAMPLES	240		/* Samples shown by the strip chart */
+
+HexModel::HexModel(QObject *parent) : QAbstractListModel(parent)
+{
+}
+
+int HexModel::rowCount(const QModelIndex &parent) const
+{
+	if ( parent.isValid() )
+		return 0;
+	return ( buf.size() + HEX_ROW - 1 ) / HEX_ROW;
+}
+
+QVariant HexModel::data(const QModelIndex &index, int role) const
+{
+	char line[HEX_ROW * 5 + 4];
+	char *p = line;
+	const unsigned char *d;
+	int i, n;
+
+	if ( ( role != Qt::DisplayRole ) || ( !index.isValid() ) || ( index.row() >= rowCount() ) )
+		return QVariant();
+
+	d = (const unsigned char *)buf.constData() + index.row() * HEX_ROW;
+	n = qMin(HEX_ROW, buf.size() - index.row() * HEX_ROW);
+	for ( i = 0; i < HEX_ROW; ++i ) {
+		if ( i < n )
+			p += sprintf(p, "%02x ", d[i]);
+		else p += sprintf(p, "   ");
+	}
+	p += sprintf(p, ": ");
+	for ( i = 0; i < n; ++i )
+		p += sprintf(p, "%c ", isprint(d[i]) ? d[i] : '.');
+	return QString(line);
+}
+
+void HexModel::append(const QByteArray &bytes)
+{
+	int rows, new_rows, drop;
+	bool partial;
+
+	if ( bytes.isEmpty() )
+		return;
+
+	/* Past the cap, whole rows are dropped from the front and the view starts over. */
+	if ( buf.size() + bytes.size() > HEXMODEL_MAX_BYTES ) {
+		drop = ( buf.size() + bytes.size() - HEXMODEL_MAX_BYTES + HEX_ROW - 1 ) / HEX_ROW * HEX_ROW;
+		beginResetModel();
+		buf.append(bytes);
+		buf.remove(0, qMin(drop, buf.size()));
+		endResetModel();
+		return;
+	}
+
+	rows     = rowCount();
+	new_rows = ( buf.size() + bytes.size() + HEX_ROW - 1 ) / HEX_ROW;
+	partial  = ( buf.size() % HEX_ROW ) != 0;
+	if ( new_rows > rows )
+		beginInsertRows(QModelIndex(), rows, new_rows - 1);
+	buf.append(bytes);
+	if ( new_rows > rows )
+		endInsertRows();
+	if ( partial )
+		emit dataChanged(index(rows - 1), index(rows - 1));
+}
+
+void HexModel::clear()
+{
+	beginResetModel();
+	buf.clear();
+	endResetModel();
+}
+
+RatePlot::RatePlot(QWidget *parent) : QWidget(parent)
+{
+}
+
+void RatePlot::addSample(double rate, double errors_per_sec)
+{
+	mbps.append(rate);
+	errs.append(errors_per_sec);
+	if ( mbps.size() > PLOT_SAMPLES ) {
+		mbps.remove(0);
+		errs.remove(0);
+	}
+	update();
+}
+
+void RatePlot::clear()
+{
+	mbps.clear();
+	errs.clear();
+	update();
+}
+
+/* Round a scale up to 1, 2 or 5 times a power of ten. */
+static double nice_ceiling(double v)
+{
+	double e;
+
+	if ( v <= 0 )
+		return 1;
+	e = pow(10, floor(log10(v)));
+	if ( v <= e )
+		return e;
+	if ( v <= 2 * e )
+		return 2 * e;
+	if ( v <= 5 * e )
+		return 5 * e;
+	return 10 * e;
+}
+
+void RatePlot::paintEvent(QPaintEvent *)
+{
+	QPainter p(this);
+	QRect r = rect().adjusted(0, 0, -1, -1);
+	QPolygonF line;
+	double top = 0, etop = 0, step, x, y;
+	int i, n = mbps.size();
+	char tbuf[80];
+
+	p.fillRect(rect(), palette().base());
+	p.setPen(palette().mid().color());
+	p.drawRect(r);
+	for ( i = 1; i < 4; ++i )
+		p.drawLine(r.left(), r.top() + r.height() * i / 4, r.right(), r.top() + r.height() * i / 4);
+	if ( n == 0 )
+		return;
+
+	for ( i = 0; i < n; ++i ) {
+		top  = qMax(top, mbps[i]);
+		etop = qMax(etop, errs[i]);
+	}
+	top  = nice_ceiling(top);
+	etop = nice_ceiling(etop);
+	step = (double)r.width() / ( PLOT_SAMPLES - 1 );
+
+	/* Errors as bars in the bottom quarter, throughput as a line over the whole height. */
+	p.setPen(Qt::red);
+	for ( i = 0; i < n; ++i ) {
+		if ( errs[i] <= 0 )
+			continue;
+		x = r.right() - ( n - 1 - i ) * step;
+		p.drawLine(QPointF(x, r.bottom()), QPointF(x, r.bottom() - errs[i] / etop * r.height() / 4));
+	}
+
+	for ( i = 0; i < n; ++i ) {
+		x = r.right() - ( n - 1 - i ) * step;
+		y = r.bottom() - mbps[i] / top * ( r.height() - 1 );
+		line << QPointF(x, y);
+	}
+	p.setPen(QPen(Qt::blue, 2));
+	p.drawPolyline(line);
+
+	p.setPen(palette().text().color());
+	sprintf(tbuf, "%.1f MB/s  (scale %g)    %.0f errors/s", mbps[n - 1], top, errs[n - 1]);
+	p.drawText(r.adjusted(4, 2, -4, -2), Qt::AlignLeft | Qt::AlignTop, tbuf);
+}
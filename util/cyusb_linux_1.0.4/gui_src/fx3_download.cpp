@@ -85,7 +85,10 @@ static int ram_write(unsigned char *buf, unsigned int ramAddress, int len)
 	return 0;
 }
 
-static int read_firmware_image(const char *filename, unsigned char *buf, int *romsize)
+/* Read the firmware image from the file into a buffer. Packed images (elf2img -compress) are
+   only accepted when packed_ok is set: the boot firmware expands them when booting from SPI
+   flash, but not from I2C EEPROM or when loaded by the ROM boot loader. */
+static int read_firmware_image(const char *filename, unsigned char *buf, int *romsize, int packed_ok)
 {
 	int fd;
 	int nbr;
@@ -122,7 +125,12 @@ static int read_firmware_image(const char *filename, unsigned char *buf, int *ro
 		*romsize = i2c_eeprom_size[(buf[0] >> 1) & 0x07];
 
 	nbr = read(fd, buf, 1);		/* Read 1 byte. bImageType	*/
-	if ( !(buf[0] == 0xB0) ) {
+	if ( ( buf[0] == 0xB4 ) && ( !packed_ok ) ) {
+		printf("Packed image (type 0xB4) can only be programmed to SPI flash\n");
+		close(fd);
+		return -7;
+	}
+	if ( ( buf[0] != 0xB0 ) && ( buf[0] != 0xB4 ) ) {
 		printf("Not a normal FW binary with checksum\n");
 		return -6;
 	}
@@ -132,6 +140,12 @@ static int read_firmware_image(const char *filename, unsigned char *buf, int *ro
 	nbr = read(fd, buf, filesize);
 
 	close(fd);
+
+	// A packed image has no checksum over the data as stored; check its record layout instead.
+	if ( ( buf[3] == 0xB4 ) && ( cyusb_check_fx3_image(buf, filesize, NULL) != 0 ) ) {
+		printf("Packed image has an invalid record layout\n");
+		return -8;
+	}
 	return 0;
 }
 
@@ -151,7 +165,7 @@ int fx3_usbboot_download(const char *filename)
 	}
 
 	// Read the firmware image into the local RAM buffer.
-	r = read_firmware_image(filename, fwBuf, NULL);
+	r = read_firmware_image(filename, fwBuf, NULL, 0);
 	if ( r != 0 ) {
 		printf("Failed to read firmware file %s\n", filename);
 		sb->showMessage("Error: Failed to read firmware binary\n", 5000);
@@ -257,8 +271,11 @@ static int get_fx3_prog_handle(void)
 	// Now wait for the flash programmer to enumerate, and get a handle to it.
 	for ( j = 0; j < GETHANDLE_TIMEOUT; j++ ) {
 		sleep (1);
-		for ( i = 0; i < num_devices_detected; i++ ) {
+		/* The device list is refreshed behind our back, by SIGUSR1 or hotplug events. */
+		for ( i = 0; i < cyusb_get_device_slots(); i++ ) {
 			handle = cyusb_gethandle(i);
+			if ( handle == NULL )
+				continue;
 			if ( cyusb_getvendor(handle) == FLASHPROG_VID ) {
 				r = check_fx3_flashprog(handle);
 				if ( r == 0 ) {
@@ -347,9 +364,12 @@ int fx3_i2cboot_download(const char *filename)
 	// Allocate memory for holding the firmware binary.
 	fwBuf = (unsigned char *)calloc (1, MAX_FWIMG_SIZE);
 
-	if ( read_firmware_image(filename, fwBuf, &romsize) ) {
+	r = read_firmware_image(filename, fwBuf, &romsize, 0);
+	if ( r != 0 ) {
 		printf("File %s does not contain valid FX3 firmware image\n", filename);
-		sb->showMessage("Error: Failed to find valid FX3 firmware image", 5000);
+		if ( r == -7 )
+			sb->showMessage("Error: Packed images cannot boot from I2C EEPROM, use SPI flash", 5000);
+		else sb->showMessage("Error: Failed to find valid FX3 firmware image", 5000);
 		free(fwBuf);
 		return -2;
 	}
@@ -498,7 +518,7 @@ int fx3_spiboot_download(const char *filename)
 		return -2;
 	}
 
-	if ( read_firmware_image(filename, fwBuf, NULL) ) {
+	if ( read_firmware_image(filename, fwBuf, NULL, 1) ) {
 		printf("File %s does not contain valid FX3 firmware image\n", filename);
 		sb->showMessage("Error: Failed to find valid FX3 firmware image", 5000);
 		free(fwBuf);
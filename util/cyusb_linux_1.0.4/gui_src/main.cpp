@@ -24,7 +24,7 @@
 #include <sys/time.h>
 
 #include "../include/controlcenter.h"
-#include "../include/cyusb.h"
+#include "../include/cyusb.hpp"
 
 ControlCenter *mainwin = NULL;
 QProgressBar  *mbar = NULL;
@@ -32,9 +32,12 @@ QStatusBar *sb = NULL;
 cyusb_handle  *h = NULL;
 int num_devices_detected;
 int current_device_index = -1;
+static int hotplug_enabled;	/* Device list is updated from libusb hotplug events */
 
 static QLocalServer server(0);
-static QTime *isoc_time;
+
+#define BULK6_DEPTH	8		/* Transfers queued by the Bulk tab for files and repeats */
+#define BULK6_FILE_XFER	4096		/* Files are sent in 4096 byte transfers */
 
 
 extern int sigusr1_fd[2];
@@ -60,14 +63,15 @@ struct DEVICE_SUMMARY {
 
 static struct DEVICE_SUMMARY summ[100];
 static int summ_count = 0;
-static unsigned int cum_data_in;
-static unsigned int cum_data_out;
-static int data_count;
-static struct libusb_transfer *transfer = NULL;
-static unsigned char *isoc_databuf = NULL;
-static int totalout, totalin, pkts_success, pkts_failure;
-
-static int fd_outfile, fd_infile;
+static unsigned long long cum_data_in;
+static unsigned long long cum_data_out;
+static QTime bulk6_time;		/* Started with each Bulk tab job */
+static BulkStats bulk6_prev;		/* Worker totals at the previous poll */
+static int bulk6_prev_ms;
+static bool bulk6_repeat, bulk6_verify;
+static int bulk6_pattern = -1;		/* CYUSB_PATTERN_xxx of the last bulk write, or -1 for file or typed data */
+static unsigned int bulk6_seed;
+static IsoJob iso7_job;			/* Job last handed to the Isochronous tab's worker */
 
 
 static void libusb_error(int errno, const char *detailedText)
@@ -117,17 +121,21 @@ static void update_devlist()
 {
 	int i, r, num_interfaces, index = 0;
 	char tbuf[60];
-	struct libusb_config_descriptor *config_desc = NULL;
+	cyusb::ConfigDescriptor config_desc;
 
 	mainwin->listWidget->clear();
 
 	for ( i = 0; i < num_devices_detected; ++i ) {
 		h = cyusb_gethandle(i);
+		if ( h == NULL )		/* Slot of a device detached while hotplug is enabled */
+			continue;
 		sprintf(tbuf,"VID=%04x,PID=%04x,BusNum=%02x,Addr=%d",
 				cyusb_getvendor(h), cyusb_getproduct(h),
 				cyusb_get_busnumber(h), cyusb_get_devaddr(h));
-		mainwin->listWidget->addItem(QString(tbuf));
-		r = cyusb_get_active_config_descriptor (h, &config_desc);
+		QListWidgetItem *entry = new QListWidgetItem(QString(tbuf));
+		entry->setData(Qt::UserRole, i);
+		mainwin->listWidget->addItem(entry);
+		r = config_desc.get(h);
 		if ( r ) {
 			libusb_error(r, "Error in 'get_active_config_descriptor' ");
 			return;
@@ -140,7 +148,6 @@ static void update_devlist()
 			index++;
 			num_interfaces--;
 		}
-		cyusb_free_config_descriptor (config_desc);
 	}
 }
 static void disable_vendor_extensions()
@@ -331,10 +338,13 @@ void ControlCenter::on_pb_setIFace_clicked()
 	char tval[3];
 	int N, M;
 
-	struct libusb_config_descriptor *config_desc = NULL;
+	cyusb::ConfigDescriptor config_desc;
 
-	r = cyusb_get_active_config_descriptor(h, &config_desc);
-	if ( r ) libusb_error(r, "Error in 'get_active_config_descriptor' ");
+	r = config_desc.get(h);
+	if ( r ) {
+		libusb_error(r, "Error in 'get_active_config_descriptor' ");
+		return;
+	}
 
 	N = config_desc->interface[mainwin->sb_selectIf->value()].num_altsetting;
 	sprintf(tval,"%d",N);
@@ -534,7 +544,7 @@ void get_device_details()
 	char tbuf[60];
 	char tval[3];
 	struct libusb_device_descriptor desc;
-	struct libusb_config_descriptor *config_desc = NULL;
+	cyusb::ConfigDescriptor config_desc;
 
 	h = cyusb_gethandle(current_device_index);
 	if ( !h ) {
@@ -546,7 +556,11 @@ void get_device_details()
 		libusb_error(r, "Error getting device descriptor");
 		return ;
 	}
-	r = cyusb_get_active_config_descriptor(h, &config_desc);
+	r = config_desc.get(h);
+	if ( r ) {
+		libusb_error(r, "Error in 'get_active_config_descriptor' ");
+		return ;
+	}
 	sprintf(tval,"%d",config_desc->bNumInterfaces);
 	mainwin->le_numIfaces->setText(tval);
 	mainwin->sb_selectIf->setEnabled(TRUE);
@@ -594,7 +608,6 @@ void get_device_details()
 	check_for_kernel_driver();
 	detect_device();
 	mainwin->on_pb_setIFace_clicked();
-	cyusb_free_config_descriptor (config_desc);
 }
 
 static void clear_widgets()
@@ -643,9 +656,8 @@ static void set_if_aif()
 
 void ControlCenter::on_listWidget_itemClicked(QListWidgetItem *item)
 {
-	item = item;
 	clear_widgets();
-	current_device_index = mainwin->listWidget->currentRow();
+	current_device_index = item->data(Qt::UserRole).toInt();
 	get_device_details();
 	get_config_details();
 	set_if_aif();
@@ -693,6 +705,27 @@ void ControlCenter::on_rb1_large_clicked()
 	mainwin->groupBox_3->setVisible(FALSE);
 }
 
+/* True if dev is the handle of a device still attached. */
+static bool handle_present(cyusb_handle *dev)
+{
+	int i;
+
+	for ( i = 0; i < cyusb_get_device_slots(); ++i ) {
+		if ( ( dev != NULL ) && ( cyusb_gethandle(i) == dev ) )
+			return true;
+	}
+	return false;
+}
+
+/* A worker still running on a departed device is stopped before its handle is closed. */
+static void stop_if_detached(TransferWorker *worker)
+{
+	if ( ( worker->isRunning() ) && ( !handle_present(worker->device()) ) ) {
+		worker->requestStop();
+		worker->wait();
+	}
+}
+
 void ControlCenter::sigusr1_handler()
 {
 	int nbr;
@@ -701,10 +734,31 @@ void ControlCenter::sigusr1_handler()
 	mainwin->sn_sigusr1->setEnabled(false);
 	nbr = read(sigusr1_fd[1], &tmp, 1);
 
+	if ( hotplug_enabled ) {
+		if ( ( current_device_index >= 0 ) && ( cyusb_gethandle(current_device_index) == NULL ) ) {
+			clear_widgets();
+			current_device_index = -1;
+		}
+		stop_if_detached(worker6);
+		stop_if_detached(worker7);
+		if ( !handle_present(h) )
+			h = NULL;
+		cyusb_hotplug_poll();
+		num_devices_detected = cyusb_get_device_slots();
+	}
 	update_devlist();
 	mainwin->sn_sigusr1->setEnabled(true);	
 }
 
+/* The event thread may be inside cyusb_handle_events(), and the hotplug callback registered,
+   until both are stopped; only then can the library be closed. */
+static void close_library(void)
+{
+	cyusb_event_thread_stop();
+	cyusb_hotplug_disable();
+	cyusb_close();
+}
+
 static void setup_handler(int signo)
 {
 	int nbw;
@@ -712,7 +766,11 @@ static void setup_handler(int signo)
 	int N;
 
 	printf("Signal %d (=SIGUSR1) received !\n",signo);
-	cyusb_close();
+	if ( hotplug_enabled ) {
+		nbw = write(sigusr1_fd[0], &a, 1);
+		return;
+	}
+	close_library();
 	N = cyusb_open();
 	if ( N < 0 ) {
 		printf("Error in opening library\n");
@@ -731,6 +789,16 @@ static void setup_handler(int signo)
 	nbw = write(sigusr1_fd[0], &a, 1);
 }
 
+/* Called from the libcyusb event thread; the list is refreshed, and the handles of departed
+   devices closed, on the UI thread. */
+static void hotplug_notify(int index, int arrived, void *user_data)
+{
+	int nbw;
+	char a = 1;
+
+	nbw = write(sigusr1_fd[0], &a, 1);
+}
+
 void ControlCenter::on_pb1_selfile_clicked()
 {
 	QString filename;
@@ -1113,8 +1181,9 @@ void ControlCenter::on_le6_out_ascii_textChanged()
 
 void ControlCenter::on_pb6_clear_clicked()
 {
-	mainwin->lw6->clear();
-	mainwin->lw6_out->clear();
+	mainwin->model6_in->clear();
+	mainwin->model6_out->clear();
+	mainwin->plot6->clear();
 	mainwin->le6_out_hex->clear();
 	mainwin->le6_out_ascii->clear();
 	mainwin->label6_out->clear();
@@ -1147,7 +1216,7 @@ void ControlCenter::on_rb6_inc_clicked()
 
 void ControlCenter::on_cb6_loop_clicked()
 {
-	if ( mainwin->cb6_loop->isChecked() ) {
+	if ( ( mainwin->cb6_loop->isChecked() ) || ( mainwin->worker6->isRunning() ) ) {
 		mainwin->pb6_rcv->setEnabled(FALSE);
 	}
 	else {
@@ -1155,88 +1224,6 @@ void ControlCenter::on_cb6_loop_clicked()
 	}
 }
 
-static void dump_data6_out(int num_bytes, unsigned char *dbuf)
-{
-	int i, j, k, index, filler;
-	char ttbuf[10];
-	char finalbuf[256];
-	char tbuf[256];
-	int balance = 0;
-
-	balance = num_bytes;
-	index = 0;
-
-	while ( balance > 0 ) {
-		tbuf[0]  = '\0';
-		if ( balance < 8 )
-			j = balance;
-		else j = 8;
-		for ( i = 0; i < j; ++i ) {
-			sprintf(ttbuf,"%02x ",(unsigned char)dbuf[index+i]);
-			strcat(tbuf,ttbuf);
-		}
-		if ( balance < 8 ) {
-			filler = 8-balance;
-			for ( k = 0; k < filler; ++k ) 
-				strcat(tbuf,"   ");
-		}
-		strcat(tbuf,": ");
-		for ( i = 0; i < j; ++i ) {
-			if ( !isprint(dbuf[index+i]) )
-				strcat(tbuf,". ");
-			else {
-				sprintf(ttbuf,"%c ",dbuf[index+i]);
-				strcat(tbuf,ttbuf);
-			}
-		}
-		sprintf(finalbuf,"%s",tbuf);
-		mainwin->lw6_out->addItem(finalbuf);
-		balance -= j;
-		index += j;
-	}
-}
-
-static void dump_data6_in(int num_bytes, unsigned char *dbuf)
-{
-	int i, j, k, index, filler;
-	char ttbuf[10];
-	char finalbuf[256];
-	char tbuf[256];
-	int balance = 0;
-
-	balance = num_bytes;
-	index = 0;
-
-	while ( balance > 0 ) {
-		tbuf[0]  = '\0';
-		if ( balance < 8 )
-			j = balance;
-		else j = 8;
-		for ( i = 0; i < j; ++i ) {
-			sprintf(ttbuf,"%02x ",(unsigned char)dbuf[index+i]);
-			strcat(tbuf,ttbuf);
-		}
-		if ( balance < 8 ) {
-			filler = 8-balance;
-			for ( k = 0; k < filler; ++k ) 
-				strcat(tbuf,"   ");
-		}
-		strcat(tbuf,": ");
-		for ( i = 0; i < j; ++i ) {
-			if ( !isprint(dbuf[index+i]) )
-				strcat(tbuf,". ");
-			else {
-				sprintf(ttbuf,"%c ",dbuf[index+i]);
-				strcat(tbuf,ttbuf);
-			}
-		}
-		sprintf(finalbuf,"%s",tbuf);
-		mainwin->lw6->addItem(finalbuf);
-		balance -= j;
-		index += j;
-	}
-}
-
 //static void get_maxps(int *maxps)
 //{
 //	int i;
@@ -1263,163 +1250,40 @@ static void dump_data6_in(int num_bytes, unsigned char *dbuf)
 //	*maxps = summ[i].maxps;
 //} 
 
-static void clearhalt_in()
+/* Pattern picked by the Constant / Random / Increment buttons; random data is a PRBS-31 run. */
+static int selected_pattern(unsigned int *seed)
 {
-	int r;
-	unsigned char ep;
 	bool ok;
 
-	ep = mainwin->cb6_in->currentText().toInt(&ok, 16);
-	r = cyusb_clear_halt(h, ep);
-	if ( r ) {
-		libusb_error(r, "Error while automatically clearing halt condition on IN pipe");
-		return;
+	if ( mainwin->rb6_random->isChecked() ) {
+		*seed = random();
+		return CYUSB_PATTERN_PRBS31;
 	}
+	*seed = mainwin->le6_value->text().toInt(&ok, 16);
+	if ( mainwin->rb6_constant->isChecked() )
+		return CYUSB_PATTERN_CONSTANT;
+	return CYUSB_PATTERN_COUNTER8;
 }
 
-static void clearhalt_out()
+/* Hand a job to the Bulk tab's worker thread. The buttons stay disabled until it finishes. */
+static void bulk6_start(const BulkJob &job)
 {
-	int r;
-	unsigned char ep;
-	bool ok;
-
-	ep = mainwin->cb6_out->currentText().toInt(&ok, 16);
-	r = cyusb_clear_halt(h, ep);
-	if ( r ) {
-		libusb_error(r, "Error while automatically clearing halt condition on OUT pipe");
+	if ( !mainwin->worker6->startJob(h, job) )
 		return;
-	}
-}
 
-void ControlCenter::on_pb6_rcv_clicked()
-{
-	int r;
-	int transferred = 0;
-	bool ok;
-	unsigned char *buf;
-	char tmpbuf[10];
-	int nbw;
+	bulk6_repeat = job.repeat;
+	bulk6_verify = ( job.verify >= 0 );
+	memset(&bulk6_prev, 0, sizeof(bulk6_prev));
+	bulk6_prev_ms = 0;
+	bulk6_time.start();
 
-	if ( mainwin->cb6_loop->isChecked() ) {
-		buf = (unsigned char *)malloc(data_count);
-		r = cyusb_bulk_transfer(h, mainwin->cb6_in->currentText().toInt(&ok, 16), buf, 
-				data_count, &transferred, 1000);
-		printf("Bytes read from device = %d\n",transferred);
-		if ( r ) {
-			libusb_error(r, "Data Read Error");
-			clearhalt_in();
-		}
-		dump_data6_in(transferred, buf);
-		cum_data_in += transferred;
-		sprintf(tmpbuf,"%d",cum_data_in);
-		mainwin->label6_in->setText(tmpbuf);
-		if ( mainwin->le6_infile->text() != "" )
-			nbw = write(fd_infile, buf, transferred);
-	}
-	else {
-		buf = (unsigned char *)malloc(mainwin->le6_size->text().toInt(&ok, 10));	      
-		r = cyusb_bulk_transfer(h, mainwin->cb6_in->currentText().toInt(&ok, 16), buf, 
-				mainwin->le6_size->text().toInt(&ok, 10), &transferred, 1000);
-		printf("Bytes read from device = %d\n",transferred);
-		dump_data6_in(transferred, buf);
-		cum_data_in += transferred;
-		sprintf(tmpbuf,"%d",cum_data_in);
-		mainwin->label6_in->setText(tmpbuf);
-		if ( mainwin->le6_infile->text() != "" )
-			nbw = write(fd_infile, buf, transferred);
-	}
-	free(buf);
+	mainwin->pb6_send->setEnabled(FALSE);
+	mainwin->pb6_rcv->setEnabled(FALSE);
+	mainwin->pb6_stop->setEnabled(TRUE);
+	mainwin->plot6->clear();
+	mainwin->timer6->start();
 }
 
-void ControlCenter::pb6_send_file_selected(unsigned char *buf, int sz)
-{
-	int r;
-	int transferred = 0;
-	bool ok;
-	char tmpbuf[10];
-
-	r = cyusb_bulk_transfer(h, mainwin->cb6_out->currentText().toInt(&ok, 16), buf, sz, &transferred, 1000);
-	printf("Bytes sent to device = %d\n",transferred);
-	if ( r ) {
-		libusb_error(r, "Error in bulk write!");
-		clearhalt_out();
-		return ;
-	}
-	cum_data_out += transferred;
-	sprintf(tmpbuf,"%d",cum_data_out);
-	mainwin->label6_out->setText(tmpbuf);
-	dump_data6_out(transferred, buf);
-
-	if ( mainwin->cb6_loop->isChecked() ) {
-		data_count = transferred;
-		on_pb6_rcv_clicked();
-	}
-}
-
-void ControlCenter::pb6_send_nofile_selected()
-{
-	int r, i;
-	int transferred = 0;
-	bool ok;
-	unsigned char *buf;
-	char tmpbuf[10];
-
-	int sz;
-	unsigned char val;
-
-
-	if ( mainwin->le6_out_hex->text() == "" ) {
-		sz = mainwin->le6_size->text().toInt(&ok, 10);
-		buf = (unsigned char *)malloc(sz);
-		if ( mainwin->rb6_constant->isChecked() ) {
-			val = mainwin->le6_value->text().toInt(&ok, 16);
-			for ( i = 0; i < sz; ++i )
-				buf[i] = val;
-		}
-		else if ( mainwin->rb6_random->isChecked() ) {
-			for ( i = 0; i < sz; ++i )
-				buf[i] = random();
-		}
-		else {
-			val = mainwin->le6_value->text().toInt(&ok, 16);
-			for ( i = 0; i < sz; ++i ) {
-				if ( i == 0 )
-					buf[i] = val;
-				else buf[i] = buf[i-1] + 1;
-			}	
-		}
-	}
-	else {
-		sz = strlen(qPrintable(mainwin->le6_out_ascii->text() ) + 1);
-		buf = (unsigned char *)malloc(sz);
-		strcpy((char *)buf, qPrintable(mainwin->le6_out_ascii->text()) );
-	}
-
-	cum_data_out = 0;
-	cum_data_in  = 0;
-
-	r = cyusb_bulk_transfer(h, mainwin->cb6_out->currentText().toInt(&ok, 16), buf, 
-			mainwin->le6_size->text().toInt(&ok, 10), &transferred, 1000);
-	printf("Bytes sent to device = %d\n",transferred);
-	if ( r ) {
-		libusb_error(r, "Error in bulk write!\nPerhaps size > device buffer ?");
-		clearhalt_out();
-	}
-	cum_data_out += transferred;
-	sprintf(tmpbuf,"%d",cum_data_out);
-	mainwin->label6_out->setText(tmpbuf);
-
-	dump_data6_out(transferred, buf);
-
-	free(buf);
-
-	if ( mainwin->cb6_loop->isChecked() ) {
-		data_count = transferred;
-		on_pb6_rcv_clicked();
-	}
-}
-
-
 void ControlCenter::on_pb6_clearhalt_out_clicked()
 {
 	int r;
@@ -1492,44 +1356,165 @@ void ControlCenter::on_pb7_clearhalt_in_clicked()
 	return;
 }
 
-void ControlCenter::on_pb6_send_clicked()
+void ControlCenter::on_pb6_rcv_clicked()
 {
-	int nbr;
-	unsigned char *buf;
-	int maxps = 0;
+	BulkJob job;
+	bool ok;
 
-	if ( mainwin->le6_outfile->text() == "" )
-		pb6_send_nofile_selected();
-	else {
-		fd_outfile = open(qPrintable(mainwin->le6_outfile->text()), O_RDONLY);
-		if ( fd_outfile < 0 ) {
+	job.ep_out  = 0;
+	job.ep_in   = cb6_in->currentText().toInt(&ok, 16);
+	job.size    = le6_size->text().toInt(&ok, 10);
+	job.repeat  = cb6_repeat->isChecked();
+	job.depth   = ( job.repeat ) ? BULK6_DEPTH : 1;
+	job.infile  = le6_infile->text();
+	job.pattern = -1;
+	job.seed    = 0;
+	job.verify  = bulk6_pattern;
+	job.verify_seed = bulk6_seed;
+	if ( job.size <= 0 )
+		return;
+
+	bulk6_start(job);
+}
+
+void ControlCenter::on_pb6_send_clicked()
+{
+	BulkJob job;
+	bool ok;
+	int fd;
+
+	job.ep_out  = cb6_out->currentText().toInt(&ok, 16);
+	job.ep_in   = ( cb6_loop->isChecked() ) ? cb6_in->currentText().toInt(&ok, 16) : 0;
+	job.repeat  = cb6_repeat->isChecked();
+	job.depth   = ( job.repeat ) ? BULK6_DEPTH : 1;
+	job.pattern = -1;
+	job.seed    = 0;
+	job.verify  = -1;
+	job.verify_seed = 0;
+
+	if ( le6_outfile->text() != "" ) {
+		fd = open(qPrintable(le6_outfile->text()), O_RDONLY);
+		if ( fd < 0 ) {
 			QMessageBox mb;
 			mb.setText("Output file not found!");
 			mb.exec();
 			return ;
 		}
-		if ( mainwin->le6_infile->text() != "" ) {
-			fd_infile = open(qPrintable(mainwin->le6_infile->text()), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-			if ( fd_infile < 0 ) {
+		::close(fd);
+		if ( ( job.ep_in ) && ( le6_infile->text() != "" ) ) {
+			fd = open(qPrintable(le6_infile->text()), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+			if ( fd < 0 ) {
 				QMessageBox mb;
 				mb.setText("Input file creation error");
 				mb.exec();
 				return;
 			}
+			::close(fd);
+			job.infile = le6_infile->text();
+		}
+		job.outfile = le6_outfile->text();
+		job.size    = BULK6_FILE_XFER;
+		job.depth   = BULK6_DEPTH;
+	}
+	else {
+		if ( le6_out_hex->text() == "" ) {
+			job.size    = le6_size->text().toInt(&ok, 10);
+			job.pattern = selected_pattern(&job.seed);
+			job.verify  = job.pattern;
+			job.verify_seed = job.seed;
 		}
+		else {
+			job.data = le6_out_ascii->text().toAscii();
+			job.size = job.data.size();
+		}
+		cum_data_out = 0;
+		cum_data_in  = 0;
+	}
+	if ( job.size <= 0 )
+		return;
 
-		maxps = 4096;	/* If sending a file, then data is sent in 4096 byte packets */
+	bulk6_pattern = job.pattern;
+	bulk6_seed    = job.seed;
+	bulk6_start(job);
+}
 
-		buf = (unsigned char *)malloc(maxps);
-		while ( (nbr = read(fd_outfile, buf, maxps)) ) {
-			pb6_send_file_selected(buf, nbr);
-		}
-		free(buf);
-		::close(fd_outfile);
-		::close(fd_infile);
+void ControlCenter::on_pb6_stop_clicked()
+{
+	worker6->requestStop();
+}
+
+/* Runs on the UI thread while a job is active: shows what the worker has moved since the
+   last call. At most a few KB per call reach the hex views, whatever the transfer rate. */
+void ControlCenter::bulk6_tick()
+{
+	BulkStats st;
+	QByteArray out, in;
+	char tbuf[32];
+	int ms = bulk6_time.elapsed();
+	double secs;
+
+	worker6->stats(&st);
+	worker6->takeData(&out, &in);
+	if ( !out.isEmpty() ) {
+		model6_out->append(out);
+		lw6_out->scrollToBottom();
+	}
+	if ( !in.isEmpty() ) {
+		model6_in->append(in);
+		lw6->scrollToBottom();
+	}
+
+	/* In loopback the same data is counted once, as it comes back. */
+	secs = ( ms - bulk6_prev_ms ) / 1000.0;
+	if ( secs > 0 )
+		plot6->addSample(qMax(st.bytes_out - bulk6_prev.bytes_out, st.bytes_in - bulk6_prev.bytes_in) / secs / 1e6,
+				( st.errors - bulk6_prev.errors ) / secs);
+	bulk6_prev    = st;
+	bulk6_prev_ms = ms;
+
+	sprintf(tbuf, "%llu", cum_data_out + st.bytes_out);
+	label6_out->setText(tbuf);
+	sprintf(tbuf, "%llu", cum_data_in + st.bytes_in);
+	label6_in->setText(tbuf);
+}
+
+void ControlCenter::bulk6_finished()
+{
+	BulkStats st;
+	char tbuf[100];
+
+	timer6->stop();
+	bulk6_tick();
+	worker6->stats(&st);
+	cum_data_out += st.bytes_out;
+	cum_data_in  += st.bytes_in;
+
+	pb6_send->setEnabled(TRUE);
+	pb6_rcv->setEnabled(!cb6_loop->isChecked());
+	pb6_stop->setEnabled(FALSE);
+
+	printf("Bytes sent to device = %llu\n", st.bytes_out);
+	printf("Bytes read from device = %llu\n", st.bytes_in);
+	if ( st.corrupt ) {
+		sprintf(tbuf, "Received data does not match the pattern at offset %lld", st.first_bad);
+		printf("%s (%llu transfers)\n", tbuf, st.corrupt);
+		sb->showMessage(tbuf);
+	}
+	else if ( ( bulk6_verify ) && ( st.bytes_in ) ) {
+		printf("Data verified, %llu bytes\n", st.bytes_in);
+		sb->showMessage("Received data matches the pattern", 5000);
 	}
-}  
 
+	if ( ( st.last_error ) && ( st.last_error_ep == 0 ) )
+		libusb_error(st.last_error, "Error reading or writing the data file");
+	else if ( ( st.last_error ) && ( !bulk6_repeat ) )
+		libusb_error(st.last_error, ( st.last_error_ep & 0x80 ) ? "Data Read Error" :
+				"Error in bulk write!\nPerhaps size > device buffer ?");
+	else if ( st.errors ) {
+		sprintf(tbuf, "%llu transfer(s) failed", st.errors);
+		sb->showMessage(tbuf);
+	}
+}
 
 void ControlCenter::on_pb6_selout_clicked()
 {
@@ -1649,121 +1634,23 @@ static void dump_data7_out(int num_bytes, unsigned char *dbuf)
 	}
 }
 
-static void in_callback( struct libusb_transfer *transfer)
-{
-	bool ok;
-	int pktsin, act_len;
-	char tbuf[8];
-	unsigned char *ptr;
-	int elapsed;
-	unsigned char ep_in;
-	int pktsize_in;
-	char ttbuf[10];
-	double inrate;
-
-	printf("Callback function called\n");
-
-	if ( transfer->status != LIBUSB_TRANSFER_COMPLETED ) {
-		libusb_error(transfer->status, "Transfer not completed normally");
-	}
-
-	totalin = pkts_success = pkts_failure = 0;
-
-	pktsin = mainwin->cb7_numpkts->currentText().toInt(&ok, 10);
-
-	elapsed = isoc_time->elapsed();
-
-	printf("Milliseconds elapsed = %d\n",elapsed);
-
-	for ( int i = 0; i < pktsin; ++i ) {
-		ptr = libusb_get_iso_packet_buffer_simple(transfer, i);
-		act_len = transfer->iso_packet_desc[i].actual_length;
-		totalin += 1;
-		if ( transfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED ) {
-			pkts_success += 1;
-			if ( mainwin->rb7_enable->isChecked() ) {
-				dump_data7_in(act_len, ptr);
-				mainwin->lw7_in->addItem("");
-			}
-		}
-		else pkts_failure += 1;
-	}
-	sprintf(tbuf,"%6d",totalin);
-	mainwin->label7_totalin->setText(tbuf);
-	sprintf(tbuf,"%6d",pkts_success);
-	mainwin->label7_pktsin->setText(tbuf);
-	sprintf(tbuf,"%6d",pkts_failure);
-	mainwin->label7_dropped_in->setText(tbuf);
-	ep_in = mainwin->cb7_in->currentText().toInt(&ok, 16);  
-	pktsize_in = cyusb_get_max_iso_packet_size(h, ep_in);
-	inrate = ( (((double)totalin * (double)pktsize_in) / (double)elapsed ) * (1000.0 / 1024.0) );
-	sprintf(ttbuf, "%8.1f", inrate);
-	mainwin->label7_ratein->setText(ttbuf);
-}	
-
-static void out_callback( struct libusb_transfer *transfer)
+/* Hand an isochronous job to the Isochronous tab's worker thread. The buttons stay disabled
+   until it finishes. */
+static void iso7_start(const IsoJob &job)
 {
-	bool ok;
-	int pktsout, act_len;
-	char tbuf[8];
-	unsigned char *ptr;
-	int elapsed;
-	unsigned char ep_out;
-	int pktsize_out;
-	char ttbuf[10];
-	double outrate;
-
-
-	printf("Callback function called\n");
-
-	if ( transfer->status != LIBUSB_TRANSFER_COMPLETED ) {
-		libusb_error(transfer->status, "Transfer not completed normally");
-	}
-
-	totalout = pkts_success = pkts_failure = 0;
-
-	pktsout = mainwin->cb7_numpkts->currentText().toInt(&ok, 10);
-
-	elapsed = isoc_time->elapsed();
-
-	printf("Milliseconds elapsed = %d\n",elapsed);
+	if ( !mainwin->worker7->startIsoJob(h, job) )
+		return;
 
-	for ( int i = 0; i < pktsout; ++i ) {
-		ptr = libusb_get_iso_packet_buffer_simple(transfer, i);
-		act_len = transfer->iso_packet_desc[i].actual_length;
-		totalout += 1;
-		if ( transfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED ) {
-			pkts_success += 1;
-			if ( mainwin->rb7_enable->isChecked() ) {
-				dump_data7_out(act_len, ptr);
-				mainwin->lw7_out->addItem("");
-			}
-		}
-		else pkts_failure += 1;
-	}
-	sprintf(tbuf,"%6d",totalout);
-	mainwin->label7_totalout->setText(tbuf);
-	sprintf(tbuf,"%6d",pkts_success);
-	mainwin->label7_pktsout->setText(tbuf);
-	sprintf(tbuf,"%6d",pkts_failure);
-	mainwin->label7_dropped_out->setText(tbuf);
-	ep_out = mainwin->cb7_out->currentText().toInt(&ok, 16);  
-	pktsize_out = cyusb_get_max_iso_packet_size(h, ep_out);
-	outrate = ( (((double)totalout * (double)pktsize_out) / (double)elapsed ) * (1000.0 / 1024.0) );
-	sprintf(ttbuf, "%8.1f", outrate);
-	mainwin->label7_rateout->setText(ttbuf);
-}	
+	iso7_job = job;
+	mainwin->pb7_send->setEnabled(FALSE);
+	mainwin->pb7_rcv->setEnabled(FALSE);
+}
 
 void ControlCenter::on_pb7_rcv_clicked()
 {
-	int numpkts;	
+	IsoJob job;
 	bool ok;
-	int pktsize_in;
-	int bufsize_in;
-	unsigned char ep_in;
-	int r;
 	char tbuf[10];
-	struct timeval tv;
 
 	if ( cb7_in->currentText() == "" ) {  /* No ep_in exists */
 		QMessageBox mb;
@@ -1772,55 +1659,24 @@ void ControlCenter::on_pb7_rcv_clicked()
 		return;
 	} 
 
-	ep_in = cb7_in->currentText().toInt(&ok, 16);  
-	pktsize_in = cyusb_get_max_iso_packet_size(h, ep_in);
-	sprintf(tbuf,"%9d",pktsize_in);
-	mainwin->label7_pktsize_in->setText(tbuf);
-
-	numpkts = mainwin->cb7_numpkts->currentText().toInt(&ok, 10);
-	bufsize_in = pktsize_in * numpkts;
-	isoc_databuf = (unsigned char *)malloc(bufsize_in);
-
-	transfer = libusb_alloc_transfer(numpkts);
-	if ( !transfer ) {
-		QMessageBox mb;
-		mb.setText("Alloc failure");
-		mb.exec();
+	job.ep = cb7_in->currentText().toInt(&ok, 16);  
+	job.pkt_size = cyusb_get_max_iso_packet_size(h, job.ep);
+	if ( job.pkt_size <= 0 ) {
+		libusb_error(job.pkt_size, "Error getting the packet size of the IN endpoint");
 		return;
 	}
+	sprintf(tbuf,"%9d",job.pkt_size);
+	label7_pktsize_in->setText(tbuf);
 
-	libusb_fill_iso_transfer(transfer, h, ep_in, isoc_databuf, bufsize_in, numpkts, in_callback, NULL, 10000 );
-
-	libusb_set_iso_packet_lengths(transfer, pktsize_in);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
-
-	isoc_time = new QTime();
-	isoc_time->start();
-
-	r = libusb_submit_transfer(transfer);
-
-	tv.tv_sec = 0;
-	tv.tv_usec = 50;
-
-	for ( int i = 0; i < 100; ++i ) {
-		libusb_handle_events_timeout(NULL,&tv);
-	}
-
-	if ( r ) {
-		printf("Error %d submitting transfer\n", r);
-	}
+	job.num_pkts = cb7_numpkts->currentText().toInt(&ok, 10);
+	iso7_start(job);
 }
 
 void ControlCenter::on_pb7_send_clicked()
 {
-	int numpkts;	
+	IsoJob job;
 	bool ok;
-	int pktsize_out;
-	int bufsize_out;
-	unsigned char ep_out;
-	int r;
 	char tbuf[10];
-	struct timeval tv;
 
 	if ( cb7_out->currentText() == "" ) {  /* No ep_out exists */
 		QMessageBox mb;
@@ -1829,48 +1685,71 @@ void ControlCenter::on_pb7_send_clicked()
 		return;
 	} 
 
-	ep_out = cb7_out->currentText().toInt(&ok, 16);  
-	pktsize_out = cyusb_get_max_iso_packet_size(h, ep_out);
-	sprintf(tbuf,"%9d",pktsize_out);
-	mainwin->label7_pktsize_out->setText(tbuf);
-
-	numpkts = mainwin->cb7_numpkts->currentText().toInt(&ok, 10);
-	bufsize_out = pktsize_out * numpkts;
-	isoc_databuf = (unsigned char *)malloc(bufsize_out);
-
-	for ( int i = 0; i < numpkts; ++i )
-		for ( int j = 0; j < pktsize_out; ++j )
-			isoc_databuf[i*pktsize_out+j] = i + 1;
-
-	transfer = libusb_alloc_transfer(numpkts);
-	if ( !transfer ) {
-		QMessageBox mb;
-		mb.setText("Alloc failure");
-		mb.exec();
+	job.ep = cb7_out->currentText().toInt(&ok, 16);  
+	job.pkt_size = cyusb_get_max_iso_packet_size(h, job.ep);
+	if ( job.pkt_size <= 0 ) {
+		libusb_error(job.pkt_size, "Error getting the packet size of the OUT endpoint");
 		return;
 	}
+	sprintf(tbuf,"%9d",job.pkt_size);
+	label7_pktsize_out->setText(tbuf);
 
-	libusb_fill_iso_transfer(transfer, h, ep_out, isoc_databuf, bufsize_out, numpkts, out_callback, NULL, 10000 );
-
-	libusb_set_iso_packet_lengths(transfer, pktsize_out);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
-
-	isoc_time = new QTime();
-	isoc_time->start();
+	job.num_pkts = cb7_numpkts->currentText().toInt(&ok, 10);
+	iso7_start(job);
+}
 
-	r = libusb_submit_transfer(transfer);
+/* Runs on the UI thread once the worker is done: shows the packet counts, the rate and, if
+   enabled, the data of the transfer. */
+void ControlCenter::iso7_finished()
+{
+	IsoStats st;
+	QByteArray out, in;
+	QLabel *total, *good, *dropped, *rate;
+	char tbuf[10];
+	double kbps = 0;
 
+	pb7_send->setEnabled(TRUE);
+	pb7_rcv->setEnabled(TRUE);
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 50;
+	worker7->isoStats(&st);
+	worker7->takeData(&out, &in);
 
-	for ( int i = 0; i < 100; ++i ) {
-		libusb_handle_events_timeout(NULL,&tv);
+	if ( iso7_job.ep & LIBUSB_ENDPOINT_IN ) {
+		if ( ( rb7_enable->isChecked() ) && ( !in.isEmpty() ) ) {
+			dump_data7_in(in.size(), (unsigned char *)in.data());
+			lw7_in->addItem("");
+		}
+		total   = label7_totalin;
+		good    = label7_pktsin;
+		dropped = label7_dropped_in;
+		rate    = label7_ratein;
+	}
+	else {
+		if ( ( rb7_enable->isChecked() ) && ( !out.isEmpty() ) ) {
+			dump_data7_out(out.size(), (unsigned char *)out.data());
+			lw7_out->addItem("");
+		}
+		total   = label7_totalout;
+		good    = label7_pktsout;
+		dropped = label7_dropped_out;
+		rate    = label7_rateout;
 	}
 
-	if ( r ) {
-		printf("Error %d submitting transfer\n", r);
+	if ( st.packets ) {
+		sprintf(tbuf,"%6d",st.packets);
+		total->setText(tbuf);
+		sprintf(tbuf,"%6d",st.packets_ok);
+		good->setText(tbuf);
+		sprintf(tbuf,"%6d",st.packets_dropped);
+		dropped->setText(tbuf);
+		if ( st.elapsed_ms > 0 )
+			kbps = ( (((double)st.packets * (double)iso7_job.pkt_size) / (double)st.elapsed_ms ) * (1000.0 / 1024.0) );
+		sprintf(tbuf, "%8.1f", kbps);
+		rate->setText(tbuf);
 	}
+
+	if ( st.status )
+		libusb_error(st.status, "Transfer not completed normally");
 }
 
 void ControlCenter::on_pb7_clear_clicked()
@@ -1913,8 +1792,20 @@ static int multiple_instances()
 	return 1;
 }
 
+/* Jobs are stopped while the event thread still completes their transfers, then the library
+   is closed. */
+static void app_shutdown(void)
+{
+	mainwin->worker6->requestStop();
+	mainwin->worker7->requestStop();
+	mainwin->worker6->wait();
+	mainwin->worker7->wait();
+	close_library();
+}
+
 void ControlCenter::appExit()
 {
+	app_shutdown();
 	exit(0);
 }
 
@@ -1952,6 +1843,9 @@ int main(int argc, char **argv)
 	signal(SIGUSR1, setup_handler);
 
 	mainwin = new ControlCenter;
+	if ( ( cyusb_hotplug_enable(hotplug_notify, NULL) == 0 ) && ( cyusb_event_thread_start(-1, 0) == 0 ) )
+		hotplug_enabled = 1;
+	else cyusb_hotplug_disable();
 	QMainWindow *mw = new QMainWindow(0);
 	mw->setCentralWidget(mainwin);
 	QIcon *qic = new QIcon("cypress.png");
@@ -1980,5 +1874,7 @@ int main(int argc, char **argv)
 
 	sb->showMessage("Starting Application...",2000);
 
-	return app.exec();
+	r = app.exec();
+	app_shutdown();
+	return r;
 }
@@ -0,0 +1,437 @@
+/***********************************************************************************************************************\
+ * Program Name		:	transferworker.cpp									*
+ * License		:	GPL Ver 2.0										*
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS							*
+ * Modification Notes	:												*
+ * 															*
+ * Transfer engine for the Bulk and Isochronous tabs. Jobs run on their own thread over libcyusb		*
+ * streams, so that the UI thread only displays results.							*
+\***********************************************************************************************************************/
+#include <QtCore>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../include/transferworker.h"
+
+#define XFER_TIMEOUT	1000			/* Timeout of each transfer in ms */
+#define POLL_MS		2			/* Wait on one endpoint before checking the other */
+#define DISPLAY_MAX	(64 * 1024)		/* Data kept for display between two polls */
+#define ISO_TIMEOUT	10000			/* Time allowed for an isochronous transfer in ms */
+
+TransferWorker::TransferWorker(QObject *parent) : QThread(parent)
+{
+	h = NULL;
+	iso = false;
+	iso_done = false;
+	fd_out = fd_in = -1;
+	sent_once = false;
+	stop_requested = false;
+	memset(&st, 0, sizeof(st));
+	st.first_bad = -1;
+	memset(&ist, 0, sizeof(ist));
+}
+
+bool TransferWorker::startJob(cyusb_handle *handle, const BulkJob &j)
+{
+	if ( isRunning() )
+		return false;
+
+	h = handle;
+	iso = false;
+	job = j;
+	sent_once = false;
+	stop_requested = false;
+
+	lock.lock();
+	memset(&st, 0, sizeof(st));
+	st.first_bad = -1;
+	pending_out.clear();
+	pending_in.clear();
+	lock.unlock();
+
+	start();
+	return true;
+}
+
+bool TransferWorker::startIsoJob(cyusb_handle *handle, const IsoJob &j)
+{
+	if ( isRunning() )
+		return false;
+
+	h = handle;
+	iso = true;
+	isojob = j;
+	iso_done = false;
+	stop_requested = false;
+
+	lock.lock();
+	memset(&ist, 0, sizeof(ist));
+	pending_out.clear();
+	pending_in.clear();
+	lock.unlock();
+
+	start();
+	return true;
+}
+
+void TransferWorker::requestStop()
+{
+	stop_requested = true;
+}
+
+/* Device of the current or last job. */
+cyusb_handle *TransferWorker::device() const
+{
+	return h;
+}
+
+void TransferWorker::stats(BulkStats *s)
+{
+	QMutexLocker locker(&lock);
+
+	*s = st;
+}
+
+void TransferWorker::isoStats(IsoStats *s)
+{
+	QMutexLocker locker(&lock);
+
+	*s = ist;
+}
+
+void TransferWorker::takeData(QByteArray *out, QByteArray *in)
+{
+	QMutexLocker locker(&lock);
+
+	*out = pending_out;
+	*in  = pending_in;
+	pending_out.clear();
+	pending_in.clear();
+}
+
+/* Keep a copy of transferred data for display, up to DISPLAY_MAX bytes per poll. */
+void TransferWorker::capture(QByteArray *pending, const unsigned char *data, int len)
+{
+	QMutexLocker locker(&lock);
+
+	if ( pending->size() + len > DISPLAY_MAX )
+		len = DISPLAY_MAX - pending->size();
+	if ( len > 0 )
+		pending->append((const char *)data, len);
+}
+
+/* An endpoint of 0 marks a file error rather than a failed transfer. */
+void TransferWorker::countError(unsigned char ep, int status)
+{
+	QMutexLocker locker(&lock);
+
+	st.errors++;
+	st.last_error = status;
+	st.last_error_ep = ep;
+}
+
+/* Fill the next OUT transfer. Returns its length, or 0 once there is nothing left to send. */
+int TransferWorker::nextOut(struct cyusb_stream_buffer *buf)
+{
+	int n;
+
+	if ( fd_out >= 0 ) {
+		n = read(fd_out, buf->data, buf->length);
+		if ( ( n <= 0 ) && ( job.repeat ) && ( lseek(fd_out, 0, SEEK_SET) == 0 ) )
+			n = read(fd_out, buf->data, buf->length);
+		return ( n > 0 ) ? n : 0;
+	}
+
+	if ( ( sent_once ) && ( !job.repeat ) )
+		return 0;
+	sent_once = true;
+
+	if ( job.pattern >= 0 ) {
+		cyusb_pattern_fill(&pat, buf->data, buf->length);
+		return buf->length;
+	}
+	n = qMin(job.data.size(), buf->length);
+	memcpy(buf->data, job.data.constData(), n);
+	return n;
+}
+
+void TransferWorker::run()
+{
+	if ( !iso )
+		runBulk();
+	else if ( isojob.ep & LIBUSB_ENDPOINT_IN )
+		runIsoIn();
+	else
+		runIsoOut();
+}
+
+void TransferWorker::runBulk()
+{
+	struct cyusb_stream *out = NULL, *in = NULL;
+	struct cyusb_stream_buffer *buf;
+	bool used[CYUSB_STREAM_MAX_XFERS];
+	bool out_done, in_done;
+	unsigned long long queued = 0, received = 0;
+	long long bad;
+	int n, r, e;
+	unsigned char ep;
+
+	fd_out = fd_in = -1;
+	memset(used, 0, sizeof(used));
+	if ( job.pattern >= 0 )
+		cyusb_pattern_init(&pat, job.pattern, job.seed);
+
+	if ( ( job.ep_out ) && ( !job.outfile.isEmpty() ) ) {
+		fd_out = open(qPrintable(job.outfile), O_RDONLY);
+		if ( fd_out < 0 ) {
+			countError(0, LIBUSB_ERROR_NOT_FOUND);
+			goto done;
+		}
+	}
+	if ( ( job.ep_in ) && ( !job.infile.isEmpty() ) ) {
+		fd_in = open(qPrintable(job.infile), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if ( fd_in < 0 ) {
+			countError(0, LIBUSB_ERROR_ACCESS);
+			goto done;
+		}
+	}
+
+	if ( job.ep_out )
+		out = cyusb_stream_create(h, job.ep_out, job.depth, job.size, XFER_TIMEOUT, NULL, NULL);
+	if ( job.ep_in )
+		in = cyusb_stream_create(h, job.ep_in, job.depth, job.size, XFER_TIMEOUT, NULL, NULL);
+	if ( ( ( job.ep_out ) && ( out == NULL ) ) || ( ( job.ep_in ) && ( in == NULL ) ) ) {
+		countError(0, LIBUSB_ERROR_NO_MEM);
+		goto done;
+	}
+
+	/* Start reading first, so that looped back data always has a buffer to land in. */
+	if ( in ) {
+		r = cyusb_stream_start(in);
+		if ( r ) {
+			countError(job.ep_in, r);
+			goto done;
+		}
+	}
+	if ( out ) {
+		r = cyusb_stream_start(out);
+		if ( r ) {
+			countError(job.ep_out, r);
+			goto done;
+		}
+	}
+
+	out_done = ( out == NULL );
+	in_done  = ( in == NULL );
+	while ( ( !stop_requested ) && ( ( !out_done ) || ( !in_done ) ) ) {
+		if ( !out_done ) {
+			r = cyusb_stream_get(out, &buf, POLL_MS);
+			if ( r == 0 ) {
+				if ( ( used[buf->index] ) && ( buf->status ) )
+					countError(job.ep_out, buf->status);
+				else if ( used[buf->index] ) {
+					lock.lock();
+					st.bytes_out += buf->actual_length;
+					st.xfers++;
+					lock.unlock();
+				}
+				n = ( ( buf->status ) && ( !job.repeat ) ) ? 0 : nextOut(buf);
+				used[buf->index] = ( n > 0 );
+				if ( n > 0 ) {
+					capture(&pending_out, buf->data, n);
+					queued += n;
+				}
+				cyusb_stream_put(out, buf, n);
+			}
+			else if ( r != LIBUSB_ERROR_TIMEOUT )
+				out_done = true;	/* Every buffer has been retired */
+		}
+
+		if ( !in_done ) {
+			r = cyusb_stream_get(in, &buf, POLL_MS);
+			if ( r == 0 ) {
+				if ( buf->status ) {
+					countError(job.ep_in, buf->status);
+					if ( !job.repeat )
+						in_done = true;
+				}
+				else {
+					if ( job.verify >= 0 ) {
+						bad = cyusb_pattern_check(job.verify, job.verify_seed, buf->data,
+								buf->actual_length);
+						if ( bad >= 0 ) {
+							lock.lock();
+							if ( st.corrupt++ == 0 )
+								st.first_bad = received + bad;
+							lock.unlock();
+						}
+					}
+					if ( ( fd_in >= 0 ) && ( write(fd_in, buf->data, buf->actual_length) != buf->actual_length ) ) {
+						countError(0, LIBUSB_ERROR_IO);
+						in_done = true;
+					}
+					capture(&pending_in, buf->data, buf->actual_length);
+					received += buf->actual_length;
+					lock.lock();
+					st.bytes_in += buf->actual_length;
+					st.xfers++;
+					lock.unlock();
+
+					/* A plain read is a single transfer. */
+					if ( out == NULL )
+						in_done = !job.repeat;
+				}
+				cyusb_stream_put(in, buf, ( in_done ) ? 0 : job.size);
+			}
+			else if ( r != LIBUSB_ERROR_TIMEOUT )
+				in_done = true;
+		}
+
+		/* In loopback, stop reading once everything sent has come back. */
+		if ( ( out != NULL ) && ( out_done ) && ( received >= queued ) )
+			in_done = true;
+	}
+
+done:
+	cyusb_stream_destroy(out);
+	cyusb_stream_destroy(in);
+	if ( fd_out >= 0 )
+		::close(fd_out);
+	if ( fd_in >= 0 )
+		::close(fd_in);
+
+	/* As with the synchronous transfers, a failure leaves the endpoint with its halt cleared. */
+	lock.lock();
+	e  = st.last_error;
+	ep = st.last_error_ep;
+	lock.unlock();
+	if ( ( e ) && ( ep ) )
+		cyusb_clear_halt(h, ep);
+}
+
+/* Called for each transfer of the capture stream; only the first one is reported. */
+void TransferWorker::isoReceived(struct cyusb_iso_stream *, unsigned char *data, int length,
+		int dropped, void *user_data)
+{
+	TransferWorker *w = (TransferWorker *)user_data;
+
+	if ( w->iso_done )
+		return;
+
+	w->capture(&w->pending_in, data, length);
+	w->lock.lock();
+	w->ist.packets         = w->isojob.num_pkts;
+	w->ist.packets_ok      = w->isojob.num_pkts - dropped;
+	w->ist.packets_dropped = dropped;
+	w->ist.elapsed_ms      = w->iso_time.elapsed();
+	w->lock.unlock();
+	w->iso_done = true;
+}
+
+/* Reads one transfer through an iso capture stream. The stream resubmits its transfer as soon
+   as it has been handed over, so it is stopped once the first one has arrived. */
+void TransferWorker::runIsoIn()
+{
+	struct cyusb_iso_stream *in;
+	int r, e;
+
+	in = cyusb_iso_stream_create(h, isojob.ep, 1, isojob.num_pkts, isojob.pkt_size, isoReceived, this);
+	if ( in == NULL ) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto done;
+	}
+
+	iso_time.start();
+	r = cyusb_iso_stream_start(in);
+	while ( ( r == 0 ) && ( !iso_done ) && ( !stop_requested ) && ( iso_time.elapsed() < ISO_TIMEOUT ) )
+		cyusb_handle_events(POLL_MS);
+	e = cyusb_iso_stream_stop(in);
+	cyusb_iso_stream_destroy(in);
+
+	if ( ( r == 0 ) && ( !iso_done ) )
+		r = ( stop_requested ) ? LIBUSB_ERROR_INTERRUPTED : LIBUSB_ERROR_TIMEOUT;
+	else if ( r == 0 )
+		r = e;
+
+done:
+	lock.lock();
+	ist.status = r;
+	lock.unlock();
+}
+
+void TransferWorker::isoSent(struct libusb_transfer *xfer)
+{
+	TransferWorker *w = (TransferWorker *)xfer->user_data;
+	int i, ok = 0;
+
+	cyusb_stats_completed(xfer, w->iso_t_submit);
+
+	for ( i = 0; i < xfer->num_iso_packets; ++i ) {
+		if ( ( xfer->status == LIBUSB_TRANSFER_COMPLETED ) &&
+		     ( xfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED ) ) {
+			w->capture(&w->pending_out, libusb_get_iso_packet_buffer_simple(xfer, i),
+					xfer->iso_packet_desc[i].actual_length);
+			++ok;
+		}
+	}
+
+	w->lock.lock();
+	w->ist.packets         = xfer->num_iso_packets;
+	w->ist.packets_ok      = ok;
+	w->ist.packets_dropped = xfer->num_iso_packets - ok;
+	w->ist.elapsed_ms      = w->iso_time.elapsed();
+	if ( xfer->status == LIBUSB_TRANSFER_TIMED_OUT )
+		w->ist.status = LIBUSB_ERROR_TIMEOUT;
+	else if ( xfer->status == LIBUSB_TRANSFER_NO_DEVICE )
+		w->ist.status = LIBUSB_ERROR_NO_DEVICE;
+	else if ( xfer->status == LIBUSB_TRANSFER_CANCELLED )
+		w->ist.status = LIBUSB_ERROR_INTERRUPTED;
+	else if ( xfer->status != LIBUSB_TRANSFER_COMPLETED )
+		w->ist.status = LIBUSB_ERROR_IO;
+	w->lock.unlock();
+	w->iso_done = true;
+}
+
+/* Iso streams only capture, so an OUT transfer is submitted here and reaped before the job
+   ends; the transfer and its buffer belong to this call. */
+void TransferWorker::runIsoOut()
+{
+	struct libusb_transfer *xfer;
+	QByteArray data(isojob.num_pkts * isojob.pkt_size, 0);
+	bool cancelled = false;
+	int i, r;
+
+	for ( i = 0; i < isojob.num_pkts; ++i )
+		memset(data.data() + i * isojob.pkt_size, i + 1, isojob.pkt_size);
+
+	xfer = libusb_alloc_transfer(isojob.num_pkts);
+	if ( xfer == NULL ) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto done;
+	}
+	libusb_fill_iso_transfer(xfer, h, isojob.ep, (unsigned char *)data.data(), data.size(),
+			isojob.num_pkts, isoSent, this, ISO_TIMEOUT);
+	libusb_set_iso_packet_lengths(xfer, isojob.pkt_size);
+
+	iso_time.start();
+	r = cyusb_stats_submit(xfer, &iso_t_submit);
+	while ( ( r == 0 ) && ( !iso_done ) ) {
+		if ( ( stop_requested ) && ( !cancelled ) ) {
+			cyusb_cancel_transfer(xfer);
+			cancelled = true;
+		}
+		cyusb_handle_events(POLL_MS);
+	}
+	libusb_free_transfer(xfer);
+	if ( r == 0 )
+		return;		/* isoSent() has filled in the result */
+
+done:
+	lock.lock();
+	ist.status = r;
+	lock.unlock();
+}
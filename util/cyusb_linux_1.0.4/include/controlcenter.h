@@ -7,6 +7,8 @@
 #define CONTROLCENTER_H
 
 #include "ui_controlcenter.h"
+#include "transferworker.h"
+#include "dataviews.h"
 
 class ControlCenter : public QWidget, public Ui::ControlCenter
 {
@@ -16,13 +18,18 @@ public:
 	ControlCenter(QWidget *parent = 0);
 	static void unixhandler_sigusr1(int unused);
 	QSocketNotifier *sn_sigusr1;
+	TransferWorker *worker6;	/* Runs the Bulk tab transfers */
+	TransferWorker *worker7;	/* Runs the Isochronous tab transfers */
+	QTimer *timer6;			/* Polls worker6 while a job runs */
+	HexModel *model6_out, *model6_in;
 
 public slots:
 	void on_pb_setIFace_clicked();
 	void on_pb_setAltIf_clicked();
 	void on_pb6_rcv_clicked();
-	void pb6_send_nofile_selected();
-	void pb6_send_file_selected(unsigned char *, int);
+	void bulk6_tick();
+	void bulk6_finished();
+	void iso7_finished();
 	void on_pb7_send_clicked();
 	void appExit();
 	void about();
@@ -65,6 +72,7 @@ private slots:
 	void on_rb6_random_clicked();
 	void on_rb6_inc_clicked();
 	void on_pb6_send_clicked();
+	void on_pb6_stop_clicked();
 	void on_cb6_loop_clicked();
 	void on_pb6_selout_clicked();
 	void on_pb6_selin_clicked();
@@ -17,13 +17,15 @@
 
 #include <libusb-1.0/libusb.h>
 #include <linux/types.h>
+#include <poll.h>
+#include <stdio.h>
 
 typedef struct libusb_device               cyusb_device;
 typedef struct libusb_device_handle        cyusb_handle;
 
 /* This is the maximum number of 'devices of interest' we are willing to store as default. */
 /* These are the maximum number of devices we will communicate with simultaneously */
-#define MAXDEVICES        10
+#define MAXDEVICES        64
 
 /* This is the maximum number of VID/PID pairs that this library will consider. This limits
    the number of valid VID/PID entries in the configuration file.
@@ -64,6 +66,9 @@ extern void cyusb_error(int err);
   Description  : This initializes the underlying libusb library, populates the cydev[]
                  array, and returns the number of devices of interest detected. A
                  'device of interest' is a device which appears in the /etc/cyusb.conf file.
+                 Setting CYUSB_BACKEND=mock in the environment replaces libusb with a
+                 software FX3 model (see lib/cyusb_mock.c for its settings); every device
+                 of the model is then of interest and /etc/cyusb.conf is optional.
   Parameters   : None
   Return Value : Returns an integer, equal to number of devices of interest detected.
  *******************************************************************************************/
@@ -93,6 +98,63 @@ extern int cyusb_open(unsigned short vid, unsigned short pid);
  *******************************************************************************************/
 extern cyusb_handle * cyusb_gethandle(int index);
 
+/* Notification of a device of interest being attached (arrived = 1) or detached (arrived = 0).
+   index is the device's slot in the cydev[] array, as used with cyusb_gethandle(). The change
+   takes effect when the client next calls cyusb_hotplug_poll().
+ */
+typedef void (*cyusb_hotplug_cb)(int index, int arrived, void *user_data);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_hotplug_enable(cyusb_hotplug_cb cb, void *user_data);
+  Description  : Switches the cydev[] array, populated by cyusb_open(), to incremental updates
+                 driven by libusb hotplug events. Devices of interest get a slot when attached
+                 and lose it when detached; other entries and their handles are left untouched,
+                 so indices stay stable and no rescan is needed. A detached device leaves a
+                 hole in the array, for which cyusb_gethandle() returns NULL at once; its
+                 handle stays open, failing with LIBUSB_ERROR_NO_DEVICE, until the client
+                 calls cyusb_hotplug_poll().
+                 Notifications are delivered while libusb events are handled, by
+                 cyusb_handle_events() or the event thread. The callback must not block or
+                 call back into libcyusb; it should only wake the thread that calls
+                 cyusb_hotplug_poll().
+  Parameters   :
+                 cyusb_hotplug_cb cb : Notification callback, may be NULL
+                 void *user_data     : Passed through to the callback
+  Return Value : 0 on success, LIBUSB_ERROR_NOT_SUPPORTED if the platform has no hotplug
+                 support (the caller should fall back to cyusb_close()/cyusb_open()), or an
+                 appropriate LIBUSB_ERROR.
+ *******************************************************************************************/
+extern int cyusb_hotplug_enable(cyusb_hotplug_cb cb, void *user_data);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_hotplug_disable(void);
+  Description  : Stops incremental updates of the cydev[] array. Also done by cyusb_close().
+                 Stop the event thread first, so that no callback is running.
+  Parameters   : none
+  Return Value : none
+ *******************************************************************************************/
+extern void cyusb_hotplug_disable(void);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_hotplug_poll(void);
+  Description  : Applies the hotplug events recorded since the last call: opens the devices
+                 that arrived and closes the handles of those that left. Called by the client
+                 from its own thread once it has stopped using the handles of departed devices
+                 (cyusb_gethandle() already returns NULL for them).
+  Parameters   : none
+  Return Value : Number of cydev[] slots that changed.
+ *******************************************************************************************/
+extern int cyusb_hotplug_poll(void);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_get_device_slots(void);
+  Description  : Returns one more than the highest cydev[] index in use. With hotplug enabled
+                 this can exceed the number of attached devices.
+  Parameters   : none
+  Return Value : Number of cydev[] entries to scan.
+ *******************************************************************************************/
+extern int cyusb_get_device_slots(void);
+
 /*******************************************************************************************
   Prototype    : unsigned short cyusb_getvendor(cyusb_handle *);
   Description  : This function returns a 16-bit value corresponding to the vendor ID given
@@ -407,7 +469,7 @@ extern int cyusb_control_write(cyusb_handle *h, unsigned char bmRequestType, uns
                  unsigned char endpoint : Address of endpoint to comunicate with
                  unsigned char *data    : Data Buffer ( for input or output )
                  unsigned short wLength : The length field of the data buffer for read or write
-                 int * transferred      : Output location of bytes actually transferred
+                 int * transferred      : Output location of bytes actually transferred, or NULL
                  unsigned int timeout   : Timeout in milliseconds. 0 means no Timeout.
   Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
  ****************************************************************************************/
@@ -423,7 +485,7 @@ extern int cyusb_bulk_transfer(cyusb_handle *h, unsigned char endpoint, unsigned
                  unsigned char endpoint : Address of endpoint to comunicate with
                  unsigned char *data    : Data Buffer ( for input or output )
                  unsigned short wLength : The length field of the data buffer for read or write
-                 int * transferred      : Output location of bytes actually transferred
+                 int * transferred      : Output location of bytes actually transferred, or NULL
                  unsigned int timeout   : Timeout in milliseconds. 0 means no Timeout.
   Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
  ****************************************************************************************/
@@ -431,26 +493,1021 @@ extern int cyusb_interrupt_transfer(cyusb_handle *h, unsigned char endpoint, uns
         int length, int *transferred, unsigned int timeout);
 
 /****************************************************************************************
-  Prototype    : void cyusb_download_fx2(cyusb_handle *h, char *filename,
+  Prototype    : int cyusb_submit_transfer(struct libusb_transfer *xfer);
+  Description  : Submits an asynchronous transfer set up with libusb_alloc_transfer() and
+                 the libusb_fill_xxx_transfer() helpers on a handle from cyusb_gethandle().
+                 Use this instead of libusb_submit_transfer(), so that the transfer goes
+                 to the device backend in use (see cyusb_open()). The callback is invoked
+                 from cyusb_handle_events() or the event thread. The transfer is not timed
+                 for the statistics; use cyusb_stats_submit() for that.
+  Parameters   :
+                 struct libusb_transfer *xfer : Transfer to submit
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_submit_transfer(struct libusb_transfer *xfer);
+
+/****************************************************************************************
+  Prototype    : int cyusb_cancel_transfer(struct libusb_transfer *xfer);
+  Description  : Cancels a transfer submitted with cyusb_submit_transfer(). The callback
+                 is still invoked, with status LIBUSB_TRANSFER_CANCELLED.
+  Parameters   :
+                 struct libusb_transfer *xfer : Transfer to cancel
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_cancel_transfer(struct libusb_transfer *xfer);
+
+/****************************************************************************************
+  Prototype    : int cyusb_alloc_streams(cyusb_handle *h, unsigned int num_streams,
+                     unsigned char *endpoints, int num_endpoints);
+  Description  : Allocates USB 3.0 bulk streams on one or more endpoints of a SuperSpeed
+                 device, as used by the cyfxbulkstreams firmware. Each stream ID (1 to the
+                 number allocated) is an independent queue on the endpoint, so a stalled
+                 stream does not hold up the others. Transfers are addressed to a stream
+                 with libusb_fill_bulk_stream_transfer() and cyusb_submit_transfer(), or
+                 with cyusb_stream_set_stream_id(). Requires libusb 1.0.19 or later.
+  Parameters   :
+                 cyusb_handle *h            : Device handle; the interface must be claimed
+                 unsigned int num_streams   : Number of streams wanted on each endpoint
+                 unsigned char *endpoints   : Endpoint addresses
+                 int num_endpoints          : Number of entries in endpoints
+  Return Value : Number of streams allocated, which may be fewer than requested when
+                 the device or host controller supports fewer, or a LIBUSB_ERROR code.
+ ****************************************************************************************/
+extern int cyusb_alloc_streams(cyusb_handle *h, unsigned int num_streams, unsigned char *endpoints,
+        int num_endpoints);
+
+/****************************************************************************************
+  Prototype    : int cyusb_free_streams(cyusb_handle *h, unsigned char *endpoints,
+                     int num_endpoints);
+  Description  : Frees the bulk streams allocated with cyusb_alloc_streams(). No stream
+                 transfers may be pending on the endpoints.
+  Parameters   :
+                 cyusb_handle *h            : Device handle
+                 unsigned char *endpoints   : Endpoint addresses
+                 int num_endpoints          : Number of entries in endpoints
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_free_streams(cyusb_handle *h, unsigned char *endpoints, int num_endpoints);
+
+/****************************************************************************************
+  Prototype    : void cyusb_download_fx2(cyusb_handle *h, const char *filename,
                      unsigned char vendor_command);
-  Description  : Performs firmware download on FX2.
+  Description  : Performs firmware download on FX2. The Intel HEX file is parsed and checked
+                 with cyusb_hex_load() before the CPU is put into reset, and each contiguous
+                 segment is written with vendor requests of up to CYUSB_HEX_MAX_RUN bytes.
   Parameters   :
                  cyusb_handle *h              : Device handle
-                 char * filename              : Path where the firmware file is stored
+                 const char * filename        : Path where the firmware file is stored
                  unsigned char vendor_command : Vendor command that needs to be passed during download
+  Return Value : 0 on success, a CYUSB_HEX_ERROR code if the file is not valid, or an
+                 appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_download_fx2(cyusb_handle *h, const char *filename, unsigned char vendor_command);
+
+
+/****************************************************************************************
+  Prototype    : void cyusb_download_fx3(cyusb_handle *h, const char *filename);
+  Description  : Performs firmware download on FX3. The image is memory-mapped and its
+                 header, section layout and checksum are validated before anything is sent.
+                 The sections are then written to RAM with several vendor requests kept in
+                 flight, and the device is started as soon as every write has completed.
+                 Packed images (elf2img -compress) can only be loaded through the second
+                 stage boot firmware, which expands their zero-fill and LZ4 records itself.
+  Parameters   :
+                 cyusb_handle *h      : Device handle
+                 const char *filename : Path where the firmware file is stored
+  Return Value : 0 on success; -1 if the file cannot be opened, -2 to -4 for an invalid
+                 header, -5 for a checksum error, -6 for a truncated image and -7 if the
+                 download to the device failed.
+ ***************************************************************************************/
+extern int cyusb_download_fx3(cyusb_handle *h, const char *filename);
+
+/****************************************************************************************
+  Prototype    : int cyusb_check_fx3_image(const unsigned char *img, int size, unsigned int *entry);
+  Description  : Validates an FX3 boot image held in memory, as cyusb_download_fx3() does
+                 before downloading it: the header, then the section layout and checksum of
+                 a normal image (type 0xB0) or the raw, zero-fill and LZ4 record layout of a
+                 packed image (type 0xB4). Used by the tools that write images to flash.
+  Parameters   :
+                 const unsigned char *img : Image data
+                 int size                 : Image size in bytes
+                 unsigned int *entry      : Receives the program entry point; may be NULL
+  Return Value : 0 on success; -2 to -6 as for cyusb_download_fx3().
+ ***************************************************************************************/
+extern int cyusb_check_fx3_image(const unsigned char *img, int size, unsigned int *entry);
+
+/* Errors reported by the Intel HEX loader. These do not overlap the LIBUSB_ERROR codes. */
+#define CYUSB_HEX_ERROR_IO		(-101)	/* File could not be opened or read */
+#define CYUSB_HEX_ERROR_SYNTAX		(-102)	/* Malformed record */
+#define CYUSB_HEX_ERROR_CHECKSUM	(-103)	/* Record checksum mismatch */
+#define CYUSB_HEX_ERROR_RECORD		(-104)	/* Unsupported record type */
+#define CYUSB_HEX_ERROR_NO_EOF		(-105)	/* End of file record missing */
+#define CYUSB_HEX_ERROR_NOMEM		(-106)	/* Out of memory */
+
+/* Largest block of firmware written with a single vendor request. */
+#define CYUSB_HEX_MAX_RUN		(4096)
+
+/* A contiguous block of data in a HEX image. */
+struct cyusb_hex_segment {
+	unsigned int   address;		/* Absolute address, after extended address records */
+	unsigned int   length;
+	unsigned char *data;
+};
+
+/* Contents of a HEX file. Segments are sorted by address and do not overlap or touch. */
+struct cyusb_hex_image {
+	int                       num_segments;
+	struct cyusb_hex_segment *segments;
+	unsigned int              size;		/* Total number of data bytes */
+	unsigned int              start_address;	/* From a start address record, or 0 */
+	unsigned char            *data;		/* Storage backing all the segments */
+};
+
+/****************************************************************************************
+  Prototype    : int cyusb_hex_load(const char *filename, struct cyusb_hex_image *img,
+                     int *errline);
+  Description  : Reads and parses an Intel HEX file. Data, end of file, extended segment,
+                 extended linear and start address records are supported, and the checksum
+                 of every record is verified. Adjacent and overlapping data records are
+                 merged into segments; where records overlap the later one in the file wins.
+                 The image must be released with cyusb_hex_free().
+  Parameters   :
+                 const char *filename        : Path of the HEX file
+                 struct cyusb_hex_image *img : Receives the parsed image
+                 int *errline                : Receives the line number of a bad record, or
+                                               0. May be NULL.
+  Return Value : 0 on success, or one of the CYUSB_HEX_ERROR codes.
+ ****************************************************************************************/
+extern int cyusb_hex_load(const char *filename, struct cyusb_hex_image *img, int *errline);
+
+/****************************************************************************************
+  Prototype    : int cyusb_hex_parse(const char *text, size_t len,
+                     struct cyusb_hex_image *img, int *errline);
+  Description  : Parses Intel HEX records held in memory, as cyusb_hex_load() does for a file.
+  Parameters   :
+                 const char *text            : HEX records
+                 size_t len                  : Length of text in bytes
+                 struct cyusb_hex_image *img : Receives the parsed image
+                 int *errline                : Receives the line number of a bad record, or
+                                               0. May be NULL.
+  Return Value : 0 on success, or one of the CYUSB_HEX_ERROR codes.
+ ****************************************************************************************/
+extern int cyusb_hex_parse(const char *text, size_t len, struct cyusb_hex_image *img, int *errline);
+
+/****************************************************************************************
+  Prototype    : void cyusb_hex_free(struct cyusb_hex_image *img);
+  Description  : Releases the memory held by a parsed HEX image.
+  Parameters   :
+                 struct cyusb_hex_image *img : Image filled in by cyusb_hex_load()
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_hex_free(struct cyusb_hex_image *img);
+
+/* Pool of transfer buffers; see cyusb_pool_create(). */
+struct cyusb_buffer_pool;
+
+/****************************************************************************************
+  Prototype    : struct cyusb_buffer_pool * cyusb_pool_create(cyusb_handle *h,
+                     int count, int size);
+  Description  : Allocates a pool of count transfer buffers of size bytes each. Buffers are
+                 allocated from usbfs with libusb_dev_mem_alloc() where the kernel supports
+                 it, so that the kernel transfers directly into them without copying; the
+                 remaining buffers are page-aligned heap memory. Pool buffers may be passed
+                 to any of the cyusb transfer functions. The pool must be destroyed before
+                 the device handle is closed.
+  Parameters   :
+                 cyusb_handle *h : Device handle the buffers are used with
+                 int count       : Number of buffers in the pool
+                 int size        : Size of each buffer in bytes
+  Return Value : Pointer to the new pool, or NULL on failure.
+ ****************************************************************************************/
+extern struct cyusb_buffer_pool * cyusb_pool_create(cyusb_handle *h, int count, int size);
+
+/****************************************************************************************
+  Prototype    : unsigned char * cyusb_pool_get(struct cyusb_buffer_pool *pool);
+  Description  : Takes a free buffer from the pool. This does not allocate memory.
+  Parameters   :
+                 struct cyusb_buffer_pool *pool : Pool to take the buffer from
+  Return Value : Pointer to the buffer, or NULL if all buffers are in use.
+ ****************************************************************************************/
+extern unsigned char * cyusb_pool_get(struct cyusb_buffer_pool *pool);
+
+/****************************************************************************************
+  Prototype    : void cyusb_pool_put(struct cyusb_buffer_pool *pool, unsigned char *buf);
+  Description  : Returns a buffer obtained with cyusb_pool_get() to the pool.
+  Parameters   :
+                 struct cyusb_buffer_pool *pool : Pool the buffer belongs to
+                 unsigned char *buf             : Buffer to return
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_pool_put(struct cyusb_buffer_pool *pool, unsigned char *buf);
+
+/****************************************************************************************
+  Prototype    : int cyusb_pool_buffer_size(struct cyusb_buffer_pool *pool);
+  Description  : Returns the size of each buffer in the pool.
+  Parameters   :
+                 struct cyusb_buffer_pool *pool : Pool to query
+  Return Value : Buffer size in bytes.
+ ****************************************************************************************/
+extern int cyusb_pool_buffer_size(struct cyusb_buffer_pool *pool);
+
+/****************************************************************************************
+  Prototype    : int cyusb_pool_zero_copy(struct cyusb_buffer_pool *pool);
+  Description  : Returns how many buffers of the pool were allocated from usbfs memory.
+  Parameters   :
+                 struct cyusb_buffer_pool *pool : Pool to query
+  Return Value : Number of zero-copy buffers; 0 if the kernel does not support them.
+ ****************************************************************************************/
+extern int cyusb_pool_zero_copy(struct cyusb_buffer_pool *pool);
+
+/****************************************************************************************
+  Prototype    : void cyusb_pool_destroy(struct cyusb_buffer_pool *pool);
+  Description  : Frees all buffers of the pool, whether or not they have been returned.
+  Parameters   :
+                 struct cyusb_buffer_pool *pool : Pool to free
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_pool_destroy(struct cyusb_buffer_pool *pool);
+
+/* Maximum number of transfers that a single cyusb_stream can keep queued on an endpoint. */
+#define CYUSB_STREAM_MAX_XFERS  64
+
+/* Value returned from a stream callback to keep the buffer; it is handed back later
+   through cyusb_stream_put().
+ */
+#define CYUSB_STREAM_HOLD       (-1)
+
+struct cyusb_stream;
+
+/* Descriptor for one of the transfer buffers owned by a cyusb_stream. */
+struct cyusb_stream_buffer {
+    unsigned char *data;        /* Transfer buffer, taken from the stream's buffer pool */
+    int length;                 /* Size of the buffer in bytes */
+    int actual_length;          /* Bytes transferred by the last completion */
+    int status;                 /* 0, or the LIBUSB_ERROR code for the last completion */
+    int index;                  /* Position of this buffer within the stream */
+};
+
+/* Completion callback for a stream. Returns the number of bytes to submit next in this
+   buffer, 0 to retire the buffer, or CYUSB_STREAM_HOLD to keep it.
+ */
+typedef int (*cyusb_stream_cb)(struct cyusb_stream *stream, struct cyusb_stream_buffer *buf,
+        void *user_data);
+
+/****************************************************************************************
+  Prototype    : struct cyusb_stream * cyusb_stream_create(cyusb_handle *h,
+                     unsigned char endpoint, int num_xfers, int xfer_size,
+                     unsigned int timeout, cyusb_stream_cb cb, void *user_data);
+  Description  : Allocates a streaming engine that keeps up to num_xfers bulk transfers
+                 of xfer_size bytes queued on the given endpoint. All buffers and transfers
+                 are allocated here, so the data path never allocates memory. Buffers come
+                 from a cyusb_buffer_pool and are zero-copy where usbfs supports it.
+                 If cb is NULL, completed buffers are queued and retrieved with
+                 cyusb_stream_get(). Otherwise cb is invoked for each completed buffer
+                 from the thread handling libusb events.
+  Parameters   :
+                 cyusb_handle *h        : Device handle
+                 unsigned char endpoint : Address of the bulk endpoint (bit 7 set for IN)
+                 int num_xfers          : Number of transfers (1 to CYUSB_STREAM_MAX_XFERS)
+                 int xfer_size          : Size of each transfer buffer in bytes
+                 unsigned int timeout   : Timeout for each transfer in ms. 0 means no Timeout.
+                 cyusb_stream_cb cb     : Completion callback, or NULL for pull mode
+                 void *user_data        : Passed through to the callback
+  Return Value : Pointer to the new stream, or NULL on failure.
+ ****************************************************************************************/
+extern struct cyusb_stream * cyusb_stream_create(cyusb_handle *h, unsigned char endpoint,
+        int num_xfers, int xfer_size, unsigned int timeout, cyusb_stream_cb cb, void *user_data);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_set_stream_id(struct cyusb_stream *stream,
+                     unsigned int stream_id);
+  Description  : Addresses every transfer of a stream to one USB 3.0 bulk stream of its
+                 endpoint, allocated with cyusb_alloc_streams(). Create one cyusb_stream
+                 per stream ID to run several independent channels over one endpoint. May
+                 only be called while the stream is stopped.
+  Parameters   :
+                 struct cyusb_stream *stream : Stream to modify
+                 unsigned int stream_id      : Bulk stream ID, or 0 for ordinary bulk transfers
+  Return Value : 0 on success, LIBUSB_ERROR_BUSY if the stream is running, or
+                 LIBUSB_ERROR_NOT_SUPPORTED if libusb has no stream support.
+ ****************************************************************************************/
+extern int cyusb_stream_set_stream_id(struct cyusb_stream *stream, unsigned int stream_id);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_start(struct cyusb_stream *stream);
+  Description  : Starts the stream. For IN endpoints all transfers are submitted. For OUT
+                 endpoints the callback is invoked once per buffer with actual_length = 0
+                 so that it can be filled; in pull mode the empty buffers are made available
+                 through cyusb_stream_get().
+  Parameters   :
+                 struct cyusb_stream *stream : Stream to start
   Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
  ****************************************************************************************/
-extern int cyusb_download_fx2(cyusb_handle *h, char *filename, unsigned char vendor_command);
+extern int cyusb_stream_start(struct cyusb_stream *stream);
 
+/****************************************************************************************
+  Prototype    : int cyusb_stream_get(struct cyusb_stream *stream,
+                     struct cyusb_stream_buffer **buf, unsigned int timeout);
+  Description  : Pull mode only. Waits for the next completed buffer, handling libusb events
+                 as required. Buffers are returned in completion order and stay owned by
+                 the caller until handed back with cyusb_stream_put().
+  Parameters   :
+                 struct cyusb_stream *stream     : Stream to read from
+                 struct cyusb_stream_buffer **buf : Output location for the buffer
+                 unsigned int timeout             : Timeout in ms. 0 means no Timeout.
+  Return Value : 0 on success, LIBUSB_ERROR_TIMEOUT if nothing completed in time, or
+                 LIBUSB_ERROR_NOT_FOUND if no transfer is pending.
+ ****************************************************************************************/
+extern int cyusb_stream_get(struct cyusb_stream *stream, struct cyusb_stream_buffer **buf,
+        unsigned int timeout);
 
 /****************************************************************************************
-  Prototype    : void cyusb_download_fx3(cyusb_handle *h, char *filename);
-  Description  : Performs firmware download on FX3.
+  Prototype    : int cyusb_stream_put(struct cyusb_stream *stream,
+                     struct cyusb_stream_buffer *buf, int length);
+  Description  : Hands a buffer back to the stream and resubmits it. For OUT endpoints
+                 length is the number of bytes to send; for IN endpoints it is the number
+                 of bytes to request and is clamped to the buffer size.
   Parameters   :
-                 cyusb_handle *h : Device handle
-                 char *filename  : Path where the firmware file is stored
+                 struct cyusb_stream *stream     : Stream owning the buffer
+                 struct cyusb_stream_buffer *buf : Buffer obtained from the stream
+                 int length                      : Bytes to transfer. 0 retires the buffer.
   Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
- ***************************************************************************************/
-extern int cyusb_download_fx3(cyusb_handle *h, char *filename);
+ ****************************************************************************************/
+extern int cyusb_stream_put(struct cyusb_stream *stream, struct cyusb_stream_buffer *buf,
+        int length);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_stop(struct cyusb_stream *stream);
+  Description  : Cancels all pending transfers and waits for them to be reaped. Data in
+                 cancelled transfers is discarded. All buffers return to the stream, and
+                 the stream may be started again. This must not be called from a stream
+                 callback, which would wait for itself: a callback ends the stream by
+                 returning 0 for each buffer, or by setting a flag for the application to
+                 act on. Neither may a callback call cyusb_stream_destroy().
+  Parameters   :
+                 struct cyusb_stream *stream : Stream to stop
+  Return Value : 0 on success, LIBUSB_ERROR_BUSY if called from a stream callback, or the
+                 last error seen by the stream.
+ ****************************************************************************************/
+extern int cyusb_stream_stop(struct cyusb_stream *stream);
+
+/****************************************************************************************
+  Prototype    : void cyusb_stream_destroy(struct cyusb_stream *stream);
+  Description  : Stops the stream if required and frees all of its resources.
+  Parameters   :
+                 struct cyusb_stream *stream : Stream to free
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_stream_destroy(struct cyusb_stream *stream);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_in_flight(struct cyusb_stream *stream);
+  Description  : Returns the number of transfers currently submitted to the device.
+  Parameters   :
+                 struct cyusb_stream *stream : Stream to query
+  Return Value : Number of transfers in flight.
+ ****************************************************************************************/
+extern int cyusb_stream_in_flight(struct cyusb_stream *stream);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_get_fd(struct cyusb_stream *stream);
+  Description  : Pull mode only. Returns an eventfd that becomes readable whenever a buffer
+                 is queued for cyusb_stream_get(). Reading the fd returns the number of
+                 buffers queued since the last read; that many cyusb_stream_get() calls will
+                 then succeed without waiting. Intended for use with poll/epoll together
+                 with cyusb_event_thread_start().
+  Parameters   :
+                 struct cyusb_stream *stream : Stream to query
+  Return Value : File descriptor, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_stream_get_fd(struct cyusb_stream *stream);
+
+/****************************************************************************************
+  Prototype    : int cyusb_handle_events(unsigned int timeout);
+  Description  : Handles pending libusb events, invoking stream callbacks for completed
+                 transfers. Returns when at least one event has been handled or when the
+                 timeout expires.
+  Parameters   :
+                 unsigned int timeout : Timeout in milliseconds
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_handle_events(unsigned int timeout);
+
+/****************************************************************************************
+  Prototype    : int cyusb_event_thread_start(int cpu, int rt_priority);
+  Description  : Starts an internal thread that handles libusb events, so that stream
+                 callbacks run without the application pumping events. Only one event
+                 thread exists per process.
+  Parameters   :
+                 int cpu         : CPU to pin the thread to, or -1 for no affinity
+                 int rt_priority : SCHED_FIFO priority (1 to 99), or 0 for normal scheduling
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_event_thread_start(int cpu, int rt_priority);
+
+/****************************************************************************************
+  Prototype    : void cyusb_event_thread_stop(void);
+  Description  : Stops the event thread started by cyusb_event_thread_start() and waits
+                 for it to exit.
+  Parameters   : none
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_event_thread_stop(void);
+
+/****************************************************************************************
+  Prototype    : int cyusb_get_pollfds(struct pollfd *fds, int max);
+  Description  : Exports the file descriptors libusb needs to be polled on, for callers
+                 that integrate cyusb I/O into their own poll/epoll loop. When any of them
+                 is ready, call cyusb_handle_events_nonblocking(). The set can change when
+                 devices are opened or closed.
+  Parameters   :
+                 struct pollfd *fds : Output array
+                 int max            : Number of entries in fds
+  Return Value : Number of entries filled, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_get_pollfds(struct pollfd *fds, int max);
+
+/****************************************************************************************
+  Prototype    : int cyusb_get_next_timeout(void);
+  Description  : Returns how long an external poll loop may sleep before libusb needs
+                 cyusb_handle_events_nonblocking() to be called to expire a transfer timeout.
+  Parameters   : none
+  Return Value : Timeout in milliseconds, or -1 if no timeout is pending.
+ ****************************************************************************************/
+extern int cyusb_get_next_timeout(void);
+
+/****************************************************************************************
+  Prototype    : int cyusb_handle_events_nonblocking(void);
+  Description  : Handles any libusb events that are ready, without waiting.
+  Parameters   : none
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_handle_events_nonblocking(void);
+
+/* Running counters kept by an isochronous capture stream. */
+struct cyusb_iso_stats {
+    unsigned long long transfers;       /* Completed transfers */
+    unsigned long long packets;         /* Packets (service intervals) seen */
+    unsigned long long packets_ok;      /* Packets completed with data */
+    unsigned long long packets_empty;   /* Packets completed without data */
+    unsigned long long packets_dropped; /* Packets lost to errors (dropped microframes) */
+    unsigned long long gaps;            /* Runs of one or more consecutive dropped packets */
+    unsigned long long underruns;       /* Times every transfer had completed before a resubmit */
+    unsigned long long bytes;           /* Payload bytes delivered to the callback */
+};
+
+struct cyusb_iso_stream;
+
+/* Callback for an isochronous capture stream. data holds the payloads of all good packets
+   of one transfer packed back to back; dropped is the number of packets lost in it.
+ */
+typedef void (*cyusb_iso_cb)(struct cyusb_iso_stream *stream, unsigned char *data, int length,
+        int dropped, void *user_data);
+
+/****************************************************************************************
+  Prototype    : struct cyusb_iso_stream * cyusb_iso_stream_create(cyusb_handle *h,
+                     unsigned char endpoint, int num_xfers, int num_pkts, int pkt_size,
+                     cyusb_iso_cb cb, void *user_data);
+  Description  : Allocates a ring of num_xfers isochronous IN transfers of num_pkts packets
+                 each for continuous capture. The ring is resubmitted as it completes, the
+                 status of every packet is accounted for, and the good payloads of each
+                 transfer are packed in place and handed to cb.
+  Parameters   :
+                 cyusb_handle *h        : Device handle
+                 unsigned char endpoint : Address of the isochronous IN endpoint
+                 int num_xfers          : Number of transfers (1 to CYUSB_STREAM_MAX_XFERS)
+                 int num_pkts           : Packets per transfer
+                 int pkt_size           : Bytes per packet, or 0 to use the endpoint's
+                                          maximum including high-bandwidth transactions
+                 cyusb_iso_cb cb        : Callback for each completed transfer
+                 void *user_data        : Passed through to the callback
+  Return Value : Pointer to the new stream, or NULL on failure.
+ ****************************************************************************************/
+extern struct cyusb_iso_stream * cyusb_iso_stream_create(cyusb_handle *h, unsigned char endpoint,
+        int num_xfers, int num_pkts, int pkt_size, cyusb_iso_cb cb, void *user_data);
+
+/****************************************************************************************
+  Prototype    : int cyusb_iso_stream_start(struct cyusb_iso_stream *stream);
+  Description  : Submits every transfer of the ring. Events must then be handled with
+                 cyusb_handle_events() or by an event thread.
+  Parameters   :
+                 struct cyusb_iso_stream *stream : Stream to start
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_iso_stream_start(struct cyusb_iso_stream *stream);
+
+/****************************************************************************************
+  Prototype    : int cyusb_iso_stream_stop(struct cyusb_iso_stream *stream);
+  Description  : Cancels the ring and waits for every transfer to be reaped.
+  Parameters   :
+                 struct cyusb_iso_stream *stream : Stream to stop
+  Return Value : 0 on success, or the last error seen by the stream.
+ ****************************************************************************************/
+extern int cyusb_iso_stream_stop(struct cyusb_iso_stream *stream);
+
+/****************************************************************************************
+  Prototype    : void cyusb_iso_stream_get_stats(struct cyusb_iso_stream *stream,
+                     struct cyusb_iso_stats *stats);
+  Description  : Copies the current counters of the stream. May be called from any thread.
+  Parameters   :
+                 struct cyusb_iso_stream *stream : Stream to query
+                 struct cyusb_iso_stats *stats   : Output location for the counters
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_iso_stream_get_stats(struct cyusb_iso_stream *stream, struct cyusb_iso_stats *stats);
+
+/****************************************************************************************
+  Prototype    : void cyusb_iso_stream_destroy(struct cyusb_iso_stream *stream);
+  Description  : Stops the stream if required and frees all of its resources.
+  Parameters   :
+                 struct cyusb_iso_stream *stream : Stream to free
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_iso_stream_destroy(struct cyusb_iso_stream *stream);
+
+/* Max. number of writer threads of a recorder. */
+#define CYUSB_RECORD_MAX_WRITERS    8
+
+/* Recorder flags. */
+#define CYUSB_RECORD_DIRECT         0x01    /* Write with O_DIRECT, bypassing the page cache */
+
+/* Settings for a bulk-to-disk recorder. */
+struct cyusb_recorder_config {
+    unsigned char endpoint;             /* Bulk IN endpoint to record from */
+    int num_xfers;                      /* Transfers kept queued (1 to CYUSB_STREAM_MAX_XFERS) */
+    int xfer_size;                      /* Size of each transfer in bytes */
+    size_t block_size;                  /* Size of a ring block; rounded up to 4 KB */
+    int num_blocks;                     /* Blocks in the ring (at least 2) */
+    int num_writers;                    /* Writer threads (1 to CYUSB_RECORD_MAX_WRITERS) */
+    const char *path;                   /* Output file. With rotation, a printf pattern taking
+                                           the file number, or a name to which ".NNNN" is added */
+    unsigned long long rotate_bytes;    /* Start a new file after this many bytes, or 0 */
+    unsigned int rotate_seconds;        /* Start a new file after this many seconds, or 0 */
+    unsigned int flags;                 /* CYUSB_RECORD_xxx flags */
+};
+
+/* Running counters kept by a recorder. */
+struct cyusb_recorder_stats {
+    unsigned long long bytes_received;  /* Bytes received from the device */
+    unsigned long long bytes_written;   /* Bytes written to disk */
+    unsigned long long bytes_dropped;   /* Bytes discarded because the ring was full */
+    unsigned long long overruns;        /* Runs of one or more transfers discarded */
+    unsigned long long transfer_errors; /* Transfers that completed with an error */
+    unsigned long long write_errors;    /* Blocks that could not be written */
+    unsigned int overrun_file;          /* File number at which the last overrun began */
+    unsigned long long overrun_offset;  /* Offset in that file at which the data is missing */
+    unsigned int files;                 /* Files created */
+    int ring_used;                      /* Blocks currently filled or being written */
+    int ring_high_water;                /* Max. value of ring_used */
+    int last_error;                     /* Last LIBUSB_ERROR seen, or 0 */
+};
+
+struct cyusb_recorder;
+
+/****************************************************************************************
+  Prototype    : struct cyusb_recorder * cyusb_recorder_create(cyusb_handle *h,
+                     const struct cyusb_recorder_config *cfg);
+  Description  : Allocates a recorder that streams a bulk IN endpoint to disk. Completed
+                 transfers are copied into a preallocated ring of blocks, which writer
+                 threads drain to the output files, so that slow writes never hold up the
+                 USB queue. When the ring is full, incoming data is dropped and counted as
+                 an overrun. All memory, including the whole ring, is allocated here.
+  Parameters   :
+                 cyusb_handle *h                    : Device handle
+                 const struct cyusb_recorder_config *cfg : Recorder settings
+  Return Value : Pointer to the new recorder, or NULL on failure.
+ ****************************************************************************************/
+extern struct cyusb_recorder * cyusb_recorder_create(cyusb_handle *h,
+        const struct cyusb_recorder_config *cfg);
+
+/****************************************************************************************
+  Prototype    : int cyusb_recorder_start(struct cyusb_recorder *rec);
+  Description  : Starts the writer threads and the transfers. Events must then be handled
+                 with cyusb_handle_events() or by an event thread.
+  Parameters   :
+                 struct cyusb_recorder *rec : Recorder to start
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_recorder_start(struct cyusb_recorder *rec);
+
+/****************************************************************************************
+  Prototype    : int cyusb_recorder_stop(struct cyusb_recorder *rec);
+  Description  : Cancels the transfers, writes out all data in the ring and closes the
+                 output file.
+  Parameters   :
+                 struct cyusb_recorder *rec : Recorder to stop
+  Return Value : 0 on success, or the last error seen by the recorder.
+ ****************************************************************************************/
+extern int cyusb_recorder_stop(struct cyusb_recorder *rec);
+
+/****************************************************************************************
+  Prototype    : void cyusb_recorder_get_stats(struct cyusb_recorder *rec,
+                     struct cyusb_recorder_stats *stats);
+  Description  : Returns a snapshot of the recorder counters.
+  Parameters   :
+                 struct cyusb_recorder *rec          : Recorder to query
+                 struct cyusb_recorder_stats *stats  : Output location for the counters
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_recorder_get_stats(struct cyusb_recorder *rec, struct cyusb_recorder_stats *stats);
+
+/****************************************************************************************
+  Prototype    : void cyusb_recorder_destroy(struct cyusb_recorder *rec);
+  Description  : Stops the recorder if required and frees all of its resources.
+  Parameters   :
+                 struct cyusb_recorder *rec : Recorder to free
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_recorder_destroy(struct cyusb_recorder *rec);
+
+/* Max. number of frame buffers of a UVC stream. */
+#define CYUSB_UVC_MAX_FRAMES        32
+
+/* UVC stream flags. */
+#define CYUSB_UVC_FIXED_SIZE        0x01    /* Every frame is dwMaxVideoFrameSize bytes, as for
+                                               uncompressed formats; other sizes are flagged */
+#define CYUSB_UVC_DROP_BAD          0x02    /* Discard flagged frames instead of delivering them */
+
+/* Flags reported with each frame. A frame with any flag set is counted as truncated. */
+#define CYUSB_UVC_FRAME_ERROR       0x01    /* The device set the error bit in a payload header */
+#define CYUSB_UVC_FRAME_INCOMPLETE  0x02    /* Data was lost, or a fixed-size frame came up short */
+#define CYUSB_UVC_FRAME_OVERFLOW    0x04    /* The frame did not fit in its buffer and was cut */
+
+/* Settings for a UVC stream. */
+struct cyusb_uvc_config {
+    int interface;                      /* VideoStreaming interface number */
+    int alt_setting;                    /* Alternate setting carrying the endpoint; 0 for bulk */
+    unsigned char endpoint;             /* Video IN endpoint (bulk or isochronous) */
+    unsigned char format_index;         /* bFormatIndex to request, or 0 for the device default */
+    unsigned char frame_index;          /* bFrameIndex to request, or 0 for the device default */
+    unsigned int frame_interval;        /* dwFrameInterval to request in 100 ns units, or 0 */
+    int num_frames;                     /* Frame buffers (2 to CYUSB_UVC_MAX_FRAMES) */
+    int num_xfers;                      /* Transfers kept queued (1 to CYUSB_STREAM_MAX_XFERS) */
+    int payload_size;                   /* Bulk: bytes per payload, or 0 to use the negotiated
+                                           dwMaxPayloadTransferSize */
+    int iso_packets;                    /* Iso: packets per transfer, or 0 for the default (32) */
+    unsigned int flags;                 /* CYUSB_UVC_xxx flags */
+};
+
+/* Video probe and commit control, as negotiated with the device. The UVC 1.1 fields are 0 for
+   a UVC 1.0 device. */
+struct cyusb_uvc_probe {
+    int length;                         /* Length of the control: 26, 34 or 48 bytes */
+    unsigned short bmHint;
+    unsigned char bFormatIndex;
+    unsigned char bFrameIndex;
+    unsigned int dwFrameInterval;       /* In 100 ns units */
+    unsigned short wKeyFrameRate;
+    unsigned short wPFrameRate;
+    unsigned short wCompQuality;
+    unsigned short wCompWindowSize;
+    unsigned short wDelay;
+    unsigned int dwMaxVideoFrameSize;
+    unsigned int dwMaxPayloadTransferSize;
+    unsigned int dwClockFrequency;
+    unsigned char bmFramingInfo;
+    unsigned char bPreferedVersion;
+    unsigned char bMinVersion;
+    unsigned char bMaxVersion;
+};
+
+/* One frame buffer of a UVC stream. */
+struct cyusb_uvc_frame {
+    unsigned char *data;                /* Image data, without payload headers */
+    unsigned int length;                /* Bytes of image data */
+    unsigned int size;                  /* Size of the buffer (dwMaxVideoFrameSize) */
+    unsigned long long sequence;        /* Frame number since the start, counting dropped frames */
+    unsigned long long timestamp_ns;    /* CLOCK_MONOTONIC time at which the frame completed */
+    unsigned int pts;                   /* Presentation time stamp from the headers, or 0 */
+    int flags;                          /* CYUSB_UVC_FRAME_xxx flags */
+    int index;                          /* Buffer index within the stream */
+};
+
+/* Running counters kept by a UVC stream. */
+struct cyusb_uvc_stats {
+    unsigned long long frames;          /* Frames completed, including truncated ones */
+    unsigned long long frames_truncated;/* Frames completed with any CYUSB_UVC_FRAME_xxx flag */
+    unsigned long long frames_dropped;  /* Frames discarded because every buffer was in use */
+    unsigned long long payloads;        /* Payloads with a valid header */
+    unsigned long long payload_errors;  /* Bad headers, lost iso packets and failed transfers */
+    unsigned long long bytes;           /* Image bytes stored in completed frames */
+    double fps;                         /* Mean frame rate since the start */
+    double interval_us;                 /* Mean time between frames */
+    double interval_max_us;             /* Longest time between frames */
+    double jitter_us;                   /* Standard deviation of the time between frames */
+    int last_error;                     /* Last LIBUSB_ERROR seen, or 0 */
+};
+
+struct cyusb_uvc;
+
+/****************************************************************************************
+  Prototype    : struct cyusb_uvc * cyusb_uvc_create(cyusb_handle *h,
+                     const struct cyusb_uvc_config *cfg);
+  Description  : Allocates a UVC capture stream. The video probe control is negotiated
+                 here (GET_CUR, SET_CUR with the requested format, frame and interval,
+                 then GET_CUR for the device's choice), and all frame buffers are sized
+                 from the negotiated dwMaxVideoFrameSize and allocated. The transfer type
+                 is taken from the endpoint descriptor. Payload headers are stripped and
+                 image data is copied straight from the transfer buffers into the frame
+                 being assembled; frames are delimited by EOF and by the frame ID toggle.
+                 The streaming interface should already be claimed.
+  Parameters   :
+                 cyusb_handle *h                    : Device handle
+                 const struct cyusb_uvc_config *cfg : Stream settings
+  Return Value : Pointer to the new stream, or NULL on failure.
+ ****************************************************************************************/
+extern struct cyusb_uvc * cyusb_uvc_create(cyusb_handle *h, const struct cyusb_uvc_config *cfg);
+
+/****************************************************************************************
+  Prototype    : int cyusb_uvc_start(struct cyusb_uvc *uvc);
+  Description  : Commits the negotiated settings, selects the alternate setting for an
+                 isochronous endpoint and submits the transfers. Counters are reset.
+                 Events must then be handled with cyusb_handle_events(), by an event
+                 thread, or by cyusb_uvc_get_frame().
+  Parameters   :
+                 struct cyusb_uvc *uvc : Stream to start
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_uvc_start(struct cyusb_uvc *uvc);
+
+/****************************************************************************************
+  Prototype    : int cyusb_uvc_stop(struct cyusb_uvc *uvc);
+  Description  : Cancels the transfers and stops the video stream, with a clear halt on a
+                 bulk endpoint or alternate setting 0 for an isochronous one. Frames
+                 already queued can still be fetched.
+  Parameters   :
+                 struct cyusb_uvc *uvc : Stream to stop
+  Return Value : 0 on success, or the last error seen by the stream.
+ ****************************************************************************************/
+extern int cyusb_uvc_stop(struct cyusb_uvc *uvc);
+
+/****************************************************************************************
+  Prototype    : int cyusb_uvc_get_frame(struct cyusb_uvc *uvc,
+                     struct cyusb_uvc_frame **frame, unsigned int timeout);
+  Description  : Waits for the oldest completed frame, handling libusb events meanwhile.
+                 The frame belongs to the caller until handed back with
+                 cyusb_uvc_put_frame(); while every buffer is held or queued, new frames
+                 are dropped.
+  Parameters   :
+                 struct cyusb_uvc *uvc           : Stream to read from
+                 struct cyusb_uvc_frame **frame  : Output location for the frame
+                 unsigned int timeout            : Timeout in milliseconds, 0 to wait forever
+  Return Value : 0 on success, LIBUSB_ERROR_TIMEOUT, or another LIBUSB_ERROR if the
+                 stream has stopped.
+ ****************************************************************************************/
+extern int cyusb_uvc_get_frame(struct cyusb_uvc *uvc, struct cyusb_uvc_frame **frame,
+        unsigned int timeout);
+
+/****************************************************************************************
+  Prototype    : int cyusb_uvc_put_frame(struct cyusb_uvc *uvc, struct cyusb_uvc_frame *frame);
+  Description  : Returns a frame obtained from cyusb_uvc_get_frame() to the stream.
+  Parameters   :
+                 struct cyusb_uvc *uvc          : Stream the frame came from
+                 struct cyusb_uvc_frame *frame  : Frame to return
+  Return Value : 0 on success, or LIBUSB_ERROR_INVALID_PARAM.
+ ****************************************************************************************/
+extern int cyusb_uvc_put_frame(struct cyusb_uvc *uvc, struct cyusb_uvc_frame *frame);
+
+/****************************************************************************************
+  Prototype    : void cyusb_uvc_get_probe(struct cyusb_uvc *uvc, struct cyusb_uvc_probe *probe);
+  Description  : Returns the probe control negotiated with the device.
+  Parameters   :
+                 struct cyusb_uvc *uvc         : Stream to query
+                 struct cyusb_uvc_probe *probe : Output location for the control
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_uvc_get_probe(struct cyusb_uvc *uvc, struct cyusb_uvc_probe *probe);
+
+/****************************************************************************************
+  Prototype    : void cyusb_uvc_get_stats(struct cyusb_uvc *uvc, struct cyusb_uvc_stats *stats);
+  Description  : Returns a snapshot of the stream counters. The frame interval figures
+                 cover every frame boundary seen, including dropped frames.
+  Parameters   :
+                 struct cyusb_uvc *uvc         : Stream to query
+                 struct cyusb_uvc_stats *stats : Output location for the counters
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_uvc_get_stats(struct cyusb_uvc *uvc, struct cyusb_uvc_stats *stats);
+
+/****************************************************************************************
+  Prototype    : void cyusb_uvc_destroy(struct cyusb_uvc *uvc);
+  Description  : Stops the stream if required and frees all of its resources, including
+                 the frame buffers.
+  Parameters   :
+                 struct cyusb_uvc *uvc : Stream to free
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_uvc_destroy(struct cyusb_uvc *uvc);
+
+/* Number of latency histogram buckets kept per endpoint. Bucket i counts transfers that
+   completed in under 2^(i+1) microseconds (and, except for bucket 0, in at least 2^i); the
+   last bucket also holds everything slower. */
+#define CYUSB_STATS_LATENCY_BUCKETS 24
+
+/* Size of the per-endpoint error table. Entry n counts LIBUSB_ERROR -n (e.g. entry 7 counts
+   LIBUSB_ERROR_TIMEOUT); entry 0 counts LIBUSB_ERROR_OTHER and any unknown code. */
+#define CYUSB_STATS_ERROR_CODES     13
+
+/* Transfer counters of one endpoint. Control transfers are counted on endpoint 0x00 or 0x80,
+   according to their direction. */
+struct cyusb_ep_stats {
+    unsigned char endpoint;             /* Endpoint address */
+    unsigned long long transfers;       /* Transfers completed, including failed ones */
+    unsigned long long bytes;           /* Bytes actually transferred */
+    unsigned long long errors;          /* Transfers that completed with an error */
+    unsigned long long error_codes[CYUSB_STATS_ERROR_CODES]; /* Errors by LIBUSB_ERROR code */
+    unsigned long long short_packets;   /* Successful transfers shorter than requested */
+    unsigned long long timeouts;        /* Transfers that timed out (also counted in errors) */
+    int in_flight;                      /* Transfers currently submitted */
+    int max_in_flight;                  /* Max. value of in_flight */
+    unsigned long long latency_total_us;    /* Sum of the submit-to-completion times */
+    unsigned long long latency_max_us;      /* Longest submit-to-completion time */
+    unsigned long long latency[CYUSB_STATS_LATENCY_BUCKETS]; /* Log2 latency histogram */
+};
+
+/****************************************************************************************
+  Prototype    : int cyusb_stats_enable(int enable);
+  Description  : Turns transfer statistics on or off for every handle. Statistics are off
+                 by default, or on from cyusb_open() when CYUSB_STATS=1 is set in the
+                 environment. While on, every transfer made through libcyusb (synchronous,
+                 cyusb_stats_submit(), streams, iso streams and recorders) updates the
+                 counters of its endpoint with a few atomic operations on completion.
+                 Transfers already in flight when statistics are turned on are not counted.
+  Parameters   :
+                 int enable : 1 to turn statistics on, 0 to turn them off
+  Return Value : The previous setting.
+ ****************************************************************************************/
+extern int cyusb_stats_enable(int enable);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stats_submit(struct libusb_transfer *xfer,
+                     unsigned long long *t_submit);
+  Description  : Submits an asynchronous transfer like cyusb_submit_transfer(), and stores
+                 its submission time in *t_submit (0 when statistics are off). The caller
+                 keeps this value with the transfer, e.g. next to it in its own slot, and
+                 passes it to cyusb_stats_completed() from the transfer callback. Neither
+                 call allocates memory or touches the callback or user_data of the transfer.
+  Parameters   :
+                 struct libusb_transfer *xfer    : Transfer to submit
+                 unsigned long long *t_submit    : Output location for the submission time
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_stats_submit(struct libusb_transfer *xfer, unsigned long long *t_submit);
+
+/****************************************************************************************
+  Prototype    : void cyusb_stats_completed(struct libusb_transfer *xfer,
+                     unsigned long long t_submit);
+  Description  : Counts a transfer submitted with cyusb_stats_submit(). To be called from
+                 its callback, before the transfer is resubmitted. Cancelled transfers are
+                 not counted.
+  Parameters   :
+                 struct libusb_transfer *xfer    : Completed transfer
+                 unsigned long long t_submit     : Value stored by cyusb_stats_submit()
+  Return Value : None
+ ****************************************************************************************/
+extern void cyusb_stats_completed(struct libusb_transfer *xfer, unsigned long long t_submit);
+
+/****************************************************************************************
+  Prototype    : int cyusb_get_ep_stats(cyusb_handle *h, unsigned char endpoint,
+                     struct cyusb_ep_stats *stats);
+  Description  : Returns a snapshot of the counters of one endpoint. May be called from
+                 any thread while transfers are running; each counter is read atomically,
+                 but the set is not captured at a single instant.
+  Parameters   :
+                 cyusb_handle *h              : Device handle
+                 unsigned char endpoint       : Endpoint address
+                 struct cyusb_ep_stats *stats : Output location for the counters
+  Return Value : 0 on success, or LIBUSB_ERROR_NOT_FOUND if the endpoint has not been
+                 used since statistics were turned on (stats is then zeroed).
+ ****************************************************************************************/
+extern int cyusb_get_ep_stats(cyusb_handle *h, unsigned char endpoint, struct cyusb_ep_stats *stats);
+
+/****************************************************************************************
+  Prototype    : int cyusb_get_stats_endpoints(cyusb_handle *h, unsigned char *endpoints,
+                     int max);
+  Description  : Lists the endpoints of a handle that have statistics.
+  Parameters   :
+                 cyusb_handle *h          : Device handle
+                 unsigned char *endpoints : Output array of endpoint addresses
+                 int max                  : Size of the array
+  Return Value : Number of endpoints stored.
+ ****************************************************************************************/
+extern int cyusb_get_stats_endpoints(cyusb_handle *h, unsigned char *endpoints, int max);
+
+/****************************************************************************************
+  Prototype    : void cyusb_reset_stats(cyusb_handle *h);
+  Description  : Zeroes the counters of a handle, or of every handle if h is NULL. The
+                 in-flight count is kept, as it tracks transfers that are still queued.
+  Parameters   :
+                 cyusb_handle *h : Device handle, or NULL
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_reset_stats(cyusb_handle *h);
+
+/****************************************************************************************
+  Prototype    : unsigned long long cyusb_stats_percentile(const struct cyusb_ep_stats *stats,
+                     double pct);
+  Description  : Estimates a latency percentile from the histogram of a snapshot.
+  Parameters   :
+                 const struct cyusb_ep_stats *stats : Snapshot from cyusb_get_ep_stats()
+                 double pct                         : Percentile, 0 to 100
+  Return Value : Upper bound of the histogram bucket holding the percentile, in
+                 microseconds, or 0 if no transfers were counted.
+ ****************************************************************************************/
+extern unsigned long long cyusb_stats_percentile(const struct cyusb_ep_stats *stats, double pct);
+
+/****************************************************************************************
+  Prototype    : void cyusb_dump_stats(FILE *fp);
+  Description  : Prints the counters of every open device and endpoint in text form.
+                 Not async-signal-safe; from a signal handler, set a flag and call this
+                 from the main loop.
+  Parameters   :
+                 FILE *fp : Stream to print to
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_dump_stats(FILE *fp);
+
+
+/* Test data patterns. Word patterns are stored little-endian. */
+#define CYUSB_PATTERN_CONSTANT      0   /* Every byte equals the seed (0xAA for the FX3 source/sink firmware) */
+#define CYUSB_PATTERN_COUNTER8      1   /* Bytes counting up from the seed */
+#define CYUSB_PATTERN_COUNTER32     2   /* 32-bit words counting up from the seed */
+#define CYUSB_PATTERN_PRBS31        3   /* PRBS-31 (x^31 + x^28 + 1), most significant bit first */
+#define CYUSB_PATTERN_LFSR32        4   /* 32-bit words from a Galois LFSR (x^32 + x^22 + x^2 + x + 1) */
+
+/* Generator state of one pattern stream. */
+struct cyusb_pattern {
+    int type;                           /* CYUSB_PATTERN_xxx */
+    unsigned int word;                  /* Next byte or word to produce */
+    unsigned int phase;                 /* Bytes of the current word already produced */
+    unsigned char history[31];          /* Last 31 bytes produced, for PRBS-31 */
+    unsigned long long offset;          /* Bytes produced so far */
+};
+
+/****************************************************************************************
+  Prototype    : int cyusb_pattern_init(struct cyusb_pattern *pat, int type, unsigned int seed);
+  Description  : Starts a pattern stream. The seed is the constant byte, the first counter
+                 value or the initial LFSR state; a zero LFSR or PRBS-31 seed, which would
+                 never leave the all-zero state, is replaced by a non-zero one.
+  Parameters   :
+                 struct cyusb_pattern *pat : Stream to initialise
+                 int type                  : CYUSB_PATTERN_xxx
+                 unsigned int seed         : Seed value
+  Return Value : 0 on success, or LIBUSB_ERROR_INVALID_PARAM for an unknown type.
+ ****************************************************************************************/
+extern int cyusb_pattern_init(struct cyusb_pattern *pat, int type, unsigned int seed);
+
+/****************************************************************************************
+  Prototype    : void cyusb_pattern_fill(struct cyusb_pattern *pat, unsigned char *buf,
+                     size_t len);
+  Description  : Writes the next len bytes of the stream to buf. Successive calls continue
+                 the stream, whatever the buffer lengths. SSE2 is used where available.
+  Parameters   :
+                 struct cyusb_pattern *pat : Pattern stream
+                 unsigned char *buf        : Buffer to fill
+                 size_t len                : Bytes to write
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_pattern_fill(struct cyusb_pattern *pat, unsigned char *buf, size_t len);
+
+/****************************************************************************************
+  Prototype    : long long cyusb_pattern_check(int type, unsigned int seed,
+                     const unsigned char *buf, size_t len);
+  Description  : Verifies that a buffer holds a run of the pattern. Except for
+                 CYUSB_PATTERN_CONSTANT, the check does not depend on the seed or on where
+                 in the stream the buffer starts: each byte or word is checked against the
+                 ones before it, so received buffers can be checked in any order (a lost
+                 or repeated buffer is not detected by itself). Word patterns must start
+                 on a word boundary of the stream. Uses AVX2 or SSE2 where available; the CPU
+                 is probed on first use, and CYUSB_PATTERN_ISA=scalar or sse2 in the
+                 environment selects a narrower code path.
+  Parameters   :
+                 int type                 : CYUSB_PATTERN_xxx
+                 unsigned int seed        : Constant byte, for CYUSB_PATTERN_CONSTANT
+                 const unsigned char *buf : Data to check
+                 size_t len               : Length of the data
+  Return Value : -1 if the data matches, otherwise the offset of the first byte that
+                 does not follow from the data before it, or LIBUSB_ERROR_INVALID_PARAM
+                 for an unknown type.
+ ****************************************************************************************/
+extern long long cyusb_pattern_check(int type, unsigned int seed, const unsigned char *buf,
+        size_t len);
+
+/****************************************************************************************
+  Prototype    : int cyusb_pattern_from_name(const char *name);
+  Description  : Looks up a pattern by name: const, count8, count32, prbs31 or lfsr32.
+  Parameters   :
+                 const char *name : Pattern name
+  Return Value : CYUSB_PATTERN_xxx, or LIBUSB_ERROR_INVALID_PARAM if unknown.
+ ****************************************************************************************/
+extern int cyusb_pattern_from_name(const char *name);
+
+/****************************************************************************************
+  Prototype    : const char * cyusb_pattern_isa(void);
+  Description  : Names the code path used by the pattern functions.
+  Parameters   : none
+  Return Value : "avx2", "sse2" or "scalar".
+ ****************************************************************************************/
+extern const char * cyusb_pattern_isa(void);
 
 #endif
@@ -0,0 +1,446 @@
+#ifndef __CYUSB_HPP
+#define __CYUSB_HPP
+
+/*********************************************************************************\
+ * C++ interface to the cyusb library, called cyusb.hpp                           *
+ *                                                                                *
+ * License             :        GPL Ver 2.0                                       *
+ * Copyright           :        Cypress Semiconductors Inc. / ATR-LABS            *
+ * Modification Notes  :                                                          *
+ *                                                                                *
+ * Header-only wrappers over cyusb.h. Descriptors, claimed interfaces and         *
+ * transfers are owned by move-only objects and released by their destructors,    *
+ * so that no error path can leak them. Errors are returned as LIBUSB_ERROR       *
+ * codes, as in the C API; the library does not throw. Requires C++11.            *
+ *                                                                                *
+ \********************************************************************************/
+
+#include <stddef.h>
+#include <mutex>
+#include <utility>
+
+#include "cyusb.h"
+
+namespace cyusb {
+
+/* A configuration descriptor, freed when the object goes out of scope. */
+class ConfigDescriptor
+{
+public:
+	ConfigDescriptor() : desc(NULL) { }
+	~ConfigDescriptor() { reset(); }
+
+	ConfigDescriptor(ConfigDescriptor &&o) : desc(o.desc) { o.desc = NULL; }
+	ConfigDescriptor & operator=(ConfigDescriptor &&o)
+	{
+		if ( this != &o ) {
+			reset();
+			desc = o.desc;
+			o.desc = NULL;
+		}
+		return *this;
+	}
+	ConfigDescriptor(const ConfigDescriptor &) = delete;
+	ConfigDescriptor & operator=(const ConfigDescriptor &) = delete;
+
+	/* Fetch the active configuration, or the one at index if index >= 0. */
+	int get(cyusb_handle *h, int index = -1)
+	{
+		reset();
+		if ( index < 0 )
+			return cyusb_get_active_config_descriptor(h, &desc);
+		return cyusb_get_config_descriptor(h, index, &desc);
+	}
+
+	void reset()
+	{
+		if ( desc )
+			cyusb_free_config_descriptor(desc);
+		desc = NULL;
+	}
+
+	bool valid() const { return desc != NULL; }
+	const struct libusb_config_descriptor * get() const { return desc; }
+	const struct libusb_config_descriptor * operator->() const { return desc; }
+
+private:
+	struct libusb_config_descriptor *desc;
+};
+
+/* Opens the library on construction and closes it, with every device handle, on
+   destruction. Device and Interface objects must not outlive it. */
+class Library
+{
+public:
+	Library() : count(cyusb_open()) { }
+	Library(unsigned short vid, unsigned short pid) : count(cyusb_open(vid, pid)) { }
+	~Library() { if ( count >= 0 ) cyusb_close(); }
+
+	Library(const Library &) = delete;
+	Library & operator=(const Library &) = delete;
+
+	/* Number of devices found, or a negative value if the library could not be opened. */
+	int devices() const { return count; }
+
+private:
+	int count;
+};
+
+/* A device handle from cyusb_gethandle(). The handle itself belongs to the library and is
+   closed by cyusb_close(); a Device only guarantees that it is not copied around. */
+class Device
+{
+public:
+	Device() : h(NULL) { }
+	explicit Device(int index) : h(cyusb_gethandle(index)) { }
+	explicit Device(cyusb_handle *handle) : h(handle) { }
+
+	Device(Device &&o) : h(o.h) { o.h = NULL; }
+	Device & operator=(Device &&o) { std::swap(h, o.h); return *this; }
+	Device(const Device &) = delete;
+	Device & operator=(const Device &) = delete;
+
+	bool valid() const { return h != NULL; }
+	cyusb_handle * handle() const { return h; }
+
+	unsigned short vendor() const { return cyusb_getvendor(h); }
+	unsigned short product() const { return cyusb_getproduct(h); }
+
+	int config_descriptor(ConfigDescriptor *desc, int index = -1) const { return desc->get(h, index); }
+	int set_configuration(int config) { return cyusb_set_configuration(h, config); }
+
+private:
+	cyusb_handle *h;
+};
+
+/* A claimed interface, released on destruction. A kernel driver bound to the interface is
+   detached first if asked, and reattached on release. */
+class Interface
+{
+public:
+	Interface() : h(NULL), num(-1), err(LIBUSB_ERROR_NOT_FOUND), reattach(false) { }
+
+	Interface(const Device &dev, int interface, bool detach = false)
+		: h(dev.handle()), num(interface), err(0), reattach(false)
+	{
+		if ( ( detach ) && ( cyusb_kernel_driver_active(h, num) == 1 ) ) {
+			err = cyusb_detach_kernel_driver(h, num);
+			reattach = ( err == 0 );
+		}
+		if ( err == 0 )
+			err = cyusb_claim_interface(h, num);
+		if ( err )
+			release();
+	}
+	~Interface() { release(); }
+
+	Interface(Interface &&o) : h(o.h), num(o.num), err(o.err), reattach(o.reattach)
+	{
+		o.h = NULL;
+		o.reattach = false;
+	}
+	Interface & operator=(Interface &&o)
+	{
+		if ( this != &o ) {
+			release();
+			h = o.h;
+			num = o.num;
+			err = o.err;
+			reattach = o.reattach;
+			o.h = NULL;
+			o.reattach = false;
+		}
+		return *this;
+	}
+	Interface(const Interface &) = delete;
+	Interface & operator=(const Interface &) = delete;
+
+	/* 0 if the interface is claimed, or the LIBUSB_ERROR that prevented it. */
+	int error() const { return err; }
+	int number() const { return num; }
+
+	int set_alt_setting(int alt) { return cyusb_set_interface_alt_setting(h, num, alt); }
+
+	void release()
+	{
+		if ( h == NULL )
+			return;
+		if ( err == 0 )
+			cyusb_release_interface(h, num);
+		if ( reattach )
+			cyusb_attach_kernel_driver(h, num);
+		h = NULL;
+		reattach = false;
+	}
+
+private:
+	cyusb_handle *h;
+	int num;
+	int err;
+	bool reattach;
+};
+
+/* An endpoint of a claimed interface, for synchronous transfers and to build TransferPools. */
+class Endpoint
+{
+public:
+	Endpoint() : h(NULL), addr(0) { }
+	Endpoint(const Device &dev, unsigned char address) : h(dev.handle()), addr(address) { }
+
+	Endpoint(Endpoint &&o) : h(o.h), addr(o.addr) { o.h = NULL; }
+	Endpoint & operator=(Endpoint &&o) { std::swap(h, o.h); std::swap(addr, o.addr); return *this; }
+	Endpoint(const Endpoint &) = delete;
+	Endpoint & operator=(const Endpoint &) = delete;
+
+	cyusb_handle * handle() const { return h; }
+	unsigned char address() const { return addr; }
+	bool is_in() const { return ( addr & LIBUSB_ENDPOINT_IN ) != 0; }
+	int max_packet_size() const { return cyusb_get_max_packet_size(h, addr); }
+
+	int bulk(unsigned char *data, int length, int *transferred, unsigned int timeout)
+	{
+		return cyusb_bulk_transfer(h, addr, data, length, transferred, timeout);
+	}
+	int interrupt(unsigned char *data, int length, int *transferred, unsigned int timeout)
+	{
+		return cyusb_interrupt_transfer(h, addr, data, length, transferred, timeout);
+	}
+	int clear_halt() { return cyusb_clear_halt(h, addr); }
+
+private:
+	cyusb_handle *h;
+	unsigned char addr;
+};
+
+/* One transfer of a TransferPool, as seen by its owner and by the completion handler. */
+class Transfer
+{
+public:
+	unsigned char * data() const { return xfer->buffer; }
+	int size() const { return capacity; }
+	int actual_length() const { return xfer->actual_length; }
+	int status() const { return xfer->status; }	/* LIBUSB_TRANSFER_xxx */
+	int index() const { return slot; }
+	unsigned char endpoint() const { return xfer->endpoint; }
+
+private:
+	template <int N, typename Handler> friend class TransferPool;
+
+	Transfer() : xfer(NULL), capacity(0), slot(0), pool(NULL), next(NULL), busy(false), t_submit(0) { }
+	Transfer(const Transfer &) = delete;
+	Transfer & operator=(const Transfer &) = delete;
+
+	struct libusb_transfer *xfer;
+	int capacity;
+	int slot;
+	void *pool;
+	Transfer *next;			/* Free list link */
+	bool busy;			/* Submitted and not yet completed */
+	unsigned long long t_submit;	/* From cyusb_stats_submit() */
+};
+
+/* A fixed set of N bulk transfers on one endpoint, with their buffers. Every
+   transfer and buffer is allocated by the constructor; acquire(), submit(), release() and
+   completions only move transfers between the free list and the device.
+
+   Completions are delivered from cyusb_handle_events() or the event thread to handler, which
+   may be any function object taking a Transfer & and returning an int:
+        n > 0              : resubmit the transfer for n bytes
+        0                  : return the transfer to the pool
+        CYUSB_STREAM_HOLD  : keep it; the owner later submits or releases it
+   The handler is stored by value in the pool, so that calling it never allocates. It must
+   not submit or release the transfer it is given itself; that is what the return value is for.
+
+   The destructor cancels whatever is still in flight and waits for it before freeing, so the
+   pool must be destroyed before the library is closed. Once it has started, transfers are no
+   longer resubmitted, whatever the handler returns. */
+template <int N, typename Handler>
+class TransferPool
+{
+public:
+	TransferPool(const Endpoint &ep, int size, Handler handler, unsigned int timeout = 1000)
+		: h(ep.handle()), pool(NULL), free_list(NULL), in_flight(0), err(0), closing(false),
+		  cb(handler)
+	{
+		int i;
+
+		pool = cyusb_pool_create(h, N, size);
+		if ( pool == NULL ) {
+			err = LIBUSB_ERROR_NO_MEM;
+			return;
+		}
+		for ( i = 0; i < N; ++i ) {
+			Transfer *t = &slots[i];
+
+			t->xfer     = libusb_alloc_transfer(0);
+			t->capacity = size;
+			t->slot     = i;
+			t->pool     = this;
+			if ( t->xfer == NULL ) {
+				err = LIBUSB_ERROR_NO_MEM;
+				return;
+			}
+			libusb_fill_bulk_transfer(t->xfer, h, ep.address(), cyusb_pool_get(pool), size,
+					complete, t, timeout);
+			t->next   = free_list;
+			free_list = t;
+		}
+	}
+
+	~TransferPool()
+	{
+		int i;
+
+		lock.lock();
+		closing = true;
+		lock.unlock();
+
+		cancel_all();
+		wait_idle();
+		for ( i = 0; i < N; ++i ) {
+			if ( slots[i].xfer )
+				libusb_free_transfer(slots[i].xfer);
+		}
+		cyusb_pool_destroy(pool);	/* Frees the buffers too */
+	}
+
+	TransferPool(const TransferPool &) = delete;
+	TransferPool & operator=(const TransferPool &) = delete;
+
+	/* 0 if every transfer and buffer was allocated, or LIBUSB_ERROR_NO_MEM. */
+	int error() const { return err; }
+
+	/* A free transfer, or NULL if all N are submitted or held. */
+	Transfer * acquire()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		Transfer *t = free_list;
+
+		if ( t )
+			free_list = t->next;
+		return t;
+	}
+
+	/* Return an acquired or held transfer without submitting it. */
+	void release(Transfer *t)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		t->next   = free_list;
+		free_list = t;
+	}
+
+	/* Submit an acquired or held transfer for length bytes, at most size(). The transfer is
+	   returned to the pool if the submission fails. */
+	int submit(Transfer *t, int length)
+	{
+		int r;
+
+		if ( ( length <= 0 ) || ( length > t->capacity ) ) {
+			release(t);
+			return LIBUSB_ERROR_INVALID_PARAM;
+		}
+		lock.lock();
+		t->xfer->length = length;
+		t->busy = true;
+		++in_flight;
+		lock.unlock();
+
+		r = cyusb_stats_submit(t->xfer, &t->t_submit);
+		if ( r ) {
+			lock.lock();
+			t->busy = false;
+			--in_flight;
+			t->next   = free_list;
+			free_list = t;
+			lock.unlock();
+		}
+		return r;
+	}
+
+	/* Number of transfers submitted and not yet completed. */
+	int pending()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		return in_flight;
+	}
+
+	/* Cancel every submitted transfer; the handler still sees each one complete. */
+	void cancel_all()
+	{
+		int i;
+		std::lock_guard<std::mutex> guard(lock);
+
+		for ( i = 0; i < N; ++i ) {
+			if ( slots[i].busy )
+				cyusb_cancel_transfer(slots[i].xfer);
+		}
+	}
+
+	/* Handle events until nothing is in flight. */
+	void wait_idle()
+	{
+		while ( pending() )
+			cyusb_handle_events(100);
+	}
+
+private:
+	static void LIBUSB_CALL complete(struct libusb_transfer *xfer)
+	{
+		Transfer *t = (Transfer *)xfer->user_data;
+		TransferPool *p = (TransferPool *)t->pool;
+		int verdict;
+
+		cyusb_stats_completed(xfer, t->t_submit);
+
+		/* Still counted as in flight while the handler runs and while the transfer is
+		   resubmitted, so that the destructor cannot free the transfer from under it. */
+		verdict = p->cb(*t);
+
+		p->lock.lock();
+		if ( ( verdict > 0 ) && ( verdict <= t->capacity ) && !p->closing ) {
+			/* Submitted under the lock, so that the destructor either finds closing set
+			   or cancels the transfer after this. */
+			t->xfer->length = verdict;
+			if ( cyusb_stats_submit(t->xfer, &t->t_submit) == 0 ) {
+				p->lock.unlock();
+				return;
+			}
+		}
+		t->busy = false;
+		--p->in_flight;
+		if ( verdict != CYUSB_STREAM_HOLD ) {
+			t->next = p->free_list;
+			p->free_list = t;
+		}
+		p->lock.unlock();
+	}
+
+	cyusb_handle *h;
+	struct cyusb_buffer_pool *pool;
+	Transfer slots[N];
+	Transfer *free_list;
+	int in_flight;
+	int err;
+	bool closing;			/* Destructor running; do not resubmit */
+	std::mutex lock;
+	Handler cb;
+};
+
+/* Deduces the handler type, e.g.
+        auto pool = cyusb::make_transfer_pool<8>(ep, 16384, [&](cyusb::Transfer &t) { ... });
+   The pool is returned by value only through guaranteed copy elision, so this needs C++17;
+   with C++11 declare TransferPool<N, Handler> directly. */
+#if __cplusplus >= 201703L
+template <int N, typename Handler>
+TransferPool<N, Handler> make_transfer_pool(const Endpoint &ep, int size, Handler handler,
+		unsigned int timeout = 1000)
+{
+	return TransferPool<N, Handler>(ep, size, handler, timeout);
+}
+#endif
+
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef DATAVIEWS_H
+#define DATAVIEWS_H
+
+#include <QtCore>
+#include <QtGui>
+
+/* Hex dump of a byte stream for a QListView, 8 bytes per row. Rows are only formatted when
+   the view paints them, and only the last HEXMODEL_MAX_BYTES bytes are kept. */
+#define HEXMODEL_MAX_BYTES	(256 * 1024)
+
+class HexModel : public QAbstractListModel
+{
+	Q_OBJECT
+
+public:
+	HexModel(QObject *parent = 0);
+	int rowCount(const QModelIndex &parent = QModelIndex()) const;
+	QVariant data(const QModelIndex &index, int role) const;
+	void append(const QByteArray &bytes);
+	void clear();
+
+private:
+	QByteArray buf;
+};
+
+/* Strip chart of throughput in MB/s with the error rate drawn underneath, one sample per
+   call to addSample(), newest on the right. */
+class RatePlot : public QWidget
+{
+	Q_OBJECT
+
+public:
+	RatePlot(QWidget *parent = 0);
+	void addSample(double mbps, double errors_per_sec);
+	void clear();
+
+protected:
+	void paintEvent(QPaintEvent *event);
+
+private:
+	QVector<double> mbps;
+	QVector<double> errs;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef TRANSFERWORKER_H
+#define TRANSFERWORKER_H
+
+#include <QtCore>
+
+#include <libusb-1.0/libusb.h>
+#include "cyusb.h"
+
+/* A bulk job run by TransferWorker. Data written to ep_out comes from outfile, from the
+   pattern generator, or from data, in that order of preference. */
+struct BulkJob {
+	unsigned char ep_out;		/* OUT endpoint, or 0 to only read */
+	unsigned char ep_in;		/* IN endpoint, or 0 to only write */
+	int size;			/* Bytes per transfer */
+	int depth;			/* Transfers kept queued on each endpoint */
+	bool repeat;			/* Keep going until stopped */
+	QString outfile;		/* File to send, in size byte transfers */
+	QString infile;			/* File to save received data to */
+	int pattern;			/* CYUSB_PATTERN_xxx to send, or -1 */
+	unsigned int seed;
+	QByteArray data;		/* Data to send if there is neither a file nor a pattern */
+	int verify;			/* CYUSB_PATTERN_xxx to check received data against, or -1 */
+	unsigned int verify_seed;
+};
+
+/* Running totals of a job; snapshot with TransferWorker::stats(). */
+struct BulkStats {
+	unsigned long long bytes_out;
+	unsigned long long bytes_in;
+	unsigned long long xfers;
+	unsigned long long errors;
+	unsigned long long corrupt;	/* IN transfers that failed verification */
+	long long first_bad;		/* Offset in the IN data of the first bad byte, or -1 */
+	int last_error;			/* Last LIBUSB_ERROR seen, or 0 */
+	unsigned char last_error_ep;	/* Endpoint that saw it */
+};
+
+/* An isochronous job run by TransferWorker: a single transfer of num_pkts packets. An IN
+   endpoint is read through an iso capture stream; an OUT endpoint is sent packets filled with
+   their number, starting at 1. */
+struct IsoJob {
+	unsigned char ep;		/* IN or OUT endpoint */
+	int num_pkts;
+	int pkt_size;			/* Bytes per packet */
+};
+
+/* Result of an isochronous job; read with TransferWorker::isoStats() once it has finished. */
+struct IsoStats {
+	int packets;
+	int packets_ok;
+	int packets_dropped;
+	int elapsed_ms;			/* From submission to completion */
+	int status;			/* LIBUSB_ERROR the transfer failed with, or 0 */
+};
+
+/* Runs bulk and isochronous jobs on their own thread with asynchronous transfers, so that
+   long or continuous transfers leave the UI responsive. The UI polls stats() and takeData();
+   the thread's finished() signal marks the end of a job. */
+class TransferWorker : public QThread
+{
+	Q_OBJECT
+
+public:
+	TransferWorker(QObject *parent = 0);
+	bool startJob(cyusb_handle *h, const BulkJob &job);
+	bool startIsoJob(cyusb_handle *h, const IsoJob &job);
+	void requestStop();
+	cyusb_handle *device() const;
+	void stats(BulkStats *st);
+	void isoStats(IsoStats *st);
+	void takeData(QByteArray *out, QByteArray *in);
+
+protected:
+	void run();
+
+private:
+	int nextOut(struct cyusb_stream_buffer *buf);
+	void countError(unsigned char ep, int status);
+	void capture(QByteArray *pending, const unsigned char *data, int len);
+	void runBulk();
+	void runIsoIn();
+	void runIsoOut();
+	static void isoReceived(struct cyusb_iso_stream *stream, unsigned char *data, int length,
+			int dropped, void *user_data);
+	static void isoSent(struct libusb_transfer *xfer);
+
+	cyusb_handle *h;
+	bool iso;			/* Running isojob rather than job */
+	BulkJob job;
+	IsoJob isojob;
+	struct cyusb_pattern pat;
+	int fd_out, fd_in;
+	bool sent_once;
+	volatile bool stop_requested;
+
+	QMutex lock;			/* Protects st, ist and the pending display data */
+	BulkStats st;
+	IsoStats ist;
+	volatile bool iso_done;		/* The isochronous transfer has completed */
+	unsigned long long iso_t_submit;	/* From cyusb_stats_submit(), for an OUT transfer */
+	QTime iso_time;
+	QByteArray pending_out, pending_in;
+};
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Filename             : cyusb_events.c
+ * Description          : libusb event handling for libcyusb: an optional completion thread,
+ *                        and the hooks needed to drive cyusb I/O from an external poll loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+#include "cyusb_internal.h"
+
+/* Upper bound on how long the event thread takes to notice a stop request. */
+#define EVENT_THREAD_POLL_MS		(100)
+
+static pthread_t event_thread;
+static int event_thread_running;
+static volatile int event_thread_exit;
+
+static void *event_thread_fn(void *arg)
+{
+	struct timeval tv;
+
+	while ( !event_thread_exit ) {
+		tv.tv_sec  = 0;
+		tv.tv_usec = EVENT_THREAD_POLL_MS * 1000;
+		cyusb_backend->handle_events(&tv, (int *)&event_thread_exit);
+	}
+	return NULL;
+}
+
+int cyusb_event_thread_start(int cpu, int rt_priority)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	cpu_set_t cpus;
+	int r;
+
+	if ( event_thread_running )
+	   return LIBUSB_ERROR_BUSY;
+
+	pthread_attr_init(&attr);
+	if ( cpu >= 0 ) {
+	   CPU_ZERO(&cpus);
+	   CPU_SET(cpu, &cpus);
+	   pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+	if ( rt_priority > 0 ) {
+	   memset(&param, 0, sizeof(param));
+	   param.sched_priority = rt_priority;
+	   pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	   pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	   pthread_attr_setschedparam(&attr, &param);
+	}
+
+	event_thread_exit = 0;
+	r = pthread_create(&event_thread, &attr, event_thread_fn, NULL);
+	pthread_attr_destroy(&attr);
+	if ( r ) {
+	   printf("Library: Error in creating event thread: %s\n", strerror(r));
+	   return ( r == EPERM ) ? LIBUSB_ERROR_ACCESS : LIBUSB_ERROR_OTHER;
+	}
+
+	event_thread_running = 1;
+	return 0;
+}
+
+void cyusb_event_thread_stop(void)
+{
+	if ( !event_thread_running )
+	   return;
+
+	event_thread_exit = 1;
+	cyusb_backend->interrupt_events();
+	pthread_join(event_thread, NULL);
+	event_thread_running = 0;
+}
+
+int cyusb_get_pollfds(struct pollfd *fds, int max)
+{
+	if ( cyusb_backend->get_pollfds == NULL )
+	   return LIBUSB_ERROR_NOT_SUPPORTED;
+	return ( cyusb_backend->get_pollfds(fds, max) );
+}
+
+int cyusb_get_next_timeout(void)
+{
+	struct timeval tv;
+	int r;
+
+	if ( cyusb_backend->get_next_timeout == NULL )
+	   return -1;
+	r = cyusb_backend->get_next_timeout(&tv);
+	if ( r <= 0 )
+	   return -1;
+	return ( tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000 );
+}
+
+int cyusb_handle_events_nonblocking(void)
+{
+	struct timeval tv;
+
+	tv.tv_sec  = 0;
+	tv.tv_usec = 0;
+	return ( cyusb_backend->handle_events(&tv, NULL) );
+}
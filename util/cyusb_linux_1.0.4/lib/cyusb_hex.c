@@ -0,0 +1,330 @@
+/*
+ * Filename             : cyusb_hex.c
+ * Description          : Intel HEX loader for libcyusb. Parses and checks a HEX file in one pass and
+ *                        merges its data records into contiguous segments, so that firmware can be
+ *                        downloaded with a few large vendor requests instead of one per record.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Intel HEX record types. */
+#define HEX_REC_DATA		(0x00)
+#define HEX_REC_EOF		(0x01)
+#define HEX_REC_EXT_SEGMENT	(0x02)
+#define HEX_REC_START_SEGMENT	(0x03)
+#define HEX_REC_EXT_LINEAR	(0x04)
+#define HEX_REC_START_LINEAR	(0x05)
+
+/* One data record, in file order. */
+struct hex_record {
+	unsigned int address;
+	unsigned int length;
+	unsigned int offset;		// Offset of the record data in the decoded data buffer
+};
+
+static inline int hex_value(unsigned char c)
+{
+	if ( ( c >= '0' ) && ( c <= '9' ) )
+	   return c - '0';
+	c |= 0x20;
+	if ( ( c >= 'a' ) && ( c <= 'f' ) )
+	   return c - 'a' + 10;
+	return -1;
+}
+
+/* Decode count bytes of hex text; returns 0 on success or -1 on a non-hex character. */
+static int decode_bytes(const char *p, int count, unsigned char *out)
+{
+	int hi, lo;
+	int i;
+
+	for ( i = 0; i < count; ++i ) {
+		hi = hex_value(p[2 * i]);
+		lo = hex_value(p[2 * i + 1]);
+		if ( ( hi < 0 ) || ( lo < 0 ) )
+		   return -1;
+		out[i] = (unsigned char)((hi << 4) | lo);
+	}
+	return 0;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+	const struct hex_record *ra = (const struct hex_record *)a;
+	const struct hex_record *rb = (const struct hex_record *)b;
+
+	if ( ra->address != rb->address )
+	   return ( ra->address < rb->address ) ? -1 : 1;
+	return ( ra->offset < rb->offset ) ? -1 : ( ra->offset > rb->offset );
+}
+
+/* Locate the segment holding address. Segments are sorted and do not overlap. */
+static struct cyusb_hex_segment * find_segment(struct cyusb_hex_image *img, unsigned int address)
+{
+	int lo = 0, hi = img->num_segments - 1, mid;
+
+	while ( lo <= hi ) {
+		mid = (lo + hi) / 2;
+		if ( address < img->segments[mid].address )
+		   hi = mid - 1;
+		else if ( address >= img->segments[mid].address + img->segments[mid].length )
+		   lo = mid + 1;
+		else return &img->segments[mid];
+	}
+	return NULL;
+}
+
+/* Build the segment list from the data records. Records that overlap are applied in file
+   order, so the last record written to an address wins, as it would on the device. */
+static int build_segments(struct cyusb_hex_image *img, struct hex_record *rec, int nrec,
+		const unsigned char *data)
+{
+	struct hex_record *sorted;
+	struct cyusb_hex_segment *seg;
+	unsigned int end, total = 0;
+	int i, n = 0;
+
+	if ( nrec == 0 )
+	   return 0;
+
+	sorted = (struct hex_record *)malloc(nrec * sizeof(struct hex_record));
+	img->segments = (struct cyusb_hex_segment *)calloc(nrec, sizeof(struct cyusb_hex_segment));
+	if ( ( sorted == NULL ) || ( img->segments == NULL ) ) {
+	   free(sorted);
+	   return CYUSB_HEX_ERROR_NOMEM;
+	}
+	memcpy(sorted, rec, nrec * sizeof(struct hex_record));
+	qsort(sorted, nrec, sizeof(struct hex_record), compare_records);
+
+	/* Merge the address ranges of adjacent and overlapping records. */
+	for ( i = 0; i < nrec; ++i ) {
+		end = sorted[i].address + sorted[i].length;
+		if ( ( n > 0 ) && ( sorted[i].address <= img->segments[n - 1].address + img->segments[n - 1].length ) ) {
+		   seg = &img->segments[n - 1];
+		   if ( end > seg->address + seg->length )
+		      seg->length = end - seg->address;
+		}
+		else {
+		   img->segments[n].address = sorted[i].address;
+		   img->segments[n].length  = sorted[i].length;
+		   ++n;
+		}
+	}
+	free(sorted);
+	img->num_segments = n;
+
+	for ( i = 0; i < n; ++i )
+		total += img->segments[i].length;
+	img->data = (unsigned char *)calloc(1, total ? total : 1);
+	if ( img->data == NULL )
+	   return CYUSB_HEX_ERROR_NOMEM;
+
+	total = 0;
+	for ( i = 0; i < n; ++i ) {
+		img->segments[i].data = img->data + total;
+		total += img->segments[i].length;
+	}
+
+	for ( i = 0; i < nrec; ++i ) {
+		seg = find_segment(img, rec[i].address);
+		memcpy(seg->data + (rec[i].address - seg->address), data + rec[i].offset, rec[i].length);
+	}
+	img->size = total;
+	return 0;
+}
+
+int cyusb_hex_parse(const char *text, size_t len, struct cyusb_hex_image *img, int *errline)
+{
+	struct hex_record *rec = NULL;
+	unsigned char *data = NULL;
+	unsigned char bytes[5 + 255];
+	const char *p = text, *end = text + len, *eol;
+	unsigned int base = 0;
+	unsigned int address;
+	unsigned char sum;
+	size_t linelen;
+	int nrec = 0, maxrec, ndata = 0;
+	int count, type;
+	int line = 0;
+	int seen_eof = 0;
+	int r = 0;
+	int i;
+
+	memset(img, 0, sizeof(struct cyusb_hex_image));
+
+	/* Every record takes at least 11 characters, and holds at most 255 data bytes; this bounds
+	   the record table and the decoded data, so neither has to grow while parsing. */
+	maxrec = len / 11 + 1;
+	rec  = (struct hex_record *)malloc(maxrec * sizeof(struct hex_record));
+	data = (unsigned char *)malloc(len / 2 + 1);
+	if ( ( rec == NULL ) || ( data == NULL ) ) {
+	   r = CYUSB_HEX_ERROR_NOMEM;
+	   goto out;
+	}
+
+	while ( ( p < end ) && ( !seen_eof ) ) {
+		eol = (const char *)memchr(p, '\n', end - p);
+		if ( eol == NULL )
+		   eol = end;
+		++line;
+
+		/* Skip blank lines, and strip the line terminator. */
+		while ( ( p < eol ) && ( ( *p == ' ' ) || ( *p == '\t' ) ) )
+			++p;
+		linelen = eol - p;
+		while ( ( linelen > 0 ) && ( ( p[linelen - 1] == '\r' ) || ( p[linelen - 1] == ' ' ) ||
+					( p[linelen - 1] == '\t' ) ) )
+			--linelen;
+		if ( linelen == 0 ) {
+		   p = eol + 1;
+		   continue;
+		}
+
+		if ( ( p[0] != ':' ) || ( linelen < 11 ) || ( decode_bytes(p + 1, 1, bytes) ) ) {
+		   r = CYUSB_HEX_ERROR_SYNTAX;
+		   goto out;
+		}
+		count = bytes[0];
+		if ( ( linelen != (size_t)(11 + 2 * count) ) || ( decode_bytes(p + 1, 5 + count, bytes) ) ) {
+		   r = CYUSB_HEX_ERROR_SYNTAX;
+		   goto out;
+		}
+
+		sum = 0;
+		for ( i = 0; i < 5 + count; ++i )
+			sum += bytes[i];
+		if ( sum != 0 ) {
+		   r = CYUSB_HEX_ERROR_CHECKSUM;
+		   goto out;
+		}
+
+		address = (bytes[1] << 8) | bytes[2];
+		type    = bytes[3];
+		switch ( type ) {
+			case HEX_REC_DATA:
+			     if ( count == 0 )
+			        break;
+			     rec[nrec].address = base + address;
+			     rec[nrec].length  = count;
+			     rec[nrec].offset  = ndata;
+			     memcpy(data + ndata, bytes + 4, count);
+			     ndata += count;
+			     ++nrec;
+			     break;
+
+			case HEX_REC_EOF:
+			     seen_eof = 1;
+			     break;
+
+			case HEX_REC_EXT_SEGMENT:
+			     if ( count != 2 ) {
+			        r = CYUSB_HEX_ERROR_SYNTAX;
+			        goto out;
+			     }
+			     base = ((bytes[4] << 8) | bytes[5]) << 4;
+			     break;
+
+			case HEX_REC_EXT_LINEAR:
+			     if ( count != 2 ) {
+			        r = CYUSB_HEX_ERROR_SYNTAX;
+			        goto out;
+			     }
+			     base = ((bytes[4] << 8) | bytes[5]) << 16;
+			     break;
+
+			case HEX_REC_START_SEGMENT:
+			case HEX_REC_START_LINEAR:
+			     if ( count != 4 ) {
+			        r = CYUSB_HEX_ERROR_SYNTAX;
+			        goto out;
+			     }
+			     img->start_address = (bytes[4] << 24) | (bytes[5] << 16) | (bytes[6] << 8) | bytes[7];
+			     if ( type == HEX_REC_START_SEGMENT )
+			        img->start_address = ((img->start_address >> 16) << 4) + (img->start_address & 0xffff);
+			     break;
+
+			default:
+			     r = CYUSB_HEX_ERROR_RECORD;
+			     goto out;
+		}
+		p = eol + 1;
+	}
+
+	if ( !seen_eof ) {
+	   line = 0;
+	   r = CYUSB_HEX_ERROR_NO_EOF;
+	   goto out;
+	}
+
+	line = 0;
+	r = build_segments(img, rec, nrec, data);
+
+out:
+	free(rec);
+	free(data);
+	if ( r )
+	   cyusb_hex_free(img);
+	if ( errline != NULL )
+	   *errline = ( r ) ? line : 0;
+	return r;
+}
+
+int cyusb_hex_load(const char *filename, struct cyusb_hex_image *img, int *errline)
+{
+	struct stat st;
+	char *text;
+	ssize_t n;
+	size_t done = 0;
+	int fd;
+	int r;
+
+	memset(img, 0, sizeof(struct cyusb_hex_image));
+	if ( errline != NULL )
+	   *errline = 0;
+
+	fd = open(filename, O_RDONLY);
+	if ( fd < 0 )
+	   return CYUSB_HEX_ERROR_IO;
+	if ( fstat(fd, &st) != 0 ) {
+	   close(fd);
+	   return CYUSB_HEX_ERROR_IO;
+	}
+
+	text = (char *)malloc(st.st_size + 1);
+	if ( text == NULL ) {
+	   close(fd);
+	   return CYUSB_HEX_ERROR_NOMEM;
+	}
+	while ( done < (size_t)st.st_size ) {
+		n = read(fd, text + done, st.st_size - done);
+		if ( n <= 0 )
+		   break;
+		done += n;
+	}
+	close(fd);
+	if ( done != (size_t)st.st_size ) {
+	   free(text);
+	   return CYUSB_HEX_ERROR_IO;
+	}
+
+	r = cyusb_hex_parse(text, done, img, errline);
+	free(text);
+	return r;
+}
+
+void cyusb_hex_free(struct cyusb_hex_image *img)
+{
+	if ( img == NULL )
+	   return;
+	free(img->segments);
+	free(img->data);
+	memset(img, 0, sizeof(struct cyusb_hex_image));
+}
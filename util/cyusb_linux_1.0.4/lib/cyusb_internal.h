@@ -0,0 +1,127 @@
+#ifndef __CYUSB_INTERNAL_H
+#define __CYUSB_INTERNAL_H
+
+/*
+ * Filename             : cyusb_internal.h
+ * Description          : Helpers shared between the libcyusb source files. Not installed and
+ *                        not part of the public API.
+ */
+
+#include <libusb-1.0/libusb.h>
+
+#include "../include/cyusb.h"
+
+/* Bulk stream transfers (LIBUSB_TRANSFER_TYPE_BULK_STREAM and the stream ID accessors) first
+   appeared in libusb 1.0.19 (API version 0x01000103). */
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000103)
+#define CYUSB_HAVE_BULK_STREAMS
+#endif
+
+/* Map the status of a completed transfer onto a LIBUSB_ERROR code (0 for success). */
+extern int cyusb_transfer_status_to_error(enum libusb_transfer_status status);
+
+/* Hold the lock that guards the cydev[] array against hotplug updates, while walking it with
+   cyusb_get_device_slots() and cyusb_gethandle(). The lock is recursive. */
+extern void cyusb_lock_devices(void);
+extern void cyusb_unlock_devices(void);
+
+/* Transfer statistics (cyusb_stats.c). cyusb_stats_begin() is called as a transfer is submitted
+   and returns a start time, or 0 when statistics are off; the same value is passed to
+   cyusb_stats_end() on completion, or to cyusb_stats_abort() if the submission failed. Control
+   transfers are counted against endpoint 0x00 or 0x80 according to their direction. */
+extern volatile int cyusb_stats_on;
+extern unsigned long long cyusb_stats_begin(cyusb_handle *h, unsigned char endpoint);
+extern void cyusb_stats_end(cyusb_handle *h, unsigned char endpoint, unsigned long long start,
+		int error, int requested, int actual);
+extern void cyusb_stats_abort(cyusb_handle *h, unsigned char endpoint, unsigned long long start);
+
+/* cyusb_stats_end() for a completed asynchronous transfer; cancelled transfers are not counted. */
+extern void cyusb_stats_complete(struct libusb_transfer *xfer, unsigned char endpoint,
+		unsigned long long start, int requested, int actual);
+
+/* Zero all counters; called from cyusb_close() once the handles are gone. */
+extern void cyusb_stats_forget(void);
+
+/* Zero the counters of one handle and release its slot for reuse; called before a handle of a
+   device that has gone away is closed. The counters stay allocated, so other threads may still
+   be reading statistics or completing transfers of that handle; such late completions are not
+   counted. */
+extern void cyusb_stats_forget_handle(cyusb_handle *h);
+
+/* Device access used by every libcyusb module. The default backend passes each call straight to
+   libusb; setting CYUSB_BACKEND=mock in the environment selects a software FX3 model instead, so
+   that the library and the tools can run without hardware. Handles returned by a backend are
+   only ever passed back to the same backend. Members that a backend leaves NULL are reported to
+   the caller as LIBUSB_ERROR_NOT_SUPPORTED. */
+struct cyusb_backend {
+	const char *name;
+
+	int  (*init)(void);
+	void (*exit)(void);
+	int  (*open_devices)(cyusb_handle **handles, int max);
+	cyusb_handle * (*open_vid_pid)(unsigned short vid, unsigned short pid);
+	void (*close)(cyusb_handle *h);
+	cyusb_device * (*get_device)(cyusb_handle *h);
+
+	int  (*get_device_descriptor)(cyusb_handle *h, struct libusb_device_descriptor *desc);
+	int  (*get_active_config_descriptor)(cyusb_handle *h, struct libusb_config_descriptor **config);
+	int  (*get_config_descriptor)(cyusb_handle *h, unsigned char index,
+			struct libusb_config_descriptor **config);
+	int  (*get_config_descriptor_by_value)(cyusb_handle *h, unsigned char value,
+			struct libusb_config_descriptor **config);
+	void (*free_config_descriptor)(struct libusb_config_descriptor *config);
+	int  (*get_string_descriptor_ascii)(cyusb_handle *h, unsigned char index, unsigned char *data,
+			int length);
+	int  (*get_descriptor)(cyusb_handle *h, unsigned char type, unsigned char index,
+			unsigned char *data, int length);
+	int  (*get_string_descriptor)(cyusb_handle *h, unsigned char index, unsigned short langid,
+			unsigned char *data, int length);
+	int  (*get_bus_number)(cyusb_handle *h);
+	int  (*get_device_address)(cyusb_handle *h);
+	int  (*get_max_packet_size)(cyusb_handle *h, unsigned char endpoint);
+	int  (*get_max_iso_packet_size)(cyusb_handle *h, unsigned char endpoint);
+
+	int  (*get_configuration)(cyusb_handle *h, int *config);
+	int  (*set_configuration)(cyusb_handle *h, int config);
+	int  (*claim_interface)(cyusb_handle *h, int interface);
+	int  (*release_interface)(cyusb_handle *h, int interface);
+	int  (*set_interface_alt_setting)(cyusb_handle *h, int interface, int altsetting);
+	int  (*clear_halt)(cyusb_handle *h, unsigned char endpoint);
+	int  (*reset_device)(cyusb_handle *h);
+	int  (*kernel_driver_active)(cyusb_handle *h, int interface);
+	int  (*detach_kernel_driver)(cyusb_handle *h, int interface);
+	int  (*attach_kernel_driver)(cyusb_handle *h, int interface);
+
+	int  (*control_transfer)(cyusb_handle *h, uint8_t bmRequestType, uint8_t bRequest,
+			uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength,
+			unsigned int timeout);
+	int  (*bulk_transfer)(cyusb_handle *h, unsigned char endpoint, unsigned char *data, int length,
+			int *transferred, unsigned int timeout);
+	int  (*interrupt_transfer)(cyusb_handle *h, unsigned char endpoint, unsigned char *data,
+			int length, int *transferred, unsigned int timeout);
+
+	/* Asynchronous transfers, filled in with the libusb_fill_xxx_transfer() helpers. Completion
+	   callbacks run from handle_events(), which may be called from several threads at once. */
+	int  (*submit_transfer)(struct libusb_transfer *xfer);
+	int  (*cancel_transfer)(struct libusb_transfer *xfer);
+	int  (*handle_events)(struct timeval *tv, int *completed);
+	void (*interrupt_events)(void);
+
+	/* Optional: zero-copy buffers, poll integration, USB 3.0 bulk streams and hotplug. */
+	unsigned char * (*dev_mem_alloc)(cyusb_handle *h, size_t length);
+	int  (*dev_mem_free)(cyusb_handle *h, unsigned char *buffer, size_t length);
+	int  (*get_pollfds)(struct pollfd *fds, int max);
+	int  (*get_next_timeout)(struct timeval *tv);
+	int  (*alloc_streams)(cyusb_handle *h, unsigned int num_streams, unsigned char *endpoints,
+			int num_endpoints);
+	int  (*free_streams)(cyusb_handle *h, unsigned char *endpoints, int num_endpoints);
+	int  has_hotplug;
+};
+
+/* Backend in use; selected by cyusb_open(). */
+extern const struct cyusb_backend *cyusb_backend;
+
+/* Software FX3 model, in cyusb_mock.c. */
+extern const struct cyusb_backend cyusb_mock_backend;
+
+#endif
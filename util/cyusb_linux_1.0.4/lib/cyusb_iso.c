@@ -0,0 +1,277 @@
+/*
+ * Filename             : cyusb_iso.c
+ * Description          : Continuous isochronous capture for libcyusb. Keeps a ring of iso
+ *                        transfers queued, accounts for the status of every packet and hands
+ *                        the packed payload of each transfer to the application.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+#include "cyusb_internal.h"
+
+struct iso_slot {
+	struct libusb_transfer  *xfer;
+	struct cyusb_iso_stream *stream;
+	int                      submitted;
+	unsigned long long       t_submit;	// From cyusb_stats_begin()
+};
+
+struct cyusb_iso_stream {
+	cyusb_handle             *h;
+	unsigned char             endpoint;
+	int                       num_xfers;
+	int                       num_pkts;
+	int                       pkt_size;
+	cyusb_iso_cb              cb;
+	void                     *user_data;
+	struct cyusb_buffer_pool *pool;
+
+	pthread_mutex_t           lock;
+	int                       running;
+	int                       in_flight;
+	int                       last_error;
+	int                       in_gap;	// Last packet seen was dropped
+	struct cyusb_iso_stats    stats;
+
+	struct iso_slot           slot[CYUSB_STREAM_MAX_XFERS];
+};
+
+/* Pack the payloads of the good packets of a transfer to the start of its buffer, and update
+   the packet counters. Returns the packed length; *dropped receives the number of lost packets.
+   Must be called with the stream lock held. */
+static int pack_transfer_locked(struct cyusb_iso_stream *s, struct libusb_transfer *xfer, int *dropped)
+{
+	struct libusb_iso_packet_descriptor *pd;
+	unsigned char *src = xfer->buffer;
+	int packed = 0;
+	int lost = 0;
+	int whole_xfer_failed;
+	int i;
+
+	whole_xfer_failed = ( xfer->status != LIBUSB_TRANSFER_COMPLETED );
+
+	for ( i = 0; i < xfer->num_iso_packets; ++i ) {
+		pd = &xfer->iso_packet_desc[i];
+		++s->stats.packets;
+
+		if ( ( whole_xfer_failed ) || ( pd->status != LIBUSB_TRANSFER_COMPLETED ) ) {
+		   ++lost;
+		   if ( !s->in_gap )
+		      ++s->stats.gaps;
+		   s->in_gap = 1;
+		}
+		else {
+		   s->in_gap = 0;
+		   if ( pd->actual_length == 0 )
+		      ++s->stats.packets_empty;
+		   else {
+		      ++s->stats.packets_ok;
+		      if ( src != xfer->buffer + packed )
+		         memmove(xfer->buffer + packed, src, pd->actual_length);
+		      packed += pd->actual_length;
+		   }
+		}
+		src += pd->length;
+	}
+
+	s->stats.packets_dropped += lost;
+	s->stats.bytes           += packed;
+	*dropped = lost;
+	return packed;
+}
+
+static void iso_transfer_cb(struct libusb_transfer *xfer)
+{
+	struct iso_slot *slot = (struct iso_slot *)xfer->user_data;
+	struct cyusb_iso_stream *s = slot->stream;
+	int packed;
+	int dropped;
+	int received = 0;
+	int i, r;
+
+	if ( slot->t_submit ) {
+	   for ( i = 0; i < xfer->num_iso_packets; ++i )
+		   received += xfer->iso_packet_desc[i].actual_length;
+	   cyusb_stats_complete(xfer, s->endpoint, slot->t_submit, xfer->length, received);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	slot->submitted = 0;
+
+	if ( ( !s->running ) || ( xfer->status == LIBUSB_TRANSFER_CANCELLED ) ) {
+	   --s->in_flight;
+	   pthread_mutex_unlock(&s->lock);
+	   return;
+	}
+
+	++s->stats.transfers;
+	if ( xfer->status != LIBUSB_TRANSFER_COMPLETED )
+	   s->last_error = cyusb_transfer_status_to_error(xfer->status);
+
+	/* If this was the last transfer in the ring, the host controller had nothing queued
+	   for the following service intervals and their data is gone. */
+	if ( s->in_flight == 1 )
+	   ++s->stats.underruns;
+
+	packed = pack_transfer_locked(s, xfer, &dropped);
+	pthread_mutex_unlock(&s->lock);
+
+	if ( s->cb )
+	   s->cb(s, xfer->buffer, packed, dropped, s->user_data);
+
+	pthread_mutex_lock(&s->lock);
+	if ( ( s->running ) && ( xfer->status != LIBUSB_TRANSFER_NO_DEVICE ) ) {
+	   slot->t_submit = cyusb_stats_begin(s->h, s->endpoint);
+	   r = cyusb_backend->submit_transfer(xfer);
+	   if ( r )
+	      cyusb_stats_abort(s->h, s->endpoint, slot->t_submit);
+	   if ( r == 0 ) {
+	      slot->submitted = 1;
+	      pthread_mutex_unlock(&s->lock);
+	      return;
+	   }
+	   s->last_error = r;
+	}
+	--s->in_flight;
+	pthread_mutex_unlock(&s->lock);
+}
+
+struct cyusb_iso_stream * cyusb_iso_stream_create(cyusb_handle *h, unsigned char endpoint,
+		int num_xfers, int num_pkts, int pkt_size, cyusb_iso_cb cb, void *user_data)
+{
+	struct cyusb_iso_stream *s;
+	unsigned char *buf;
+	int i;
+
+	if ( ( h == NULL ) || ( !(endpoint & LIBUSB_ENDPOINT_IN) ) || ( num_xfers < 1 ) ||
+	     ( num_xfers > CYUSB_STREAM_MAX_XFERS ) || ( num_pkts < 1 ) )
+	   return NULL;
+
+	if ( pkt_size <= 0 )
+	   pkt_size = cyusb_get_max_iso_packet_size(h, endpoint);
+	if ( pkt_size <= 0 )
+	   return NULL;
+
+	s = (struct cyusb_iso_stream *)calloc(1, sizeof(struct cyusb_iso_stream));
+	if ( s == NULL )
+	   return NULL;
+
+	s->h         = h;
+	s->endpoint  = endpoint;
+	s->num_xfers = num_xfers;
+	s->num_pkts  = num_pkts;
+	s->pkt_size  = pkt_size;
+	s->cb        = cb;
+	s->user_data = user_data;
+	pthread_mutex_init(&s->lock, NULL);
+
+	s->pool = cyusb_pool_create(h, num_xfers, num_pkts * pkt_size);
+	if ( s->pool == NULL ) {
+	   cyusb_iso_stream_destroy(s);
+	   return NULL;
+	}
+
+	for ( i = 0; i < num_xfers; ++i ) {
+		s->slot[i].stream = s;
+		s->slot[i].xfer   = libusb_alloc_transfer(num_pkts);
+		buf = cyusb_pool_get(s->pool);
+		if ( ( s->slot[i].xfer == NULL ) || ( buf == NULL ) ) {
+		   cyusb_iso_stream_destroy(s);
+		   return NULL;
+		}
+		libusb_fill_iso_transfer(s->slot[i].xfer, h, endpoint, buf, num_pkts * pkt_size,
+				num_pkts, iso_transfer_cb, &s->slot[i], 0);
+		libusb_set_iso_packet_lengths(s->slot[i].xfer, pkt_size);
+	}
+
+	return s;
+}
+
+int cyusb_iso_stream_start(struct cyusb_iso_stream *s)
+{
+	int i;
+	int r = 0;
+
+	pthread_mutex_lock(&s->lock);
+	if ( s->running ) {
+	   pthread_mutex_unlock(&s->lock);
+	   return LIBUSB_ERROR_BUSY;
+	}
+	s->running    = 1;
+	s->last_error = 0;
+	s->in_gap     = 0;
+	memset(&s->stats, 0, sizeof(s->stats));
+
+	for ( i = 0; i < s->num_xfers; ++i ) {
+		s->slot[i].t_submit = cyusb_stats_begin(s->h, s->endpoint);
+		r = cyusb_backend->submit_transfer(s->slot[i].xfer);
+		if ( r ) {
+		   cyusb_stats_abort(s->h, s->endpoint, s->slot[i].t_submit);
+		   s->last_error = r;
+		   break;
+		}
+		s->slot[i].submitted = 1;
+		++s->in_flight;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if ( r )
+	   cyusb_iso_stream_stop(s);
+	return r;
+}
+
+int cyusb_iso_stream_stop(struct cyusb_iso_stream *s)
+{
+	int i;
+	int pending;
+
+	pthread_mutex_lock(&s->lock);
+	s->running = 0;
+	for ( i = 0; i < s->num_xfers; ++i ) {
+		if ( s->slot[i].submitted )
+		   cyusb_backend->cancel_transfer(s->slot[i].xfer);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	while ( 1 ) {
+		pthread_mutex_lock(&s->lock);
+		pending = s->in_flight;
+		pthread_mutex_unlock(&s->lock);
+		if ( pending == 0 )
+		   break;
+		cyusb_handle_events(100);
+	}
+
+	return s->last_error;
+}
+
+void cyusb_iso_stream_get_stats(struct cyusb_iso_stream *s, struct cyusb_iso_stats *stats)
+{
+	pthread_mutex_lock(&s->lock);
+	*stats = s->stats;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void cyusb_iso_stream_destroy(struct cyusb_iso_stream *s)
+{
+	int i;
+
+	if ( s == NULL )
+	   return;
+
+	if ( s->in_flight )
+	   cyusb_iso_stream_stop(s);
+
+	for ( i = 0; i < s->num_xfers; ++i ) {
+		if ( s->slot[i].xfer )
+		   libusb_free_transfer(s->slot[i].xfer);
+	}
+	cyusb_pool_destroy(s->pool);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
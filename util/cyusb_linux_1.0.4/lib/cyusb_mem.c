@@ -0,0 +1,163 @@
+/*
+ * Filename             : cyusb_mem.c
+ * Description          : Transfer buffer pools for libcyusb. Buffers are mapped from usbfs when
+ *                        the kernel supports it, so bulk and iso data is not copied between the
+ *                        kernel and user space.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+#include "cyusb_internal.h"
+
+struct pool_entry {
+	unsigned char *data;
+	unsigned char  dev_mem;		// Allocated from usbfs
+	unsigned char  in_use;
+};
+
+struct cyusb_buffer_pool {
+	cyusb_handle      *h;
+	int                count;
+	int                size;
+	int                zero_copy;	// Number of usbfs backed buffers
+	pthread_mutex_t    lock;
+	int                nfree;
+	int               *free_list;	// Stack of free entry indices
+	struct pool_entry *entry;
+};
+
+static unsigned char * heap_alloc(int size)
+{
+	void *p = NULL;
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if ( pagesize <= 0 )
+	   pagesize = 4096;
+	if ( posix_memalign(&p, pagesize, size) )
+	   return NULL;
+	return (unsigned char *)p;
+}
+
+struct cyusb_buffer_pool * cyusb_pool_create(cyusb_handle *h, int count, int size)
+{
+	struct cyusb_buffer_pool *pool;
+	int use_dev_mem = ( cyusb_backend->dev_mem_alloc != NULL );
+	int i;
+
+	if ( ( count <= 0 ) || ( size <= 0 ) )
+	   return NULL;
+
+	pool = (struct cyusb_buffer_pool *)calloc(1, sizeof(struct cyusb_buffer_pool));
+	if ( pool == NULL )
+	   return NULL;
+
+	pool->h         = h;
+	pool->count     = count;
+	pool->size      = size;
+	pool->entry     = (struct pool_entry *)calloc(count, sizeof(struct pool_entry));
+	pool->free_list = (int *)calloc(count, sizeof(int));
+	pthread_mutex_init(&pool->lock, NULL);
+	if ( ( pool->entry == NULL ) || ( pool->free_list == NULL ) ) {
+	   cyusb_pool_destroy(pool);
+	   return NULL;
+	}
+
+	for ( i = 0; i < count; ++i ) {
+		struct pool_entry *e = &pool->entry[i];
+
+		/* Once usbfs refuses an allocation (no kernel support, or usbfs_memory_mb
+		   exhausted), use the heap for the rest of the pool. */
+		if ( ( use_dev_mem ) && ( h != NULL ) ) {
+		   e->data = cyusb_backend->dev_mem_alloc(h, size);
+		   if ( e->data != NULL ) {
+		      e->dev_mem = 1;
+		      ++pool->zero_copy;
+		   }
+		   else use_dev_mem = 0;
+		}
+		if ( e->data == NULL )
+		   e->data = heap_alloc(size);
+		if ( e->data == NULL ) {
+		   cyusb_pool_destroy(pool);
+		   return NULL;
+		}
+		pool->free_list[pool->nfree++] = count - 1 - i;
+	}
+
+	return pool;
+}
+
+unsigned char * cyusb_pool_get(struct cyusb_buffer_pool *pool)
+{
+	unsigned char *buf = NULL;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	if ( pool->nfree > 0 ) {
+	   i = pool->free_list[--pool->nfree];
+	   pool->entry[i].in_use = 1;
+	   buf = pool->entry[i].data;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return buf;
+}
+
+void cyusb_pool_put(struct cyusb_buffer_pool *pool, unsigned char *buf)
+{
+	int i;
+
+	if ( buf == NULL )
+	   return;
+
+	pthread_mutex_lock(&pool->lock);
+	for ( i = 0; i < pool->count; ++i ) {
+		if ( pool->entry[i].data == buf ) {
+		   if ( pool->entry[i].in_use ) {
+		      pool->entry[i].in_use = 0;
+		      pool->free_list[pool->nfree++] = i;
+		   }
+		   break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int cyusb_pool_buffer_size(struct cyusb_buffer_pool *pool)
+{
+	return pool->size;
+}
+
+int cyusb_pool_zero_copy(struct cyusb_buffer_pool *pool)
+{
+	return pool->zero_copy;
+}
+
+void cyusb_pool_destroy(struct cyusb_buffer_pool *pool)
+{
+	int i;
+
+	if ( pool == NULL )
+	   return;
+
+	if ( pool->entry != NULL ) {
+	   for ( i = 0; i < pool->count; ++i ) {
+		if ( pool->entry[i].data == NULL )
+		   continue;
+		if ( pool->entry[i].dev_mem ) {
+		   cyusb_backend->dev_mem_free(pool->h, pool->entry[i].data, pool->size);
+		   continue;
+		}
+		free(pool->entry[i].data);
+	   }
+	}
+	free(pool->entry);
+	free(pool->free_list);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
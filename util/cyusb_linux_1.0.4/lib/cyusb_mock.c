@@ -0,0 +1,1300 @@
+/*
+ * Filename             : cyusb_mock.c
+ * Description          : Software FX3 model for libcyusb, selected with CYUSB_BACKEND=mock. Emulates
+ *                        the boot loader's 0xA0 RAM download, the cyfxflashprog I2C EEPROM and SPI
+ *                        flash commands, the bulk source/sink and loopback firmware, and the
+ *                        cyfxuvcinmem_bulk camera, with a simple latency and bandwidth model, so
+ *                        that the library and the tools can be exercised without hardware.
+ *
+ * The model is configured through the environment when the library is first opened:
+ *   CYUSB_MOCK_DEVICES    : Number of emulated devices (default 1)
+ *   CYUSB_MOCK_STATE      : Initial state: "boot", "bulk", "flashprog" or "uvc" (default "boot")
+ *   CYUSB_MOCK_BULK       : Bulk firmware model: "srcsink" or "loopback" (default "srcsink")
+ *   CYUSB_MOCK_LATENCY_US : Time from a transfer reaching the device to its completion (default 100)
+ *   CYUSB_MOCK_BANDWIDTH  : Bulk bytes per second in each direction, K/M/G suffixes (default 400M)
+ *   CYUSB_MOCK_SPI_SIZE   : Size of the emulated SPI flash in bytes (default 2M)
+ *   CYUSB_MOCK_ERASE_MS   : Time for which an SPI sector erase keeps the flash busy (default 10)
+ *
+ * A firmware image downloaded to the boot loader is not executed. When the boot loader is told to
+ * jump to it, the device re-enumerates as the flash programmer if the image contains the "FX3PROG"
+ * ID string that the programmer returns for request 0xB0, and as the bulk firmware otherwise.
+ * The source/sink model also accepts up to 4 bulk streams per endpoint, like cyfxbulkstreams.
+ * The UVC camera answers the probe and commit controls of interface 1, and once committed sends
+ * frames on its bulk endpoint (burst 16) as 4096-byte payloads of whole packets with 12-byte
+ * headers, until the endpoint halt is cleared. Byte i of every frame is (i & 0xFF).
+ * Device state persists across cyusb_close() and cyusb_open(), as it does on real hardware.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+#include "cyusb_internal.h"
+
+#define MOCK_VID		(0x04b4)
+#define MOCK_PID_BOOT		(0x00f3)	// FX3 boot loader
+#define MOCK_PID_SRCSINK	(0x00f1)	// cyfxbulksrcsink
+#define MOCK_PID_LOOPBACK	(0x00f0)	// cyfxbulklpautoenum
+#define MOCK_PID_FLASHPROG	(0x4720)	// cyfxflashprog
+#define MOCK_PID_UVC		(0x4722)	// cyfxuvcinmem_bulk
+
+#define MOCK_EP_OUT		(0x01)
+#define MOCK_EP_IN		(0x81)
+#define MOCK_MAX_PACKET		(1024)
+
+#define MOCK_ITCM_BASE		(0x00000000)
+#define MOCK_ITCM_SIZE		(16 * 1024)
+#define MOCK_SYSMEM_BASE	(0x40000000)
+#define MOCK_SYSMEM_SIZE	(512 * 1024)
+
+#define MOCK_I2C_SLAVES		(8)
+#define MOCK_I2C_SLAVE_SIZE	(64 * 1024)
+#define MOCK_SPI_PAGE_SIZE	(256)
+#define MOCK_SPI_SECTOR_SIZE	(64 * 1024)
+
+#define MOCK_MAX_STREAMS	(4)		// CY_FX_EP_MAX_STREAMS of cyfxbulkstreams
+#define MOCK_FIFO_SIZE		(1024 * 1024)	// Data held by the loopback firmware
+
+#define MOCK_PROG_ID		"FX3PROG"
+
+/* UVC camera, as configured by cyfxuvcinmem_bulk. */
+#define MOCK_UVC_VS_INTF	(1)		// VideoStreaming interface
+#define MOCK_UVC_EP		(0x81)		// CY_FX_EP_BULK_VIDEO
+#define MOCK_UVC_BURST		(16)		// CY_FX_Bulk_BURST
+#define MOCK_UVC_PAYLOAD	(4096)		// CY_FX_UVC_STREAM_BUF_SIZE
+#define MOCK_UVC_HEADER		(12)		// CY_FX_UVC_MAX_HEADER
+#define MOCK_UVC_BFH		(0x8C)		// CY_FX_UVC_HEADER_DEFAULT_BFH
+#define MOCK_UVC_PROBE_LEN	(26)		// CY_FX_UVC_MAX_PROBE_SETTING
+#define MOCK_UVC_FRAME_SIZE	(4 * (MOCK_UVC_PAYLOAD - MOCK_UVC_HEADER))	// Whole payloads only
+#define MOCK_UVC_CLASS		(0x0E)		// CC_VIDEO
+#define MOCK_UVC_DT_COMPANION	(0x30)		// SuperSpeed endpoint companion descriptor
+#define MOCK_UVC_COMPANION_LEN	(6)
+
+typedef enum {
+	MOCK_BOOT = 0,		// Boot loader, waiting for a RAM download
+	MOCK_BULK,		// Running the bulk source/sink or loopback firmware
+	MOCK_FLASHPROG,		// Running the flash programmer
+	MOCK_UVC		// Running the UVC camera firmware
+} mock_state;
+
+struct mock_dev {
+	int                 index;
+	mock_state          state;
+	unsigned int        generation;	// Incremented on every re-enumeration
+	unsigned char      *itcm;
+	unsigned char      *sysmem;
+	unsigned char      *i2c;	// Allocated on first use, erased to 0xFF
+	unsigned char      *spi;	// Allocated on first use, erased to 0xFF
+	unsigned long long  erase_done;	// Time at which the SPI flash stops being busy
+
+	/* Bus model: time at which EP0 and each bulk direction become idle. */
+	unsigned long long  ep0_free;
+	unsigned long long  link_free[2];
+
+	/* Bulk streams allocated on the OUT and IN endpoints. */
+	unsigned int        num_streams[2];
+
+	/* Loopback data, as a ring. */
+	unsigned char      *fifo;
+	int                 fifo_head;
+	int                 fifo_count;
+
+	/* UVC video stream: frames sent, and bytes of the current frame's payloads sent. */
+	int                 uvc_streaming;
+	unsigned int        uvc_frame;
+	int                 uvc_offset;
+};
+
+struct mock_handle {
+	struct mock_dev    *dev;
+	unsigned int        generation;	// Generation of the device when it was opened
+};
+
+/* A submitted transfer. due is 0 while a loopback transfer waits for data or space. */
+struct mock_xfer {
+	struct libusb_transfer     *xfer;
+	struct mock_dev            *dev;
+	unsigned long long          due;
+	unsigned long long          deadline;
+	enum libusb_transfer_status status;
+	int                         actual;
+	struct mock_xfer           *next;
+};
+
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  mock_cond;
+static int             mock_initialized;
+static int             mock_handler_active;	// A thread is running completions
+static unsigned int    mock_interrupt_seq;
+
+static struct mock_dev  mock_devs[MAXDEVICES];
+static int              mock_ndev;
+static struct mock_xfer *mock_head, *mock_tail;
+
+static int                mock_loopback;
+static unsigned long long mock_latency_ns;
+static unsigned long long mock_bandwidth;
+static unsigned int       mock_spi_size;
+static unsigned long long mock_erase_ns;
+
+/* Probe control returned by the UVC camera, whatever the host sets. */
+static const unsigned char mock_uvc_probe[MOCK_UVC_PROBE_LEN] = {
+	0x00, 0x00,				// bmHint
+	0x01, 0x01,				// bFormatIndex, bFrameIndex
+	0x2A, 0x2C, 0x0A, 0x00,			// dwFrameInterval (66.7 ms)
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	// wKeyFrameRate, wPFrameRate, wCompQuality
+	0x00, 0x00, 0x00, 0x00,			// wCompWindowSize, wDelay
+	MOCK_UVC_FRAME_SIZE & 0xFF, MOCK_UVC_FRAME_SIZE >> 8, 0x00, 0x00,	// dwMaxVideoFrameSize
+	0x68, 0x42, 0x00, 0x00			// dwMaxPayloadTransferSize, more than is ever sent
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ( (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec );
+}
+
+static unsigned long long env_number(const char *name, unsigned long long def)
+{
+	const char *str = getenv(name);
+	unsigned long long v;
+	char *end;
+
+	if ( ( str == NULL ) || ( *str == '\0' ) )
+	   return def;
+	v = strtoull(str, &end, 0);
+	switch ( *end ) {
+		case 'g': case 'G': v *= 1000;
+		case 'm': case 'M': v *= 1000;
+		case 'k': case 'K': v *= 1000;
+	}
+	return v;
+}
+
+static int mock_init(void)
+{
+	const char *state;
+	pthread_condattr_t attr;
+	int i;
+
+	pthread_mutex_lock(&mock_lock);
+	if ( mock_initialized ) {
+	   pthread_mutex_unlock(&mock_lock);
+	   return 0;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&mock_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	mock_ndev = (int)env_number("CYUSB_MOCK_DEVICES", 1);
+	if ( mock_ndev > MAXDEVICES )
+	   mock_ndev = MAXDEVICES;
+	mock_loopback   = ( ( getenv("CYUSB_MOCK_BULK") != NULL ) &&
+			( strcmp(getenv("CYUSB_MOCK_BULK"), "loopback") == 0 ) );
+	mock_latency_ns = env_number("CYUSB_MOCK_LATENCY_US", 100) * 1000;
+	mock_bandwidth  = env_number("CYUSB_MOCK_BANDWIDTH", 400000000ULL);
+	mock_spi_size   = (unsigned int)env_number("CYUSB_MOCK_SPI_SIZE", 2 * 1024 * 1024);
+	mock_erase_ns   = env_number("CYUSB_MOCK_ERASE_MS", 10) * 1000000;
+	if ( mock_bandwidth == 0 )
+	   mock_bandwidth = 1;
+	mock_spi_size -= mock_spi_size % MOCK_SPI_SECTOR_SIZE;
+
+	state = getenv("CYUSB_MOCK_STATE");
+	for ( i = 0; i < mock_ndev; ++i ) {
+		mock_devs[i].index  = i;
+		mock_devs[i].state  = MOCK_BOOT;
+		if ( ( state != NULL ) && ( strcmp(state, "bulk") == 0 ) )
+		   mock_devs[i].state = MOCK_BULK;
+		else if ( ( state != NULL ) && ( strcmp(state, "flashprog") == 0 ) )
+		   mock_devs[i].state = MOCK_FLASHPROG;
+		else if ( ( state != NULL ) && ( strcmp(state, "uvc") == 0 ) )
+		   mock_devs[i].state = MOCK_UVC;
+		mock_devs[i].itcm   = (unsigned char *)calloc(1, MOCK_ITCM_SIZE);
+		mock_devs[i].sysmem = (unsigned char *)calloc(1, MOCK_SYSMEM_SIZE);
+		mock_devs[i].fifo   = (unsigned char *)malloc(MOCK_FIFO_SIZE);
+		if ( ( mock_devs[i].itcm == NULL ) || ( mock_devs[i].sysmem == NULL ) ||
+		     ( mock_devs[i].fifo == NULL ) ) {
+		   pthread_mutex_unlock(&mock_lock);
+		   return LIBUSB_ERROR_NO_MEM;
+		}
+	}
+
+	mock_initialized = 1;
+	pthread_mutex_unlock(&mock_lock);
+	return 0;
+}
+
+static void mock_exit(void)
+{
+}
+
+/* Return the device behind a handle, or NULL if it has re-enumerated since it was opened. */
+static struct mock_dev * mock_device(cyusb_handle *h)
+{
+	struct mock_handle *mh = (struct mock_handle *)h;
+
+	if ( ( mh == NULL ) || ( mh->generation != mh->dev->generation ) )
+	   return NULL;
+	return mh->dev;
+}
+
+static unsigned short mock_product(struct mock_dev *dev)
+{
+	switch ( dev->state ) {
+		case MOCK_BULK:      return ( mock_loopback ) ? MOCK_PID_LOOPBACK : MOCK_PID_SRCSINK;
+		case MOCK_FLASHPROG: return MOCK_PID_FLASHPROG;
+		case MOCK_UVC:       return MOCK_PID_UVC;
+		default:             return MOCK_PID_BOOT;
+	}
+}
+
+static const char * mock_string(struct mock_dev *dev, unsigned char index, char *buf, int size)
+{
+	switch ( index ) {
+		case 1:
+		     return "Cypress";
+		case 2:
+		     if ( dev->state == MOCK_BOOT )
+		        return "WESTBRIDGE";
+		     if ( dev->state == MOCK_FLASHPROG )
+		        return "FX3 Flash Programmer (mock)";
+		     if ( dev->state == MOCK_UVC )
+		        return "FX3 UVC Camera (mock)";
+		     return ( mock_loopback ) ? "FX3 Bulk Loopback (mock)" : "FX3 Bulk Source/Sink (mock)";
+		case 3:
+		     snprintf(buf, size, "MOCK%04d", dev->index);
+		     return buf;
+		default:
+		     return NULL;
+	}
+}
+
+static cyusb_handle * mock_open_dev(struct mock_dev *dev)
+{
+	struct mock_handle *mh;
+
+	mh = (struct mock_handle *)malloc(sizeof(struct mock_handle));
+	if ( mh == NULL )
+	   return NULL;
+	mh->dev        = dev;
+	mh->generation = dev->generation;
+	return (cyusb_handle *)mh;
+}
+
+static int mock_open_devices(cyusb_handle **handles, int max)
+{
+	int n;
+
+	for ( n = 0; ( n < mock_ndev ) && ( n < max ); ++n ) {
+		handles[n] = mock_open_dev(&mock_devs[n]);
+		if ( handles[n] == NULL )
+		   return LIBUSB_ERROR_NO_MEM;
+	}
+	return n;
+}
+
+static cyusb_handle * mock_open_vid_pid(unsigned short vid, unsigned short pid)
+{
+	int i;
+
+	for ( i = 0; i < mock_ndev; ++i ) {
+		if ( ( vid == MOCK_VID ) && ( pid == mock_product(&mock_devs[i]) ) )
+		   return mock_open_dev(&mock_devs[i]);
+	}
+	return NULL;
+}
+
+static void mock_close(cyusb_handle *h)
+{
+	free(h);
+}
+
+static cyusb_device * mock_get_device(cyusb_handle *h)
+{
+	return NULL;
+}
+
+static int mock_get_device_descriptor(cyusb_handle *h, struct libusb_device_descriptor *desc)
+{
+	struct mock_dev *dev = mock_device(h);
+
+	memset(desc, 0, sizeof(struct libusb_device_descriptor));
+	if ( dev == NULL )
+	   return LIBUSB_ERROR_NO_DEVICE;
+
+	desc->bLength            = LIBUSB_DT_DEVICE_SIZE;
+	desc->bDescriptorType    = LIBUSB_DT_DEVICE;
+	desc->bcdUSB             = 0x0300;
+	desc->bMaxPacketSize0    = 9;
+	desc->idVendor           = MOCK_VID;
+	desc->idProduct          = mock_product(dev);
+	desc->bcdDevice          = 0x0100;
+	desc->iManufacturer      = 1;
+	desc->iProduct           = 2;
+	desc->iSerialNumber      = 3;
+	desc->bNumConfigurations = 1;
+	return 0;
+}
+
+/* Configuration descriptor, allocated as one block so that it is freed with a single free(). */
+struct mock_config {
+	struct libusb_config_descriptor    config;
+	struct libusb_interface            intf[2];
+	struct libusb_interface_descriptor alt[2];
+	struct libusb_endpoint_descriptor  ep[2];
+	unsigned char                      companion[MOCK_UVC_COMPANION_LEN];
+};
+
+static int mock_get_config_descriptor(cyusb_handle *h, unsigned char index,
+		struct libusb_config_descriptor **config)
+{
+	struct mock_dev *dev = mock_device(h);
+	struct mock_config *mc;
+	int num_intf;
+	int i;
+
+	if ( dev == NULL )
+	   return LIBUSB_ERROR_NO_DEVICE;
+	if ( index != 0 )
+	   return LIBUSB_ERROR_NOT_FOUND;
+	num_intf = ( dev->state == MOCK_UVC ) ? 2 : 1;
+
+	mc = (struct mock_config *)calloc(1, sizeof(struct mock_config));
+	if ( mc == NULL )
+	   return LIBUSB_ERROR_NO_MEM;
+
+	for ( i = 0; i < num_intf; ++i ) {
+		mc->alt[i].bLength          = LIBUSB_DT_INTERFACE_SIZE;
+		mc->alt[i].bDescriptorType  = LIBUSB_DT_INTERFACE;
+		mc->alt[i].bInterfaceNumber = i;
+		mc->alt[i].bInterfaceClass  = LIBUSB_CLASS_VENDOR_SPEC;
+		mc->alt[i].endpoint         = mc->ep;
+		mc->intf[i].altsetting      = &mc->alt[i];
+		mc->intf[i].num_altsetting  = 1;
+	}
+	for ( i = 0; i < 2; ++i ) {
+		mc->ep[i].bLength          = LIBUSB_DT_ENDPOINT_SIZE;
+		mc->ep[i].bDescriptorType  = LIBUSB_DT_ENDPOINT;
+		mc->ep[i].bEndpointAddress = ( i == 0 ) ? MOCK_EP_OUT : MOCK_EP_IN;
+		mc->ep[i].bmAttributes     = LIBUSB_TRANSFER_TYPE_BULK;
+		mc->ep[i].wMaxPacketSize   = MOCK_MAX_PACKET;
+	}
+
+	if ( dev->state == MOCK_UVC ) {
+	   /* Video control interface, and the video streaming interface with the bulk video endpoint
+	      and its SuperSpeed companion. Class-specific descriptors are not modelled. */
+	   mc->alt[0].bInterfaceClass    = MOCK_UVC_CLASS;
+	   mc->alt[0].bInterfaceSubClass = 1;
+	   mc->alt[1].bInterfaceClass    = MOCK_UVC_CLASS;
+	   mc->alt[1].bInterfaceSubClass = 2;
+	   mc->alt[1].bNumEndpoints      = 1;
+	   mc->ep[0].bEndpointAddress    = MOCK_UVC_EP;
+	   mc->ep[0].extra               = mc->companion;
+	   mc->ep[0].extra_length        = MOCK_UVC_COMPANION_LEN;
+	   mc->companion[0] = MOCK_UVC_COMPANION_LEN;
+	   mc->companion[1] = MOCK_UVC_DT_COMPANION;
+	   mc->companion[2] = MOCK_UVC_BURST - 1;
+	   mc->companion[4] = (MOCK_MAX_PACKET * MOCK_UVC_BURST) & 0xFF;
+	   mc->companion[5] = (MOCK_MAX_PACKET * MOCK_UVC_BURST) >> 8;
+	}
+	else mc->alt[0].bNumEndpoints = ( dev->state == MOCK_BULK ) ? 2 : 0;
+
+	mc->config.bLength             = LIBUSB_DT_CONFIG_SIZE;
+	mc->config.bDescriptorType     = LIBUSB_DT_CONFIG;
+	mc->config.wTotalLength        = LIBUSB_DT_CONFIG_SIZE + num_intf * LIBUSB_DT_INTERFACE_SIZE;
+	for ( i = 0; i < num_intf; ++i )
+		mc->config.wTotalLength += mc->alt[i].bNumEndpoints * LIBUSB_DT_ENDPOINT_SIZE;
+	mc->config.wTotalLength       += mc->ep[0].extra_length;
+	mc->config.bNumInterfaces      = num_intf;
+	mc->config.bConfigurationValue = 1;
+	mc->config.bmAttributes        = 0x80;
+	mc->config.MaxPower            = 50;
+	mc->config.interface           = mc->intf;
+
+	*config = &mc->config;
+	return 0;
+}
+
+static int mock_get_active_config_descriptor(cyusb_handle *h, struct libusb_config_descriptor **config)
+{
+	return ( mock_get_config_descriptor(h, 0, config) );
+}
+
+static int mock_get_config_descriptor_by_value(cyusb_handle *h, unsigned char value,
+		struct libusb_config_descriptor **config)
+{
+	if ( value != 1 )
+	   return LIBUSB_ERROR_NOT_FOUND;
+	return ( mock_get_config_descriptor(h, 0, config) );
+}
+
+static void mock_free_config_descriptor(struct libusb_config_descriptor *config)
+{
+	free(config);
+}
+
+static int mock_get_string_descriptor_ascii(cyusb_handle *h, unsigned char index, unsigned char *data,
+		int length)
+{
+	struct mock_dev *dev = mock_device(h);
+	const char *str;
+	char buf[16];
+	int n;
+
+	if ( dev == NULL )
+	   return LIBUSB_ERROR_NO_DEVICE;
+	str = mock_string(dev, index, buf, sizeof(buf));
+	if ( ( str == NULL ) || ( length <= 0 ) )
+	   return LIBUSB_ERROR_PIPE;
+
+	n = strlen(str);
+	if ( n > length - 1 )
+	   n = length - 1;
+	memcpy(data, str, n);
+	data[n] = '\0';
+	return n;
+}
+
+static int mock_get_string_descriptor(cyusb_handle *h, unsigned char index, unsigned short langid,
+		unsigned char *data, int length)
+{
+	struct mock_dev *dev = mock_device(h);
+	unsigned char desc[2 + 2 * 64];
+	const char *str;
+	char buf[16];
+	int n, i;
+
+	if ( dev == NULL )
+	   return LIBUSB_ERROR_NO_DEVICE;
+
+	if ( index == 0 ) {
+	   desc[2] = 0x09;		// English (US)
+	   desc[3] = 0x04;
+	   n = 4;
+	}
+	else {
+	   str = mock_string(dev, index, buf, sizeof(buf));
+	   if ( str == NULL )
+	      return LIBUSB_ERROR_PIPE;
+	   for ( i = 0; ( str[i] != '\0' ) && ( i < 64 ); ++i ) {
+		desc[2 + 2 * i]     = str[i];
+		desc[2 + 2 * i + 1] = 0;
+	   }
+	   n = 2 + 2 * i;
+	}
+	desc[0] = n;
+	desc[1] = LIBUSB_DT_STRING;
+
+	if ( n > length )
+	   n = length;
+	memcpy(data, desc, n);
+	return n;
+}
+
+static int mock_get_descriptor(cyusb_handle *h, unsigned char type, unsigned char index,
+		unsigned char *data, int length)
+{
+	struct libusb_device_descriptor d;
+	unsigned char desc[LIBUSB_DT_DEVICE_SIZE];
+	int r;
+
+	if ( type == LIBUSB_DT_STRING )
+	   return ( mock_get_string_descriptor(h, index, 0x0409, data, length) );
+	if ( type != LIBUSB_DT_DEVICE )
+	   return LIBUSB_ERROR_PIPE;
+
+	r = mock_get_device_descriptor(h, &d);
+	if ( r )
+	   return r;
+	desc[0]  = d.bLength;
+	desc[1]  = d.bDescriptorType;
+	desc[2]  = d.bcdUSB & 0xff;
+	desc[3]  = d.bcdUSB >> 8;
+	desc[4]  = d.bDeviceClass;
+	desc[5]  = d.bDeviceSubClass;
+	desc[6]  = d.bDeviceProtocol;
+	desc[7]  = d.bMaxPacketSize0;
+	desc[8]  = d.idVendor & 0xff;
+	desc[9]  = d.idVendor >> 8;
+	desc[10] = d.idProduct & 0xff;
+	desc[11] = d.idProduct >> 8;
+	desc[12] = d.bcdDevice & 0xff;
+	desc[13] = d.bcdDevice >> 8;
+	desc[14] = d.iManufacturer;
+	desc[15] = d.iProduct;
+	desc[16] = d.iSerialNumber;
+	desc[17] = d.bNumConfigurations;
+
+	r = ( length < LIBUSB_DT_DEVICE_SIZE ) ? length : LIBUSB_DT_DEVICE_SIZE;
+	memcpy(data, desc, r);
+	return r;
+}
+
+static int mock_get_bus_number(cyusb_handle *h)
+{
+	return 1;
+}
+
+static int mock_get_device_address(cyusb_handle *h)
+{
+	return ( ((struct mock_handle *)h)->dev->index + 1 );
+}
+
+/* Return whether the firmware the device is running has a bulk endpoint at this address. */
+static int mock_has_endpoint(struct mock_dev *dev, unsigned char endpoint)
+{
+	if ( dev->state == MOCK_UVC )
+	   return ( endpoint == MOCK_UVC_EP );
+	return ( ( dev->state == MOCK_BULK ) && ( ( endpoint == MOCK_EP_OUT ) || ( endpoint == MOCK_EP_IN ) ) );
+}
+
+static int mock_get_max_packet_size(cyusb_handle *h, unsigned char endpoint)
+{
+	struct mock_dev *dev = mock_device(h);
+
+	if ( dev == NULL )
+	   return LIBUSB_ERROR_NO_DEVICE;
+	if ( !mock_has_endpoint(dev, endpoint) )
+	   return LIBUSB_ERROR_NOT_FOUND;
+	return MOCK_MAX_PACKET;
+}
+
+static int mock_get_max_iso_packet_size(cyusb_handle *h, unsigned char endpoint)
+{
+	return ( mock_device(h) == NULL ) ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int mock_get_configuration(cyusb_handle *h, int *config)
+{
+	if ( mock_device(h) == NULL )
+	   return LIBUSB_ERROR_NO_DEVICE;
+	*config = 1;
+	return 0;
+}
+
+static int mock_set_configuration(cyusb_handle *h, int config)
+{
+	if ( mock_device(h) == NULL )
+	   return LIBUSB_ERROR_NO_DEVICE;
+	return ( ( config == 1 ) || ( config == -1 ) ) ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int mock_interface_op(cyusb_handle *h, int interface)
+{
+	struct mock_dev *dev = mock_device(h);
+
+	if ( dev == NULL )
+	   return LIBUSB_ERROR_NO_DEVICE;
+	if ( ( interface == 0 ) || ( ( dev->state == MOCK_UVC ) && ( interface == MOCK_UVC_VS_INTF ) ) )
+	   return 0;
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int mock_set_interface_alt_setting(cyusb_handle *h, int interface, int altsetting)
+{
+	if ( altsetting != 0 )
+	   return LIBUSB_ERROR_NOT_FOUND;
+	return ( mock_interface_op(h, interface) );
+}
+
+static int mock_device_op(cyusb_handle *h)
+{
+	return ( mock_device(h) == NULL ) ? LIBUSB_ERROR_NO_DEVICE : 0;
+}
+
+static int mock_clear_halt(cyusb_handle *h, unsigned char endpoint)
+{
+	struct mock_dev *dev = mock_device(h);
+
+	if ( dev == NULL )
+	   return LIBUSB_ERROR_NO_DEVICE;
+
+	/* The UVC firmware stops the video stream when the host clears the endpoint halt. */
+	if ( ( dev->state == MOCK_UVC ) && ( endpoint == MOCK_UVC_EP ) ) {
+	   pthread_mutex_lock(&mock_lock);
+	   dev->uvc_streaming = 0;
+	   pthread_mutex_unlock(&mock_lock);
+	}
+	return 0;
+}
+
+static int mock_kernel_driver_active(cyusb_handle *h, int interface)
+{
+	return ( mock_device_op(h) );
+}
+
+/* Write or read the boot loader's view of memory. Returns 0, or -1 for an address that is not
+   backed by ITCM or SYSMEM. */
+static int mock_ram_access(struct mock_dev *dev, unsigned int address, unsigned char *data, int len,
+		int write)
+{
+	unsigned char *mem;
+
+	if ( ( address >= MOCK_SYSMEM_BASE ) && ( address + len <= MOCK_SYSMEM_BASE + MOCK_SYSMEM_SIZE ) )
+	   mem = dev->sysmem + (address - MOCK_SYSMEM_BASE);
+	else if ( address + len <= MOCK_ITCM_BASE + MOCK_ITCM_SIZE )
+	   mem = dev->itcm + (address - MOCK_ITCM_BASE);
+	else return -1;
+
+	if ( write )
+	   memcpy(mem, data, len);
+	else memcpy(data, mem, len);
+	return 0;
+}
+
+static int mock_contains(const unsigned char *mem, int size, const char *str)
+{
+	int len = strlen(str);
+	int i;
+
+	for ( i = 0; i + len <= size; ++i ) {
+		if ( ( mem[i] == (unsigned char)str[0] ) && ( memcmp(mem + i, str, len) == 0 ) )
+		   return 1;
+	}
+	return 0;
+}
+
+/* Jump to the downloaded image: the device drops off the bus and comes back running it. */
+static void mock_reenumerate(struct mock_dev *dev)
+{
+	if ( ( mock_contains(dev->sysmem, MOCK_SYSMEM_SIZE, MOCK_PROG_ID) ) ||
+	     ( mock_contains(dev->itcm, MOCK_ITCM_SIZE, MOCK_PROG_ID) ) )
+	   dev->state = MOCK_FLASHPROG;
+	else dev->state = MOCK_BULK;
+	++dev->generation;
+	dev->num_streams[0] = 0;
+	dev->num_streams[1] = 0;
+	dev->fifo_head  = 0;
+	dev->fifo_count = 0;
+}
+
+static unsigned char * mock_memory(unsigned char **mem, unsigned int size)
+{
+	if ( *mem == NULL ) {
+	   *mem = (unsigned char *)malloc(size);
+	   if ( *mem != NULL )
+	      memset(*mem, 0xFF, size);
+	}
+	return *mem;
+}
+
+/* Execute a class request of the UVC camera: GET_CUR and SET_CUR of the probe and commit
+   controls. Like cyfxuvcinmem, the camera keeps its one setting whatever the host probes, and a
+   commit starts the video stream at the start of a frame. */
+static enum libusb_transfer_status mock_uvc_control_locked(struct mock_dev *dev,
+		struct libusb_control_setup *setup, unsigned char *data, int *actual)
+{
+	unsigned short wValue  = libusb_le16_to_cpu(setup->wValue);
+	unsigned short wIndex  = libusb_le16_to_cpu(setup->wIndex);
+	unsigned short wLength = libusb_le16_to_cpu(setup->wLength);
+	int in = ( (setup->bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN );
+	int control = wValue >> 8;
+
+	if ( ( (setup->bmRequestType & (0x03 << 5)) != LIBUSB_REQUEST_TYPE_CLASS ) ||
+	     ( (wIndex & 0xFF) != MOCK_UVC_VS_INTF ) || ( ( control != 0x01 ) && ( control != 0x02 ) ) )
+	   return LIBUSB_TRANSFER_STALL;
+
+	if ( ( in ) && ( setup->bRequest == 0x81 ) ) {		/* GET_CUR */
+	   *actual = ( wLength < MOCK_UVC_PROBE_LEN ) ? wLength : MOCK_UVC_PROBE_LEN;
+	   memcpy(data, mock_uvc_probe, *actual);
+	   return LIBUSB_TRANSFER_COMPLETED;
+	}
+	if ( ( in ) || ( setup->bRequest != 0x01 ) || ( wLength != MOCK_UVC_PROBE_LEN ) )
+	   return LIBUSB_TRANSFER_STALL;
+
+	if ( control == 0x02 ) {
+	   dev->uvc_streaming = 1;
+	   dev->uvc_offset    = 0;
+	}
+	*actual = wLength;
+	return LIBUSB_TRANSFER_COMPLETED;
+}
+
+/* Execute a control request. Returns the transfer status; *actual receives the data length. */
+static enum libusb_transfer_status mock_control_locked(struct mock_dev *dev, struct libusb_transfer *xfer,
+		int *actual, unsigned long long now)
+{
+	struct libusb_control_setup *setup = libusb_control_transfer_get_setup(xfer);
+	unsigned char *data = libusb_control_transfer_get_data(xfer);
+	unsigned short wValue  = libusb_le16_to_cpu(setup->wValue);
+	unsigned short wIndex  = libusb_le16_to_cpu(setup->wIndex);
+	unsigned short wLength = libusb_le16_to_cpu(setup->wLength);
+	int in = ( (setup->bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN );
+	unsigned int offset;
+	unsigned char *mem;
+	int i;
+
+	*actual = 0;
+	if ( dev->state == MOCK_UVC )
+	   return ( mock_uvc_control_locked(dev, setup, data, actual) );
+	if ( (setup->bmRequestType & (0x03 << 5)) != LIBUSB_REQUEST_TYPE_VENDOR )
+	   return LIBUSB_TRANSFER_STALL;
+
+	if ( dev->state == MOCK_BOOT ) {
+	   if ( setup->bRequest != 0xA0 )
+	      return LIBUSB_TRANSFER_STALL;
+	   if ( ( !in ) && ( wLength == 0 ) ) {
+	      mock_reenumerate(dev);
+	      return LIBUSB_TRANSFER_COMPLETED;
+	   }
+	   if ( mock_ram_access(dev, ((unsigned int)wIndex << 16) | wValue, data, wLength, !in ) )
+	      return LIBUSB_TRANSFER_STALL;
+	   *actual = wLength;
+	   return LIBUSB_TRANSFER_COMPLETED;
+	}
+
+	if ( dev->state != MOCK_FLASHPROG )
+	   return LIBUSB_TRANSFER_STALL;
+
+	switch ( setup->bRequest ) {
+		case 0xB0:	/* Read the programmer ID */
+		     if ( !in )
+		        return LIBUSB_TRANSFER_STALL;
+		     *actual = ( wLength < sizeof(MOCK_PROG_ID) ) ? wLength : sizeof(MOCK_PROG_ID);
+		     memcpy(data, MOCK_PROG_ID, *actual);
+		     return LIBUSB_TRANSFER_COMPLETED;
+
+		case 0xBA:	/* I2C EEPROM write and read */
+		case 0xBB:
+		     if ( ( in != ( setup->bRequest == 0xBB ) ) || ( wValue >= MOCK_I2C_SLAVES ) ||
+		          ( (unsigned int)wIndex + wLength > MOCK_I2C_SLAVE_SIZE ) )
+		        return LIBUSB_TRANSFER_STALL;
+		     mem = mock_memory(&dev->i2c, MOCK_I2C_SLAVES * MOCK_I2C_SLAVE_SIZE);
+		     if ( mem == NULL )
+		        return LIBUSB_TRANSFER_ERROR;
+		     mem += wValue * MOCK_I2C_SLAVE_SIZE + wIndex;
+		     if ( in )
+		        memcpy(data, mem, wLength);
+		     else memcpy(mem, data, wLength);
+		     *actual = wLength;
+		     return LIBUSB_TRANSFER_COMPLETED;
+
+		case 0xC2:	/* SPI flash program and read, by page */
+		case 0xC3:
+		     offset = (unsigned int)wIndex * MOCK_SPI_PAGE_SIZE;
+		     if ( ( in != ( setup->bRequest == 0xC3 ) ) || ( offset + wLength > mock_spi_size ) )
+		        return LIBUSB_TRANSFER_STALL;
+		     mem = mock_memory(&dev->spi, mock_spi_size);
+		     if ( mem == NULL )
+		        return LIBUSB_TRANSFER_ERROR;
+		     mem += offset;
+		     if ( in )
+		        memcpy(data, mem, wLength);
+		     else {
+		        /* Programming can only clear bits; a missed erase shows up as corrupt data. */
+		        for ( i = 0; i < wLength; ++i )
+			        mem[i] &= data[i];
+		     }
+		     *actual = wLength;
+		     return LIBUSB_TRANSFER_COMPLETED;
+
+		case 0xC4:	/* SPI sector erase, or status poll */
+		     if ( ( in ) && ( wValue == 0 ) && ( wLength >= 1 ) ) {
+		        data[0] = ( now < dev->erase_done ) ? 1 : 0;
+		        *actual = 1;
+		        return LIBUSB_TRANSFER_COMPLETED;
+		     }
+		     if ( ( in ) || ( wValue != 1 ) ||
+		          ( ((unsigned int)wIndex + 1) * MOCK_SPI_SECTOR_SIZE > mock_spi_size ) )
+		        return LIBUSB_TRANSFER_STALL;
+		     mem = mock_memory(&dev->spi, mock_spi_size);
+		     if ( mem == NULL )
+		        return LIBUSB_TRANSFER_ERROR;
+		     memset(mem + wIndex * MOCK_SPI_SECTOR_SIZE, 0xFF, MOCK_SPI_SECTOR_SIZE);
+		     dev->erase_done = now + mock_erase_ns;
+		     return LIBUSB_TRANSFER_COMPLETED;
+
+		default:
+		     return LIBUSB_TRANSFER_STALL;
+	}
+}
+
+/* Occupy one direction of the bulk link for len bytes, and return the completion time. */
+static unsigned long long mock_schedule_bulk(struct mock_dev *dev, int dir, int len, unsigned long long now)
+{
+	unsigned long long start = ( dev->link_free[dir] > now ) ? dev->link_free[dir] : now;
+
+	dev->link_free[dir] = start + (unsigned long long)len * 1000000000ULL / mock_bandwidth;
+	return ( dev->link_free[dir] + mock_latency_ns );
+}
+
+/* Send up to len bytes of the UVC video stream. Each frame goes out as payloads of up to
+   MOCK_UVC_PAYLOAD bytes, each with a header; the transfer also ends at the end of a payload
+   that is not a whole number of packets, as the host sees a short packet there. Returns the
+   bytes sent. */
+static int mock_uvc_read(struct mock_dev *dev, unsigned char *buf, int len)
+{
+	unsigned char hdr[MOCK_UVC_HEADER];
+	int n = 0;
+	int pos, start, plen, eof;
+
+	while ( n < len ) {
+		pos   = dev->uvc_offset % MOCK_UVC_PAYLOAD;
+		start = dev->uvc_offset / MOCK_UVC_PAYLOAD * (MOCK_UVC_PAYLOAD - MOCK_UVC_HEADER);
+		plen  = MOCK_UVC_FRAME_SIZE - start;
+		if ( plen > MOCK_UVC_PAYLOAD - MOCK_UVC_HEADER )
+		   plen = MOCK_UVC_PAYLOAD - MOCK_UVC_HEADER;
+		eof   = ( start + plen == MOCK_UVC_FRAME_SIZE );
+		plen += MOCK_UVC_HEADER;
+
+		/* Header with the frame ID, EOF on the last payload, and the frame number as PTS. */
+		memset(hdr, 0, sizeof(hdr));
+		hdr[0] = MOCK_UVC_HEADER;
+		hdr[1] = MOCK_UVC_BFH | (dev->uvc_frame & 0x01) | ( ( eof ) ? 0x02 : 0 );
+		hdr[2] = dev->uvc_frame & 0xFF;
+		hdr[3] = (dev->uvc_frame >> 8) & 0xFF;
+		hdr[4] = (dev->uvc_frame >> 16) & 0xFF;
+		hdr[5] = (dev->uvc_frame >> 24) & 0xFF;
+
+		for ( ; ( pos < plen ) && ( n < len ); ++pos, ++n, ++dev->uvc_offset )
+			buf[n] = ( pos < MOCK_UVC_HEADER ) ? hdr[pos] : (unsigned char)(start + pos - MOCK_UVC_HEADER);
+		if ( pos < plen )
+		   break;
+
+		if ( eof ) {
+		   ++dev->uvc_frame;
+		   dev->uvc_offset = 0;
+		}
+		if ( plen % MOCK_MAX_PACKET )
+		   break;
+	}
+	return n;
+}
+
+/* Move loopback data for transfers waiting on the FIFO, and UVC data for transfers waiting on a
+   commit, in submission order. */
+static void mock_progress_locked(unsigned long long now)
+{
+	struct mock_xfer *mx;
+	struct mock_dev *dev;
+	struct libusb_transfer *xfer;
+	int n, first, pos;
+
+	for ( mx = mock_head; mx != NULL; mx = mx->next ) {
+		if ( mx->due )
+		   continue;
+		dev  = mx->dev;
+		xfer = mx->xfer;
+
+		if ( xfer->endpoint == MOCK_EP_OUT ) {
+		   if ( dev->fifo_count + xfer->length > MOCK_FIFO_SIZE )
+		      continue;
+		   pos = (dev->fifo_head + dev->fifo_count) % MOCK_FIFO_SIZE;
+		   first = MOCK_FIFO_SIZE - pos;
+		   if ( first > xfer->length )
+		      first = xfer->length;
+		   memcpy(dev->fifo + pos, xfer->buffer, first);
+		   memcpy(dev->fifo, xfer->buffer + first, xfer->length - first);
+		   dev->fifo_count += xfer->length;
+		   mx->actual = xfer->length;
+		   mx->due    = mock_schedule_bulk(dev, 0, xfer->length, now);
+		}
+		else if ( ( dev->state == MOCK_UVC ) && ( dev->uvc_streaming ) ) {
+		   mx->actual = mock_uvc_read(dev, xfer->buffer, xfer->length);
+		   mx->due    = mock_schedule_bulk(dev, 1, mx->actual, now);
+		}
+		else if ( dev->fifo_count > 0 ) {
+		   n = ( dev->fifo_count < xfer->length ) ? dev->fifo_count : xfer->length;
+		   first = MOCK_FIFO_SIZE - dev->fifo_head;
+		   if ( first > n )
+		      first = n;
+		   memcpy(xfer->buffer, dev->fifo + dev->fifo_head, first);
+		   memcpy(xfer->buffer + first, dev->fifo, n - first);
+		   dev->fifo_head   = (dev->fifo_head + n) % MOCK_FIFO_SIZE;
+		   dev->fifo_count -= n;
+		   mx->actual = n;
+		   mx->due    = mock_schedule_bulk(dev, 1, n, now);
+		}
+		else if ( ( mx->deadline ) && ( now >= mx->deadline ) ) {
+		   mx->status = LIBUSB_TRANSFER_TIMED_OUT;
+		   mx->due    = now;
+		}
+	}
+}
+
+static int mock_is_bulk(struct libusb_transfer *xfer)
+{
+#ifdef CYUSB_HAVE_BULK_STREAMS
+	if ( xfer->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM )
+	   return 1;
+#endif
+	return ( xfer->type == LIBUSB_TRANSFER_TYPE_BULK );
+}
+
+static int mock_submit_transfer(struct libusb_transfer *xfer)
+{
+	struct mock_dev *dev = mock_device(xfer->dev_handle);
+	struct mock_xfer *mx;
+	unsigned long long now = now_ns();
+	unsigned long long start;
+
+	if ( dev == NULL )
+	   return LIBUSB_ERROR_NO_DEVICE;
+	if ( ( xfer->type != LIBUSB_TRANSFER_TYPE_CONTROL ) && ( !mock_is_bulk(xfer) ) )
+	   return LIBUSB_ERROR_NOT_SUPPORTED;
+	if ( ( mock_is_bulk(xfer) ) && ( !mock_has_endpoint(dev, xfer->endpoint) ) )
+	   return LIBUSB_ERROR_NOT_FOUND;
+#ifdef CYUSB_HAVE_BULK_STREAMS
+	if ( ( xfer->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM ) &&
+	     ( ( libusb_transfer_get_stream_id(xfer) < 1 ) ||
+	       ( libusb_transfer_get_stream_id(xfer) > dev->num_streams[xfer->endpoint >> 7] ) ) )
+	   return LIBUSB_ERROR_INVALID_PARAM;
+#endif
+	if ( ( xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL ) && ( xfer->length < LIBUSB_CONTROL_SETUP_SIZE ) )
+	   return LIBUSB_ERROR_INVALID_PARAM;
+
+	mx = (struct mock_xfer *)calloc(1, sizeof(struct mock_xfer));
+	if ( mx == NULL )
+	   return LIBUSB_ERROR_NO_MEM;
+	mx->xfer     = xfer;
+	mx->dev      = dev;
+	mx->status   = LIBUSB_TRANSFER_COMPLETED;
+	mx->deadline = ( xfer->timeout ) ? now + xfer->timeout * 1000000ULL : 0;
+
+	pthread_mutex_lock(&mock_lock);
+
+	/* EP0 requests take effect in submission order, as the device processes them. */
+	if ( xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL ) {
+	   mx->status = mock_control_locked(dev, xfer, &mx->actual, now);
+	   start = ( dev->ep0_free > now ) ? dev->ep0_free : now;
+	   dev->ep0_free = start + mock_latency_ns;
+	   mx->due = dev->ep0_free;
+	}
+	else if ( ( dev->state == MOCK_BULK ) && ( !mock_loopback ) ) {
+	   /* Source/sink firmware: IN data is always available, OUT data is discarded. */
+	   if ( xfer->endpoint == MOCK_EP_IN )
+	      memset(xfer->buffer, 0xAA, xfer->length);
+	   mx->actual = xfer->length;
+	   mx->due    = mock_schedule_bulk(dev, ( xfer->endpoint == MOCK_EP_IN ), xfer->length, now);
+	}
+
+	if ( mock_tail != NULL )
+	   mock_tail->next = mx;
+	else mock_head = mx;
+	mock_tail = mx;
+
+	if ( mx->due == 0 )
+	   mock_progress_locked(now);
+	pthread_cond_broadcast(&mock_cond);
+	pthread_mutex_unlock(&mock_lock);
+	return 0;
+}
+
+static int mock_cancel_transfer(struct libusb_transfer *xfer)
+{
+	struct mock_xfer *mx;
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	pthread_mutex_lock(&mock_lock);
+	for ( mx = mock_head; mx != NULL; mx = mx->next ) {
+		if ( ( mx->xfer == xfer ) && ( mx->status != LIBUSB_TRANSFER_CANCELLED ) ) {
+		   mx->status = LIBUSB_TRANSFER_CANCELLED;
+		   mx->actual = 0;
+		   mx->due    = now_ns();
+		   r = 0;
+		   break;
+		}
+	}
+	pthread_cond_broadcast(&mock_cond);
+	pthread_mutex_unlock(&mock_lock);
+	return r;
+}
+
+/* Unlink every transfer that is due, keeping submission order. Must be called with the lock held. */
+static struct mock_xfer * mock_take_due_locked(unsigned long long now)
+{
+	struct mock_xfer *mx, *prev = NULL, *next;
+	struct mock_xfer *done = NULL, *done_tail = NULL;
+
+	for ( mx = mock_head; mx != NULL; mx = next ) {
+		next = mx->next;
+		if ( ( mx->due == 0 ) || ( mx->due > now ) ) {
+		   prev = mx;
+		   continue;
+		}
+		if ( prev != NULL )
+		   prev->next = next;
+		else mock_head = next;
+		if ( mock_tail == mx )
+		   mock_tail = prev;
+
+		mx->next = NULL;
+		if ( done_tail != NULL )
+		   done_tail->next = mx;
+		else done = mx;
+		done_tail = mx;
+	}
+	return done;
+}
+
+static void mock_complete(struct mock_xfer *mx)
+{
+	struct libusb_transfer *xfer = mx->xfer;
+
+	xfer->status        = mx->status;
+	xfer->actual_length = mx->actual;
+	if ( ( xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL ) && ( mx->status == LIBUSB_TRANSFER_COMPLETED ) &&
+	     ( mx->actual < xfer->length - LIBUSB_CONTROL_SETUP_SIZE ) &&
+	     ( xfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK ) )
+	   xfer->status = LIBUSB_TRANSFER_ERROR;
+	else if ( ( mock_is_bulk(xfer) ) && ( mx->status == LIBUSB_TRANSFER_COMPLETED ) &&
+		  ( mx->actual < xfer->length ) && ( xfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK ) )
+	   xfer->status = LIBUSB_TRANSFER_ERROR;
+	free(mx);
+
+	if ( xfer->callback )
+	   xfer->callback(xfer);
+	if ( xfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER )
+	   libusb_free_transfer(xfer);
+}
+
+/* Same contract as libusb_handle_events_timeout_completed(): completion callbacks run in the
+   calling thread, and only one thread runs them at a time. */
+static int mock_handle_events(struct timeval *tv, int *completed)
+{
+	struct mock_xfer *done, *next, *mx;
+	struct timespec ts;
+	unsigned long long now = now_ns();
+	unsigned long long end, wake;
+	unsigned int seq;
+
+	end = now + (unsigned long long)tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+
+	pthread_mutex_lock(&mock_lock);
+	seq = mock_interrupt_seq;
+	while ( 1 ) {
+		if ( ( ( completed != NULL ) && ( *completed ) ) || ( seq != mock_interrupt_seq ) )
+		   break;
+
+		now = now_ns();
+		if ( !mock_handler_active ) {
+		   mock_progress_locked(now);
+		   done = mock_take_due_locked(now);
+		   if ( done != NULL ) {
+		      mock_handler_active = 1;
+		      pthread_mutex_unlock(&mock_lock);
+		      for ( ; done != NULL; done = next ) {
+			      next = done->next;
+			      mock_complete(done);
+		      }
+		      pthread_mutex_lock(&mock_lock);
+		      mock_handler_active = 0;
+		      pthread_cond_broadcast(&mock_cond);
+		      break;
+		   }
+		}
+		if ( now >= end )
+		   break;
+
+		/* Sleep until the next transfer is due or times out, or something is submitted. */
+		wake = end;
+		for ( mx = mock_head; mx != NULL; mx = mx->next ) {
+			if ( ( mx->due ) && ( mx->due < wake ) )
+			   wake = mx->due;
+			else if ( ( !mx->due ) && ( mx->deadline ) && ( mx->deadline < wake ) )
+			   wake = mx->deadline;
+		}
+		ts.tv_sec  = wake / 1000000000ULL;
+		ts.tv_nsec = wake % 1000000000ULL;
+		pthread_cond_timedwait(&mock_cond, &mock_lock, &ts);
+	}
+	pthread_mutex_unlock(&mock_lock);
+	return 0;
+}
+
+static void mock_interrupt_events(void)
+{
+	pthread_mutex_lock(&mock_lock);
+	++mock_interrupt_seq;
+	pthread_cond_broadcast(&mock_cond);
+	pthread_mutex_unlock(&mock_lock);
+}
+
+#ifdef CYUSB_HAVE_BULK_STREAMS
+/* The source/sink firmware serves every stream from the same pattern, so streams only need to be
+   tracked for validation. Loopback has a single FIFO and does not support them. */
+static int mock_alloc_streams(cyusb_handle *h, unsigned int num_streams, unsigned char *endpoints,
+		int num_endpoints)
+{
+	struct mock_dev *dev = mock_device(h);
+	int i;
+
+	if ( dev == NULL )
+	   return LIBUSB_ERROR_NO_DEVICE;
+	if ( ( dev->state != MOCK_BULK ) || ( mock_loopback ) )
+	   return LIBUSB_ERROR_NOT_SUPPORTED;
+	if ( ( num_streams < 1 ) || ( num_endpoints < 1 ) )
+	   return LIBUSB_ERROR_INVALID_PARAM;
+	for ( i = 0; i < num_endpoints; ++i ) {
+		if ( ( endpoints[i] != MOCK_EP_OUT ) && ( endpoints[i] != MOCK_EP_IN ) )
+		   return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	if ( num_streams > MOCK_MAX_STREAMS )
+	   num_streams = MOCK_MAX_STREAMS;
+	pthread_mutex_lock(&mock_lock);
+	for ( i = 0; i < num_endpoints; ++i )
+		dev->num_streams[endpoints[i] >> 7] = num_streams;
+	pthread_mutex_unlock(&mock_lock);
+	return num_streams;
+}
+
+static int mock_free_streams(cyusb_handle *h, unsigned char *endpoints, int num_endpoints)
+{
+	struct mock_dev *dev = mock_device(h);
+	int i;
+
+	if ( dev == NULL )
+	   return LIBUSB_ERROR_NO_DEVICE;
+	pthread_mutex_lock(&mock_lock);
+	for ( i = 0; i < num_endpoints; ++i )
+		dev->num_streams[endpoints[i] >> 7] = 0;
+	pthread_mutex_unlock(&mock_lock);
+	return 0;
+}
+#endif
+
+static void mock_sync_cb(struct libusb_transfer *xfer)
+{
+	*(int *)xfer->user_data = 1;
+}
+
+/* Run one transfer to completion, handling events in the calling thread. */
+static int mock_sync_transfer(struct libusb_transfer *xfer)
+{
+	volatile int completed = 0;
+	struct timeval tv;
+	int r;
+
+	xfer->user_data = (void *)&completed;
+	xfer->callback  = mock_sync_cb;
+	r = mock_submit_transfer(xfer);
+	if ( r )
+	   return r;
+
+	while ( !completed ) {
+		tv.tv_sec  = 1;
+		tv.tv_usec = 0;
+		mock_handle_events(&tv, (int *)&completed);
+	}
+	return ( cyusb_transfer_status_to_error(xfer->status) );
+}
+
+static int mock_control_transfer(cyusb_handle *h, uint8_t bmRequestType, uint8_t bRequest,
+		uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength,
+		unsigned int timeout)
+{
+	struct libusb_transfer *xfer;
+	unsigned char *buf;
+	int r;
+
+	xfer = libusb_alloc_transfer(0);
+	buf  = (unsigned char *)malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
+	if ( ( xfer == NULL ) || ( buf == NULL ) ) {
+	   libusb_free_transfer(xfer);
+	   free(buf);
+	   return LIBUSB_ERROR_NO_MEM;
+	}
+
+	libusb_fill_control_setup(buf, bmRequestType, bRequest, wValue, wIndex, wLength);
+	if ( ( (bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT ) && ( wLength ) )
+	   memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+	libusb_fill_control_transfer(xfer, h, buf, NULL, NULL, timeout);
+
+	r = mock_sync_transfer(xfer);
+	if ( r == 0 ) {
+	   r = xfer->actual_length;
+	   if ( (bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN )
+	      memcpy(data, buf + LIBUSB_CONTROL_SETUP_SIZE, r);
+	}
+
+	libusb_free_transfer(xfer);
+	free(buf);
+	return r;
+}
+
+static int mock_bulk_transfer(cyusb_handle *h, unsigned char endpoint, unsigned char *data, int length,
+		int *transferred, unsigned int timeout)
+{
+	struct libusb_transfer *xfer;
+	int r;
+
+	*transferred = 0;
+	xfer = libusb_alloc_transfer(0);
+	if ( xfer == NULL )
+	   return LIBUSB_ERROR_NO_MEM;
+
+	libusb_fill_bulk_transfer(xfer, h, endpoint, data, length, NULL, NULL, timeout);
+	r = mock_sync_transfer(xfer);
+	*transferred = xfer->actual_length;
+
+	libusb_free_transfer(xfer);
+	return r;
+}
+
+static int mock_interrupt_transfer(cyusb_handle *h, unsigned char endpoint, unsigned char *data,
+		int length, int *transferred, unsigned int timeout)
+{
+	*transferred = 0;
+	return ( mock_device(h) == NULL ) ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_NOT_FOUND;
+}
+
+const struct cyusb_backend cyusb_mock_backend = {
+	"mock",
+	mock_init,
+	mock_exit,
+	mock_open_devices,
+	mock_open_vid_pid,
+	mock_close,
+	mock_get_device,
+	mock_get_device_descriptor,
+	mock_get_active_config_descriptor,
+	mock_get_config_descriptor,
+	mock_get_config_descriptor_by_value,
+	mock_free_config_descriptor,
+	mock_get_string_descriptor_ascii,
+	mock_get_descriptor,
+	mock_get_string_descriptor,
+	mock_get_bus_number,
+	mock_get_device_address,
+	mock_get_max_packet_size,
+	mock_get_max_iso_packet_size,
+	mock_get_configuration,
+	mock_set_configuration,
+	mock_interface_op,
+	mock_interface_op,
+	mock_set_interface_alt_setting,
+	mock_clear_halt,
+	mock_device_op,
+	mock_kernel_driver_active,
+	mock_interface_op,
+	mock_interface_op,
+	mock_control_transfer,
+	mock_bulk_transfer,
+	mock_interrupt_transfer,
+	mock_submit_transfer,
+	mock_cancel_transfer,
+	mock_handle_events,
+	mock_interrupt_events,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+#ifdef CYUSB_HAVE_BULK_STREAMS
+	mock_alloc_streams,
+	mock_free_streams,
+#else
+	NULL,
+	NULL,
+#endif
+	0
+};
@@ -0,0 +1,665 @@
+/*
+ * Filename             : cyusb_pattern.c
+ * Description          : Test data patterns for libcyusb. Generates and verifies constant,
+ *                        counter, PRBS-31 and LFSR data with SSE2 and AVX2 code paths chosen
+ *                        at run time, and a portable fallback. Verification is position
+ *                        independent: every buffer is checked against its own contents, so
+ *                        buffers can be checked in any order and from any point of the stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PATTERN_X86
+#include <immintrin.h>
+#endif
+
+/* Galois LFSR taps for x^32 + x^22 + x^2 + x + 1, a maximal length polynomial. */
+#define LFSR32_TAPS		(0x80200003u)
+
+/* PRBS-31 is x^31 + x^28 + 1: bit n of the stream is bit n-31 XOR bit n-28. Raised to the 8th
+   power the polynomial is x^248 + x^224 + 1, so byte n is also byte n-31 XOR byte n-28, which
+   lets whole vectors be generated and checked with plain byte loads. */
+#define PRBS_LAG_LONG		(31)
+#define PRBS_LAG_SHORT		(28)
+
+/* Code path for one instruction set. Checks return the offset of the first bad byte, or -1. */
+struct pattern_isa {
+	const char *name;
+	long long (*check_constant)(const unsigned char *buf, size_t len, unsigned char value);
+	long long (*check_counter8)(const unsigned char *buf, size_t len);
+	long long (*check_counter32)(const unsigned char *buf, size_t len);
+	long long (*check_lfsr32)(const unsigned char *buf, size_t len);
+	long long (*check_prbs31)(const unsigned char *buf, size_t len);
+	void (*fill_counter8)(unsigned char *buf, size_t len, unsigned char first);
+	unsigned int (*fill_counter32)(unsigned char *buf, size_t words, unsigned int first);
+	unsigned int (*fill_lfsr32)(unsigned char *buf, size_t words, unsigned int first);
+	void (*fill_prbs31)(unsigned char *buf, size_t len, const unsigned char *history);
+};
+
+static const char *pattern_names[] = { "const", "count8", "count32", "prbs31", "lfsr32" };
+
+static unsigned int get_le32(const unsigned char *p)
+{
+	return ( p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24) );
+}
+
+static void put_le32(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = v >> 24;
+}
+
+static unsigned int lfsr32_step(unsigned int w)
+{
+	return ( (w >> 1) ^ ((0u - (w & 1)) & LFSR32_TAPS) );
+}
+
+static unsigned int next_word(int type, unsigned int w)
+{
+	return ( type == CYUSB_PATTERN_LFSR32 ) ? lfsr32_step(w) : w + 1;
+}
+
+/* Portable code. The checks take the offset to start from, so that the vector code can hand
+   over the rest of a buffer at the first vector that does not match. */
+
+static long long scan_constant(const unsigned char *buf, size_t start, size_t len, unsigned char value)
+{
+	size_t i;
+
+	for ( i = start; i < len; ++i ) {
+		if ( buf[i] != value )
+		   return i;
+	}
+	return -1;
+}
+
+static long long scan_counter8(const unsigned char *buf, size_t start, size_t len)
+{
+	size_t i;
+
+	for ( i = ( start ) ? start : 1; i < len; ++i ) {
+		if ( buf[i] != (unsigned char)(buf[i - 1] + 1) )
+		   return i;
+	}
+	return -1;
+}
+
+static long long scan_words(const unsigned char *buf, size_t start, size_t len, int type)
+{
+	unsigned char e[4];
+	size_t i, j;
+
+	start &= ~(size_t)3;
+	for ( i = ( start ) ? start : 4; i < len; i += 4 ) {
+		put_le32(e, next_word(type, get_le32(buf + i - 4)));
+		for ( j = 0; ( j < 4 ) && ( i + j < len ); ++j ) {
+			if ( buf[i + j] != e[j] )
+			   return i + j;
+		}
+	}
+	return -1;
+}
+
+static long long scan_prbs31(const unsigned char *buf, size_t start, size_t len)
+{
+	size_t i;
+
+	for ( i = ( start > PRBS_LAG_LONG ) ? start : PRBS_LAG_LONG; i < len; ++i ) {
+		if ( buf[i] != (buf[i - PRBS_LAG_LONG] ^ buf[i - PRBS_LAG_SHORT]) )
+		   return i;
+	}
+	return -1;
+}
+
+static long long check_constant_c(const unsigned char *buf, size_t len, unsigned char value)
+{
+	return ( scan_constant(buf, 0, len, value) );
+}
+
+static long long check_counter8_c(const unsigned char *buf, size_t len)
+{
+	return ( scan_counter8(buf, 0, len) );
+}
+
+static long long check_counter32_c(const unsigned char *buf, size_t len)
+{
+	return ( scan_words(buf, 0, len, CYUSB_PATTERN_COUNTER32) );
+}
+
+static long long check_lfsr32_c(const unsigned char *buf, size_t len)
+{
+	return ( scan_words(buf, 0, len, CYUSB_PATTERN_LFSR32) );
+}
+
+static long long check_prbs31_c(const unsigned char *buf, size_t len)
+{
+	return ( scan_prbs31(buf, 0, len) );
+}
+
+static void fill_counter8_c(unsigned char *buf, size_t len, unsigned char first)
+{
+	size_t i;
+
+	for ( i = 0; i < len; ++i )
+		buf[i] = first++;
+}
+
+static unsigned int fill_counter32_c(unsigned char *buf, size_t words, unsigned int first)
+{
+	size_t i;
+
+	for ( i = 0; i < words; ++i )
+		put_le32(buf + 4 * i, first++);
+	return first;
+}
+
+static unsigned int fill_lfsr32_c(unsigned char *buf, size_t words, unsigned int first)
+{
+	size_t i;
+
+	for ( i = 0; i < words; ++i ) {
+		put_le32(buf + 4 * i, first);
+		first = lfsr32_step(first);
+	}
+	return first;
+}
+
+/* Continue a PRBS-31 stream whose last 31 bytes are in history. */
+static void fill_prbs31_c(unsigned char *buf, size_t len, const unsigned char *history)
+{
+	size_t i;
+
+	for ( i = 0; ( i < PRBS_LAG_LONG ) && ( i < len ); ++i )
+		buf[i] = history[i] ^ ( ( i >= PRBS_LAG_SHORT ) ? buf[i - PRBS_LAG_SHORT] :
+				history[i + PRBS_LAG_LONG - PRBS_LAG_SHORT] );
+	for ( ; i < len; ++i )
+		buf[i] = buf[i - PRBS_LAG_LONG] ^ buf[i - PRBS_LAG_SHORT];
+}
+
+static const struct pattern_isa isa_scalar = {
+	"scalar",
+	check_constant_c,
+	check_counter8_c,
+	check_counter32_c,
+	check_lfsr32_c,
+	check_prbs31_c,
+	fill_counter8_c,
+	fill_counter32_c,
+	fill_lfsr32_c,
+	fill_prbs31_c
+};
+
+#ifdef PATTERN_X86
+
+/* SSE2. Each loop stops at the first vector that does not match, and the portable code finds
+   the exact offset from there. */
+
+__attribute__((target("sse2")))
+static long long check_constant_sse2(const unsigned char *buf, size_t len, unsigned char value)
+{
+	__m128i v = _mm_set1_epi8((char)value);
+	__m128i d;
+	size_t i;
+
+	for ( i = 0; i + 16 <= len; i += 16 ) {
+		d = _mm_loadu_si128((const __m128i *)(buf + i));
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi8(d, v)) != 0xFFFF )
+		   break;
+	}
+	return ( scan_constant(buf, i, len, value) );
+}
+
+__attribute__((target("sse2")))
+static long long check_counter8_sse2(const unsigned char *buf, size_t len)
+{
+	__m128i one = _mm_set1_epi8(1);
+	__m128i a, b;
+	size_t i;
+
+	for ( i = 1; i + 16 <= len; i += 16 ) {
+		a = _mm_loadu_si128((const __m128i *)(buf + i - 1));
+		b = _mm_loadu_si128((const __m128i *)(buf + i));
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_add_epi8(a, one), b)) != 0xFFFF )
+		   break;
+	}
+	return ( scan_counter8(buf, i, len) );
+}
+
+__attribute__((target("sse2")))
+static long long check_counter32_sse2(const unsigned char *buf, size_t len)
+{
+	__m128i one = _mm_set1_epi32(1);
+	__m128i a, b;
+	size_t i;
+
+	for ( i = 4; i + 16 <= len; i += 16 ) {
+		a = _mm_loadu_si128((const __m128i *)(buf + i - 4));
+		b = _mm_loadu_si128((const __m128i *)(buf + i));
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_add_epi32(a, one), b)) != 0xFFFF )
+		   break;
+	}
+	return ( scan_words(buf, i, len, CYUSB_PATTERN_COUNTER32) );
+}
+
+__attribute__((target("sse2")))
+static __m128i lfsr32_step_sse2(__m128i w)
+{
+	__m128i mask = _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(w, _mm_set1_epi32(1)));
+
+	return ( _mm_xor_si128(_mm_srli_epi32(w, 1), _mm_and_si128(mask, _mm_set1_epi32((int)LFSR32_TAPS))) );
+}
+
+__attribute__((target("sse2")))
+static long long check_lfsr32_sse2(const unsigned char *buf, size_t len)
+{
+	__m128i a, b;
+	size_t i;
+
+	for ( i = 4; i + 16 <= len; i += 16 ) {
+		a = _mm_loadu_si128((const __m128i *)(buf + i - 4));
+		b = _mm_loadu_si128((const __m128i *)(buf + i));
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi8(lfsr32_step_sse2(a), b)) != 0xFFFF )
+		   break;
+	}
+	return ( scan_words(buf, i, len, CYUSB_PATTERN_LFSR32) );
+}
+
+__attribute__((target("sse2")))
+static long long check_prbs31_sse2(const unsigned char *buf, size_t len)
+{
+	__m128i x, d;
+	size_t i;
+
+	for ( i = PRBS_LAG_LONG; i + 16 <= len; i += 16 ) {
+		x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + i - PRBS_LAG_LONG)),
+				_mm_loadu_si128((const __m128i *)(buf + i - PRBS_LAG_SHORT)));
+		d = _mm_loadu_si128((const __m128i *)(buf + i));
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi8(x, d)) != 0xFFFF )
+		   break;
+	}
+	return ( scan_prbs31(buf, i, len) );
+}
+
+__attribute__((target("sse2")))
+static void fill_counter8_sse2(unsigned char *buf, size_t len, unsigned char first)
+{
+	__m128i v = _mm_add_epi8(_mm_set1_epi8((char)first),
+			_mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+	__m128i step = _mm_set1_epi8(16);
+	size_t i;
+
+	for ( i = 0; i + 16 <= len; i += 16 ) {
+		_mm_storeu_si128((__m128i *)(buf + i), v);
+		v = _mm_add_epi8(v, step);
+	}
+	fill_counter8_c(buf + i, len - i, (unsigned char)(first + i));
+}
+
+__attribute__((target("sse2")))
+static unsigned int fill_counter32_sse2(unsigned char *buf, size_t words, unsigned int first)
+{
+	__m128i v = _mm_add_epi32(_mm_set1_epi32((int)first), _mm_setr_epi32(0, 1, 2, 3));
+	__m128i step = _mm_set1_epi32(4);
+	size_t i;
+
+	for ( i = 0; i + 4 <= words; i += 4 ) {
+		_mm_storeu_si128((__m128i *)(buf + 4 * i), v);
+		v = _mm_add_epi32(v, step);
+	}
+	return ( fill_counter32_c(buf + 4 * i, words - i, first + (unsigned int)i) );
+}
+
+/* Four lanes, each four LFSR steps ahead of the lane before it. */
+__attribute__((target("sse2")))
+static unsigned int fill_lfsr32_sse2(unsigned char *buf, size_t words, unsigned int first)
+{
+	unsigned int w1 = lfsr32_step(first);
+	unsigned int w2 = lfsr32_step(w1);
+	unsigned int w3 = lfsr32_step(w2);
+	__m128i v = _mm_setr_epi32((int)first, (int)w1, (int)w2, (int)w3);
+	size_t i;
+
+	for ( i = 0; i + 4 <= words; i += 4 ) {
+		_mm_storeu_si128((__m128i *)(buf + 4 * i), v);
+		v = lfsr32_step_sse2(lfsr32_step_sse2(lfsr32_step_sse2(lfsr32_step_sse2(v))));
+	}
+	return ( fill_lfsr32_c(buf + 4 * i, words - i, (unsigned int)_mm_cvtsi128_si32(v)) );
+}
+
+/* Each vector only depends on bytes at least 28 back, so 16 bytes can be produced at a time. */
+__attribute__((target("sse2")))
+static void fill_prbs31_sse2(unsigned char *buf, size_t len, const unsigned char *history)
+{
+	__m128i x;
+	size_t i;
+
+	if ( len <= PRBS_LAG_LONG ) {
+	   fill_prbs31_c(buf, len, history);
+	   return;
+	}
+	fill_prbs31_c(buf, PRBS_LAG_LONG, history);
+	for ( i = PRBS_LAG_LONG; i + 16 <= len; i += 16 ) {
+		x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + i - PRBS_LAG_LONG)),
+				_mm_loadu_si128((const __m128i *)(buf + i - PRBS_LAG_SHORT)));
+		_mm_storeu_si128((__m128i *)(buf + i), x);
+	}
+	for ( ; i < len; ++i )
+		buf[i] = buf[i - PRBS_LAG_LONG] ^ buf[i - PRBS_LAG_SHORT];
+}
+
+static const struct pattern_isa isa_sse2 = {
+	"sse2",
+	check_constant_sse2,
+	check_counter8_sse2,
+	check_counter32_sse2,
+	check_lfsr32_sse2,
+	check_prbs31_sse2,
+	fill_counter8_sse2,
+	fill_counter32_sse2,
+	fill_lfsr32_sse2,
+	fill_prbs31_sse2
+};
+
+/* AVX2 checks, 32 bytes at a time. Generation is store bound and stays on SSE2. */
+
+__attribute__((target("avx2")))
+static long long check_constant_avx2(const unsigned char *buf, size_t len, unsigned char value)
+{
+	__m256i v = _mm256_set1_epi8((char)value);
+	__m256i d;
+	size_t i;
+
+	for ( i = 0; i + 32 <= len; i += 32 ) {
+		d = _mm256_loadu_si256((const __m256i *)(buf + i));
+		if ( _mm256_movemask_epi8(_mm256_cmpeq_epi8(d, v)) != -1 )
+		   break;
+	}
+	return ( scan_constant(buf, i, len, value) );
+}
+
+__attribute__((target("avx2")))
+static long long check_counter8_avx2(const unsigned char *buf, size_t len)
+{
+	__m256i one = _mm256_set1_epi8(1);
+	__m256i a, b;
+	size_t i;
+
+	for ( i = 1; i + 32 <= len; i += 32 ) {
+		a = _mm256_loadu_si256((const __m256i *)(buf + i - 1));
+		b = _mm256_loadu_si256((const __m256i *)(buf + i));
+		if ( _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_add_epi8(a, one), b)) != -1 )
+		   break;
+	}
+	return ( scan_counter8(buf, i, len) );
+}
+
+__attribute__((target("avx2")))
+static long long check_counter32_avx2(const unsigned char *buf, size_t len)
+{
+	__m256i one = _mm256_set1_epi32(1);
+	__m256i a, b;
+	size_t i;
+
+	for ( i = 4; i + 32 <= len; i += 32 ) {
+		a = _mm256_loadu_si256((const __m256i *)(buf + i - 4));
+		b = _mm256_loadu_si256((const __m256i *)(buf + i));
+		if ( _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_add_epi32(a, one), b)) != -1 )
+		   break;
+	}
+	return ( scan_words(buf, i, len, CYUSB_PATTERN_COUNTER32) );
+}
+
+__attribute__((target("avx2")))
+static long long check_lfsr32_avx2(const unsigned char *buf, size_t len)
+{
+	__m256i lsb  = _mm256_set1_epi32(1);
+	__m256i taps = _mm256_set1_epi32((int)LFSR32_TAPS);
+	__m256i a, b, mask, e;
+	size_t i;
+
+	for ( i = 4; i + 32 <= len; i += 32 ) {
+		a = _mm256_loadu_si256((const __m256i *)(buf + i - 4));
+		b = _mm256_loadu_si256((const __m256i *)(buf + i));
+		mask = _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_and_si256(a, lsb));
+		e = _mm256_xor_si256(_mm256_srli_epi32(a, 1), _mm256_and_si256(mask, taps));
+		if ( _mm256_movemask_epi8(_mm256_cmpeq_epi8(e, b)) != -1 )
+		   break;
+	}
+	return ( scan_words(buf, i, len, CYUSB_PATTERN_LFSR32) );
+}
+
+__attribute__((target("avx2")))
+static long long check_prbs31_avx2(const unsigned char *buf, size_t len)
+{
+	__m256i x, d;
+	size_t i;
+
+	for ( i = PRBS_LAG_LONG; i + 32 <= len; i += 32 ) {
+		x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buf + i - PRBS_LAG_LONG)),
+				_mm256_loadu_si256((const __m256i *)(buf + i - PRBS_LAG_SHORT)));
+		d = _mm256_loadu_si256((const __m256i *)(buf + i));
+		if ( _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, d)) != -1 )
+		   break;
+	}
+	return ( scan_prbs31(buf, i, len) );
+}
+
+static const struct pattern_isa isa_avx2 = {
+	"avx2",
+	check_constant_avx2,
+	check_counter8_avx2,
+	check_counter32_avx2,
+	check_lfsr32_avx2,
+	check_prbs31_avx2,
+	fill_counter8_sse2,
+	fill_counter32_sse2,
+	fill_lfsr32_sse2,
+	fill_prbs31_sse2
+};
+
+#endif
+
+static const struct pattern_isa *isa = &isa_scalar;
+static pthread_once_t isa_once = PTHREAD_ONCE_INIT;
+
+/* Use the widest code path the CPU supports. CYUSB_PATTERN_ISA=scalar or sse2 in the
+   environment selects a narrower one, for comparison. */
+static void select_isa(void)
+{
+	const char *env = getenv("CYUSB_PATTERN_ISA");
+
+#ifdef PATTERN_X86
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("sse2") )
+	   isa = &isa_sse2;
+	if ( __builtin_cpu_supports("avx2") )
+	   isa = &isa_avx2;
+	if ( ( env ) && ( strcmp(env, "sse2") == 0 ) && ( isa == &isa_avx2 ) )
+	   isa = &isa_sse2;
+#endif
+	if ( ( env ) && ( strcmp(env, "scalar") == 0 ) )
+	   isa = &isa_scalar;
+}
+
+static const struct pattern_isa * get_isa(void)
+{
+	pthread_once(&isa_once, select_isa);
+	return isa;
+}
+
+/* Produce the first 31 bytes of a PRBS-31 stream bit by bit from the seed, then run the byte
+   recurrence backwards to find the 31 bytes that precede them. */
+static void prbs31_init(unsigned char *history, unsigned int seed)
+{
+	unsigned char head[PRBS_LAG_LONG];
+	unsigned int state = seed & 0x7FFFFFFF;		// Bits n to n+30, bit n in bit 30
+	int n, j;
+
+	if ( state == 0 )
+	   state = 0x7FFFFFFF;
+
+	memset(head, 0, sizeof(head));
+	for ( n = 0; n < PRBS_LAG_LONG * 8; ++n ) {
+		head[n / 8] |= ((state >> 30) & 1) << (7 - n % 8);
+		state = ((state << 1) | (((state >> 30) ^ (state >> 27)) & 1)) & 0x7FFFFFFF;
+	}
+
+	/* history[j] is byte j-31: byte j-31 = byte j XOR byte j-28. */
+	for ( j = PRBS_LAG_LONG - 1; j >= 0; --j )
+		history[j] = head[j] ^ ( ( j >= PRBS_LAG_SHORT ) ? head[j - PRBS_LAG_SHORT] :
+				history[j + PRBS_LAG_LONG - PRBS_LAG_SHORT] );
+}
+
+/* The byte recurrence also holds for data that is not a PRBS-31 bit stream, so the first 31
+   bytes are checked bit by bit. Together they pin down the rest of the buffer. */
+static long long check_prbs31_head(const unsigned char *buf, size_t len)
+{
+	size_t nbits = ( ( len < PRBS_LAG_LONG ) ? len : PRBS_LAG_LONG ) * 8;
+	size_t n;
+	int zero = 1;
+
+#define PRBS_BIT(k)	((buf[(k) / 8] >> (7 - (k) % 8)) & 1)
+	for ( n = PRBS_LAG_LONG; n < nbits; ++n ) {
+		if ( PRBS_BIT(n) != (PRBS_BIT(n - PRBS_LAG_LONG) ^ PRBS_BIT(n - PRBS_LAG_SHORT)) )
+		   return n / 8;
+	}
+#undef PRBS_BIT
+
+	for ( n = 0; n < nbits / 8; ++n ) {
+		if ( buf[n] )
+		   zero = 0;
+	}
+	/* All zeroes satisfy the recurrence, but never appear in the sequence. */
+	return ( ( zero ) && ( nbits ) ) ? 0 : -1;
+}
+
+int cyusb_pattern_init(struct cyusb_pattern *pat, int type, unsigned int seed)
+{
+	memset(pat, 0, sizeof(struct cyusb_pattern));
+	pat->type = type;
+
+	switch ( type ) {
+		case CYUSB_PATTERN_CONSTANT:
+		case CYUSB_PATTERN_COUNTER8:
+			pat->word = seed & 0xFF;
+			break;
+		case CYUSB_PATTERN_COUNTER32:
+			pat->word = seed;
+			break;
+		case CYUSB_PATTERN_LFSR32:
+			pat->word = ( seed ) ? seed : 1;	// Zero is a fixed point of the LFSR
+			break;
+		case CYUSB_PATTERN_PRBS31:
+			prbs31_init(pat->history, seed);
+			break;
+		default:
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	return 0;
+}
+
+void cyusb_pattern_fill(struct cyusb_pattern *pat, unsigned char *buf, size_t len)
+{
+	const struct pattern_isa *p = get_isa();
+	unsigned char w[4];
+	size_t n, i;
+
+	pat->offset += len;
+	switch ( pat->type ) {
+		case CYUSB_PATTERN_CONSTANT:
+			memset(buf, pat->word, len);
+			break;
+
+		case CYUSB_PATTERN_COUNTER8:
+			p->fill_counter8(buf, len, (unsigned char)pat->word);
+			pat->word = (pat->word + len) & 0xFF;
+			break;
+
+		case CYUSB_PATTERN_COUNTER32:
+		case CYUSB_PATTERN_LFSR32:
+			/* Finish the word left part-written by the last call. */
+			while ( ( pat->phase ) && ( len ) ) {
+				put_le32(w, pat->word);
+				*buf++ = w[pat->phase];
+				--len;
+				if ( ++pat->phase == 4 ) {
+				   pat->phase = 0;
+				   pat->word  = next_word(pat->type, pat->word);
+				}
+			}
+			if ( len == 0 )
+			   break;
+
+			n = len / 4;
+			if ( pat->type == CYUSB_PATTERN_LFSR32 )
+			   pat->word = p->fill_lfsr32(buf, n, pat->word);
+			else pat->word = p->fill_counter32(buf, n, pat->word);
+
+			put_le32(w, pat->word);
+			for ( i = 0; i < len % 4; ++i )
+				buf[4 * n + i] = w[i];
+			pat->phase = len % 4;
+			break;
+
+		case CYUSB_PATTERN_PRBS31:
+			p->fill_prbs31(buf, len, pat->history);
+			if ( len >= PRBS_LAG_LONG )
+			   memcpy(pat->history, buf + len - PRBS_LAG_LONG, PRBS_LAG_LONG);
+			else {
+			   memmove(pat->history, pat->history + len, PRBS_LAG_LONG - len);
+			   memcpy(pat->history + PRBS_LAG_LONG - len, buf, len);
+			}
+			break;
+	}
+}
+
+long long cyusb_pattern_check(int type, unsigned int seed, const unsigned char *buf, size_t len)
+{
+	const struct pattern_isa *p = get_isa();
+	long long r;
+
+	switch ( type ) {
+		case CYUSB_PATTERN_CONSTANT:
+			return ( p->check_constant(buf, len, (unsigned char)seed) );
+		case CYUSB_PATTERN_COUNTER8:
+			return ( p->check_counter8(buf, len) );
+		case CYUSB_PATTERN_COUNTER32:
+			return ( p->check_counter32(buf, len) );
+		case CYUSB_PATTERN_LFSR32:
+			if ( ( len >= 4 ) && ( get_le32(buf) == 0 ) )
+			   return 0;
+			return ( p->check_lfsr32(buf, len) );
+		case CYUSB_PATTERN_PRBS31:
+			r = check_prbs31_head(buf, len);
+			if ( r >= 0 )
+			   return r;
+			return ( p->check_prbs31(buf, len) );
+		default:
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+}
+
+int cyusb_pattern_from_name(const char *name)
+{
+	int i;
+
+	for ( i = 0; i < (int)(sizeof(pattern_names) / sizeof(pattern_names[0])); ++i ) {
+		if ( strcmp(name, pattern_names[i]) == 0 )
+		   return i;
+	}
+	return LIBUSB_ERROR_INVALID_PARAM;
+}
+
+const char * cyusb_pattern_isa(void)
+{
+	return ( get_isa()->name );
+}
@@ -0,0 +1,489 @@
+/*
+ * Filename             : cyusb_record.c
+ * Description          : Bulk-to-disk recorder for libcyusb. Completed bulk transfers are copied
+ *                        into a large preallocated ring of blocks, and writer threads drain the
+ *                        ring to disk, so a slow write never stalls the USB queue. Data that
+ *                        finds the ring full is dropped and counted instead of blocking.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		// For O_DIRECT
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Alignment of block buffers, file offsets and write lengths, as required by O_DIRECT. */
+#define REC_ALIGN		(4096)
+
+/* Max. number of files that can have blocks queued or being written at the same time. */
+#define REC_MAX_FILES		(8)
+
+/* Ownership state of each block in the ring. */
+typedef enum {
+	BLOCK_FREE = 0,		// Empty, may be claimed by the producer
+	BLOCK_FILLING,		// Being filled by the producer
+	BLOCK_READY,		// Full, waiting for a writer
+	BLOCK_WRITING		// Being written by a writer thread
+} rec_block_state;
+
+struct rec_block {
+	unsigned char      *data;
+	size_t              length;
+	rec_block_state     state;
+	unsigned int        file_no;
+	unsigned long long  offset;	// Offset of the block within its file
+	int                 last;	// Last block of its file
+};
+
+struct rec_file {
+	int                 in_use;
+	unsigned int        no;
+	int                 fd;
+	int                 failed;	// File could not be opened; its blocks are discarded
+	int                 pending;	// Blocks of this file not yet written
+	int                 sealed;	// Last block of the file has been written
+	unsigned long long  size;
+};
+
+struct cyusb_recorder {
+	struct cyusb_recorder_config  cfg;
+	char                         *path;
+	struct cyusb_stream          *stream;
+
+	pthread_mutex_t               lock;
+	pthread_cond_t                cond;
+	int                           running;
+	int                           stopping;	// Writers exit once the ring is drained
+	int                           num_threads;
+	pthread_t                     writer[CYUSB_RECORD_MAX_WRITERS];
+
+	int                           num_blocks;
+	struct rec_block             *block;
+	int                           write_idx;	// Next block to hand to a writer
+	struct rec_file               file[REC_MAX_FILES];
+
+	/* Producer state, only touched by the thread handling libusb events. */
+	int                           cur;		// Block being filled, or -1
+	int                           fill_idx;		// Next block to claim
+	unsigned int                  file_no;
+	unsigned long long            next_offset;
+	unsigned long long            file_deadline;	// Time (in ms) to rotate the current file
+	int                           in_overrun;
+
+	struct cyusb_recorder_stats   stats;
+};
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ( (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+}
+
+static void make_file_name(struct cyusb_recorder *rec, unsigned int no, char *name, size_t size)
+{
+	if ( strchr(rec->path, '%') != NULL )
+	   snprintf(name, size, rec->path, no);
+	else if ( ( rec->cfg.rotate_bytes ) || ( rec->cfg.rotate_seconds ) )
+	   snprintf(name, size, "%s.%04u", rec->path, no);
+	else snprintf(name, size, "%s", rec->path);
+}
+
+static int open_file(struct cyusb_recorder *rec, unsigned int no)
+{
+	char name[512];
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	int fd = -1;
+
+	make_file_name(rec, no, name, sizeof(name));
+	if ( rec->cfg.flags & CYUSB_RECORD_DIRECT ) {
+	   fd = open(name, flags | O_DIRECT, 0644);
+	   /* Not every file system supports O_DIRECT; fall back to buffered writes. */
+	   if ( ( fd < 0 ) && ( errno == EINVAL ) )
+	      fd = open(name, flags, 0644);
+	}
+	else fd = open(name, flags, 0644);
+
+	if ( fd < 0 )
+	   printf("Library: Error in creating %s: %s\n", name, strerror(errno));
+	return fd;
+}
+
+/* Claim the next block of the ring for the producer. Fails if the writers have not yet freed it,
+   or if too many files are still being written. Must be called with the lock held. */
+static int claim_block_locked(struct cyusb_recorder *rec)
+{
+	struct rec_block *b = &rec->block[rec->fill_idx];
+	struct rec_file *f = &rec->file[rec->file_no % REC_MAX_FILES];
+	int used;
+
+	if ( b->state != BLOCK_FREE )
+	   return -1;
+
+	if ( ( f->in_use ) && ( f->no != rec->file_no ) )
+	   return -1;
+	if ( !f->in_use ) {
+	   memset(f, 0, sizeof(struct rec_file));
+	   f->in_use = 1;
+	   f->no     = rec->file_no;
+	   f->fd     = -1;
+	   ++rec->stats.files;
+	}
+	++f->pending;
+
+	b->state   = BLOCK_FILLING;
+	b->length  = 0;
+	b->file_no = rec->file_no;
+	b->offset  = rec->next_offset;
+	b->last    = 0;
+	if ( rec->next_offset == 0 )
+	   rec->file_deadline = now_ms() + rec->cfg.rotate_seconds * 1000ULL;
+	rec->next_offset += rec->cfg.block_size;
+
+	rec->cur = rec->fill_idx;
+	rec->fill_idx = (rec->fill_idx + 1) % rec->num_blocks;
+
+	used = ++rec->stats.ring_used;
+	if ( used > rec->stats.ring_high_water )
+	   rec->stats.ring_high_water = used;
+	return 0;
+}
+
+/* Hand the current block to the writers. If last is set, the block ends its file and the
+   next block starts a new one; an empty block is queued if required to carry the flag.
+   Must be called with the lock held. */
+static int finish_block_locked(struct cyusb_recorder *rec, int last)
+{
+	struct rec_block *b;
+
+	if ( rec->cur < 0 ) {
+	   if ( ( !last ) || ( rec->next_offset == 0 ) )
+	      return 0;
+	   if ( claim_block_locked(rec) )
+	      return -1;
+	}
+
+	b = &rec->block[rec->cur];
+	b->state = BLOCK_READY;
+	b->last  = last;
+	rec->cur = -1;
+	pthread_cond_signal(&rec->cond);
+
+	if ( last ) {
+	   ++rec->file_no;
+	   rec->next_offset = 0;
+	}
+	return 0;
+}
+
+static int record_cb(struct cyusb_stream *stream, struct cyusb_stream_buffer *buf, void *user_data)
+{
+	struct cyusb_recorder *rec = (struct cyusb_recorder *)user_data;
+	unsigned char *src = buf->data;
+	struct rec_block *b;
+	size_t left, n;
+	int last;
+
+	pthread_mutex_lock(&rec->lock);
+	if ( buf->status ) {
+	   ++rec->stats.transfer_errors;
+	   rec->stats.last_error = buf->status;
+	   pthread_mutex_unlock(&rec->lock);
+	   return ( buf->status == LIBUSB_ERROR_NO_DEVICE ) ? 0 : buf->length;
+	}
+
+	if ( ( rec->cfg.rotate_seconds ) && ( rec->next_offset ) && ( now_ms() >= rec->file_deadline ) )
+	   finish_block_locked(rec, 1);
+
+	left = buf->actual_length;
+	rec->stats.bytes_received += left;
+	while ( left ) {
+		if ( ( rec->cur < 0 ) && ( claim_block_locked(rec) ) ) {
+		   if ( !rec->in_overrun ) {
+		      ++rec->stats.overruns;
+		      rec->stats.overrun_file   = rec->file_no;
+		      rec->stats.overrun_offset = rec->next_offset;
+		   }
+		   rec->in_overrun = 1;
+		   rec->stats.bytes_dropped += left;
+		   break;
+		}
+		rec->in_overrun = 0;
+
+		b = &rec->block[rec->cur];
+		n = rec->cfg.block_size - b->length;
+		if ( n > left )
+		   n = left;
+
+		/* The block is owned by the producer until it is finished, so copy without the lock. */
+		pthread_mutex_unlock(&rec->lock);
+		memcpy(b->data + b->length, src, n);
+		pthread_mutex_lock(&rec->lock);
+		b->length += n;
+		src  += n;
+		left -= n;
+
+		if ( b->length == rec->cfg.block_size ) {
+		   last = ( ( rec->cfg.rotate_bytes ) &&
+				   ( rec->next_offset + rec->cfg.block_size > rec->cfg.rotate_bytes ) );
+		   finish_block_locked(rec, last);
+		}
+	}
+	pthread_mutex_unlock(&rec->lock);
+
+	return buf->length;
+}
+
+/* Write one block at its offset. For O_DIRECT files the final, partial block of a file is
+   padded to the alignment; the padding is truncated away when the file is closed. */
+static int write_block(struct cyusb_recorder *rec, struct rec_block *b, int fd)
+{
+	size_t len = b->length;
+	size_t done = 0;
+	ssize_t n;
+
+	if ( ( rec->cfg.flags & CYUSB_RECORD_DIRECT ) && ( len % REC_ALIGN ) ) {
+	   memset(b->data + len, 0, REC_ALIGN - len % REC_ALIGN);
+	   len += REC_ALIGN - len % REC_ALIGN;
+	}
+
+	while ( done < len ) {
+		n = pwrite(fd, b->data + done, len - done, b->offset + done);
+		if ( n < 0 ) {
+		   if ( errno == EINTR )
+		      continue;
+		   return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static void *writer_thread_fn(void *arg)
+{
+	struct cyusb_recorder *rec = (struct cyusb_recorder *)arg;
+	struct rec_block *b;
+	struct rec_file *f;
+	unsigned long long size;
+	int fd, close_fd;
+	int r;
+
+	pthread_mutex_lock(&rec->lock);
+	while ( 1 ) {
+		b = &rec->block[rec->write_idx];
+		if ( b->state != BLOCK_READY ) {
+		   if ( rec->stopping )
+		      break;
+		   pthread_cond_wait(&rec->cond, &rec->lock);
+		   continue;
+		}
+		b->state = BLOCK_WRITING;
+		rec->write_idx = (rec->write_idx + 1) % rec->num_blocks;
+
+		f = &rec->file[b->file_no % REC_MAX_FILES];
+		if ( ( f->fd < 0 ) && ( !f->failed ) ) {
+		   f->fd = open_file(rec, f->no);
+		   f->failed = ( f->fd < 0 );
+		}
+		fd = f->fd;
+		pthread_mutex_unlock(&rec->lock);
+
+		r = ( ( fd >= 0 ) && ( b->length ) ) ? write_block(rec, b, fd) : 0;
+
+		pthread_mutex_lock(&rec->lock);
+		if ( ( r ) || ( fd < 0 ) ) {
+		   ++rec->stats.write_errors;
+		   rec->stats.last_error = LIBUSB_ERROR_IO;
+		}
+		else {
+		   rec->stats.bytes_written += b->length;
+		   if ( b->offset + b->length > f->size )
+		      f->size = b->offset + b->length;
+		}
+		if ( b->last )
+		   f->sealed = 1;
+		--f->pending;
+		close_fd = -1;
+		if ( ( f->sealed ) && ( f->pending == 0 ) ) {
+		   close_fd  = f->fd;
+		   size      = f->size;
+		   f->in_use = 0;
+		}
+		b->state = BLOCK_FREE;
+		--rec->stats.ring_used;
+		pthread_cond_broadcast(&rec->cond);
+
+		if ( close_fd >= 0 ) {
+		   pthread_mutex_unlock(&rec->lock);
+		   if ( ftruncate(close_fd, size) != 0 )
+		      printf("Library: Error in truncating recorded file: %s\n", strerror(errno));
+		   close(close_fd);
+		   pthread_mutex_lock(&rec->lock);
+		}
+	}
+	pthread_mutex_unlock(&rec->lock);
+	return NULL;
+}
+
+struct cyusb_recorder * cyusb_recorder_create(cyusb_handle *h, const struct cyusb_recorder_config *cfg)
+{
+	struct cyusb_recorder *rec;
+	void *mem;
+	int i;
+
+	if ( ( h == NULL ) || ( cfg == NULL ) || ( cfg->path == NULL ) ||
+	     ( !(cfg->endpoint & LIBUSB_ENDPOINT_IN) ) || ( cfg->num_blocks < 2 ) ||
+	     ( cfg->num_writers < 1 ) || ( cfg->num_writers > CYUSB_RECORD_MAX_WRITERS ) )
+	   return NULL;
+
+	rec = (struct cyusb_recorder *)calloc(1, sizeof(struct cyusb_recorder));
+	if ( rec == NULL )
+	   return NULL;
+
+	rec->cfg = *cfg;
+	rec->cfg.block_size = (rec->cfg.block_size + REC_ALIGN - 1) & ~((size_t)REC_ALIGN - 1);
+	if ( rec->cfg.block_size == 0 )
+	   rec->cfg.block_size = REC_ALIGN;
+	if ( rec->cfg.rotate_bytes ) {
+	   rec->cfg.rotate_bytes += rec->cfg.block_size - 1;
+	   rec->cfg.rotate_bytes -= rec->cfg.rotate_bytes % rec->cfg.block_size;
+	}
+	rec->path       = strdup(cfg->path);
+	rec->cfg.path   = rec->path;
+	rec->num_blocks = cfg->num_blocks;
+	rec->cur        = -1;
+	pthread_mutex_init(&rec->lock, NULL);
+	pthread_cond_init(&rec->cond, NULL);
+
+	/* The whole ring is allocated and touched here, so that recording never faults in pages. */
+	rec->block = (struct rec_block *)calloc(rec->num_blocks, sizeof(struct rec_block));
+	if ( ( rec->path == NULL ) || ( rec->block == NULL ) ) {
+	   cyusb_recorder_destroy(rec);
+	   return NULL;
+	}
+	for ( i = 0; i < rec->num_blocks; ++i ) {
+		if ( posix_memalign(&mem, REC_ALIGN, rec->cfg.block_size) ) {
+		   cyusb_recorder_destroy(rec);
+		   return NULL;
+		}
+		memset(mem, 0, rec->cfg.block_size);
+		rec->block[i].data = (unsigned char *)mem;
+	}
+
+	rec->stream = cyusb_stream_create(h, cfg->endpoint, cfg->num_xfers, cfg->xfer_size, 0,
+			record_cb, rec);
+	if ( rec->stream == NULL ) {
+	   cyusb_recorder_destroy(rec);
+	   return NULL;
+	}
+
+	return rec;
+}
+
+int cyusb_recorder_start(struct cyusb_recorder *rec)
+{
+	int i;
+	int r;
+
+	if ( rec->running )
+	   return LIBUSB_ERROR_BUSY;
+
+	memset(&rec->stats, 0, sizeof(rec->stats));
+	rec->stopping    = 0;
+	rec->cur         = -1;
+	rec->fill_idx    = 0;
+	rec->write_idx   = 0;
+	rec->next_offset = 0;
+	rec->in_overrun  = 0;
+
+	for ( i = 0; i < rec->cfg.num_writers; ++i ) {
+		r = pthread_create(&rec->writer[i], NULL, writer_thread_fn, rec);
+		if ( r ) {
+		   printf("Library: Error in creating writer thread: %s\n", strerror(r));
+		   rec->running = 1;
+		   cyusb_recorder_stop(rec);
+		   return LIBUSB_ERROR_OTHER;
+		}
+		++rec->num_threads;
+	}
+
+	rec->running = 1;
+	r = cyusb_stream_start(rec->stream);
+	if ( r )
+	   cyusb_recorder_stop(rec);
+	return r;
+}
+
+int cyusb_recorder_stop(struct cyusb_recorder *rec)
+{
+	int i;
+
+	if ( !rec->running )
+	   return 0;
+
+	cyusb_stream_stop(rec->stream);
+
+	/* Flush the partial block and close the current file, waiting for space if required. */
+	pthread_mutex_lock(&rec->lock);
+	while ( ( rec->num_threads ) && ( finish_block_locked(rec, 1) ) )
+		pthread_cond_wait(&rec->cond, &rec->lock);
+	rec->stopping = 1;
+	pthread_cond_broadcast(&rec->cond);
+	pthread_mutex_unlock(&rec->lock);
+
+	for ( i = 0; i < rec->num_threads; ++i )
+		pthread_join(rec->writer[i], NULL);
+	rec->num_threads = 0;
+
+	/* Close anything left behind by a failed start. */
+	for ( i = 0; i < REC_MAX_FILES; ++i ) {
+		if ( ( rec->file[i].in_use ) && ( rec->file[i].fd >= 0 ) )
+		   close(rec->file[i].fd);
+		rec->file[i].in_use = 0;
+	}
+	for ( i = 0; i < rec->num_blocks; ++i )
+		rec->block[i].state = BLOCK_FREE;
+	rec->stats.ring_used = 0;
+
+	rec->running = 0;
+	return rec->stats.last_error;
+}
+
+void cyusb_recorder_get_stats(struct cyusb_recorder *rec, struct cyusb_recorder_stats *stats)
+{
+	pthread_mutex_lock(&rec->lock);
+	*stats = rec->stats;
+	pthread_mutex_unlock(&rec->lock);
+}
+
+void cyusb_recorder_destroy(struct cyusb_recorder *rec)
+{
+	int i;
+
+	if ( rec == NULL )
+	   return;
+
+	cyusb_recorder_stop(rec);
+	cyusb_stream_destroy(rec->stream);
+	if ( rec->block ) {
+	   for ( i = 0; i < rec->num_blocks; ++i )
+		   free(rec->block[i].data);
+	   free(rec->block);
+	}
+	free(rec->path);
+	pthread_cond_destroy(&rec->cond);
+	pthread_mutex_destroy(&rec->lock);
+	free(rec);
+}
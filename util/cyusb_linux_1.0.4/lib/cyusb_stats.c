@@ -0,0 +1,445 @@
+/*
+ * Filename             : cyusb_stats.c
+ * Description          : Optional per-handle, per-endpoint transfer statistics for libcyusb. Counters
+ *                        are updated with atomic operations from whichever thread completes a
+ *                        transfer, so they can be read at any time from another thread. The
+ *                        counter blocks are never freed: a device slot released when its handle
+ *                        goes away is zeroed and reused, so a late reader or completion only
+ *                        ever touches valid memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+#include "cyusb_internal.h"
+
+/* Endpoint slots per handle: 16 endpoint numbers in each direction. */
+#define STATS_NUM_EPS		(32)
+
+struct stats_dev {
+	cyusb_handle          *h;
+	unsigned int           used;		/* Bit n set when ep[n] counts transfers of h */
+	struct cyusb_ep_stats *ep[STATS_NUM_EPS];
+};
+
+volatile int cyusb_stats_on;
+
+static struct stats_dev stats_dev[MAXDEVICES];
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ( (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec );
+}
+
+static unsigned long long load(const unsigned long long *p)
+{
+	return ( __atomic_load_n(p, __ATOMIC_RELAXED) );
+}
+
+static void add(unsigned long long *p, unsigned long long v)
+{
+	__atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+}
+
+/* Raise *p to v if it is lower. */
+static void store_max(unsigned long long *p, unsigned long long v)
+{
+	unsigned long long old = load(p);
+
+	while ( ( v > old ) && ( !__atomic_compare_exchange_n(p, &old, v, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED) ) )
+		;
+}
+
+static void store_max_int(int *p, int v)
+{
+	int old = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+	while ( ( v > old ) && ( !__atomic_compare_exchange_n(p, &old, v, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED) ) )
+		;
+}
+
+static int ep_index(unsigned char endpoint)
+{
+	return ( (endpoint & 0x0f) | ((endpoint & LIBUSB_ENDPOINT_IN) ? 0x10 : 0) );
+}
+
+/* Return the counters of an endpoint, creating them on first use. Returns NULL when every
+   device slot is taken or memory runs out; the transfer then goes uncounted. A block left
+   over from an earlier owner of the slot is reused. */
+static struct cyusb_ep_stats * get_ep(cyusb_handle *h, unsigned char endpoint, int create)
+{
+	struct stats_dev *d = NULL;
+	struct cyusb_ep_stats *ep, *expected;
+	cyusb_handle *owner;
+	int i;
+
+	for ( i = 0; i < MAXDEVICES; ++i ) {
+		owner = __atomic_load_n(&stats_dev[i].h, __ATOMIC_ACQUIRE);
+		if ( owner == h ) {
+		   d = &stats_dev[i];
+		   break;
+		}
+		if ( owner == NULL ) {
+		   if ( !create )
+		      return NULL;
+		   if ( ( __atomic_compare_exchange_n(&stats_dev[i].h, &owner, h, 0, __ATOMIC_ACQ_REL,
+						   __ATOMIC_ACQUIRE) ) || ( owner == h ) ) {
+		      d = &stats_dev[i];
+		      break;
+		   }
+		}
+	}
+	if ( d == NULL )
+	   return NULL;
+
+	i = ep_index(endpoint);
+	if ( !create )
+	   return ( ( __atomic_load_n(&d->used, __ATOMIC_ACQUIRE) & (1U << i) ) ?
+			   __atomic_load_n(&d->ep[i], __ATOMIC_ACQUIRE) : NULL );
+
+	ep = __atomic_load_n(&d->ep[i], __ATOMIC_ACQUIRE);
+	if ( ep == NULL ) {
+	   ep = (struct cyusb_ep_stats *)calloc(1, sizeof(struct cyusb_ep_stats));
+	   if ( ep == NULL )
+	      return NULL;
+	   ep->endpoint = endpoint;
+	   expected = NULL;
+	   if ( !__atomic_compare_exchange_n(&d->ep[i], &expected, ep, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+	      free(ep);
+	      ep = expected;
+	   }
+	}
+	__atomic_fetch_or(&d->used, 1U << i, __ATOMIC_ACQ_REL);
+	return ep;
+}
+
+/* Zero the counters of an endpoint. in_flight tracks live transfers and is only cleared
+   when the slot is released. */
+static void zero_ep(struct cyusb_ep_stats *ep, int in_flight)
+{
+	int k;
+
+	__atomic_store_n(&ep->transfers, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ep->bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ep->errors, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ep->short_packets, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ep->timeouts, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ep->max_in_flight, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ep->latency_total_us, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ep->latency_max_us, 0, __ATOMIC_RELAXED);
+	for ( k = 0; k < CYUSB_STATS_ERROR_CODES; ++k )
+		__atomic_store_n(&ep->error_codes[k], 0, __ATOMIC_RELAXED);
+	for ( k = 0; k < CYUSB_STATS_LATENCY_BUCKETS; ++k )
+		__atomic_store_n(&ep->latency[k], 0, __ATOMIC_RELAXED);
+	if ( in_flight )
+	   __atomic_store_n(&ep->in_flight, 0, __ATOMIC_RELAXED);
+}
+
+unsigned long long cyusb_stats_begin(cyusb_handle *h, unsigned char endpoint)
+{
+	struct cyusb_ep_stats *ep;
+	int depth;
+
+	if ( !cyusb_stats_on )
+	   return 0;
+	ep = get_ep(h, endpoint, 1);
+	if ( ep == NULL )
+	   return 0;
+
+	depth = __atomic_add_fetch(&ep->in_flight, 1, __ATOMIC_RELAXED);
+	store_max_int(&ep->max_in_flight, depth);
+	return now_ns();
+}
+
+void cyusb_stats_end(cyusb_handle *h, unsigned char endpoint, unsigned long long start, int error,
+		int requested, int actual)
+{
+	struct cyusb_ep_stats *ep;
+	unsigned long long us;
+	int b;
+
+	/* Transfers started while statistics were off are not counted at either end. */
+	if ( start == 0 )
+	   return;
+	ep = get_ep(h, endpoint, 0);
+	if ( ep == NULL )
+	   return;
+
+	us = ( now_ns() - start ) / 1000;
+	b  = ( us > 1 ) ? 63 - __builtin_clzll(us) : 0;
+	if ( b >= CYUSB_STATS_LATENCY_BUCKETS )
+	   b = CYUSB_STATS_LATENCY_BUCKETS - 1;
+
+	__atomic_sub_fetch(&ep->in_flight, 1, __ATOMIC_RELAXED);
+	add(&ep->transfers, 1);
+	add(&ep->latency[b], 1);
+	add(&ep->latency_total_us, us);
+	store_max(&ep->latency_max_us, us);
+	if ( actual > 0 )
+	   add(&ep->bytes, actual);
+
+	if ( error ) {
+	   add(&ep->errors, 1);
+	   add(&ep->error_codes[( ( error < 0 ) && ( -error < CYUSB_STATS_ERROR_CODES ) ) ? -error : 0], 1);
+	   if ( error == LIBUSB_ERROR_TIMEOUT )
+	      add(&ep->timeouts, 1);
+	}
+	else if ( actual < requested )
+	   add(&ep->short_packets, 1);
+}
+
+void cyusb_stats_abort(cyusb_handle *h, unsigned char endpoint, unsigned long long start)
+{
+	struct cyusb_ep_stats *ep;
+
+	if ( start == 0 )
+	   return;
+	ep = get_ep(h, endpoint, 0);
+	if ( ep != NULL )
+	   __atomic_sub_fetch(&ep->in_flight, 1, __ATOMIC_RELAXED);
+}
+
+void cyusb_stats_complete(struct libusb_transfer *xfer, unsigned char endpoint, unsigned long long start,
+		int requested, int actual)
+{
+	/* Cancellation is a decision of the application, not a property of the link. */
+	if ( xfer->status == LIBUSB_TRANSFER_CANCELLED )
+	   cyusb_stats_abort(xfer->dev_handle, endpoint, start);
+	else cyusb_stats_end(xfer->dev_handle, endpoint, start, cyusb_transfer_status_to_error(xfer->status),
+			requested, actual);
+}
+
+/* Direction of a control transfer is in its setup packet, not in the endpoint address. */
+static unsigned char xfer_endpoint(struct libusb_transfer *xfer)
+{
+	if ( xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL )
+	   return ( xfer->buffer[0] & LIBUSB_ENDPOINT_DIR_MASK );
+	return xfer->endpoint;
+}
+
+/* The start time is stored before the transfer is submitted, as it may complete on another
+   thread before the submission returns. */
+int cyusb_stats_submit(struct libusb_transfer *xfer, unsigned long long *t_submit)
+{
+	unsigned char endpoint = xfer_endpoint(xfer);
+	int r;
+
+	*t_submit = cyusb_stats_begin(xfer->dev_handle, endpoint);
+	r = cyusb_backend->submit_transfer(xfer);
+	if ( r )
+	   cyusb_stats_abort(xfer->dev_handle, endpoint, *t_submit);
+	return r;
+}
+
+void cyusb_stats_completed(struct libusb_transfer *xfer, unsigned long long t_submit)
+{
+	int requested = xfer->length;
+	int actual = xfer->actual_length;
+	int i;
+
+	if ( xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL )
+	   requested -= LIBUSB_CONTROL_SETUP_SIZE;
+
+	/* An iso transfer reports its length per packet. */
+	if ( xfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ) {
+	   actual = 0;
+	   for ( i = 0; i < xfer->num_iso_packets; ++i )
+		   actual += xfer->iso_packet_desc[i].actual_length;
+	}
+	cyusb_stats_complete(xfer, xfer_endpoint(xfer), t_submit, requested, actual);
+}
+
+/* Zero the counters of a device slot, then release the slot for another handle. The blocks
+   stay allocated, as another thread may still be reading or updating them. */
+static void forget_dev(struct stats_dev *d)
+{
+	struct cyusb_ep_stats *ep;
+	int j;
+
+	__atomic_store_n(&d->used, 0, __ATOMIC_RELEASE);
+	for ( j = 0; j < STATS_NUM_EPS; ++j ) {
+		ep = __atomic_load_n(&d->ep[j], __ATOMIC_ACQUIRE);
+		if ( ep != NULL )
+		   zero_ep(ep, 1);
+	}
+	__atomic_store_n(&d->h, NULL, __ATOMIC_RELEASE);
+}
+
+void cyusb_stats_forget(void)
+{
+	int i;
+
+	for ( i = 0; i < MAXDEVICES; ++i )
+		forget_dev(&stats_dev[i]);
+}
+
+void cyusb_stats_forget_handle(cyusb_handle *h)
+{
+	int i;
+
+	for ( i = 0; i < MAXDEVICES; ++i ) {
+		if ( __atomic_load_n(&stats_dev[i].h, __ATOMIC_ACQUIRE) == h ) {
+		   forget_dev(&stats_dev[i]);
+		   break;
+		}
+	}
+}
+
+int cyusb_stats_enable(int enable)
+{
+	int prev = cyusb_stats_on;
+
+	cyusb_stats_on = ( enable != 0 );
+	return prev;
+}
+
+int cyusb_get_ep_stats(cyusb_handle *h, unsigned char endpoint, struct cyusb_ep_stats *stats)
+{
+	struct cyusb_ep_stats *ep = get_ep(h, endpoint, 0);
+	int i;
+
+	memset(stats, 0, sizeof(struct cyusb_ep_stats));
+	stats->endpoint = endpoint;
+	if ( ep == NULL )
+	   return LIBUSB_ERROR_NOT_FOUND;
+
+	stats->transfers        = load(&ep->transfers);
+	stats->bytes            = load(&ep->bytes);
+	stats->errors           = load(&ep->errors);
+	stats->short_packets    = load(&ep->short_packets);
+	stats->timeouts         = load(&ep->timeouts);
+	stats->in_flight        = __atomic_load_n(&ep->in_flight, __ATOMIC_RELAXED);
+	stats->max_in_flight    = __atomic_load_n(&ep->max_in_flight, __ATOMIC_RELAXED);
+	stats->latency_total_us = load(&ep->latency_total_us);
+	stats->latency_max_us   = load(&ep->latency_max_us);
+	for ( i = 0; i < CYUSB_STATS_ERROR_CODES; ++i )
+		stats->error_codes[i] = load(&ep->error_codes[i]);
+	for ( i = 0; i < CYUSB_STATS_LATENCY_BUCKETS; ++i )
+		stats->latency[i] = load(&ep->latency[i]);
+	return 0;
+}
+
+int cyusb_get_stats_endpoints(cyusb_handle *h, unsigned char *endpoints, int max)
+{
+	struct cyusb_ep_stats *ep;
+	unsigned int used;
+	int i, j, n = 0;
+
+	for ( i = 0; i < MAXDEVICES; ++i ) {
+		if ( __atomic_load_n(&stats_dev[i].h, __ATOMIC_ACQUIRE) != h )
+		   continue;
+		used = __atomic_load_n(&stats_dev[i].used, __ATOMIC_ACQUIRE);
+		for ( j = 0; ( j < STATS_NUM_EPS ) && ( n < max ); ++j ) {
+			ep = __atomic_load_n(&stats_dev[i].ep[j], __ATOMIC_ACQUIRE);
+			if ( ( ep != NULL ) && ( used & (1U << j) ) )
+			   endpoints[n++] = ep->endpoint;
+		}
+		break;
+	}
+	return n;
+}
+
+void cyusb_reset_stats(cyusb_handle *h)
+{
+	struct cyusb_ep_stats *ep;
+	cyusb_handle *owner;
+	int i, j;
+
+	for ( i = 0; i < MAXDEVICES; ++i ) {
+		owner = __atomic_load_n(&stats_dev[i].h, __ATOMIC_ACQUIRE);
+		if ( ( owner == NULL ) || ( ( h != NULL ) && ( owner != h ) ) )
+		   continue;
+		for ( j = 0; j < STATS_NUM_EPS; ++j ) {
+			ep = __atomic_load_n(&stats_dev[i].ep[j], __ATOMIC_ACQUIRE);
+			if ( ep != NULL )
+			   zero_ep(ep, 0);
+		}
+	}
+}
+
+unsigned long long cyusb_stats_percentile(const struct cyusb_ep_stats *stats, double pct)
+{
+	unsigned long long total = 0, seen = 0, want;
+	int i;
+
+	for ( i = 0; i < CYUSB_STATS_LATENCY_BUCKETS; ++i )
+		total += stats->latency[i];
+	if ( total == 0 )
+	   return 0;
+
+	want = (unsigned long long)(total * pct / 100.0 + 0.5);
+	if ( want < 1 )
+	   want = 1;
+	for ( i = 0; i < CYUSB_STATS_LATENCY_BUCKETS - 1; ++i ) {
+		seen += stats->latency[i];
+		if ( seen >= want )
+		   return ( 2ULL << i );
+	}
+	return stats->latency_max_us;
+}
+
+static void dump_endpoint(FILE *fp, const struct cyusb_ep_stats *st)
+{
+	int i;
+
+	fprintf(fp, "  EP 0x%02x: %llu transfers, %llu bytes, %llu errors, %llu short, %llu timeouts, "
+			"in flight %d (max %d)\n", st->endpoint, st->transfers, st->bytes, st->errors,
+			st->short_packets, st->timeouts, st->in_flight, st->max_in_flight);
+	if ( st->transfers == 0 )
+	   return;
+
+	fprintf(fp, "           latency us: mean %llu, p50 < %llu, p99 < %llu, max %llu\n",
+			st->latency_total_us / st->transfers, cyusb_stats_percentile(st, 50),
+			cyusb_stats_percentile(st, 99), st->latency_max_us);
+	fprintf(fp, "           histogram :");
+	for ( i = 0; i < CYUSB_STATS_LATENCY_BUCKETS; ++i ) {
+		if ( st->latency[i] )
+		   fprintf(fp, " <%llu:%llu", 2ULL << i, st->latency[i]);
+	}
+	fprintf(fp, "\n");
+	if ( st->errors ) {
+	   fprintf(fp, "           errors    :");
+	   for ( i = 0; i < CYUSB_STATS_ERROR_CODES; ++i ) {
+		   if ( st->error_codes[i] )
+		      fprintf(fp, " %s:%llu", ( i ) ? libusb_error_name(-i) : "OTHER", st->error_codes[i]);
+	   }
+	   fprintf(fp, "\n");
+	}
+}
+
+void cyusb_dump_stats(FILE *fp)
+{
+	struct cyusb_ep_stats st;
+	unsigned char eps[STATS_NUM_EPS];
+	cyusb_handle *h;
+	int i, j, n;
+
+	if ( !cyusb_stats_on )
+	   fprintf(fp, "Transfer statistics are disabled\n");
+
+	/* Keeps cyusb_hotplug_poll() from closing a handle while it is being reported. */
+	cyusb_lock_devices();
+	for ( i = 0; i < cyusb_get_device_slots(); ++i ) {
+		h = cyusb_gethandle(i);
+		if ( h == NULL )
+		   continue;
+		n = cyusb_get_stats_endpoints(h, eps, STATS_NUM_EPS);
+		fprintf(fp, "Device %d (%04x:%04x)%s\n", i, cyusb_getvendor(h), cyusb_getproduct(h),
+				( n ) ? "" : ": no transfers");
+		for ( j = 0; j < n; ++j ) {
+			if ( cyusb_get_ep_stats(h, eps[j], &st) == 0 )
+			   dump_endpoint(fp, &st);
+		}
+	}
+	cyusb_unlock_devices();
+	fflush(fp);
+}
@@ -0,0 +1,485 @@
+/*
+ * Filename             : cyusb_stream.c
+ * Description          : Asynchronous bulk streaming engine for libcyusb. Keeps a fixed set of
+ *                        transfers queued on one endpoint and recycles them without allocating.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+#include "cyusb_internal.h"
+
+/* Ownership state of each buffer in a stream. */
+typedef enum {
+	SLOT_IDLE = 0,		// Owned by the stream, not queued anywhere
+	SLOT_SUBMITTED,		// Submitted to libusb
+	SLOT_READY,		// Completed, waiting in the pull queue
+	SLOT_HELD		// Owned by the application
+} stream_slot_state;
+
+struct stream_slot {
+	struct libusb_transfer     *xfer;
+	struct cyusb_stream_buffer  buf;
+	stream_slot_state           state;
+	struct cyusb_stream        *stream;
+	unsigned long long          t_submit;	// From cyusb_stats_begin()
+};
+
+struct cyusb_stream {
+	cyusb_handle       *h;
+	unsigned char       endpoint;
+	int                 num_xfers;
+	int                 xfer_size;
+	unsigned int        timeout;
+	cyusb_stream_cb     cb;
+	void               *user_data;
+	struct cyusb_buffer_pool *pool;
+
+	pthread_mutex_t     lock;
+	int                 running;	// Set between start and stop
+	int                 in_flight;	// Transfers owned by libusb or inside the callback
+	int                 last_error;
+	int                 efd;	// eventfd signalled on pull mode completions, or -1
+
+	/* Pull mode completion queue, in completion order. */
+	int                 q_head;
+	int                 q_count;
+	int                 queue[CYUSB_STREAM_MAX_XFERS];
+
+	struct stream_slot  slot[CYUSB_STREAM_MAX_XFERS];
+};
+
+/* Number of stream callbacks running in this thread. cyusb_stream_stop() cannot be called from
+   one: it would wait for transfers that only this thread can reap. */
+static __thread int callback_depth;
+
+static int is_in_endpoint(struct cyusb_stream *s)
+{
+	return ( (s->endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN );
+}
+
+int cyusb_transfer_status_to_error(enum libusb_transfer_status status)
+{
+	switch ( status ) {
+		case LIBUSB_TRANSFER_COMPLETED: return 0;
+		case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+		case LIBUSB_TRANSFER_STALL:     return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW:  return LIBUSB_ERROR_OVERFLOW;
+		default:                        return LIBUSB_ERROR_IO;
+	}
+}
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ( (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+}
+
+/* Queue a slot for cyusb_stream_get(). Must be called with the stream lock held. */
+static void queue_slot_locked(struct cyusb_stream *s, struct stream_slot *slot)
+{
+	uint64_t one = 1;
+
+	slot->state = SLOT_READY;
+	s->queue[(s->q_head + s->q_count) % s->num_xfers] = slot->buf.index;
+	++s->q_count;
+	if ( s->efd >= 0 ) {
+	   if ( write(s->efd, &one, sizeof(one)) != sizeof(one) )
+	      s->last_error = LIBUSB_ERROR_IO;
+	}
+}
+
+/* Submit a slot with the given length. Must be called with the stream lock held. */
+static int submit_slot_locked(struct cyusb_stream *s, struct stream_slot *slot, int length)
+{
+	int r;
+
+	if ( length > s->xfer_size )
+	   length = s->xfer_size;
+
+	slot->xfer->length = length;
+	slot->state = SLOT_SUBMITTED;
+	++s->in_flight;
+
+	slot->t_submit = cyusb_stats_begin(s->h, s->endpoint);
+	r = cyusb_backend->submit_transfer(slot->xfer);
+	if ( r ) {
+	   cyusb_stats_abort(s->h, s->endpoint, slot->t_submit);
+	   slot->state = SLOT_IDLE;
+	   --s->in_flight;
+	   s->last_error = r;
+	}
+	return r;
+}
+
+/* Hand a held slot to the callback and return its verdict. Must be called without the lock. */
+static int run_callback(struct cyusb_stream *s, struct stream_slot *slot)
+{
+	int verdict;
+
+	++callback_depth;
+	verdict = s->cb(s, &slot->buf, s->user_data);
+	--callback_depth;
+	return verdict;
+}
+
+/* Apply the verdict returned by a callback to a slot. Must be called with the lock held. */
+static void dispose_slot_locked(struct cyusb_stream *s, struct stream_slot *slot, int verdict)
+{
+	if ( verdict == CYUSB_STREAM_HOLD ) {
+	   slot->state = SLOT_HELD;
+	   return;
+	}
+	if ( ( verdict > 0 ) && ( s->running ) ) {
+	   submit_slot_locked(s, slot, verdict);
+	   return;
+	}
+	slot->state = SLOT_IDLE;
+}
+
+static void stream_transfer_cb(struct libusb_transfer *xfer)
+{
+	struct stream_slot *slot = (struct stream_slot *)xfer->user_data;
+	struct cyusb_stream *s = slot->stream;
+	int verdict;
+
+	cyusb_stats_complete(xfer, s->endpoint, slot->t_submit, xfer->length, xfer->actual_length);
+	pthread_mutex_lock(&s->lock);
+
+	slot->buf.actual_length = xfer->actual_length;
+	slot->buf.status        = cyusb_transfer_status_to_error(xfer->status);
+
+	/* Cancelled transfers only happen while stopping; their data is discarded. */
+	if ( ( !s->running ) || ( xfer->status == LIBUSB_TRANSFER_CANCELLED ) ) {
+	   slot->state = SLOT_IDLE;
+	   --s->in_flight;
+	   pthread_mutex_unlock(&s->lock);
+	   return;
+	}
+
+	if ( slot->buf.status )
+	   s->last_error = slot->buf.status;
+
+	if ( s->cb == NULL ) {
+	   --s->in_flight;
+	   queue_slot_locked(s, slot);
+	   pthread_mutex_unlock(&s->lock);
+	   return;
+	}
+
+	/* Run the callback without the lock, so that it may call back into the stream. The
+	   transfer stays counted as in flight until the callback returns, so that a concurrent
+	   cyusb_stream_stop() waits for it. */
+	slot->state = SLOT_HELD;
+	pthread_mutex_unlock(&s->lock);
+
+	verdict = run_callback(s, slot);
+
+	/* A device that has gone away will not accept further transfers. */
+	if ( slot->buf.status == LIBUSB_ERROR_NO_DEVICE )
+	   verdict = 0;
+
+	pthread_mutex_lock(&s->lock);
+	dispose_slot_locked(s, slot, verdict);
+	--s->in_flight;
+	pthread_mutex_unlock(&s->lock);
+}
+
+struct cyusb_stream * cyusb_stream_create(cyusb_handle *h, unsigned char endpoint, int num_xfers,
+		int xfer_size, unsigned int timeout, cyusb_stream_cb cb, void *user_data)
+{
+	struct cyusb_stream *s;
+	int i;
+
+	if ( ( h == NULL ) || ( num_xfers < 1 ) || ( num_xfers > CYUSB_STREAM_MAX_XFERS ) ||
+	     ( xfer_size <= 0 ) )
+	   return NULL;
+
+	s = (struct cyusb_stream *)calloc(1, sizeof(struct cyusb_stream));
+	if ( s == NULL )
+	   return NULL;
+
+	s->h         = h;
+	s->endpoint  = endpoint;
+	s->num_xfers = num_xfers;
+	s->xfer_size = xfer_size;
+	s->timeout   = timeout;
+	s->cb        = cb;
+	s->user_data = user_data;
+	s->efd       = -1;
+	pthread_mutex_init(&s->lock, NULL);
+
+	s->pool = cyusb_pool_create(h, num_xfers, xfer_size);
+	if ( s->pool == NULL ) {
+	   cyusb_stream_destroy(s);
+	   return NULL;
+	}
+
+	for ( i = 0; i < num_xfers; ++i ) {
+		struct stream_slot *slot = &s->slot[i];
+
+		slot->stream    = s;
+		slot->buf.index = i;
+		slot->buf.length = xfer_size;
+		slot->buf.data  = cyusb_pool_get(s->pool);
+		slot->xfer      = libusb_alloc_transfer(0);
+		if ( ( slot->buf.data == NULL ) || ( slot->xfer == NULL ) ) {
+		   cyusb_stream_destroy(s);
+		   return NULL;
+		}
+		libusb_fill_bulk_transfer(slot->xfer, h, endpoint, slot->buf.data, xfer_size,
+				stream_transfer_cb, slot, timeout);
+	}
+
+	return s;
+}
+
+int cyusb_stream_set_stream_id(struct cyusb_stream *s, unsigned int stream_id)
+{
+#ifdef CYUSB_HAVE_BULK_STREAMS
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	if ( s->running ) {
+	   pthread_mutex_unlock(&s->lock);
+	   return LIBUSB_ERROR_BUSY;
+	}
+	for ( i = 0; i < s->num_xfers; ++i ) {
+		s->slot[i].xfer->type = ( stream_id ) ? LIBUSB_TRANSFER_TYPE_BULK_STREAM :
+			LIBUSB_TRANSFER_TYPE_BULK;
+		libusb_transfer_set_stream_id(s->slot[i].xfer, stream_id);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+#else
+	return ( stream_id ) ? LIBUSB_ERROR_NOT_SUPPORTED : 0;
+#endif
+}
+
+int cyusb_stream_start(struct cyusb_stream *s)
+{
+	int i;
+	int r = 0;
+	int verdict;
+
+	pthread_mutex_lock(&s->lock);
+	if ( s->running ) {
+	   pthread_mutex_unlock(&s->lock);
+	   return LIBUSB_ERROR_BUSY;
+	}
+	s->running    = 1;
+	s->last_error = 0;
+	s->q_head     = 0;
+	s->q_count    = 0;
+
+	for ( i = 0; i < s->num_xfers; ++i ) {
+		struct stream_slot *slot = &s->slot[i];
+
+		slot->buf.actual_length = 0;
+		slot->buf.status        = 0;
+
+		if ( is_in_endpoint(s) ) {
+		   r = submit_slot_locked(s, slot, s->xfer_size);
+		   if ( r )
+		      break;
+		}
+		else if ( s->cb == NULL ) {
+		   queue_slot_locked(s, slot);
+		}
+		else {
+		   slot->state = SLOT_HELD;
+		   pthread_mutex_unlock(&s->lock);
+		   verdict = run_callback(s, slot);
+		   pthread_mutex_lock(&s->lock);
+		   dispose_slot_locked(s, slot, verdict);
+		   if ( s->last_error ) {
+		      r = s->last_error;
+		      break;
+		   }
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if ( r )
+	   cyusb_stream_stop(s);
+	return r;
+}
+
+int cyusb_stream_get(struct cyusb_stream *s, struct cyusb_stream_buffer **buf, unsigned int timeout)
+{
+	unsigned long long deadline = now_ms() + timeout;
+	unsigned long long now;
+	unsigned int wait;
+	struct stream_slot *slot;
+	struct timeval tv;
+	int r;
+
+	if ( s->cb != NULL )
+	   return LIBUSB_ERROR_INVALID_PARAM;
+
+	while ( 1 ) {
+		pthread_mutex_lock(&s->lock);
+		if ( s->q_count > 0 ) {
+		   slot = &s->slot[s->queue[s->q_head]];
+		   s->q_head = (s->q_head + 1) % s->num_xfers;
+		   --s->q_count;
+		   slot->state = SLOT_HELD;
+		   pthread_mutex_unlock(&s->lock);
+		   *buf = &slot->buf;
+		   return 0;
+		}
+		if ( s->in_flight == 0 ) {
+		   r = s->last_error ? s->last_error : LIBUSB_ERROR_NOT_FOUND;
+		   pthread_mutex_unlock(&s->lock);
+		   return r;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		wait = 100;
+		if ( timeout ) {
+		   now = now_ms();
+		   if ( now >= deadline )
+		      return LIBUSB_ERROR_TIMEOUT;
+		   if ( deadline - now < wait )
+		      wait = (unsigned int)(deadline - now);
+		}
+		tv.tv_sec  = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		r = cyusb_backend->handle_events(&tv, NULL);
+		if ( ( r ) && ( r != LIBUSB_ERROR_INTERRUPTED ) )
+		   return r;
+	}
+}
+
+int cyusb_stream_put(struct cyusb_stream *s, struct cyusb_stream_buffer *buf, int length)
+{
+	struct stream_slot *slot;
+	int r = 0;
+
+	if ( ( buf == NULL ) || ( buf->index < 0 ) || ( buf->index >= s->num_xfers ) ||
+	     ( &s->slot[buf->index].buf != buf ) )
+	   return LIBUSB_ERROR_INVALID_PARAM;
+
+	slot = &s->slot[buf->index];
+
+	pthread_mutex_lock(&s->lock);
+	if ( slot->state != SLOT_HELD ) {
+	   pthread_mutex_unlock(&s->lock);
+	   return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	if ( ( length > 0 ) && ( s->running ) )
+	   r = submit_slot_locked(s, slot, length);
+	else
+	   slot->state = SLOT_IDLE;
+	pthread_mutex_unlock(&s->lock);
+
+	return r;
+}
+
+int cyusb_stream_stop(struct cyusb_stream *s)
+{
+	struct timeval tv;
+	int i;
+	int pending;
+
+	if ( callback_depth )
+	   return LIBUSB_ERROR_BUSY;
+
+	pthread_mutex_lock(&s->lock);
+	s->running = 0;
+	for ( i = 0; i < s->num_xfers; ++i ) {
+		if ( s->slot[i].state == SLOT_SUBMITTED )
+		   cyusb_backend->cancel_transfer(s->slot[i].xfer);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	/* Reap every cancelled transfer before the buffers can be reused. */
+	while ( 1 ) {
+		pthread_mutex_lock(&s->lock);
+		pending = s->in_flight;
+		pthread_mutex_unlock(&s->lock);
+		if ( pending == 0 )
+		   break;
+		tv.tv_sec  = 0;
+		tv.tv_usec = 100000;
+		cyusb_backend->handle_events(&tv, NULL);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	for ( i = 0; i < s->num_xfers; ++i )
+		s->slot[i].state = SLOT_IDLE;
+	s->q_head  = 0;
+	s->q_count = 0;
+	pthread_mutex_unlock(&s->lock);
+
+	return s->last_error;
+}
+
+void cyusb_stream_destroy(struct cyusb_stream *s)
+{
+	int i;
+
+	if ( s == NULL )
+	   return;
+
+	if ( s->in_flight )
+	   cyusb_stream_stop(s);
+
+	for ( i = 0; i < s->num_xfers; ++i ) {
+		if ( s->slot[i].xfer )
+		   libusb_free_transfer(s->slot[i].xfer);
+	}
+	cyusb_pool_destroy(s->pool);
+	if ( s->efd >= 0 )
+	   close(s->efd);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+int cyusb_stream_in_flight(struct cyusb_stream *s)
+{
+	int n;
+
+	pthread_mutex_lock(&s->lock);
+	n = s->in_flight;
+	pthread_mutex_unlock(&s->lock);
+	return n;
+}
+
+int cyusb_stream_get_fd(struct cyusb_stream *s)
+{
+	int fd;
+
+	if ( s->cb != NULL )
+	   return LIBUSB_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&s->lock);
+	if ( s->efd < 0 )
+	   s->efd = eventfd(s->q_count, EFD_NONBLOCK | EFD_CLOEXEC);
+	fd = s->efd;
+	pthread_mutex_unlock(&s->lock);
+
+	return ( fd >= 0 ) ? fd : LIBUSB_ERROR_NO_MEM;
+}
+
+int cyusb_handle_events(unsigned int timeout)
+{
+	struct timeval tv;
+
+	tv.tv_sec  = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	return ( cyusb_backend->handle_events(&tv, NULL) );
+}
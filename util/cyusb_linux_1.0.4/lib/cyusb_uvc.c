@@ -0,0 +1,822 @@
+/*
+ * Filename             : cyusb_uvc.c
+ * Description          : UVC video capture for libcyusb, for FX3 and CX3 camera designs.
+ *                        Negotiates the stream with the probe and commit controls, strips the
+ *                        payload headers of a bulk or isochronous video endpoint and reassembles
+ *                        frames directly into preallocated frame buffers. Frame rate, frame
+ *                        interval jitter, and truncated or dropped frames are accounted for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+#include "cyusb_internal.h"
+
+/* Video class requests and VideoStreaming interface controls. */
+#define UVC_SET_CUR			(0x01)
+#define UVC_GET_CUR			(0x81)
+#define UVC_REQ_SET			(LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE)
+#define UVC_REQ_GET			(LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE)
+#define UVC_VS_PROBE_CONTROL		(0x01)
+#define UVC_VS_COMMIT_CONTROL		(0x02)
+#define UVC_CTRL_TIMEOUT		(1000)
+
+/* Length of the probe and commit controls: 26 bytes for UVC 1.0, 34 for 1.1 and 48 for 1.5.
+   The device's own length is learnt from the first GET_CUR. */
+#define UVC_PROBE_MIN_LEN		(26)
+#define UVC_PROBE_MAX_LEN		(48)
+
+/* Bits of bmHeaderInfo, the second byte of every payload header. */
+#define UVC_BFH_FID			(0x01)
+#define UVC_BFH_EOF			(0x02)
+#define UVC_BFH_PTS			(0x04)
+#define UVC_BFH_ERR			(0x40)
+
+/* SuperSpeed endpoint companion descriptor type. */
+#define UVC_DT_SS_EP_COMPANION		(0x30)
+
+/* Alignment of the frame buffers. */
+#define UVC_FRAME_ALIGN			(4096)
+
+#define UVC_DEFAULT_ISO_PACKETS		(32)
+
+/* Ownership state of each frame buffer. */
+typedef enum {
+	FRAME_FREE = 0,		// Empty, may be claimed for the next frame
+	FRAME_FILLING,		// Being assembled by the thread handling libusb events
+	FRAME_READY,		// Complete, queued for cyusb_uvc_get_frame()
+	FRAME_HELD		// Owned by the application
+} uvc_frame_state;
+
+struct uvc_iso_slot {
+	struct libusb_transfer  *xfer;
+	struct cyusb_uvc        *uvc;
+	int                      submitted;
+	unsigned long long       t_submit;	// From cyusb_stats_begin()
+};
+
+struct cyusb_uvc {
+	cyusb_handle             *h;
+	struct cyusb_uvc_config   cfg;
+	struct cyusb_uvc_probe    probe;
+	unsigned char             ctrl[UVC_PROBE_MAX_LEN];	// Committed probe control, as sent
+	int                       ctrl_len;
+
+	int                       iso;
+	int                       payload_size;		// Bulk: max. bytes in one payload
+	int                       pkt_size;			// Iso: bytes per packet
+	struct cyusb_stream      *stream;			// Bulk transfers
+	struct cyusb_buffer_pool *pool;			// Iso transfer buffers
+	struct uvc_iso_slot       slot[CYUSB_STREAM_MAX_XFERS];
+
+	pthread_mutex_t           lock;
+	int                       running;
+	int                       in_flight;		// Iso transfers submitted
+	int                       last_error;
+
+	int                       num_frames;
+	struct cyusb_uvc_frame    frame[CYUSB_UVC_MAX_FRAMES];
+	uvc_frame_state           state[CYUSB_UVC_MAX_FRAMES];
+	int                       queue[CYUSB_UVC_MAX_FRAMES];
+	int                       q_head;
+	int                       q_count;
+
+	/* Assembly state, only touched by the thread handling libusb events. */
+	int                       cur;			// Frame being filled, or -1
+	int                       claim_idx;		// Next frame to try to claim
+	int                       fid;			// Frame ID of the last payload, or -1
+	int                       synced;		// A frame boundary has been seen
+	int                       skipping;		// Current frame is being dropped
+	int                       in_payload;		// Bulk: bytes of the current payload seen
+	int                       payload_bfh;		// Bulk: header flags of the current payload, or -1
+	unsigned long long        sequence;
+	unsigned long long        last_frame_ns;
+
+	/* Frame interval accounting, in ns. */
+	unsigned long long        intervals;
+	double                    interval_sum;
+	double                    interval_sumsq;
+	double                    interval_max;
+
+	struct cyusb_uvc_stats    stats;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ( (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec );
+}
+
+static unsigned short get_le16(const unsigned char *p)
+{
+	return ( p[0] | (p[1] << 8) );
+}
+
+static unsigned int get_le32(const unsigned char *p)
+{
+	return ( p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24) );
+}
+
+static void put_le16(unsigned char *p, unsigned short v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = v >> 24;
+}
+
+static void unpack_probe(const unsigned char *c, int len, struct cyusb_uvc_probe *p)
+{
+	memset(p, 0, sizeof(struct cyusb_uvc_probe));
+	p->length                   = len;
+	p->bmHint                   = get_le16(c + 0);
+	p->bFormatIndex             = c[2];
+	p->bFrameIndex              = c[3];
+	p->dwFrameInterval          = get_le32(c + 4);
+	p->wKeyFrameRate            = get_le16(c + 8);
+	p->wPFrameRate              = get_le16(c + 10);
+	p->wCompQuality             = get_le16(c + 12);
+	p->wCompWindowSize          = get_le16(c + 14);
+	p->wDelay                   = get_le16(c + 16);
+	p->dwMaxVideoFrameSize      = get_le32(c + 18);
+	p->dwMaxPayloadTransferSize = get_le32(c + 22);
+	if ( len >= 34 ) {
+	   p->dwClockFrequency      = get_le32(c + 26);
+	   p->bmFramingInfo         = c[30];
+	   p->bPreferedVersion      = c[31];
+	   p->bMinVersion           = c[32];
+	   p->bMaxVersion           = c[33];
+	}
+}
+
+static int probe_control(struct cyusb_uvc *u, unsigned char request, unsigned char control, int len)
+{
+	unsigned char type = ( request & 0x80 ) ? UVC_REQ_GET : UVC_REQ_SET;
+
+	return ( cyusb_control_transfer(u->h, type, request, control << 8, u->cfg.interface, u->ctrl,
+				len, UVC_CTRL_TIMEOUT) );
+}
+
+/* Run the probe phase of the negotiation: read the device defaults, request the configured
+   format, frame and interval, and read back what the device settled on. */
+static int negotiate(struct cyusb_uvc *u)
+{
+	int r;
+
+	memset(u->ctrl, 0, sizeof(u->ctrl));
+	r = probe_control(u, UVC_GET_CUR, UVC_VS_PROBE_CONTROL, UVC_PROBE_MAX_LEN);
+	if ( r < 0 )
+	   return r;
+	if ( r < UVC_PROBE_MIN_LEN )
+	   return LIBUSB_ERROR_IO;
+	u->ctrl_len = r;
+
+	put_le16(u->ctrl, ( u->cfg.frame_interval ) ? 1 : 0);	// bmHint: dwFrameInterval is fixed
+	if ( u->cfg.format_index )
+	   u->ctrl[2] = u->cfg.format_index;
+	if ( u->cfg.frame_index )
+	   u->ctrl[3] = u->cfg.frame_index;
+	if ( u->cfg.frame_interval )
+	   put_le32(u->ctrl + 4, u->cfg.frame_interval);
+
+	r = probe_control(u, UVC_SET_CUR, UVC_VS_PROBE_CONTROL, u->ctrl_len);
+	if ( r < 0 )
+	   return r;
+	r = probe_control(u, UVC_GET_CUR, UVC_VS_PROBE_CONTROL, u->ctrl_len);
+	if ( r < 0 )
+	   return r;
+	if ( r < UVC_PROBE_MIN_LEN )
+	   return LIBUSB_ERROR_IO;
+
+	unpack_probe(u->ctrl, u->ctrl_len, &u->probe);
+	if ( u->probe.dwMaxVideoFrameSize == 0 )
+	   return LIBUSB_ERROR_IO;
+	return 0;
+}
+
+/* Find the video endpoint in the configured alternate setting, and return its transfer type
+   and size: for an isochronous endpoint the bytes it carries per service interval, including
+   bursts and high-bandwidth transactions, and for a bulk endpoint its packet size. A bulk
+   burst does not delimit anything, and the device may end a payload in the middle of one. */
+static int endpoint_info(struct cyusb_uvc *u, int *type, int *max_bytes)
+{
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *alt;
+	const struct libusb_endpoint_descriptor *ep;
+	const unsigned char *extra;
+	int size;
+	int i, j, k;
+	int r;
+
+	r = cyusb_get_active_config_descriptor(u->h, &config);
+	if ( r )
+	   return r;
+
+	r = LIBUSB_ERROR_NOT_FOUND;
+	for ( i = 0; i < config->bNumInterfaces; ++i ) {
+		for ( j = 0; j < config->interface[i].num_altsetting; ++j ) {
+			alt = &config->interface[i].altsetting[j];
+			if ( ( alt->bInterfaceNumber != u->cfg.interface ) ||
+			     ( alt->bAlternateSetting != u->cfg.alt_setting ) )
+			   continue;
+			for ( k = 0; k < alt->bNumEndpoints; ++k ) {
+				ep = &alt->endpoint[k];
+				if ( ep->bEndpointAddress != u->cfg.endpoint )
+				   continue;
+
+				*type = ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+				size  = ep->wMaxPacketSize & 0x7FF;
+				extra = ep->extra;
+				if ( *type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ) {
+				   if ( ( ep->extra_length >= 6 ) && ( extra[1] == UVC_DT_SS_EP_COMPANION ) )
+				      size *= (extra[2] + 1) * ((extra[3] & 0x03) + 1);
+				   else size *= ((ep->wMaxPacketSize >> 11) & 0x03) + 1;
+				}
+				*max_bytes = size;
+				r = 0;
+			}
+		}
+	}
+
+	cyusb_free_config_descriptor(config);
+	return r;
+}
+
+/* Claim a free frame buffer for the next frame. Must be called with the lock held. */
+static int claim_frame_locked(struct cyusb_uvc *u)
+{
+	struct cyusb_uvc_frame *f;
+	int i, idx;
+
+	for ( i = 0; i < u->num_frames; ++i ) {
+		idx = (u->claim_idx + i) % u->num_frames;
+		if ( u->state[idx] != FRAME_FREE )
+		   continue;
+
+		f = &u->frame[idx];
+		f->length       = 0;
+		f->flags        = 0;
+		f->pts          = 0;
+		f->timestamp_ns = 0;
+		f->sequence     = u->sequence++;
+		u->state[idx]   = FRAME_FILLING;
+		u->cur          = idx;
+		u->claim_idx    = (idx + 1) % u->num_frames;
+		return 0;
+	}
+
+	++u->sequence;
+	++u->stats.frames_dropped;
+	u->skipping = 1;
+	return -1;
+}
+
+/* Close the frame being assembled at a frame boundary, and queue it for the application.
+   Must be called with the lock held. */
+static void end_frame_locked(struct cyusb_uvc *u)
+{
+	struct cyusb_uvc_frame *f;
+	unsigned long long now;
+	double dt;
+
+	if ( ( u->cur < 0 ) && ( !u->skipping ) )
+	   return;
+
+	now = now_ns();
+	if ( u->last_frame_ns ) {
+	   dt = (double)(now - u->last_frame_ns);
+	   ++u->intervals;
+	   u->interval_sum   += dt;
+	   u->interval_sumsq += dt * dt;
+	   if ( dt > u->interval_max )
+	      u->interval_max = dt;
+	}
+	u->last_frame_ns = now;
+	u->skipping = 0;
+
+	if ( u->cur < 0 )
+	   return;
+
+	f = &u->frame[u->cur];
+	f->timestamp_ns = now;
+	if ( ( u->cfg.flags & CYUSB_UVC_FIXED_SIZE ) && ( f->length != u->probe.dwMaxVideoFrameSize ) )
+	   f->flags |= CYUSB_UVC_FRAME_INCOMPLETE;
+
+	++u->stats.frames;
+	u->stats.bytes += f->length;
+	if ( f->flags )
+	   ++u->stats.frames_truncated;
+
+	if ( ( f->flags ) && ( u->cfg.flags & CYUSB_UVC_DROP_BAD ) )
+	   u->state[u->cur] = FRAME_FREE;
+	else {
+	   u->state[u->cur] = FRAME_READY;
+	   u->queue[(u->q_head + u->q_count) % u->num_frames] = u->cur;
+	   ++u->q_count;
+	}
+	u->cur = -1;
+}
+
+/* Data was lost between payloads; the frame being assembled cannot be complete. Must be
+   called with the lock held. */
+static void lost_data_locked(struct cyusb_uvc *u)
+{
+	++u->stats.payload_errors;
+	if ( u->cur >= 0 )
+	   u->frame[u->cur].flags |= CYUSB_UVC_FRAME_INCOMPLETE;
+}
+
+/* Copy image data straight from a transfer buffer to the end of the current frame. The frame
+   is owned by this thread until it is queued, so the copy is made without the lock. Must be
+   called with the lock held. */
+static void append_locked(struct cyusb_uvc *u, const unsigned char *data, int len)
+{
+	struct cyusb_uvc_frame *f;
+	unsigned int n;
+
+	if ( ( u->cur < 0 ) || ( len <= 0 ) )
+	   return;
+
+	f = &u->frame[u->cur];
+	n = f->size - f->length;
+	if ( n > (unsigned int)len )
+	   n = len;
+	else if ( n < (unsigned int)len )
+	   f->flags |= CYUSB_UVC_FRAME_OVERFLOW;
+
+	pthread_mutex_unlock(&u->lock);
+	memcpy(f->data + f->length, data, n);
+	pthread_mutex_lock(&u->lock);
+	f->length += n;
+}
+
+/* Handle the header at the start of a payload and store the image data that follows it.
+   Returns the header flags, or -1 if the header is invalid. Must be called with the lock held. */
+static int payload_start_locked(struct cyusb_uvc *u, const unsigned char *data, int len)
+{
+	int hlen, bfh, fid;
+
+	hlen = data[0];
+	if ( ( hlen < 2 ) || ( hlen > len ) ) {
+	   lost_data_locked(u);
+	   return -1;
+	}
+	bfh = data[1];
+	fid = bfh & UVC_BFH_FID;
+	++u->stats.payloads;
+
+	/* A toggled frame ID starts a new frame, whether or not the last one ended with EOF. Any
+	   partial frame in progress when the stream started is skipped. */
+	if ( ( u->fid >= 0 ) && ( fid != u->fid ) ) {
+	   end_frame_locked(u);
+	   u->synced = 1;
+	}
+	u->fid = fid;
+
+	if ( ( u->synced ) && ( u->cur < 0 ) && ( !u->skipping ) )
+	   claim_frame_locked(u);
+
+	if ( u->cur >= 0 ) {
+	   if ( bfh & UVC_BFH_ERR )
+	      u->frame[u->cur].flags |= CYUSB_UVC_FRAME_ERROR;
+	   if ( ( bfh & UVC_BFH_PTS ) && ( hlen >= 6 ) )
+	      u->frame[u->cur].pts = get_le32(data + 2);
+	}
+	append_locked(u, data + hlen, len - hlen);
+	return bfh;
+}
+
+/* Handle the end of a payload. Must be called with the lock held. */
+static void payload_end_locked(struct cyusb_uvc *u, int bfh)
+{
+	if ( ( bfh >= 0 ) && ( bfh & UVC_BFH_EOF ) ) {
+	   end_frame_locked(u);
+	   u->synced = 1;
+	}
+}
+
+/* Bulk payloads end with a short packet, or on reaching dwMaxPayloadTransferSize. Transfers
+   are sized to one payload, so a payload only ever starts at the start of a transfer. */
+static int uvc_bulk_cb(struct cyusb_stream *stream, struct cyusb_stream_buffer *buf, void *user_data)
+{
+	struct cyusb_uvc *u = (struct cyusb_uvc *)user_data;
+	int len = buf->actual_length;
+
+	pthread_mutex_lock(&u->lock);
+	if ( buf->status ) {
+	   u->last_error  = buf->status;
+	   u->in_payload  = 0;
+	   lost_data_locked(u);
+	   pthread_mutex_unlock(&u->lock);
+	   return ( buf->status == LIBUSB_ERROR_NO_DEVICE ) ? 0 : buf->length;
+	}
+
+	if ( u->in_payload == 0 ) {
+	   if ( len > 0 ) {
+	      u->payload_bfh = payload_start_locked(u, buf->data, len);
+	      u->in_payload  = len;
+	   }
+	}
+	else {
+	   if ( u->payload_bfh >= 0 )
+	      append_locked(u, buf->data, len);
+	   u->in_payload += len;
+	}
+
+	if ( ( u->in_payload ) && ( ( len < buf->length ) || ( u->in_payload >= u->payload_size ) ) ) {
+	   payload_end_locked(u, u->payload_bfh);
+	   u->in_payload = 0;
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	return buf->length;
+}
+
+/* Every isochronous packet carries one complete payload. The packets are parsed where they
+   landed in the transfer buffer. */
+static void uvc_iso_cb(struct libusb_transfer *xfer)
+{
+	struct uvc_iso_slot *slot = (struct uvc_iso_slot *)xfer->user_data;
+	struct cyusb_uvc *u = slot->uvc;
+	struct libusb_iso_packet_descriptor *pd;
+	unsigned char *data;
+	int received = 0;
+	int i, r;
+
+	if ( slot->t_submit ) {
+	   for ( i = 0; i < xfer->num_iso_packets; ++i )
+		   received += xfer->iso_packet_desc[i].actual_length;
+	   cyusb_stats_complete(xfer, u->cfg.endpoint, slot->t_submit, xfer->length, received);
+	}
+
+	pthread_mutex_lock(&u->lock);
+	slot->submitted = 0;
+
+	if ( ( !u->running ) || ( xfer->status == LIBUSB_TRANSFER_CANCELLED ) ) {
+	   --u->in_flight;
+	   pthread_mutex_unlock(&u->lock);
+	   return;
+	}
+
+	if ( xfer->status != LIBUSB_TRANSFER_COMPLETED ) {
+	   u->last_error = cyusb_transfer_status_to_error(xfer->status);
+	   lost_data_locked(u);
+	}
+	else {
+	   for ( i = 0; i < xfer->num_iso_packets; ++i ) {
+		   pd   = &xfer->iso_packet_desc[i];
+		   data = xfer->buffer + i * u->pkt_size;
+		   if ( pd->status != LIBUSB_TRANSFER_COMPLETED )
+		      lost_data_locked(u);
+		   else if ( pd->actual_length > 0 )
+		      payload_end_locked(u, payload_start_locked(u, data, pd->actual_length));
+	   }
+	}
+
+	if ( xfer->status != LIBUSB_TRANSFER_NO_DEVICE ) {
+	   slot->t_submit = cyusb_stats_begin(u->h, u->cfg.endpoint);
+	   r = cyusb_backend->submit_transfer(xfer);
+	   if ( r == 0 ) {
+	      slot->submitted = 1;
+	      pthread_mutex_unlock(&u->lock);
+	      return;
+	   }
+	   cyusb_stats_abort(u->h, u->cfg.endpoint, slot->t_submit);
+	   u->last_error = r;
+	}
+	--u->in_flight;
+	pthread_mutex_unlock(&u->lock);
+}
+
+struct cyusb_uvc * cyusb_uvc_create(cyusb_handle *h, const struct cyusb_uvc_config *cfg)
+{
+	struct cyusb_uvc *u;
+	unsigned char *buf;
+	void *mem;
+	int type, max_bytes;
+	int xfer_size;
+	int i;
+
+	if ( ( h == NULL ) || ( cfg == NULL ) || ( !(cfg->endpoint & LIBUSB_ENDPOINT_IN) ) ||
+	     ( cfg->num_frames < 2 ) || ( cfg->num_frames > CYUSB_UVC_MAX_FRAMES ) ||
+	     ( cfg->num_xfers < 1 ) || ( cfg->num_xfers > CYUSB_STREAM_MAX_XFERS ) )
+	   return NULL;
+
+	u = (struct cyusb_uvc *)calloc(1, sizeof(struct cyusb_uvc));
+	if ( u == NULL )
+	   return NULL;
+
+	u->h          = h;
+	u->cfg        = *cfg;
+	u->num_frames = cfg->num_frames;
+	u->cur        = -1;
+	pthread_mutex_init(&u->lock, NULL);
+
+	if ( ( endpoint_info(u, &type, &max_bytes) ) || ( max_bytes <= 0 ) ||
+	     ( ( type != LIBUSB_TRANSFER_TYPE_BULK ) && ( type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ) ) ) {
+	   printf("Library: Endpoint 0x%02x not found in interface %d alt. setting %d\n",
+			   cfg->endpoint, cfg->interface, cfg->alt_setting);
+	   cyusb_uvc_destroy(u);
+	   return NULL;
+	}
+	u->iso = ( type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS );
+
+	if ( negotiate(u) ) {
+	   printf("Library: UVC probe negotiation failed on interface %d\n", cfg->interface);
+	   cyusb_uvc_destroy(u);
+	   return NULL;
+	}
+
+	/* Frame buffers are allocated and touched here, so that capture never faults in pages. */
+	for ( i = 0; i < u->num_frames; ++i ) {
+		if ( posix_memalign(&mem, UVC_FRAME_ALIGN, u->probe.dwMaxVideoFrameSize) ) {
+		   cyusb_uvc_destroy(u);
+		   return NULL;
+		}
+		memset(mem, 0, u->probe.dwMaxVideoFrameSize);
+		u->frame[i].data  = (unsigned char *)mem;
+		u->frame[i].size  = u->probe.dwMaxVideoFrameSize;
+		u->frame[i].index = i;
+	}
+
+	if ( u->iso ) {
+	   if ( u->cfg.iso_packets <= 0 )
+	      u->cfg.iso_packets = UVC_DEFAULT_ISO_PACKETS;
+	   u->pkt_size = max_bytes;
+	   u->pool = cyusb_pool_create(h, u->cfg.num_xfers, u->cfg.iso_packets * u->pkt_size);
+	   if ( u->pool == NULL ) {
+	      cyusb_uvc_destroy(u);
+	      return NULL;
+	   }
+	   for ( i = 0; i < u->cfg.num_xfers; ++i ) {
+		   u->slot[i].uvc  = u;
+		   u->slot[i].xfer = libusb_alloc_transfer(u->cfg.iso_packets);
+		   buf = cyusb_pool_get(u->pool);
+		   if ( ( u->slot[i].xfer == NULL ) || ( buf == NULL ) ) {
+		      cyusb_uvc_destroy(u);
+		      return NULL;
+		   }
+		   libusb_fill_iso_transfer(u->slot[i].xfer, h, cfg->endpoint, buf,
+				   u->cfg.iso_packets * u->pkt_size, u->cfg.iso_packets, uvc_iso_cb,
+				   &u->slot[i], 0);
+		   libusb_set_iso_packet_lengths(u->slot[i].xfer, u->pkt_size);
+	   }
+	}
+	else {
+	   /* One payload per transfer, rounded up to whole packets. Some firmware reports a
+	      larger dwMaxPayloadTransferSize than it sends, which cfg->payload_size overrides. */
+	   u->payload_size = ( cfg->payload_size > 0 ) ? cfg->payload_size :
+		   (int)u->probe.dwMaxPayloadTransferSize;
+	   if ( u->payload_size <= 0 ) {
+	      cyusb_uvc_destroy(u);
+	      return NULL;
+	   }
+	   xfer_size = (u->payload_size + max_bytes - 1) / max_bytes * max_bytes;
+	   u->stream = cyusb_stream_create(h, cfg->endpoint, cfg->num_xfers, xfer_size, 0,
+			   uvc_bulk_cb, u);
+	   if ( u->stream == NULL ) {
+	      cyusb_uvc_destroy(u);
+	      return NULL;
+	   }
+	}
+
+	return u;
+}
+
+int cyusb_uvc_start(struct cyusb_uvc *u)
+{
+	int i;
+	int r;
+
+	pthread_mutex_lock(&u->lock);
+	if ( u->running ) {
+	   pthread_mutex_unlock(&u->lock);
+	   return LIBUSB_ERROR_BUSY;
+	}
+
+	/* Frames still held by the application stay with it; everything else is discarded. */
+	for ( i = 0; i < u->num_frames; ++i ) {
+		if ( u->state[i] != FRAME_HELD )
+		   u->state[i] = FRAME_FREE;
+	}
+	u->q_head        = 0;
+	u->q_count       = 0;
+	u->cur           = -1;
+	u->claim_idx     = 0;
+	u->fid           = -1;
+	u->synced        = 0;
+	u->skipping      = 0;
+	u->in_payload    = 0;
+	u->sequence      = 0;
+	u->last_frame_ns = 0;
+	u->intervals     = 0;
+	u->interval_sum  = 0;
+	u->interval_sumsq = 0;
+	u->interval_max  = 0;
+	u->last_error    = 0;
+	memset(&u->stats, 0, sizeof(u->stats));
+	pthread_mutex_unlock(&u->lock);
+
+	/* The commit starts the video stream on FX3 and CX3 firmware; an isochronous stream
+	   also needs its alternate setting to reserve bandwidth. */
+	r = probe_control(u, UVC_SET_CUR, UVC_VS_COMMIT_CONTROL, u->ctrl_len);
+	if ( r < 0 )
+	   return r;
+	if ( u->iso ) {
+	   r = cyusb_set_interface_alt_setting(u->h, u->cfg.interface, u->cfg.alt_setting);
+	   if ( r )
+	      return r;
+	}
+
+	pthread_mutex_lock(&u->lock);
+	u->running = 1;
+	pthread_mutex_unlock(&u->lock);
+
+	if ( !u->iso ) {
+	   r = cyusb_stream_start(u->stream);
+	   if ( r )
+	      cyusb_uvc_stop(u);
+	   return r;
+	}
+
+	r = 0;
+	pthread_mutex_lock(&u->lock);
+	for ( i = 0; i < u->cfg.num_xfers; ++i ) {
+		u->slot[i].t_submit = cyusb_stats_begin(u->h, u->cfg.endpoint);
+		r = cyusb_backend->submit_transfer(u->slot[i].xfer);
+		if ( r ) {
+		   cyusb_stats_abort(u->h, u->cfg.endpoint, u->slot[i].t_submit);
+		   u->last_error = r;
+		   break;
+		}
+		u->slot[i].submitted = 1;
+		++u->in_flight;
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	if ( r )
+	   cyusb_uvc_stop(u);
+	return r;
+}
+
+int cyusb_uvc_stop(struct cyusb_uvc *u)
+{
+	int i;
+	int pending;
+
+	pthread_mutex_lock(&u->lock);
+	if ( !u->running ) {
+	   pthread_mutex_unlock(&u->lock);
+	   return 0;
+	}
+	u->running = 0;
+	if ( u->iso ) {
+	   for ( i = 0; i < u->cfg.num_xfers; ++i ) {
+		   if ( u->slot[i].submitted )
+		      cyusb_backend->cancel_transfer(u->slot[i].xfer);
+	   }
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	if ( u->iso ) {
+	   while ( 1 ) {
+		   pthread_mutex_lock(&u->lock);
+		   pending = u->in_flight;
+		   pthread_mutex_unlock(&u->lock);
+		   if ( pending == 0 )
+		      break;
+		   cyusb_handle_events(100);
+	   }
+	   /* Alternate setting 0 releases the isochronous bandwidth and stops the stream. */
+	   cyusb_set_interface_alt_setting(u->h, u->cfg.interface, 0);
+	}
+	else {
+	   cyusb_stream_stop(u->stream);
+	   /* A bulk video stream is stopped with a CLEAR_FEATURE(ENDPOINT_HALT). */
+	   cyusb_clear_halt(u->h, u->cfg.endpoint);
+	}
+
+	pthread_mutex_lock(&u->lock);
+	if ( u->cur >= 0 )
+	   u->state[u->cur] = FRAME_FREE;
+	u->cur = -1;
+	pthread_mutex_unlock(&u->lock);
+
+	return u->last_error;
+}
+
+int cyusb_uvc_get_frame(struct cyusb_uvc *u, struct cyusb_uvc_frame **frame, unsigned int timeout)
+{
+	unsigned long long deadline = now_ns() / 1000000 + timeout;
+	unsigned long long now;
+	unsigned int wait;
+	struct timeval tv;
+	int idx;
+	int r;
+
+	while ( 1 ) {
+		pthread_mutex_lock(&u->lock);
+		if ( u->q_count > 0 ) {
+		   idx = u->queue[u->q_head];
+		   u->q_head = (u->q_head + 1) % u->num_frames;
+		   --u->q_count;
+		   u->state[idx] = FRAME_HELD;
+		   pthread_mutex_unlock(&u->lock);
+		   *frame = &u->frame[idx];
+		   return 0;
+		}
+		if ( !u->running ) {
+		   r = u->last_error ? u->last_error : LIBUSB_ERROR_NOT_FOUND;
+		   pthread_mutex_unlock(&u->lock);
+		   return r;
+		}
+		pthread_mutex_unlock(&u->lock);
+
+		wait = 100;
+		if ( timeout ) {
+		   now = now_ns() / 1000000;
+		   if ( now >= deadline )
+		      return LIBUSB_ERROR_TIMEOUT;
+		   if ( deadline - now < wait )
+		      wait = (unsigned int)(deadline - now);
+		}
+		tv.tv_sec  = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		r = cyusb_backend->handle_events(&tv, NULL);
+		if ( ( r ) && ( r != LIBUSB_ERROR_INTERRUPTED ) )
+		   return r;
+	}
+}
+
+int cyusb_uvc_put_frame(struct cyusb_uvc *u, struct cyusb_uvc_frame *frame)
+{
+	if ( ( frame == NULL ) || ( frame->index < 0 ) || ( frame->index >= u->num_frames ) ||
+	     ( &u->frame[frame->index] != frame ) )
+	   return LIBUSB_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&u->lock);
+	if ( u->state[frame->index] != FRAME_HELD ) {
+	   pthread_mutex_unlock(&u->lock);
+	   return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	u->state[frame->index] = FRAME_FREE;
+	pthread_mutex_unlock(&u->lock);
+	return 0;
+}
+
+void cyusb_uvc_get_probe(struct cyusb_uvc *u, struct cyusb_uvc_probe *probe)
+{
+	*probe = u->probe;
+}
+
+void cyusb_uvc_get_stats(struct cyusb_uvc *u, struct cyusb_uvc_stats *stats)
+{
+	double mean, var;
+
+	pthread_mutex_lock(&u->lock);
+	*stats = u->stats;
+	stats->last_error = u->last_error;
+	if ( u->intervals ) {
+	   mean = u->interval_sum / u->intervals;
+	   var  = u->interval_sumsq / u->intervals - mean * mean;
+	   stats->fps             = 1e9 / mean;
+	   stats->interval_us     = mean / 1e3;
+	   stats->interval_max_us = u->interval_max / 1e3;
+	   stats->jitter_us       = ( var > 0 ) ? sqrt(var) / 1e3 : 0;
+	}
+	pthread_mutex_unlock(&u->lock);
+}
+
+void cyusb_uvc_destroy(struct cyusb_uvc *u)
+{
+	int i;
+
+	if ( u == NULL )
+	   return;
+
+	cyusb_uvc_stop(u);
+	cyusb_stream_destroy(u->stream);
+	for ( i = 0; i < u->cfg.num_xfers; ++i ) {
+		if ( u->slot[i].xfer )
+		   libusb_free_transfer(u->slot[i].xfer);
+	}
+	cyusb_pool_destroy(u->pool);
+	for ( i = 0; i < u->num_frames; ++i )
+		free(u->frame[i].data);
+	pthread_mutex_destroy(&u->lock);
+	free(u);
+}
@@ -16,9 +16,13 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <libusb-1.0/libusb.h>
 #include "../include/cyusb.h"
+#include "cyusb_internal.h"
 
 /* Maximum length of a string read from the Configuration file (/etc/cyusb.conf) for the library. */
 #define MAX_CFG_LINE_LENGTH                     (120)
@@ -37,7 +41,21 @@ static struct VPD vpd[MAX_ID_PAIRS];
 static int maxdevices;
 static int numdev;
 static libusb_device **list;
-static unsigned int checksum = 0;
+
+/* Incremental device registry, maintained from libusb hotplug events once enabled. The hotplug
+   callback only records arrivals and departures in hotplug_state[]; devices are opened and
+   closed by cyusb_hotplug_poll(), on the client's thread. The lock is recursive so that
+   cyusb_lock_devices() callers can use the public accessors. */
+#define SLOT_ARRIVING		(1)	/* Device reference taken, not opened yet */
+#define SLOT_LEFT		(2)	/* Device gone, handle still open */
+
+static pthread_mutex_t cydev_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static int hotplug_active;
+static libusb_hotplug_callback_handle hotplug_handle;
+static cyusb_hotplug_cb hotplug_user_cb;
+static void *hotplug_user_data;
+static unsigned char hotplug_ref[MAXDEVICES];	/* Slot holds a device reference taken on arrival */
+static unsigned char hotplug_state[MAXDEVICES];	/* SLOT_xxx, or 0 */
 
 char pidfile[256];
 char logfile[256];
@@ -159,13 +177,26 @@ unsigned short cyusb_getproduct(cyusb_handle *h)
 	return d.idProduct;
 } 
 
-static int renumerate(void)
+/* libusb backend. Most operations map directly onto libusb; the adapters below cover the ones
+   that take a context or a libusb_device instead of a handle. */
+static int lu_init(void)
 {
-	cyusb_device *dev = NULL;
-	cyusb_handle *handle = NULL;
-	int found = 0;
+	return ( libusb_init(NULL) );
+}
+
+static void lu_exit(void)
+{
+	if ( list != NULL )
+	   libusb_free_device_list(list, 1);
+	list = NULL;
+	libusb_exit(NULL);
+}
+
+/* Open every attached device listed in /etc/cyusb.conf. */
+static int lu_open_devices(cyusb_handle **handles, int max)
+{
+	int n = 0;
 	int i;
-	int r;
 
 	numdev = libusb_get_device_list(NULL, &list);
 	if ( numdev < 0 ) {
@@ -173,45 +204,256 @@ static int renumerate(void)
 	   return -4;
 	}
 
-	nid = 0;
-
-	for ( i = 0; i < numdev; ++i ) {
-		cyusb_device *tdev = list[i];
-		if ( device_is_of_interest(tdev) ) {
-		   cydev[nid].dev = tdev;
-		   r = libusb_open(tdev, &cydev[nid].handle);
-		   if ( r ) {
+	for ( i = 0; ( i < numdev ) && ( n < max ); ++i ) {
+		if ( device_is_of_interest(list[i]) ) {
+		   if ( libusb_open(list[i], &handles[n]) ) {
 		      printf("Error in opening device\n");
 		      return -5;
 		   }
-		   else handle = cydev[nid].handle;
-		   cydev[nid].vid     = cyusb_getvendor(handle);
-		   cydev[nid].pid     = cyusb_getproduct(handle);
-		   cydev[nid].is_open = 1;
-		   cydev[nid].busnum  = cyusb_get_busnumber(handle);
-		   cydev[nid].devaddr = cyusb_get_devaddr(handle);
-		   ++nid;
+		   ++n;
 		}
 	}
+	return n;
+}
+
+static cyusb_handle * lu_open_vid_pid(unsigned short vid, unsigned short pid)
+{
+	return ( libusb_open_device_with_vid_pid(NULL, vid, pid) );
+}
+
+static int lu_get_device_descriptor(cyusb_handle *h, struct libusb_device_descriptor *desc)
+{
+	return ( libusb_get_device_descriptor(libusb_get_device(h), desc) );
+}
+
+static int lu_get_active_config_descriptor(cyusb_handle *h, struct libusb_config_descriptor **config)
+{
+	return ( libusb_get_active_config_descriptor(libusb_get_device(h), config) );
+}
+
+static int lu_get_config_descriptor(cyusb_handle *h, unsigned char index,
+		struct libusb_config_descriptor **config)
+{
+	return ( libusb_get_config_descriptor(libusb_get_device(h), index, config) );
+}
+
+static int lu_get_config_descriptor_by_value(cyusb_handle *h, unsigned char value,
+		struct libusb_config_descriptor **config)
+{
+	return ( libusb_get_config_descriptor_by_value(libusb_get_device(h), value, config) );
+}
+
+static int lu_get_descriptor(cyusb_handle *h, unsigned char type, unsigned char index,
+		unsigned char *data, int length)
+{
+	return ( libusb_get_descriptor(h, type, index, data, length) );
+}
+
+static int lu_get_string_descriptor(cyusb_handle *h, unsigned char index, unsigned short langid,
+		unsigned char *data, int length)
+{
+	return ( libusb_get_string_descriptor(h, index, langid, data, length) );
+}
+
+static int lu_get_bus_number(cyusb_handle *h)
+{
+	return ( libusb_get_bus_number(libusb_get_device(h)) );
+}
+
+static int lu_get_device_address(cyusb_handle *h)
+{
+	return ( libusb_get_device_address(libusb_get_device(h)) );
+}
+
+static int lu_get_max_packet_size(cyusb_handle *h, unsigned char endpoint)
+{
+	return ( libusb_get_max_packet_size(libusb_get_device(h), endpoint) );
+}
+
+static int lu_get_max_iso_packet_size(cyusb_handle *h, unsigned char endpoint)
+{
+	return ( libusb_get_max_iso_packet_size(libusb_get_device(h), endpoint) );
+}
+
+static int lu_handle_events(struct timeval *tv, int *completed)
+{
+	return ( libusb_handle_events_timeout_completed(NULL, tv, completed) );
+}
+
+/* libusb_interrupt_event_handler() and libusb_dev_mem_alloc() first appeared in libusb 1.0.21
+   (API version 0x01000105). */
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+static void lu_interrupt_events(void)
+{
+	libusb_interrupt_event_handler(NULL);
+}
+
+static unsigned char * lu_dev_mem_alloc(cyusb_handle *h, size_t length)
+{
+	return ( libusb_dev_mem_alloc(h, length) );
+}
+
+static int lu_dev_mem_free(cyusb_handle *h, unsigned char *buffer, size_t length)
+{
+	return ( libusb_dev_mem_free(h, buffer, length) );
+}
+#else
+static void lu_interrupt_events(void)
+{
+}
+
+#define lu_dev_mem_alloc	NULL
+#define lu_dev_mem_free		NULL
+#endif
+
+#ifdef CYUSB_HAVE_BULK_STREAMS
+static int lu_alloc_streams(cyusb_handle *h, unsigned int num_streams, unsigned char *endpoints,
+		int num_endpoints)
+{
+	return ( libusb_alloc_streams(h, num_streams, endpoints, num_endpoints) );
+}
+
+static int lu_free_streams(cyusb_handle *h, unsigned char *endpoints, int num_endpoints)
+{
+	return ( libusb_free_streams(h, endpoints, num_endpoints) );
+}
+#else
+#define lu_alloc_streams	NULL
+#define lu_free_streams		NULL
+#endif
+
+static int lu_get_pollfds(struct pollfd *fds, int max)
+{
+	const struct libusb_pollfd **pfds;
+	int n = 0;
+
+	pfds = libusb_get_pollfds(NULL);
+	if ( pfds == NULL )
+	   return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	while ( ( pfds[n] != NULL ) && ( n < max ) ) {
+		fds[n].fd      = pfds[n]->fd;
+		fds[n].events  = pfds[n]->events;
+		fds[n].revents = 0;
+		++n;
+	}
+	libusb_free_pollfds(pfds);
+	return n;
+}
+
+static int lu_get_next_timeout(struct timeval *tv)
+{
+	return ( libusb_get_next_timeout(NULL, tv) );
+}
+
+static const struct cyusb_backend libusb_backend = {
+	"libusb",
+	lu_init,
+	lu_exit,
+	lu_open_devices,
+	lu_open_vid_pid,
+	libusb_close,
+	libusb_get_device,
+	lu_get_device_descriptor,
+	lu_get_active_config_descriptor,
+	lu_get_config_descriptor,
+	lu_get_config_descriptor_by_value,
+	libusb_free_config_descriptor,
+	libusb_get_string_descriptor_ascii,
+	lu_get_descriptor,
+	lu_get_string_descriptor,
+	lu_get_bus_number,
+	lu_get_device_address,
+	lu_get_max_packet_size,
+	lu_get_max_iso_packet_size,
+	libusb_get_configuration,
+	libusb_set_configuration,
+	libusb_claim_interface,
+	libusb_release_interface,
+	libusb_set_interface_alt_setting,
+	libusb_clear_halt,
+	libusb_reset_device,
+	libusb_kernel_driver_active,
+	libusb_detach_kernel_driver,
+	libusb_attach_kernel_driver,
+	libusb_control_transfer,
+	libusb_bulk_transfer,
+	libusb_interrupt_transfer,
+	libusb_submit_transfer,
+	libusb_cancel_transfer,
+	lu_handle_events,
+	lu_interrupt_events,
+	lu_dev_mem_alloc,
+	lu_dev_mem_free,
+	lu_get_pollfds,
+	lu_get_next_timeout,
+	lu_alloc_streams,
+	lu_free_streams,
+	1
+};
+
+const struct cyusb_backend *cyusb_backend = &libusb_backend;
+
+static int renumerate(void)
+{
+	cyusb_handle *handles[MAXDEVICES];
+	cyusb_handle *handle = NULL;
+	int n;
+
+	nid = 0;
+	n = cyusb_backend->open_devices(handles, MAXDEVICES);
+	if ( n < 0 )
+	   return n;
+
+	for ( nid = 0; nid < n; ++nid ) {
+		handle = handles[nid];
+		cydev[nid].dev     = cyusb_backend->get_device(handle);
+		cydev[nid].handle  = handle;
+		cydev[nid].vid     = cyusb_getvendor(handle);
+		cydev[nid].pid     = cyusb_getproduct(handle);
+		cydev[nid].is_open = 1;
+		cydev[nid].busnum  = cyusb_get_busnumber(handle);
+		cydev[nid].devaddr = cyusb_get_devaddr(handle);
+	}
 	return nid;
 }
 
+/* Select the backend for this session (see struct cyusb_backend) and apply CYUSB_STATS. */
+static void select_backend(void)
+{
+	const char *name = getenv("CYUSB_BACKEND");
+
+	if ( ( name != NULL ) && ( strcmp(name, cyusb_mock_backend.name) == 0 ) )
+	   cyusb_backend = &cyusb_mock_backend;
+	else cyusb_backend = &libusb_backend;
+
+	/* Statistics can be turned on for an unmodified application. */
+	name = getenv("CYUSB_STATS");
+	if ( ( name != NULL ) && ( atoi(name) ) )
+	   cyusb_stats_enable(1);
+}
+
 int cyusb_open(void)
 {
 	int fd1;
 	int r;
 
+	select_backend();
+
+	/* The software model needs no configuration; every emulated device is of interest. */
 	fd1 = open("/etc/cyusb.conf", O_RDONLY);
 	if ( fd1 < 0 ) {
-	   printf("/etc/cyusb.conf file not found. Exiting\n");
-	   return -1;
+	   if ( cyusb_backend == &libusb_backend ) {
+	      printf("/etc/cyusb.conf file not found. Exiting\n");
+	      return -1;
+	   }
 	}
 	else {
 	   close(fd1);
 	   parse_configfile();	/* Parses the file and stores critical information inside exported data structures */
 	}
 
-	r = libusb_init(NULL);
+	r = cyusb_backend->init();
 	if (r) {
 	      printf("Error in initializing libusb library...\n");
 	      return -2;
@@ -226,17 +468,18 @@ int cyusb_open(unsigned short vid, unsigned short pid)
 	int r;
 	cyusb_handle *h = NULL;
 	
-	r = libusb_init(NULL);
+	select_backend();
+	r = cyusb_backend->init();
 	if (r) {
 	      printf("Error in initializing libusb library...\n");
 	      return -1;
 	}
-	h = libusb_open_device_with_vid_pid(NULL, vid, pid);
+	h = cyusb_backend->open_vid_pid(vid, pid);
 	if ( !h ) {
 	   printf("Device not found\n");
 	   return -2;
 	}
-	cydev[0].dev     = libusb_get_device(h);
+	cydev[0].dev     = cyusb_backend->get_device(h);
 	cydev[0].handle  = h;
   	cydev[nid].vid     = cyusb_getvendor(h);
 	cydev[nid].pid     = cyusb_getproduct(h);
@@ -278,148 +521,343 @@ void cyusb_error(int err)
 
 cyusb_handle * cyusb_gethandle(int index)	
 {
-	return cydev[index].handle;
+	cyusb_handle *h;
+
+	pthread_mutex_lock(&cydev_lock);
+	h = ( hotplug_state[index] == SLOT_LEFT ) ? NULL : cydev[index].handle;
+	pthread_mutex_unlock(&cydev_lock);
+	return h;
+}
+
+void cyusb_lock_devices(void)
+{
+	pthread_mutex_lock(&cydev_lock);
+}
+
+void cyusb_unlock_devices(void)
+{
+	pthread_mutex_unlock(&cydev_lock);
+}
+
+/* Close and forget slot i, whatever its hotplug state. Called with cydev_lock held. */
+static void release_slot(int i)
+{
+	if ( cydev[i].is_open ) {
+	   cyusb_stats_forget_handle(cydev[i].handle);
+	   cyusb_backend->close(cydev[i].handle);
+	}
+	if ( hotplug_ref[i] )
+	   libusb_unref_device(cydev[i].dev);
+	hotplug_ref[i]   = 0;
+	hotplug_state[i] = 0;
+	memset(&cydev[i], 0, sizeof(struct cydev));
 }
 
 void cyusb_close(void)
 {
 	int i;
 
+	cyusb_hotplug_disable();
+	pthread_mutex_lock(&cydev_lock);
+	for ( i = 0; i < nid; ++i )
+		release_slot(i);
+	nid = 0;
+	pthread_mutex_unlock(&cydev_lock);
+	cyusb_stats_forget();
+	cyusb_backend->exit();
+}
+
+/* Return the cydev[] slot holding the given device, opened or about to be, or -1. Called with
+   cydev_lock held. */
+static int find_device_slot(cyusb_device *dev)
+{
+	int i;
+
 	for ( i = 0; i < nid; ++i ) {
-		libusb_close(cydev[i].handle);
+	    if ( ( cydev[i].dev == dev ) && ( hotplug_state[i] != SLOT_LEFT ) &&
+		 ( ( cydev[i].is_open ) || ( hotplug_state[i] == SLOT_ARRIVING ) ) )
+	       return i;
 	}
-	libusb_free_device_list(list, 1);
-	libusb_exit(NULL);
+	return -1;
+}
+
+/* Reserve a slot for a device of interest. libusb_open() may not be called from a hotplug
+   callback, so the device is only referenced here and opened by cyusb_hotplug_poll(). */
+static int device_arrived(cyusb_device *dev)
+{
+	int i;
+
+	if ( !device_is_of_interest(dev) )
+	   return -1;
+
+	pthread_mutex_lock(&cydev_lock);
+
+	/* Devices present when cyusb_open() ran are reported again when hotplug is enabled. */
+	if ( find_device_slot(dev) >= 0 ) {
+	   pthread_mutex_unlock(&cydev_lock);
+	   return -1;
+	}
+
+	for ( i = 0; i < MAXDEVICES; ++i ) {
+	    if ( ( !cydev[i].is_open ) && ( !hotplug_state[i] ) )
+	       break;
+	}
+	if ( i == MAXDEVICES ) {
+	   pthread_mutex_unlock(&cydev_lock);
+	   printf("Library: No free device slot for new device\n");
+	   return -1;
+	}
+
+	hotplug_ref[i]   = 1;
+	hotplug_state[i] = SLOT_ARRIVING;
+	cydev[i].dev     = libusb_ref_device(dev);
+	if ( i >= nid )
+	   nid = i + 1;
+
+	pthread_mutex_unlock(&cydev_lock);
+	return i;
+}
+
+/* Mark the slot of a departed device. Its handle stays open, and fails with
+   LIBUSB_ERROR_NO_DEVICE, until cyusb_hotplug_poll() closes it. */
+static int device_left(cyusb_device *dev)
+{
+	int i;
+
+	pthread_mutex_lock(&cydev_lock);
+	i = find_device_slot(dev);
+	if ( i >= 0 )
+	   hotplug_state[i] = SLOT_LEFT;
+	pthread_mutex_unlock(&cydev_lock);
+	return i;
+}
+
+static int hotplug_callback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event,
+		void *user_data)
+{
+	int arrived = ( event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED );
+	int i;
+
+	i = ( arrived ) ? device_arrived(dev) : device_left(dev);
+	if ( ( i >= 0 ) && ( hotplug_user_cb ) )
+	   hotplug_user_cb(i, arrived, hotplug_user_data);
+	return 0;
+}
+
+int cyusb_hotplug_poll(void)
+{
+	cyusb_handle *handle;
+	int i, n = 0;
+
+	pthread_mutex_lock(&cydev_lock);
+	for ( i = 0; i < nid; ++i ) {
+		if ( hotplug_state[i] == SLOT_LEFT ) {
+		   release_slot(i);
+		   ++n;
+		}
+		else if ( hotplug_state[i] == SLOT_ARRIVING ) {
+		   ++n;
+		   hotplug_state[i] = 0;
+		   if ( libusb_open(cydev[i].dev, &handle) ) {
+		      printf("Error in opening device\n");
+		      release_slot(i);
+		      continue;
+		   }
+		   cydev[i].handle  = handle;
+		   cydev[i].vid     = cyusb_getvendor(handle);
+		   cydev[i].pid     = cyusb_getproduct(handle);
+		   cydev[i].busnum  = cyusb_get_busnumber(handle);
+		   cydev[i].devaddr = cyusb_get_devaddr(handle);
+		   cydev[i].is_open = 1;
+		}
+	}
+	while ( ( nid > 0 ) && ( !cydev[nid - 1].is_open ) && ( !hotplug_state[nid - 1] ) )
+		--nid;
+	pthread_mutex_unlock(&cydev_lock);
+	return n;
+}
+
+int cyusb_hotplug_enable(cyusb_hotplug_cb cb, void *user_data)
+{
+	int r;
+
+	if ( hotplug_active )
+	   return LIBUSB_ERROR_BUSY;
+	if ( ( !cyusb_backend->has_hotplug ) || ( !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) ) )
+	   return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	hotplug_user_cb   = cb;
+	hotplug_user_data = user_data;
+
+	/* Enumerate so that devices attached since cyusb_open() are not missed. */
+	r = libusb_hotplug_register_callback(NULL,
+			(libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+			LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &hotplug_handle);
+	if ( r ) {
+	   hotplug_user_cb = NULL;
+	   return r;
+	}
+	hotplug_active = 1;
+	return 0;
+}
+
+void cyusb_hotplug_disable(void)
+{
+	if ( !hotplug_active )
+	   return;
+	libusb_hotplug_deregister_callback(NULL, hotplug_handle);
+	hotplug_active = 0;
+	hotplug_user_cb = NULL;
+}
+
+int cyusb_get_device_slots(void)
+{
+	int n;
+
+	pthread_mutex_lock(&cydev_lock);
+	n = nid;
+	pthread_mutex_unlock(&cydev_lock);
+	return n;
 }
 
 int cyusb_get_busnumber(cyusb_handle *h)
 {
-	cyusb_device *tdev = libusb_get_device(h);
-	return libusb_get_bus_number( tdev );
+	return ( cyusb_backend->get_bus_number(h) );
 }
 
 int cyusb_get_devaddr(cyusb_handle *h)
 {
-	cyusb_device *tdev = libusb_get_device(h);
-	return libusb_get_device_address( tdev );
+	return ( cyusb_backend->get_device_address(h) );
 }
 
 int cyusb_get_max_packet_size(cyusb_handle *h, unsigned char endpoint)
 {
-	cyusb_device *tdev = libusb_get_device(h);
-	return ( libusb_get_max_packet_size(tdev, endpoint) );
+	return ( cyusb_backend->get_max_packet_size(h, endpoint) );
 }
 
 int cyusb_get_max_iso_packet_size(cyusb_handle *h, unsigned char endpoint)
 {
-	cyusb_device *tdev = libusb_get_device(h);
-	return ( libusb_get_max_iso_packet_size(tdev, endpoint) );
+	return ( cyusb_backend->get_max_iso_packet_size(h, endpoint) );
 }
 
 int cyusb_get_configuration(cyusb_handle *h, int *config)
 {
-	return ( libusb_get_configuration(h, config) );
+	return ( cyusb_backend->get_configuration(h, config) );
 }
 
 int cyusb_set_configuration(cyusb_handle *h, int config)
 {
-	return ( libusb_set_configuration(h, config) );
+	return ( cyusb_backend->set_configuration(h, config) );
 }
 
 int cyusb_claim_interface(cyusb_handle *h, int interface)
 {
-	return ( libusb_claim_interface(h, interface) );
+	return ( cyusb_backend->claim_interface(h, interface) );
 }
 
 int cyusb_release_interface(cyusb_handle *h, int interface)
 {
-	return ( libusb_release_interface(h, interface) );
+	return ( cyusb_backend->release_interface(h, interface) );
 }
 
 int cyusb_set_interface_alt_setting(cyusb_handle *h, int interface, int altsetting)
 {
-	return ( libusb_set_interface_alt_setting(h, interface, altsetting) );
+	return ( cyusb_backend->set_interface_alt_setting(h, interface, altsetting) );
 }
 
 int cyusb_clear_halt(cyusb_handle *h, unsigned char endpoint)
 {
-	return ( libusb_clear_halt(h, endpoint) );
+	return ( cyusb_backend->clear_halt(h, endpoint) );
 }
 
 int cyusb_reset_device(cyusb_handle *h)
 {
-	return ( libusb_reset_device(h) );
+	return ( cyusb_backend->reset_device(h) );
 }
 
 int cyusb_kernel_driver_active(cyusb_handle *h, int interface)
 {
-	return ( libusb_kernel_driver_active(h, interface) );
+	return ( cyusb_backend->kernel_driver_active(h, interface) );
 }
 
 int cyusb_detach_kernel_driver(cyusb_handle *h, int interface)
 {
-	return ( libusb_detach_kernel_driver(h, interface) );
+	return ( cyusb_backend->detach_kernel_driver(h, interface) );
 }
 
 int cyusb_attach_kernel_driver(cyusb_handle *h, int interface)
 {
-	return ( libusb_attach_kernel_driver(h, interface) );
+	return ( cyusb_backend->attach_kernel_driver(h, interface) );
 }
 
 int cyusb_get_device_descriptor(cyusb_handle *h, struct libusb_device_descriptor *desc)
 {
-	cyusb_device *tdev = libusb_get_device(h);
-	return ( libusb_get_device_descriptor(tdev, desc ) );
+	return ( cyusb_backend->get_device_descriptor(h, desc) );
 }
 
 int cyusb_get_active_config_descriptor(cyusb_handle *h, struct libusb_config_descriptor **config)
 {
-	cyusb_device *tdev = libusb_get_device(h);
-	return ( libusb_get_active_config_descriptor(tdev, config) );
+	return ( cyusb_backend->get_active_config_descriptor(h, config) );
 }
 
 int cyusb_get_config_descriptor(cyusb_handle *h, unsigned char config_index, struct libusb_config_descriptor **config)
 {
-	cyusb_device *tdev = libusb_get_device(h);
-	return ( libusb_get_config_descriptor(tdev, config_index, config) );
+	return ( cyusb_backend->get_config_descriptor(h, config_index, config) );
 }
 
 int cyusb_get_config_descriptor_by_value(cyusb_handle *h, unsigned char bConfigurationValue, 
 									struct usb_config_descriptor **config)
 {
-	cyusb_device *tdev = libusb_get_device(h);
-	return ( libusb_get_config_descriptor_by_value(tdev, bConfigurationValue,
+	return ( cyusb_backend->get_config_descriptor_by_value(h, bConfigurationValue,
                     (struct libusb_config_descriptor **)config) );
 }
 
 void cyusb_free_config_descriptor(struct libusb_config_descriptor *config)
 {
-	libusb_free_config_descriptor( (libusb_config_descriptor *)config );
+	cyusb_backend->free_config_descriptor( (libusb_config_descriptor *)config );
 }
 
 int cyusb_get_string_descriptor_ascii(cyusb_handle *h, unsigned char index, unsigned char *data,  int length)
 {
-	cyusb_device *tdev = libusb_get_device(h);
-	return ( libusb_get_string_descriptor_ascii(h, index, data, length) );
+	return ( cyusb_backend->get_string_descriptor_ascii(h, index, data, length) );
 }
 
 int cyusb_get_descriptor(cyusb_handle *h, unsigned char desc_type, unsigned char desc_index, unsigned char *data,
         int len)
 {
-	return ( libusb_get_descriptor(h, desc_type, desc_index, data, len) );
+	return ( cyusb_backend->get_descriptor(h, desc_type, desc_index, data, len) );
 }
 
 int cyusb_get_string_descriptor(cyusb_handle *h, unsigned char desc_index, unsigned short langid, 
 								unsigned char *data, int len)
 {
-	return ( libusb_get_string_descriptor(h, desc_index, langid, data, len) );
+	return ( cyusb_backend->get_string_descriptor(h, desc_index, langid, data, len) );
+}
+
+/* Synchronous control transfer, counted in the statistics when they are on. */
+static int control_transfer(cyusb_handle *h, unsigned char bmRequestType, unsigned char bRequest,
+        unsigned short wValue, unsigned short wIndex, unsigned char *data, unsigned short wLength,
+        unsigned int timeout)
+{
+	unsigned char ep = bmRequestType & LIBUSB_ENDPOINT_DIR_MASK;
+	unsigned long long start;
+	int r;
+
+	if ( !cyusb_stats_on )
+	   return ( cyusb_backend->control_transfer(h, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout) );
+
+	start = cyusb_stats_begin(h, ep);
+	r = cyusb_backend->control_transfer(h, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+	cyusb_stats_end(h, ep, start, ( r < 0 ) ? r : 0, wLength, ( r < 0 ) ? 0 : r);
+	return r;
 }
 
 int cyusb_control_transfer(cyusb_handle *h, unsigned char bmRequestType, unsigned char bRequest,
         unsigned short wValue, unsigned short wIndex, unsigned char *data, unsigned short wLength,
         unsigned int timeout)
 {
-	return ( libusb_control_transfer(h, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout) );
+	return ( control_transfer(h, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout) );
 }
 
 int cyusb_control_read (cyusb_handle *h, unsigned char bmRequestType, unsigned char bRequest,
@@ -427,7 +865,7 @@ int cyusb_control_read (cyusb_handle *h, unsigned char bmRequestType, unsigned c
         unsigned int timeout)
 {
 	/* Set the direction bit to indicate a read transfer. */
-	return ( libusb_control_transfer(h, bmRequestType | 0x80, bRequest, wValue, wIndex, data, wLength, timeout) );
+	return ( control_transfer(h, bmRequestType | 0x80, bRequest, wValue, wIndex, data, wLength, timeout) );
 }
 
 int cyusb_control_write (cyusb_handle *h, unsigned char bmRequestType, unsigned char bRequest,
@@ -435,121 +873,394 @@ int cyusb_control_write (cyusb_handle *h, unsigned char bmRequestType, unsigned
         unsigned int timeout)
 {
 	/* Clear the direction bit to indicate a write transfer. */
-	return ( libusb_control_transfer(h, bmRequestType & 0x7F, bRequest, wValue, wIndex, data, wLength, timeout) );
+	return ( control_transfer(h, bmRequestType & 0x7F, bRequest, wValue, wIndex, data, wLength, timeout) );
 }
 
 int cyusb_bulk_transfer(cyusb_handle *h, unsigned char endpoint, unsigned char *data, int length, 
 				int *transferred, int timeout)
 {
-	return ( libusb_bulk_transfer(h, endpoint, data, length, transferred, timeout) );
+	unsigned long long start;
+	int n = 0;
+	int r;
+
+	/* The caller may pass a NULL transferred, and the count is not set on every error. */
+	if ( !cyusb_stats_on )
+	   r = cyusb_backend->bulk_transfer(h, endpoint, data, length, &n, timeout);
+	else {
+	   start = cyusb_stats_begin(h, endpoint);
+	   r = cyusb_backend->bulk_transfer(h, endpoint, data, length, &n, timeout);
+	   cyusb_stats_end(h, endpoint, start, r, length, ( r < 0 ) ? 0 : n);
+	}
+	if ( transferred != NULL )
+	   *transferred = n;
+	return r;
 }
 
 int cyusb_interrupt_transfer(cyusb_handle *h, unsigned char endpoint, unsigned char *data, int length,
 				int *transferred, unsigned int timeout)
 {
-	return ( libusb_interrupt_transfer(h, endpoint, data, length, transferred, timeout) );
+	unsigned long long start;
+	int n = 0;
+	int r;
+
+	/* The caller may pass a NULL transferred, and the count is not set on every error. */
+	if ( !cyusb_stats_on )
+	   r = cyusb_backend->interrupt_transfer(h, endpoint, data, length, &n, timeout);
+	else {
+	   start = cyusb_stats_begin(h, endpoint);
+	   r = cyusb_backend->interrupt_transfer(h, endpoint, data, length, &n, timeout);
+	   cyusb_stats_end(h, endpoint, start, r, length, ( r < 0 ) ? 0 : n);
+	}
+	if ( transferred != NULL )
+	   *transferred = n;
+	return r;
+}
+
+int cyusb_submit_transfer(struct libusb_transfer *xfer)
+{
+	return ( cyusb_backend->submit_transfer(xfer) );
+}
+
+int cyusb_cancel_transfer(struct libusb_transfer *xfer)
+{
+	return ( cyusb_backend->cancel_transfer(xfer) );
+}
+
+int cyusb_alloc_streams(cyusb_handle *h, unsigned int num_streams, unsigned char *endpoints,
+		int num_endpoints)
+{
+	if ( cyusb_backend->alloc_streams == NULL )
+	   return LIBUSB_ERROR_NOT_SUPPORTED;
+	return ( cyusb_backend->alloc_streams(h, num_streams, endpoints, num_endpoints) );
 }
 
-int cyusb_download_fx2(cyusb_handle *h, char *filename, unsigned char vendor_command)
+int cyusb_free_streams(cyusb_handle *h, unsigned char *endpoints, int num_endpoints)
+{
+	if ( cyusb_backend->free_streams == NULL )
+	   return LIBUSB_ERROR_NOT_SUPPORTED;
+	return ( cyusb_backend->free_streams(h, endpoints, num_endpoints) );
+}
+
+/* Address of the FX2 CPUCS register, written through 0xA0 to hold the 8051 in reset. */
+#define FX2_CPUCS_ADDR		(0xE600)
+
+static int fx2_cpu_reset(cyusb_handle *h, unsigned char reset)
 {
-	FILE *fp = NULL;
-	char buf[256];
-	char tbuf1[3];
-	char tbuf2[5];
-	char tbuf3[3];
-	unsigned char reset = 0;
 	int r;
+
+	r = cyusb_control_transfer(h, 0x40, 0xA0, FX2_CPUCS_ADDR, 0x00, &reset, 0x01, 1000);
+	if ( r != 1 ) {
+	   printf("Error in control_transfer\n");
+	   return ( r < 0 ) ? r : LIBUSB_ERROR_IO;
+	}
+	return 0;
+}
+
+int cyusb_download_fx2(cyusb_handle *h, const char *filename, unsigned char vendor_command)
+{
+	struct cyusb_hex_image img;
+	struct cyusb_hex_segment *seg;
+	unsigned int offset;
+	unsigned int b;
 	int count = 0;
-	unsigned char num_bytes = 0;
-	unsigned short address = 0;
-	unsigned char *dbuf = NULL;
+	int line;
+	int r;
 	int i;
 
+	r = cyusb_hex_load(filename, &img, &line);
+	if ( r ) {
+	   if ( line )
+	      printf("Error in hex file %s at line %d\n", filename, line);
+	   else printf("Error in reading hex file %s\n", filename);
+	   return r;
+	}
 
-	fp = fopen(filename, "r" );
-	tbuf1[2] ='\0';
-	tbuf2[4] = '\0';
-	tbuf3[2] = '\0';
-
-	reset = 1;
-	r = cyusb_control_transfer(h, 0x40, 0xA0, 0xE600, 0x00, &reset, 0x01, 1000);
-	if ( !r ) {
-	   printf("Error in control_transfer\n");
+	r = fx2_cpu_reset(h, 1);
+	if ( r ) {
+	   cyusb_hex_free(&img);
 	   return r;
 	}
-	sleep(1);
-	
-	count = 0;
 
-	while ( fgets(buf, 256, fp) != NULL ) {
-		if ( buf[8] == '1' )
-		   break;
-		strncpy(tbuf1,buf+1,2);
-		num_bytes = strtoul(tbuf1,NULL,16);
-		strncpy(tbuf2,buf+3,4);
-		address = strtoul(tbuf2,NULL,16);
-		dbuf = (unsigned char *)malloc(num_bytes);
-		for ( i = 0; i < num_bytes; ++i ) {
-		    strncpy(tbuf3,&buf[9+i*2],2);
-		    dbuf[i] = strtoul(tbuf3,NULL,16);
-		}
-		r = cyusb_control_transfer(h, 0x40, vendor_command, address, 0x00, dbuf, num_bytes, 1000);
-		if ( !r ) {
-	   	   printf("Error in control_transfer\n");
-		   free(dbuf);
-	   	   return r;
+	for ( i = 0; i < img.num_segments; ++i ) {
+		seg = &img.segments[i];
+		for ( offset = 0; offset < seg->length; offset += b ) {
+			b = seg->length - offset;
+			if ( b > CYUSB_HEX_MAX_RUN )
+			   b = CYUSB_HEX_MAX_RUN;
+			r = cyusb_control_transfer(h, 0x40, vendor_command, (seg->address + offset) & 0xFFFF,
+					(seg->address + offset) >> 16, seg->data + offset, b, 1000);
+			if ( r != (int)b ) {
+			   printf("Error in control_transfer\n");
+			   cyusb_hex_free(&img);
+			   return ( r < 0 ) ? r : LIBUSB_ERROR_IO;
+			}
+			count += b;
 		}
-	     	count += num_bytes;
-		free(dbuf);
 	}
 	printf("Total bytes downloaded = %d\n", count);
-	sleep(1);
-	reset = 0;
-	r = cyusb_control_transfer(h, 0x40, 0xA0, 0xE600, 0x00, &reset, 0x01, 1000);
-	fclose(fp);
-	return 0;
+	cyusb_hex_free(&img);
+
+	return fx2_cpu_reset(h, 0);
+}
+
+
+/* FX3 RAM download: bytes per 0xA0 vendor request, and number of requests kept in flight. */
+#define FX3_DL_CHUNK		(4096)
+#define FX3_DL_DEPTH		(8)
+#define FX3_DL_TIMEOUT		(5000)
+
+/* Packed images (elf2img -compress) have three word record headers, with the record type and
+   payload size in the third word. Only the second stage boot firmware understands them: raw
+   records are written with 0xA0 as usual, zero-fill and LZ4 records are sent whole, header
+   included, with 0xA2 and expanded on the device. */
+#define FX3_IMG_NORMAL		(0xB0)
+#define FX3_IMG_PACKED		(0xB4)
+#define FX3_REC_RAW		(0)
+#define FX3_REC_ZERO		(1)
+#define FX3_REC_LZ4		(2)
+#define FX3_REC_TYPE(w)		((w) >> 24)
+#define FX3_REC_PAYLOAD(w)	((w) & 0x00FFFFFF)
+#define FX3_REC_PADDED(n)	(((n) + 3) & ~3u)
+
+struct fx3_dl_state {
+	volatile int pending;		/* Requests submitted and not yet completed */
+	volatile int error;		/* First error seen by a completion */
+	volatile int busy[FX3_DL_DEPTH];
+};
+
+struct fx3_dl_slot {
+	struct libusb_transfer *xfer;
+	struct fx3_dl_state    *state;
+	int                     index;
+	unsigned long long      t_submit;	// From cyusb_stats_submit()
+};
+
+static void fx3_dl_callback(struct libusb_transfer *xfer)
+{
+	struct fx3_dl_slot *slot = (struct fx3_dl_slot *)xfer->user_data;
+	struct fx3_dl_state *st = slot->state;
+
+	cyusb_stats_completed(xfer, slot->t_submit);
+	if ( ( xfer->status != LIBUSB_TRANSFER_COMPLETED ) ||
+	     ( xfer->actual_length != (int)(xfer->length - LIBUSB_CONTROL_SETUP_SIZE) ) ) {
+	   if ( st->error == 0 )
+	      st->error = ( xfer->status == LIBUSB_TRANSFER_COMPLETED ) ? LIBUSB_ERROR_IO :
+		      cyusb_transfer_status_to_error(xfer->status);
+	}
+	st->busy[slot->index] = 0;
+	__sync_fetch_and_sub(&st->pending, 1);
+}
+
+/* Validate an FX3 boot image in one pass: header, section bounds and checksum. On success
+   *entry receives the program entry point. The checksum of a packed image covers the expanded
+   data, which only the boot firmware sees, so only the record layout is checked here. */
+static int fx3_validate_image(const unsigned char *img, size_t size, unsigned int *entry)
+{
+	const unsigned int *w;
+	unsigned int sum = 0;
+	unsigned int length;
+	unsigned int payload;
+	unsigned int i;
+	size_t offset = 4;
+
+	if ( ( size < 4 ) || ( strncmp((const char *)img, "CY", 2) ) ) {
+	   printf("Image does not have 'CY' at start. aborting\n");
+	   return -2;
+	}
+	if ( img[2] & 0x01 ) {
+	   printf("Image does not contain executable code\n");
+	   return -3;
+	}
+	if ( img[3] == FX3_IMG_PACKED ) {
+	   while ( offset + 12 <= size ) {
+		w = (const unsigned int *)(img + offset);
+		if ( w[0] == 0 ) {
+		   *entry = w[1];
+		   return 0;
+		}
+		payload = FX3_REC_PAYLOAD(w[2]);
+		switch ( FX3_REC_TYPE(w[2]) ) {
+		case FX3_REC_RAW:
+			if ( payload != w[0] * 4 ) {
+			   printf("Bad record in packed image\n");
+			   return -6;
+			}
+			break;
+		case FX3_REC_ZERO:
+		case FX3_REC_LZ4:
+			if ( 12 + FX3_REC_PADDED(payload) > FX3_DL_CHUNK ) {
+			   printf("Bad record in packed image\n");
+			   return -6;
+			}
+			break;
+		default:
+			printf("Bad record in packed image\n");
+			return -6;
+		}
+		if ( FX3_REC_PADDED(payload) > size - offset - 12 )
+		   break;
+		offset += 12 + FX3_REC_PADDED(payload);
+	   }
+	   printf("Image is truncated\n");
+	   return -6;
+	}
+	if ( !(img[3] == FX3_IMG_NORMAL) ) {
+	   printf("Not a normal FW binary with checksum\n");
+	   return -4;
+	}
+
+	while ( 1 ) {
+		if ( offset + 8 > size )
+		   break;
+		w = (const unsigned int *)(img + offset);
+		length = w[0];
+		if ( length == 0 ) {
+		   if ( offset + 12 > size )
+		      break;
+		   if ( w[2] != sum ) {
+		      printf("Error in checksum\n");
+		      return -5;
+		   }
+		   *entry = w[1];
+		   return 0;
+		}
+		if ( length > ( size - offset - 8 ) / 4 )
+		   break;
+		for ( i = 0; i < length; ++i )
+			sum += w[2 + i];
+		offset += 8 + (size_t)length * 4;
+	}
+
+	printf("Image is truncated\n");
+	return -6;
 }
 
+/* Wait for a download slot to become free, or for everything to complete if slot is NULL. */
+static int fx3_dl_wait(struct fx3_dl_state *st, int *slot)
+{
+	struct timeval tv;
+	int i;
+
+	while ( 1 ) {
+		if ( st->error )
+		   return st->error;
+		if ( slot != NULL ) {
+		   for ( i = 0; i < FX3_DL_DEPTH; ++i ) {
+			if ( !st->busy[i] ) {
+			   *slot = i;
+			   return 0;
+			}
+		   }
+		}
+		else if ( st->pending == 0 )
+		   return 0;
+
+		tv.tv_sec  = 0;
+		tv.tv_usec = 100000;
+		cyusb_backend->handle_events(&tv, NULL);
+	}
+}
 
-static void control_transfer(cyusb_handle *h, unsigned int address, unsigned char *dbuf, int len)
+/* Queue one vendor request of b bytes, at most FX3_DL_CHUNK, on a free download slot. */
+static int fx3_dl_submit(cyusb_handle *h, unsigned char request, unsigned int address,
+		const unsigned char *src, int b, struct fx3_dl_slot *slots, unsigned char *bufs,
+		struct fx3_dl_state *st)
 {
-	int j;
+	unsigned char *buf;
+	int i;
 	int r;
+
+	r = fx3_dl_wait(st, &i);
+	if ( r )
+	   return r;
+
+	buf = bufs + i * (LIBUSB_CONTROL_SETUP_SIZE + FX3_DL_CHUNK);
+	libusb_fill_control_setup(buf, 0x40, request, ( address & 0x0000ffff ), address >> 16, b);
+	memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, src, b);
+	libusb_fill_control_transfer(slots[i].xfer, h, buf, fx3_dl_callback, &slots[i],
+			FX3_DL_TIMEOUT);
+
+	st->busy[i] = 1;
+	__sync_fetch_and_add(&st->pending, 1);
+	r = cyusb_stats_submit(slots[i].xfer, &slots[i].t_submit);
+	if ( r ) {
+	   st->busy[i] = 0;
+	   __sync_fetch_and_sub(&st->pending, 1);
+	}
+	return r;
+}
+
+static int fx3_download_sections(cyusb_handle *h, const unsigned char *img,
+		struct fx3_dl_slot *slots, unsigned char *bufs, struct fx3_dl_state *st)
+{
+	const unsigned int *w;
+	unsigned int address;
+	unsigned int length;
+	unsigned int payload;
+	size_t offset = 4;
+	size_t hdr = ( img[3] == FX3_IMG_PACKED ) ? 12 : 8;
+	int remaining;
 	int b;
-	unsigned int *pint;
-	int index;
+	int r;
+	const unsigned char *src;
+
+	while ( 1 ) {
+		w = (const unsigned int *)(img + offset);
+		length  = w[0];
+		address = w[1];
+		if ( length == 0 )
+		   return 0;
+
+		payload = length * 4;
+		if ( hdr == 12 ) {
+		   payload = FX3_REC_PADDED(FX3_REC_PAYLOAD(w[2]));
+		   if ( FX3_REC_TYPE(w[2]) != FX3_REC_RAW ) {
+		      r = fx3_dl_submit(h, 0xA2, 0, img + offset, 12 + payload, slots, bufs, st);
+		      if ( r )
+			 return r;
+		      offset += 12 + payload;
+		      continue;
+		   }
+		}
+
+		src       = img + offset + hdr;
+		remaining = length * 4;
+		while ( remaining > 0 ) {
+			b = ( remaining > FX3_DL_CHUNK ) ? FX3_DL_CHUNK : remaining;
 
-	int balance = len;
-	pint = (unsigned int *)dbuf;
+			r = fx3_dl_submit(h, 0xA0, address, src, b, slots, bufs, st);
+			if ( r )
+			   return r;
 
-	index = 0;
-	while ( balance > 0 ) {
-	      if ( balance > 4096 )
-	 	 b = 4096;
-	      else b = balance;
-	      r = cyusb_control_transfer(h, 0x40, 0xA0, ( address & 0x0000ffff ), address >> 16, &dbuf[index], b, 1000);
-	      if ( r != b ) {
-	   	   printf("Error in control_transfer\n");
-	      }
-	      address += b ;
-	      balance -= b;
-	      index += b;
+			address   += b;
+			src       += b;
+			remaining -= b;
+		}
+		offset += hdr + payload;
 	}
-	for ( j = 0; j < len/4; ++j )
-	    checksum += pint[j];
+}
+
+int cyusb_check_fx3_image(const unsigned char *img, int size, unsigned int *entry)
+{
+	unsigned int program_entry = 0;
+	int r;
+
+	r = fx3_validate_image(img, ( size < 0 ) ? 0 : size, &program_entry);
+	if ( ( r == 0 ) && ( entry != NULL ) )
+	   *entry = program_entry;
+	return r;
 }
 
 int cyusb_download_fx3(cyusb_handle *h, const char *filename)
 {
 	int fd;
-	unsigned char buf[1000000];
-	int nbr;
-	int dlen;
-	int count;
-	unsigned int *pdbuf = NULL;
-	unsigned int address;
-	unsigned int *pint;
-	unsigned int program_entry;
+	struct stat st;
+	unsigned char *img;
+	unsigned char *bufs = NULL;
+	struct fx3_dl_slot slots[FX3_DL_DEPTH];
+	struct fx3_dl_state state;
+	unsigned int program_entry = 0;
+	int i;
 	int r;
 
 	fd = open(filename, O_RDONLY);
@@ -557,52 +1268,69 @@ int cyusb_download_fx3(cyusb_handle *h, const char *filename)
 	   printf("File not found\n");
 	   return -1;
 	}
-	else printf("File successfully opened\n");
-	count = 0;
-	checksum = 0;
-	nbr = read(fd, buf, 2);		/* Read first 2 bytes, must be equal to 'CY'	*/
-	if ( strncmp((char *)buf,"CY",2) ) {
+	if ( ( fstat(fd, &st) != 0 ) || ( st.st_size < 4 ) ) {
 	   printf("Image does not have 'CY' at start. aborting\n");
+	   close(fd);
 	   return -2;
 	}
-	nbr = read(fd, buf, 1);		/* Read 1 byte. bImageCTL	*/
-	if ( buf[0] & 0x01 ) {
-	   printf("Image does not contain executable code\n");
-	   return -3;
+	img = (unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( img == MAP_FAILED ) {
+	   printf("File not found\n");
+	   return -1;
 	}
-	nbr = read(fd, buf, 1);		/* Read 1 byte. bImageType	*/
-	if ( !(buf[0] == 0xB0) ) {
-	   printf("Not a normal FW binary with checksum\n");
-	   return -4;
+	printf("File successfully opened\n");
+
+	/* Nothing is sent to the device unless the whole image is consistent. */
+	r = fx3_validate_image(img, st.st_size, &program_entry);
+	if ( r ) {
+	   munmap(img, st.st_size);
+	   return r;
 	}
-	while (1) {
-	   nbr = read(fd, buf, 4);	/* Read Length of section 1,2,3, ...	*/
-	   pdbuf = (unsigned int *)buf;
-	   dlen = *pdbuf;
-	   nbr = read(fd,buf,4);	/* Read Address of section 1,2,3,...	*/
-	   pint = (unsigned int *)buf;   
-	   address = *pint;
-	   if ( dlen != 0 ) {
-	      nbr = read(fd, buf, dlen*4);	/* Read data bytes	*/
-	      control_transfer(h, address, buf, dlen*4);
-	   }
-	   else {
-	      program_entry = address;
-	      break;
+
+	memset(&state, 0, sizeof(state));
+	memset(slots, 0, sizeof(slots));
+	bufs = (unsigned char *)malloc(FX3_DL_DEPTH * (LIBUSB_CONTROL_SETUP_SIZE + FX3_DL_CHUNK));
+	r = ( bufs == NULL ) ? LIBUSB_ERROR_NO_MEM : 0;
+	for ( i = 0; ( i < FX3_DL_DEPTH ) && ( r == 0 ); ++i ) {
+		slots[i].state = &state;
+		slots[i].index = i;
+		slots[i].xfer  = libusb_alloc_transfer(0);
+		if ( slots[i].xfer == NULL )
+		   r = LIBUSB_ERROR_NO_MEM;
+	}
+
+	if ( r == 0 )
+	   r = fx3_download_sections(h, img, slots, bufs, &state);
+
+	/* Every request must have been reaped before the buffers go away; on error cancel the
+	   rest. The bootloader is ready for the jump once all writes have been acknowledged. */
+	if ( r ) {
+	   for ( i = 0; i < FX3_DL_DEPTH; ++i ) {
+		if ( state.busy[i] )
+		   cyusb_backend->cancel_transfer(slots[i].xfer);
 	   }
 	}
-	nbr = read(fd, buf, 4);			/* Read checksum	*/
-	pdbuf = (unsigned int *)buf;
-	if ( *pdbuf != checksum ) {
-	   printf("Error in checksum\n");
-	   return -5;
+	while ( state.pending )
+		cyusb_handle_events(100);
+	if ( r == 0 )
+	   r = state.error;
+
+	for ( i = 0; i < FX3_DL_DEPTH; ++i ) {
+		if ( slots[i].xfer )
+		   libusb_free_transfer(slots[i].xfer);
 	}
-	sleep(1);
+	free(bufs);
+	munmap(img, st.st_size);
+
+	if ( r ) {
+	   printf("Error in control_transfer\n");
+	   return -7;
+	}
+
 	r = cyusb_control_transfer(h, 0x40, 0xA0, (program_entry & 0x0000ffff ) , program_entry >> 16, NULL, 0, 1000);
 	if ( r ) {
 	   printf("Ignored error in control_transfer: %d\n", r);
 	}
-	close(fd);
 	return 0;
 }
-
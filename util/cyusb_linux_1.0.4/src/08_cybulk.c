@@ -55,27 +55,19 @@ static void validate_inputs(void)
 	}   
 }
 
-static void *reader(void *arg1)
-{
-	int r;
-	unsigned char buf[64];
-	int transferred = 0;
-
-	memset(buf,'\0',64);
-	while (1) {
-		r = cyusb_bulk_transfer(h1, 0x86, buf, 64, &transferred, timeout * 1000);
-		if ( r == 0 ) {
-		   printf("%s", buf);
-		   memset(buf,'\0',64);
-		   continue;
-		}
-		else {
-			cyusb_error(r);
-			cyusb_close();
-			return NULL;
-		}
-	} 
+/* Number of IN transfers kept queued on the bulkloop IN endpoint. */
+#define NUM_READ_XFERS	4
 
+/* Called from the libcyusb event thread for every completed IN transfer. */
+static int reader(struct cyusb_stream *stream, struct cyusb_stream_buffer *buf, void *user_data)
+{
+	if ( ( buf->status != 0 ) && ( buf->status != LIBUSB_ERROR_TIMEOUT ) ) {
+	   cyusb_error(buf->status);
+	   return 0;
+	}
+	fwrite(buf->data, 1, buf->actual_length, stdout);
+	fflush(stdout);
+	return buf->length;
 }
 
 static void * writer(void *arg2)
@@ -105,7 +97,8 @@ int main(int argc, char **argv)
 {
 	int r;
 	char user_input = 'n';
-	pthread_t tid1, tid2;
+	pthread_t tid2;
+	struct cyusb_stream *rd;
 
 	program_name = argv[0];
 	
@@ -163,7 +156,20 @@ int main(int argc, char **argv)
 	   return 0;
 	}
 	else printf("Successfully claimed interface\n");
-	r = pthread_create(&tid1, NULL, reader, NULL);
+	rd = cyusb_stream_create(h1, 0x86, NUM_READ_XFERS, 64, timeout * 1000, reader, NULL);
+	if ( rd == NULL ) {
+	   printf("Error in allocating IN transfers\n");
+	   cyusb_close();
+	   return 0;
+	}
+	r = cyusb_event_thread_start(-1, 0);
+	if ( r == 0 )
+	   r = cyusb_stream_start(rd);
+	if ( r != 0 ) {
+	   cyusb_error(r);
+	   cyusb_close();
+	   return 0;
+	}
 	r = pthread_create(&tid2, NULL, writer, NULL);
 	while ( 1) {
 		pause();
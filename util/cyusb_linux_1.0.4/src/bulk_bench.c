@@ -0,0 +1,594 @@
+/*
+ * Filename             : bulk_bench.c
+ * Description          : Bulk throughput and latency benchmark for FX3 devices running the
+ *                        cyfxbulksrcsink or cyfxbulklpautoenum firmware. Sweeps transfer size
+ *                        and queue depth, and reports throughput, per-transfer latency
+ *                        percentiles and CPU usage for every combination. With the
+ *                        cyfxbulkstreams firmware, it can also spread the load over several
+ *                        USB 3.0 bulk streams per endpoint, each with its own queue. Data can
+ *                        be filled with a test pattern and checked on arrival at full rate.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+#define BOOTLOADER_VID		(0x04b4)	// USB VID for the FX3 boot loader.
+#define BOOTLOADER_PID		(0x00f3)	// USB PID for the FX3 boot loader.
+
+#define DEFAULT_EP_IN		(0x81)		// Bulk IN endpoint of the FX3 bulk examples.
+#define DEFAULT_EP_OUT		(0x01)		// Bulk OUT endpoint of the FX3 bulk examples.
+#define DEFAULT_SECONDS		(2)		// Measurement time for each point of the sweep.
+#define WARMUP_MS		(200)		// Time the queue runs before measurement starts.
+#define XFER_TIMEOUT		(1000)		// Timeout (in milliseconds) for each transfer.
+#define MAX_SWEEP		(16)		// Max. number of values in a size or depth list.
+#define MAX_SAMPLES		(1 << 20)	// Max. number of latency samples kept per point.
+#define MAX_STREAMS		(32)		// Max. number of bulk streams per endpoint.
+#define SRCSINK_PATTERN		(0xAA)		// Byte sent by cyfxbulksrcsink (CY_FX_BULKSRCSINK_PATTERN).
+
+#define ENUM_TIMEOUT		(5)		// Timeout (in seconds) for the firmware to enumerate.
+#define ENUM_POLL_MS		(100)		// Interval (in milliseconds) between checks for the device.
+
+/* Direction(s) in which data is moved. */
+typedef enum {
+	BENCH_IN = 0,		// Read from the IN endpoint (bulksrcsink source)
+	BENCH_OUT,		// Write to the OUT endpoint (bulksrcsink sink)
+	BENCH_BOTH,		// Read and write at the same time (bulksrcsink)
+	BENCH_LOOP		// Write and read back the same data (bulklpautoenum)
+} bench_mode;
+
+static const char *mode_names[] = { "in", "out", "both", "loop" };
+
+/* Output format for the results. */
+typedef enum {
+	FMT_TEXT = 0,
+	FMT_CSV,
+	FMT_JSON
+} bench_format;
+
+/* Counters for one endpoint. Only updated from the libcyusb event thread. */
+typedef struct {
+	unsigned long long bytes;
+	unsigned long long xfers;
+	unsigned long long errors;
+	unsigned long long submitted[CYUSB_STREAM_MAX_XFERS];	// Time each buffer was last queued, in ns.
+	int out;				// Set for an OUT endpoint.
+	struct cyusb_pattern pat;		// Generator for OUT data, when verifying.
+	unsigned long long corrupt;		// IN transfers that failed verification.
+	unsigned long long first_bad;		// Transfer and offset of the first failure.
+	long long first_bad_offset;
+} bench_dir;
+
+/* Latency samples of the current point, shared by both directions. */
+static unsigned int       *samples;
+static int                 nsamples;
+static volatile int        measuring;
+
+/* Test pattern written to OUT and expected on IN, or -1 to move data unchecked. */
+static int                 pattern = -1;
+
+static unsigned long long
+now_ns (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* Stream callback for both directions. The latency of a transfer is measured from the time the
+   buffer was queued, which is when the previous callback for it returned, to its completion. */
+static int
+bench_callback (
+		struct cyusb_stream        *stream,
+		struct cyusb_stream_buffer *buf,
+		void                       *user_data)
+{
+	bench_dir *dir = (bench_dir *)user_data;
+	unsigned long long now = now_ns ();
+	long long bad;
+
+	// OUT buffers are handed over once before their first submission; the data is kept after that.
+	if ((dir->submitted[buf->index] == 0) && (dir->out) && (pattern >= 0))
+		cyusb_pattern_fill (&dir->pat, buf->data, buf->length);
+
+	if ((dir->submitted[buf->index] != 0) && (measuring)) {
+		if (buf->status != 0)
+			dir->errors++;
+		else {
+			dir->bytes += buf->actual_length;
+			dir->xfers++;
+			if (nsamples < MAX_SAMPLES)
+				samples[nsamples++] = (unsigned int)((now - dir->submitted[buf->index]) / 1000);
+			if ((!dir->out) && (pattern >= 0)) {
+				bad = cyusb_pattern_check (pattern, SRCSINK_PATTERN, buf->data, buf->actual_length);
+				if ((bad >= 0) && (dir->corrupt++ == 0)) {
+					dir->first_bad        = dir->xfers;
+					dir->first_bad_offset = bad;
+				}
+			}
+		}
+	}
+
+	dir->submitted[buf->index] = now_ns ();
+	return buf->length;
+}
+
+static int
+compare_uint (
+		const void *a,
+		const void *b)
+{
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+
+	return (x > y) - (x < y);
+}
+
+static unsigned int
+percentile (
+		int pct)
+{
+	int i;
+
+	if (nsamples == 0)
+		return 0;
+	i = (int)(((long long)nsamples * pct + 99) / 100) - 1;
+	return samples[(i < 0) ? 0 : i];
+}
+
+/* Parse a comma separated list of sizes, with optional K or M suffixes. */
+static int
+parse_list (
+		const char *str,
+		int        *list)
+{
+	char *end;
+	int   n = 0;
+	long  v;
+
+	while ((*str != '\0') && (n < MAX_SWEEP)) {
+		v = strtol (str, &end, 0);
+		if (end == str)
+			return -1;
+		if ((*end == 'k') || (*end == 'K')) {
+			v *= 1024;
+			end++;
+		} else if ((*end == 'm') || (*end == 'M')) {
+			v *= 1024 * 1024;
+			end++;
+		}
+		if (v <= 0)
+			return -1;
+		list[n++] = (int)v;
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		str = end;
+	}
+
+	return n;
+}
+
+static double
+tv_seconds (
+		struct timeval *tv)
+{
+	return (tv->tv_sec + tv->tv_usec / 1e6);
+}
+
+/* Run one point of the sweep and print its results. */
+static int
+run_point (
+		cyusb_handle *h,
+		bench_mode    mode,
+		unsigned char ep_in,
+		unsigned char ep_out,
+		int           size,
+		int           depth,
+		int           streams,
+		int           seconds,
+		bench_format  fmt,
+		int           first)
+{
+	struct cyusb_stream *in[MAX_STREAMS], *out[MAX_STREAMS];
+	static bench_dir     din[MAX_STREAMS], dout[MAX_STREAMS];
+	struct rusage        ru0, ru1;
+	unsigned long long   t0, t1, bytes, xfers, errors, corrupt, sbytes, min_bytes;
+	double               elapsed, cpu, mbps, min_mbps;
+	int nchan = (streams) ? streams : 1;
+	int r = 0;
+	int i;
+
+	memset (in, 0, sizeof (in));
+	memset (out, 0, sizeof (out));
+	memset (din, 0, sizeof (din));
+	memset (dout, 0, sizeof (dout));
+	for (i = 0; i < nchan; i++) {
+		dout[i].out = 1;
+		if (pattern >= 0)
+			cyusb_pattern_init (&dout[i].pat, pattern, SRCSINK_PATTERN);
+	}
+	nsamples  = 0;
+	measuring = 0;
+
+	/* One queue per bulk stream, so that the streams proceed independently of each other. */
+	for (i = 0; (i < nchan) && (r == 0); i++) {
+		if (mode != BENCH_OUT) {
+			in[i] = cyusb_stream_create (h, ep_in, depth, size, XFER_TIMEOUT, bench_callback, &din[i]);
+			if ((in[i] == NULL) || ((streams) && (cyusb_stream_set_stream_id (in[i], i + 1) != 0))) {
+				fprintf (stderr, "Error: Failed to create IN stream (%d x %d bytes)\n", depth, size);
+				r = -ENOMEM;
+			}
+		}
+		if ((mode != BENCH_IN) && (r == 0)) {
+			out[i] = cyusb_stream_create (h, ep_out, depth, size, XFER_TIMEOUT, bench_callback, &dout[i]);
+			if ((out[i] == NULL) || ((streams) && (cyusb_stream_set_stream_id (out[i], i + 1) != 0))) {
+				fprintf (stderr, "Error: Failed to create OUT stream (%d x %d bytes)\n", depth, size);
+				r = -ENOMEM;
+			}
+		}
+	}
+	if (r != 0)
+		goto out;
+
+	// Start the readers first, so that looped back data always has a buffer to land in.
+	for (i = 0; (i < nchan) && (r == 0); i++) {
+		if (in[i] != NULL)
+			r = cyusb_stream_start (in[i]);
+	}
+	for (i = 0; (i < nchan) && (r == 0); i++) {
+		if (out[i] != NULL)
+			r = cyusb_stream_start (out[i]);
+	}
+	if (r != 0) {
+		fprintf (stderr, "Error: Failed to start streams\n");
+		cyusb_error (r);
+		goto out;
+	}
+
+	usleep (WARMUP_MS * 1000);
+
+	getrusage (RUSAGE_SELF, &ru0);
+	t0 = now_ns ();
+	measuring = 1;
+	sleep (seconds);
+	measuring = 0;
+	t1 = now_ns ();
+	getrusage (RUSAGE_SELF, &ru1);
+
+	for (i = 0; i < nchan; i++) {
+		if (out[i] != NULL)
+			cyusb_stream_stop (out[i]);
+		if (in[i] != NULL)
+			cyusb_stream_stop (in[i]);
+	}
+
+	elapsed = (t1 - t0) / 1e9;
+	cpu     = (tv_seconds (&ru1.ru_utime) - tv_seconds (&ru0.ru_utime)) +
+		(tv_seconds (&ru1.ru_stime) - tv_seconds (&ru0.ru_stime));
+	qsort (samples, nsamples, sizeof (unsigned int), compare_uint);
+
+	// In loop mode the data is counted once, as it arrives back.
+	bytes = xfers = errors = corrupt = 0;
+	min_bytes = ~0ULL;
+	for (i = 0; i < nchan; i++) {
+		sbytes   = din[i].bytes + ((mode == BENCH_LOOP) ? 0 : dout[i].bytes);
+		bytes   += sbytes;
+		xfers   += din[i].xfers + dout[i].xfers;
+		errors  += din[i].errors + dout[i].errors;
+		corrupt += din[i].corrupt;
+		if (sbytes < min_bytes)
+			min_bytes = sbytes;
+		if ((din[i].corrupt) && (streams))
+			fprintf (stderr, "Warning: %llu IN transfer(s) on stream %d failed verification, first at "
+					"offset %lld of transfer %llu\n", din[i].corrupt, i + 1, din[i].first_bad_offset,
+					din[i].first_bad);
+		else if (din[i].corrupt)
+			fprintf (stderr, "Warning: %llu IN transfer(s) failed verification, first at offset %lld "
+					"of transfer %llu\n", din[i].corrupt, din[i].first_bad_offset, din[i].first_bad);
+	}
+	mbps     = bytes / elapsed / 1e6;
+	min_mbps = min_bytes / elapsed / 1e6;
+
+	switch (fmt) {
+		case FMT_CSV:
+			if (first)
+				printf ("mode,streams,size,depth,seconds,bytes,transfers,errors,mbps,min_stream_mbps,"
+						"lat_p50_us,lat_p90_us,lat_p99_us,lat_max_us,cpu_pct,corrupt\n");
+			printf ("%s,%d,%d,%d,%.3f,%llu,%llu,%llu,%.2f,%.2f,%u,%u,%u,%u,%.1f,%llu\n", mode_names[mode],
+					streams, size, depth, elapsed, bytes, xfers, errors, mbps, min_mbps, percentile (50),
+					percentile (90), percentile (99), percentile (100), 100.0 * cpu / elapsed, corrupt);
+			break;
+		case FMT_JSON:
+			printf ("%s  {\"mode\": \"%s\", \"streams\": %d, \"size\": %d, \"depth\": %d, "
+					"\"seconds\": %.3f, \"bytes\": %llu, \"transfers\": %llu, \"errors\": %llu, "
+					"\"mbps\": %.2f, \"min_stream_mbps\": %.2f, \"lat_p50_us\": %u, \"lat_p90_us\": %u, "
+					"\"lat_p99_us\": %u, \"lat_max_us\": %u, \"cpu_pct\": %.1f, \"corrupt\": %llu}",
+					(first) ? "" : ",\n", mode_names[mode], streams, size, depth, elapsed, bytes, xfers,
+					errors, mbps, min_mbps, percentile (50), percentile (90), percentile (99),
+					percentile (100), 100.0 * cpu / elapsed, corrupt);
+			break;
+		default:
+			if ((first) && (streams))
+				printf ("%-5s %7s %9s %5s %10s %10s %9s %9s %9s %9s %6s %6s\n", "mode", "streams", "size",
+						"depth", "MB/s", "min MB/s", "p50 us", "p90 us", "p99 us", "max us", "cpu %",
+						"errors");
+			else if (first)
+				printf ("%-5s %9s %5s %10s %9s %9s %9s %9s %6s %6s\n", "mode", "size", "depth", "MB/s",
+						"p50 us", "p90 us", "p99 us", "max us", "cpu %", "errors");
+			if (streams)
+				printf ("%-5s %7d %9d %5d %10.2f %10.2f %9u %9u %9u %9u %6.1f %6llu\n", mode_names[mode],
+						streams, size, depth, mbps, min_mbps, percentile (50), percentile (90),
+						percentile (99), percentile (100), 100.0 * cpu / elapsed, errors);
+			else
+				printf ("%-5s %9d %5d %10.2f %9u %9u %9u %9u %6.1f %6llu\n", mode_names[mode], size,
+						depth, mbps, percentile (50), percentile (90), percentile (99), percentile (100),
+						100.0 * cpu / elapsed, errors);
+			break;
+	}
+	fflush (stdout);
+
+out:
+	for (i = 0; i < nchan; i++) {
+		cyusb_stream_destroy (out[i]);
+		cyusb_stream_destroy (in[i]);
+	}
+	return r;
+}
+
+/* Download the benchmark firmware if the device is still in boot loader mode, and return a
+   handle to the device once the firmware has enumerated. */
+static cyusb_handle *
+load_firmware (
+		cyusb_handle *h,
+		const char   *image)
+{
+	int i, n;
+
+	if ((cyusb_getvendor (h) != BOOTLOADER_VID) || (cyusb_getproduct (h) != BOOTLOADER_PID))
+		return h;
+
+	fprintf (stderr, "Info: Downloading %s to FX3 RAM\n", image);
+	if (cyusb_download_fx3 (h, image) != 0) {
+		fprintf (stderr, "Error: Failed to download %s\n", image);
+		return NULL;
+	}
+
+	cyusb_close ();
+	for (i = 0; i < (ENUM_TIMEOUT * 1000) / ENUM_POLL_MS; i++) {
+		usleep (ENUM_POLL_MS * 1000);
+		n = cyusb_open ();
+		if (n > 0) {
+			h = cyusb_gethandle (0);
+			if ((cyusb_getvendor (h) != BOOTLOADER_VID) || (cyusb_getproduct (h) != BOOTLOADER_PID))
+				return h;
+		}
+		if (n >= 0)
+			cyusb_close ();
+	}
+
+	fprintf (stderr, "Error: Device did not enumerate with the new firmware\n");
+	return NULL;
+}
+
+static void
+print_usage_info (
+		const char *arg0)
+{
+	printf ("%s: FX3 bulk throughput and latency benchmark\n\n", arg0);
+	printf ("Usage:\n");
+	printf ("\t%s [options]\n\n", arg0);
+	printf ("\t-m <mode>   : \"in\", \"out\" or \"both\" for cyfxbulksrcsink, \"loop\" for\n");
+	printf ("\t              cyfxbulklpautoenum (default \"in\")\n");
+	printf ("\t-s <sizes>  : Comma separated transfer sizes, K and M suffixes allowed\n");
+	printf ("\t              (default 16K,64K,256K,1M)\n");
+	printf ("\t-q <depths> : Comma separated queue depths, up to %d (default 1,2,4,8,16,32)\n",
+			CYUSB_STREAM_MAX_XFERS);
+	printf ("\t-t <secs>   : Measurement time for each point (default %d)\n", DEFAULT_SECONDS);
+	printf ("\t-i <ep>     : IN endpoint (default 0x%02x)\n", DEFAULT_EP_IN);
+	printf ("\t-o <ep>     : OUT endpoint (default 0x%02x)\n", DEFAULT_EP_OUT);
+	printf ("\t-S <count>  : Spread the load over <count> USB 3.0 bulk streams per endpoint, up to %d,\n",
+			MAX_STREAMS);
+	printf ("\t              each with its own queue of <depth> transfers (cyfxbulkstreams)\n");
+	printf ("\t-V <name>   : Fill OUT data with a test pattern and check IN data against it: \"const\"\n");
+	printf ("\t              (0x%02x, as sent by cyfxbulksrcsink), \"count8\", \"count32\", \"prbs31\"\n",
+			SRCSINK_PATTERN);
+	printf ("\t              or \"lfsr32\"\n");
+	printf ("\t-f <format> : Output as \"text\", \"csv\" or \"json\" (default \"text\")\n");
+	printf ("\t-l <image>  : Download <image> first if the device is in boot loader mode,\n");
+	printf ("\t              e.g. fx3_images/cyfxbulksrcsink.img\n");
+	printf ("\t-c <cpu>    : Pin the event thread to <cpu>\n");
+	printf ("\t-h          : Print this help message\n");
+	printf ("\n");
+}
+
+int main (
+		int    argc,
+		char **argv)
+{
+	cyusb_handle *h;
+	bench_mode    mode = BENCH_IN;
+	bench_format  fmt  = FMT_TEXT;
+	const char   *image = NULL;
+	unsigned char ep_in = DEFAULT_EP_IN, ep_out = DEFAULT_EP_OUT;
+	int sizes[MAX_SWEEP] = { 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+	int depths[MAX_SWEEP] = { 1, 2, 4, 8, 16, 32 };
+	int nsizes = 4, ndepths = 6;
+	int seconds = DEFAULT_SECONDS;
+	int streams = 0;
+	unsigned char stream_eps[2];
+	int nstream_eps = 0;
+	int cpu = -1;
+	int first = 1;
+	int i, j, r, opt;
+
+	while ((opt = getopt (argc, argv, "hm:s:q:t:i:o:S:V:f:l:c:")) != -1) {
+		switch (opt) {
+			case 'm':
+				for (i = 0; i < 4; i++)
+					if (strcasecmp (optarg, mode_names[i]) == 0)
+						break;
+				if (i == 4) {
+					fprintf (stderr, "Error: Unknown mode %s\n", optarg);
+					return -EINVAL;
+				}
+				mode = (bench_mode)i;
+				break;
+			case 's':
+				nsizes = parse_list (optarg, sizes);
+				break;
+			case 'q':
+				ndepths = parse_list (optarg, depths);
+				for (i = 0; i < ndepths; i++)
+					if (depths[i] > CYUSB_STREAM_MAX_XFERS)
+						ndepths = -1;
+				break;
+			case 't':
+				seconds = atoi (optarg);
+				break;
+			case 'i':
+				ep_in = (unsigned char)strtoul (optarg, NULL, 0);
+				break;
+			case 'o':
+				ep_out = (unsigned char)strtoul (optarg, NULL, 0);
+				break;
+			case 'S':
+				streams = atoi (optarg);
+				break;
+			case 'V':
+				pattern = cyusb_pattern_from_name (optarg);
+				if (pattern < 0) {
+					fprintf (stderr, "Error: Unknown pattern %s\n", optarg);
+					return -EINVAL;
+				}
+				break;
+			case 'f':
+				if (strcasecmp (optarg, "csv") == 0)
+					fmt = FMT_CSV;
+				else if (strcasecmp (optarg, "json") == 0)
+					fmt = FMT_JSON;
+				else
+					fmt = FMT_TEXT;
+				break;
+			case 'l':
+				image = optarg;
+				break;
+			case 'c':
+				cpu = atoi (optarg);
+				break;
+			case 'h':
+				print_usage_info (argv[0]);
+				return 0;
+			default:
+				print_usage_info (argv[0]);
+				return -EINVAL;
+		}
+	}
+	if ((nsizes <= 0) || (ndepths <= 0) || (seconds <= 0) || (streams < 0) || (streams > MAX_STREAMS)) {
+		fprintf (stderr, "Error: Invalid size, depth, time or stream count\n");
+		print_usage_info (argv[0]);
+		return -EINVAL;
+	}
+	if ((streams) && (mode == BENCH_LOOP)) {
+		fprintf (stderr, "Error: Bulk streams are not supported by the loopback firmware\n");
+		return -EINVAL;
+	}
+
+	samples = (unsigned int *)malloc (MAX_SAMPLES * sizeof (unsigned int));
+	if (samples == NULL) {
+		fprintf (stderr, "Error: Out of memory\n");
+		return -ENOMEM;
+	}
+
+	r = cyusb_open ();
+	if (r < 0) {
+		fprintf (stderr, "Error opening library\n");
+		return -ENODEV;
+	}
+	else if (r == 0) {
+		fprintf (stderr, "Error: No device found\n");
+		return -ENODEV;
+	}
+
+	h = cyusb_gethandle (0);
+	if (image != NULL) {
+		h = load_firmware (h, image);
+		if (h == NULL) {
+			cyusb_close ();
+			return -ENODEV;
+		}
+	}
+
+	r = cyusb_kernel_driver_active (h, 0);
+	if (r == 1)
+		cyusb_detach_kernel_driver (h, 0);
+	r = cyusb_claim_interface (h, 0);
+	if (r != 0) {
+		fprintf (stderr, "Error: Failed to claim interface 0\n");
+		cyusb_error (r);
+		cyusb_close ();
+		return r;
+	}
+
+	if (streams) {
+		if (mode != BENCH_OUT)
+			stream_eps[nstream_eps++] = ep_in;
+		if (mode != BENCH_IN)
+			stream_eps[nstream_eps++] = ep_out;
+		r = cyusb_alloc_streams (h, streams, stream_eps, nstream_eps);
+		if (r <= 0) {
+			fprintf (stderr, "Error: Failed to allocate bulk streams; a SuperSpeed connection and\n"
+					"       firmware that declares streams (e.g. cyfxbulkstreams) are required\n");
+			cyusb_error (r);
+			cyusb_release_interface (h, 0);
+			cyusb_close ();
+			return (r < 0) ? r : -EINVAL;
+		}
+		if (r < streams) {
+			fprintf (stderr, "Info: Only %d of %d bulk streams could be allocated\n", r, streams);
+			streams = r;
+		}
+	}
+
+	if (pattern >= 0)
+		fprintf (stderr, "Info: Verifying data with the %s code path\n", cyusb_pattern_isa ());
+
+	r = cyusb_event_thread_start (cpu, 0);
+	if (r != 0) {
+		fprintf (stderr, "Error: Failed to start event thread\n");
+		if (streams)
+			cyusb_free_streams (h, stream_eps, nstream_eps);
+		cyusb_close ();
+		return r;
+	}
+
+	if (fmt == FMT_JSON)
+		printf ("[\n");
+	for (i = 0; (i < nsizes) && (r == 0); i++) {
+		for (j = 0; (j < ndepths) && (r == 0); j++) {
+			r = run_point (h, mode, ep_in, ep_out, sizes[i], depths[j], streams, seconds, fmt, first);
+			first = 0;
+		}
+	}
+	if (fmt == FMT_JSON)
+		printf ("\n]\n");
+
+	cyusb_event_thread_stop ();
+	if (streams)
+		cyusb_free_streams (h, stream_eps, nstream_eps);
+	cyusb_release_interface (h, 0);
+	cyusb_close ();
+	free (samples);
+	return r;
+}
@@ -0,0 +1,336 @@
+/*
+ * Filename             : bulk_play.c
+ * Description          : Streams a file to a bulk OUT endpoint, for driving slave FIFO and GPIF
+ *                        output designs at line rate. The file is memory mapped and several
+ *                        transfers are kept queued; output can be paced to a target byte rate
+ *                        and the file can be looped for soak tests. Reports the achieved rate
+ *                        and every time the OUT queue ran dry.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+#define DEFAULT_EP_OUT		(0x01)		// Bulk OUT endpoint of the FX3 examples.
+#define DEFAULT_XFER_SIZE	(64 * 1024)	// Size of each bulk transfer.
+#define DEFAULT_NUM_XFERS	(16)		// Transfers kept queued on the endpoint.
+#define XFER_TIMEOUT		(5000)		// Timeout (in milliseconds) for each transfer.
+#define GET_TIMEOUT		(1000)		// Time to wait for a buffer to complete.
+
+static volatile int stop_requested;
+
+static void
+stop_handler (
+		int sig)
+{
+	stop_requested = 1;
+}
+
+static unsigned long long
+now_ns (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* Parse a size or rate with an optional K, M or G suffix, in multiples of unit. */
+static unsigned long long
+parse_size (
+		const char *str,
+		unsigned int unit)
+{
+	char *end;
+	unsigned long long v;
+
+	v = strtoull (str, &end, 0);
+	switch (*end) {
+		case 'g': case 'G':
+			v *= unit;
+		case 'm': case 'M':
+			v *= unit;
+		case 'k': case 'K':
+			v *= unit;
+			break;
+	}
+
+	return v;
+}
+
+/* Play-back state. The file is treated as an endless stream when looping, so that every
+   transfer is full sized and the data is continuous across the wrap. */
+typedef struct {
+	unsigned char      *map;
+	unsigned long long  size;
+	unsigned long long  pos;		// Offset of the next byte to send within the file
+	unsigned int        loops;		// Number of passes over the file, 0 for endless
+	unsigned int        pass;		// Passes completed
+} play_source;
+
+/* Fill a buffer from the file. Returns the number of bytes placed, 0 at the end of the data. */
+static int
+fill_buffer (
+		play_source   *src,
+		unsigned char *buf,
+		int            len)
+{
+	unsigned long long n;
+	int done = 0;
+
+	while ((done < len) && ((src->loops == 0) || (src->pass < src->loops))) {
+		n = src->size - src->pos;
+		if (n > (unsigned long long)(len - done))
+			n = len - done;
+		memcpy (buf + done, src->map + src->pos, n);
+		done     += n;
+		src->pos += n;
+		if (src->pos == src->size) {
+			src->pos = 0;
+			src->pass++;
+			/* Make the kernel read ahead from the start of the file again. */
+			madvise (src->map, src->size, MADV_WILLNEED);
+		}
+	}
+
+	return done;
+}
+
+static void
+print_usage_info (
+		const char *arg0)
+{
+	printf ("%s: Stream a file to a bulk OUT endpoint\n\n", arg0);
+	printf ("Usage:\n");
+	printf ("\t%s [options] -f <file>\n\n", arg0);
+	printf ("\t-f <file>   : File to send\n");
+	printf ("\t-e <ep>     : Bulk OUT endpoint (default 0x%02x)\n", DEFAULT_EP_OUT);
+	printf ("\t-s <size>   : Transfer size (default %dK)\n", DEFAULT_XFER_SIZE / 1024);
+	printf ("\t-q <depth>  : Transfers kept queued, up to %d (default %d)\n", CYUSB_STREAM_MAX_XFERS,
+			DEFAULT_NUM_XFERS);
+	printf ("\t-r <rate>   : Pace output to <rate> bytes per second, e.g. 200M (default: no pacing)\n");
+	printf ("\t-l <count>  : Send the file <count> times, 0 to loop until interrupted (default 1)\n");
+	printf ("\t-h          : Print this help message\n");
+	printf ("\n");
+}
+
+int main (
+		int    argc,
+		char **argv)
+{
+	struct cyusb_stream        *stream;
+	struct cyusb_stream_buffer *buf;
+	struct sigaction            sa;
+	struct timespec             ts;
+	struct stat                 st;
+	play_source  src;
+	cyusb_handle *h;
+	const char   *filename = NULL;
+	unsigned char ep = DEFAULT_EP_OUT;
+	unsigned long long rate = 0;
+	unsigned long long queued = 0, sent = 0, last_sent = 0;
+	unsigned long long underruns = 0, errors = 0;
+	unsigned long long t0, now, target, last_report;
+	int xfer_size = DEFAULT_XFER_SIZE;
+	int num_xfers = DEFAULT_NUM_XFERS;
+	int submitted[CYUSB_STREAM_MAX_XFERS];
+	int outstanding = 0;
+	int paced, len;
+	int fd, r, opt;
+
+	memset (&src, 0, sizeof (src));
+	memset (submitted, 0, sizeof (submitted));
+	src.loops = 1;
+
+	while ((opt = getopt (argc, argv, "hf:e:s:q:r:l:")) != -1) {
+		switch (opt) {
+			case 'f':
+				filename = optarg;
+				break;
+			case 'e':
+				ep = (unsigned char)strtoul (optarg, NULL, 0);
+				break;
+			case 's':
+				xfer_size = (int)parse_size (optarg, 1024);
+				break;
+			case 'q':
+				num_xfers = atoi (optarg);
+				break;
+			case 'r':
+				rate = parse_size (optarg, 1000);
+				break;
+			case 'l':
+				src.loops = atoi (optarg);
+				break;
+			case 'h':
+				print_usage_info (argv[0]);
+				return 0;
+			default:
+				print_usage_info (argv[0]);
+				return -EINVAL;
+		}
+	}
+	if (filename == NULL) {
+		fprintf (stderr, "Error: No input file specified\n");
+		print_usage_info (argv[0]);
+		return -EINVAL;
+	}
+
+	fd = open (filename, O_RDONLY);
+	if ((fd < 0) || (fstat (fd, &st) != 0)) {
+		fprintf (stderr, "Error: Failed to open %s\n", filename);
+		return -ENOENT;
+	}
+	if (st.st_size == 0) {
+		fprintf (stderr, "Error: %s is empty\n", filename);
+		close (fd);
+		return -EINVAL;
+	}
+	src.size = st.st_size;
+	src.map  = (unsigned char *)mmap (NULL, src.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (src.map == MAP_FAILED) {
+		fprintf (stderr, "Error: Failed to map %s\n", filename);
+		return -ENOMEM;
+	}
+	madvise (src.map, src.size, MADV_SEQUENTIAL);
+	madvise (src.map, src.size, MADV_WILLNEED);
+
+	r = cyusb_open ();
+	if (r < 0) {
+		fprintf (stderr, "Error opening library\n");
+		return -ENODEV;
+	}
+	else if (r == 0) {
+		fprintf (stderr, "Error: No device found\n");
+		return -ENODEV;
+	}
+
+	h = cyusb_gethandle (0);
+	r = cyusb_kernel_driver_active (h, 0);
+	if (r == 1)
+		cyusb_detach_kernel_driver (h, 0);
+	r = cyusb_claim_interface (h, 0);
+	if (r != 0) {
+		fprintf (stderr, "Error: Failed to claim interface 0\n");
+		cyusb_error (r);
+		cyusb_close ();
+		return r;
+	}
+
+	/* Pull mode: this thread fills and paces every buffer, and handles libusb events while it
+	   waits for one to complete. */
+	stream = cyusb_stream_create (h, ep, num_xfers, xfer_size, XFER_TIMEOUT, NULL, NULL);
+	if ((stream == NULL) || (cyusb_stream_start (stream) != 0)) {
+		fprintf (stderr, "Error: Failed to set up OUT stream on endpoint 0x%02x\n", ep);
+		cyusb_stream_destroy (stream);
+		cyusb_close ();
+		return -EINVAL;
+	}
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = stop_handler;
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	t0 = last_report = now_ns ();
+	while (!stop_requested) {
+		r = cyusb_stream_get (stream, &buf, GET_TIMEOUT);
+		if (r == LIBUSB_ERROR_TIMEOUT)
+			continue;
+		if (r != 0) {
+			fprintf (stderr, "\nError: OUT stream failed\n");
+			cyusb_error (r);
+			break;
+		}
+
+		// The first num_xfers buffers come straight from the stream and are empty.
+		if (submitted[buf->index]) {
+			submitted[buf->index] = 0;
+			outstanding--;
+			sent += buf->actual_length;
+			if (buf->status)
+				errors++;
+		}
+
+		len = fill_buffer (&src, buf->data, buf->length);
+		if (len == 0) {
+			cyusb_stream_put (stream, buf, 0);
+			if (outstanding == 0)
+				break;
+			continue;
+		}
+
+		paced = 0;
+		if (rate) {
+			target = t0 + (queued * 1000000000ULL) / rate;
+			if (now_ns () < target) {
+				ts.tv_sec  = target / 1000000000ULL;
+				ts.tv_nsec = target % 1000000000ULL;
+				clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+				paced = 1;
+			}
+		}
+
+		// The device had nothing left to transfer while we were not deliberately waiting.
+		if ((!paced) && (queued) && (cyusb_stream_in_flight (stream) == 0))
+			underruns++;
+
+		r = cyusb_stream_put (stream, buf, len);
+		if (r != 0) {
+			fprintf (stderr, "\nError: Failed to queue OUT transfer\n");
+			cyusb_error (r);
+			break;
+		}
+		submitted[buf->index] = 1;
+		outstanding++;
+		queued += len;
+
+		now = now_ns ();
+		if (now - last_report >= 1000000000ULL) {
+			fprintf (stderr, "\rOut %8.2f MB/s  Total %llu MB  Pass %u  Underruns %llu  Errors %llu  ",
+					(sent - last_sent) * 1e3 / (now - last_report), sent / 1000000, src.pass,
+					underruns, errors);
+			last_sent   = sent;
+			last_report = now;
+		}
+	}
+
+	// Let the queued transfers finish, then account for them.
+	while ((outstanding > 0) && (!stop_requested)) {
+		if (cyusb_stream_get (stream, &buf, GET_TIMEOUT) != 0)
+			break;
+		outstanding--;
+		sent += buf->actual_length;
+		if (buf->status)
+			errors++;
+		cyusb_stream_put (stream, buf, 0);
+	}
+	now = now_ns ();
+	cyusb_stream_stop (stream);
+	fprintf (stderr, "\n");
+
+	printf ("Sent       : %llu bytes in %.3f s\n", sent, (now - t0) / 1e9);
+	printf ("Throughput : %.2f MB/s\n", sent * 1e3 / (now - t0));
+	printf ("Passes     : %u\n", src.pass);
+	printf ("Underruns  : %llu\n", underruns);
+	printf ("Errors     : %llu\n", errors);
+
+	cyusb_stream_destroy (stream);
+	cyusb_release_interface (h, 0);
+	cyusb_close ();
+	munmap (src.map, src.size);
+
+	return (errors) ? 1 : 0;
+}
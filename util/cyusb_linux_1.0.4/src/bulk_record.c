@@ -0,0 +1,247 @@
+/*
+ * Filename             : bulk_record.c
+ * Description          : Records a bulk IN endpoint to disk for long captures from GPIF-to-USB
+ *                        and slave FIFO designs. Uses the libcyusb recorder, which decouples the
+ *                        USB queue from the disk with a large ring and writer threads, and
+ *                        reports every overrun instead of silently losing data.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+#define DEFAULT_EP_IN		(0x81)			// Bulk IN endpoint of the FX3 examples.
+#define DEFAULT_XFER_SIZE	(64 * 1024)		// Size of each bulk transfer.
+#define DEFAULT_NUM_XFERS	(16)			// Transfers kept queued on the endpoint.
+#define DEFAULT_BLOCK_SIZE	(4 * 1024 * 1024)	// Size of each block of the ring.
+#define DEFAULT_NUM_BLOCKS	(64)			// Blocks in the ring (256 MB by default).
+
+static volatile int stop_requested;
+
+static void
+stop_handler (
+		int sig)
+{
+	stop_requested = 1;
+}
+
+/* Parse a size with an optional K, M or G suffix. */
+static unsigned long long
+parse_size (
+		const char *str)
+{
+	char *end;
+	unsigned long long v;
+
+	v = strtoull (str, &end, 0);
+	switch (*end) {
+		case 'g': case 'G':
+			v *= 1024;
+		case 'm': case 'M':
+			v *= 1024;
+		case 'k': case 'K':
+			v *= 1024;
+			break;
+	}
+
+	return v;
+}
+
+static void
+print_usage_info (
+		const char *arg0)
+{
+	printf ("%s: Record a bulk IN endpoint to disk\n\n", arg0);
+	printf ("Usage:\n");
+	printf ("\t%s [options] -f <file>\n\n", arg0);
+	printf ("\t-f <file>   : Output file. With rotation, either a printf pattern for the file number\n");
+	printf ("\t              (e.g. capture_%%04u.bin) or a name to which .NNNN is appended\n");
+	printf ("\t-e <ep>     : Bulk IN endpoint (default 0x%02x)\n", DEFAULT_EP_IN);
+	printf ("\t-s <size>   : Transfer size (default %dK)\n", DEFAULT_XFER_SIZE / 1024);
+	printf ("\t-q <depth>  : Transfers kept queued, up to %d (default %d)\n", CYUSB_STREAM_MAX_XFERS,
+			DEFAULT_NUM_XFERS);
+	printf ("\t-b <size>   : Ring block size (default %dM)\n", DEFAULT_BLOCK_SIZE / (1024 * 1024));
+	printf ("\t-n <count>  : Ring blocks (default %d)\n", DEFAULT_NUM_BLOCKS);
+	printf ("\t-w <count>  : Writer threads, up to %d (default 1)\n", CYUSB_RECORD_MAX_WRITERS);
+	printf ("\t-R <size>   : Start a new file every <size> bytes, e.g. 1G\n");
+	printf ("\t-T <secs>   : Start a new file every <secs> seconds\n");
+	printf ("\t-t <secs>   : Stop after <secs> seconds (default: run until interrupted)\n");
+	printf ("\t-D          : Write with O_DIRECT\n");
+	printf ("\t-c <cpu>    : Pin the event thread to <cpu>\n");
+	printf ("\t-p <prio>   : Run the event thread with SCHED_FIFO priority <prio>\n");
+	printf ("\t-h          : Print this help message\n");
+	printf ("\n");
+}
+
+int main (
+		int    argc,
+		char **argv)
+{
+	struct cyusb_recorder_config cfg;
+	struct cyusb_recorder_stats  st, prev;
+	struct cyusb_recorder       *rec;
+	struct sigaction             sa;
+	cyusb_handle *h;
+	unsigned long long dropped;
+	int duration = 0;
+	int cpu = -1, prio = 0;
+	int elapsed = 0;
+	int r, opt;
+
+	memset (&cfg, 0, sizeof (cfg));
+	cfg.endpoint    = DEFAULT_EP_IN;
+	cfg.num_xfers   = DEFAULT_NUM_XFERS;
+	cfg.xfer_size   = DEFAULT_XFER_SIZE;
+	cfg.block_size  = DEFAULT_BLOCK_SIZE;
+	cfg.num_blocks  = DEFAULT_NUM_BLOCKS;
+	cfg.num_writers = 1;
+
+	while ((opt = getopt (argc, argv, "hf:e:s:q:b:n:w:R:T:t:Dc:p:")) != -1) {
+		switch (opt) {
+			case 'f':
+				cfg.path = optarg;
+				break;
+			case 'e':
+				cfg.endpoint = (unsigned char)strtoul (optarg, NULL, 0);
+				break;
+			case 's':
+				cfg.xfer_size = (int)parse_size (optarg);
+				break;
+			case 'q':
+				cfg.num_xfers = atoi (optarg);
+				break;
+			case 'b':
+				cfg.block_size = (size_t)parse_size (optarg);
+				break;
+			case 'n':
+				cfg.num_blocks = atoi (optarg);
+				break;
+			case 'w':
+				cfg.num_writers = atoi (optarg);
+				break;
+			case 'R':
+				cfg.rotate_bytes = parse_size (optarg);
+				break;
+			case 'T':
+				cfg.rotate_seconds = atoi (optarg);
+				break;
+			case 't':
+				duration = atoi (optarg);
+				break;
+			case 'D':
+				cfg.flags |= CYUSB_RECORD_DIRECT;
+				break;
+			case 'c':
+				cpu = atoi (optarg);
+				break;
+			case 'p':
+				prio = atoi (optarg);
+				break;
+			case 'h':
+				print_usage_info (argv[0]);
+				return 0;
+			default:
+				print_usage_info (argv[0]);
+				return -EINVAL;
+		}
+	}
+	if (cfg.path == NULL) {
+		fprintf (stderr, "Error: No output file specified\n");
+		print_usage_info (argv[0]);
+		return -EINVAL;
+	}
+
+	r = cyusb_open ();
+	if (r < 0) {
+		fprintf (stderr, "Error opening library\n");
+		return -ENODEV;
+	}
+	else if (r == 0) {
+		fprintf (stderr, "Error: No device found\n");
+		return -ENODEV;
+	}
+
+	h = cyusb_gethandle (0);
+	r = cyusb_kernel_driver_active (h, 0);
+	if (r == 1)
+		cyusb_detach_kernel_driver (h, 0);
+	r = cyusb_claim_interface (h, 0);
+	if (r != 0) {
+		fprintf (stderr, "Error: Failed to claim interface 0\n");
+		cyusb_error (r);
+		cyusb_close ();
+		return r;
+	}
+
+	rec = cyusb_recorder_create (h, &cfg);
+	if (rec == NULL) {
+		fprintf (stderr, "Error: Failed to create recorder; check the settings and available memory\n");
+		cyusb_close ();
+		return -ENOMEM;
+	}
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = stop_handler;
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	r = cyusb_event_thread_start (cpu, prio);
+	if (r == 0)
+		r = cyusb_recorder_start (rec);
+	if (r != 0) {
+		fprintf (stderr, "Error: Failed to start recording\n");
+		cyusb_error (r);
+		cyusb_event_thread_stop ();
+		cyusb_recorder_destroy (rec);
+		cyusb_close ();
+		return r;
+	}
+
+	fprintf (stderr, "Info: Recording to %s, press Ctrl-C to stop\n", cfg.path);
+	memset (&prev, 0, sizeof (prev));
+	while ((!stop_requested) && ((duration == 0) || (elapsed < duration))) {
+		sleep (1);
+		elapsed++;
+
+		cyusb_recorder_get_stats (rec, &st);
+		if (st.overruns != prev.overruns) {
+			dropped = st.bytes_dropped - prev.bytes_dropped;
+			fprintf (stderr, "Warning: Ring overrun, %llu bytes dropped; data missing from file %u "
+					"at offset %llu\n", dropped, st.overrun_file, st.overrun_offset);
+		}
+		if (st.write_errors != prev.write_errors)
+			fprintf (stderr, "Warning: %llu blocks could not be written\n",
+					st.write_errors - prev.write_errors);
+
+		fprintf (stderr, "\rIn %8.2f MB/s  Out %8.2f MB/s  Ring %3d%% (max %3d%%)  Files %u  ",
+				(st.bytes_received - prev.bytes_received) / 1e6,
+				(st.bytes_written - prev.bytes_written) / 1e6,
+				100 * st.ring_used / cfg.num_blocks, 100 * st.ring_high_water / cfg.num_blocks,
+				st.files);
+		prev = st;
+	}
+	fprintf (stderr, "\n");
+
+	cyusb_recorder_stop (rec);
+	cyusb_recorder_get_stats (rec, &st);
+	cyusb_event_thread_stop ();
+
+	printf ("Received       : %llu bytes\n", st.bytes_received);
+	printf ("Written        : %llu bytes in %u file(s)\n", st.bytes_written, st.files);
+	printf ("Dropped        : %llu bytes in %llu overrun(s)\n", st.bytes_dropped, st.overruns);
+	printf ("Errors         : %llu transfer, %llu write\n", st.transfer_errors, st.write_errors);
+	printf ("Ring high water: %d of %d blocks\n", st.ring_high_water, cfg.num_blocks);
+
+	cyusb_recorder_destroy (rec);
+	cyusb_release_interface (h, 0);
+	cyusb_close ();
+
+	return ((st.overruns) || (st.write_errors)) ? 1 : 0;
+}
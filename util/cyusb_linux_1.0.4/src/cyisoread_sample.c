@@ -3,52 +3,45 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "../include/cyusb.h"
 
 
-static struct libusb_transfer *transfer = NULL;
 cyusb_handle *h1 = NULL;
-static unsigned char *isoc_databuf = NULL;
 int	num_pkts;
 unsigned short gl_ep_out, gl_ep_in;
 
+/* Number of iso transfers kept queued on the endpoint. */
+#define NUM_ISO_XFERS		8
+
+/* Interval between statistics reports, in seconds. */
+#define REPORT_INTERVAL		1
+
 /*
-   This is the call back function called by libusb upon completion 
-   of transfer.
+   This is the call back function called by libcyusb for every completed
+   transfer, with the payload of all good packets packed together.
  */
-static void in_callback( struct libusb_transfer *transfer)
+static void in_callback(struct cyusb_iso_stream *stream, unsigned char *data, int length,
+        int dropped, void *user_data)
 {
-    int act_len;
-    static int total_in, pkts_success, pkts_failure;
-    unsigned char *ptr;
-    int pkts_in;
-
-    //Transfer complete call back got.Check if transfer succeeded
-    if ( transfer->status != LIBUSB_TRANSFER_COMPLETED ) 
-    {
-        printf ("Transfer not completed \n");
-    }
-
-    total_in = pkts_success = pkts_failure = 0;
-    pkts_in = num_pkts;
-
-    //Loop through all the packets and check the status of each 
-    //packet transfer
-    for ( int i = 0; i < pkts_in; ++i ) {
-        ptr = libusb_get_iso_packet_buffer_simple(transfer, i);
-        act_len = transfer->iso_packet_desc[i].actual_length;
-        total_in += 1;
-        if ( transfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED ) {
-            pkts_success += 1;
-        }
-        else pkts_failure += 1;
-    }
-    //Info on how many packets succeeded and failed
-    printf("\n***************************\n Total Packets Received: %d \n", total_in);
-    printf(" Pkts Succedded    : %d \n", pkts_success);
-    printf(" Pkts Failed       : %d \n****************************\n", pkts_failure);
+    if ( dropped )
+        printf ("Transfer lost %d packets\n", dropped);
+}
 
+static void print_stats(struct cyusb_iso_stream *stream, int seconds)
+{
+    struct cyusb_iso_stats st;
+
+    cyusb_iso_stream_get_stats(stream, &st);
+    printf("\n***************************\n Total Packets Received: %llu \n", st.packets);
+    printf(" Pkts Succedded    : %llu \n", st.packets_ok);
+    printf(" Pkts Empty        : %llu \n", st.packets_empty);
+    printf(" Pkts Failed       : %llu \n", st.packets_dropped);
+    printf(" Gaps              : %llu \n", st.gaps);
+    printf(" Ring underruns    : %llu \n", st.underruns);
+    printf(" Throughput        : %.2f MB/s \n****************************\n",
+            seconds ? (double)st.bytes / seconds / (1024 * 1024) : 0.0);
 }
 
 //This function selects the alternate setting of interface
@@ -85,22 +78,24 @@ const libusb_interface_descriptor * selectInterface (struct libusb_config_descri
 int main(int argc, char **argv)
 
 {
-    int rStatus, pktsize_in, bufsize_in;
-    int transferred = 0;
-    int num_bytes, numEndpoints, ep_index_out = 0, ep_index_in = 0;
-    unsigned short int temp, ep_in[8], ep_out[8];
-    unsigned char buf[64];
+    int rStatus, pktsize_in;
+    int numEndpoints, ep_index_out = 0, ep_index_in = 0;
+    unsigned short int ep_in[8] = { 0 }, ep_out[8] = { 0 };
     libusb_config_descriptor *configDesc;
     const struct libusb_interface_descriptor *interfaceDesc ;
     const struct libusb_endpoint_descriptor *endpoint;
-    struct timeval tv;
+    struct timeval tv, start;
+    struct cyusb_iso_stream *stream;
+    int duration = 1, elapsed, next_report = REPORT_INTERVAL;
 
-    if (argc != 2){
-        printf ("Usage of binary ./isoread_test <num packets> \n Ex: ./isoread_test 64 \n");
+    if ((argc != 2) && (argc != 3)){
+        printf ("Usage of binary ./isoread_test <num packets> [<seconds>]\n Ex: ./isoread_test 64 10 \n");
         return -1;
     }
 
     num_pkts = atoi (argv[1]);
+    if (argc == 3)
+        duration = atoi (argv[2]);
 
     // Open the libusb library and does all the
     // Initialization.
@@ -140,6 +135,7 @@ int main(int argc, char **argv)
         printf ("Device does not have IN endpoint \n");
         cyusb_free_config_descriptor (configDesc);
         cyusb_close();
+        return -1;
     }
     //interface0 = configDesc->interface;
     numEndpoints = interfaceDesc->bNumEndpoints;
@@ -170,35 +166,45 @@ int main(int argc, char **argv)
     gl_ep_out = ep_out [0];
 
 
-    transfer = libusb_alloc_transfer(num_pkts);
-    if (transfer == NULL){
+    // The endpoint addresses are all we need from the descriptor.
+    cyusb_free_config_descriptor (configDesc);
+
+    // Keep a ring of iso transfers queued on the endpoint for the whole
+    // capture, so that no service interval goes unserviced.
+    pktsize_in = cyusb_get_max_iso_packet_size(h1, gl_ep_in);
+    printf ("\nPacket size is %d \n", pktsize_in);
+    stream = cyusb_iso_stream_create(h1, gl_ep_in, NUM_ISO_XFERS, num_pkts, pktsize_in,
+            in_callback, NULL);
+    if (stream == NULL){
         printf ("Error in Transfer allocation \n");
-        cyusb_free_config_descriptor (configDesc);
         cyusb_close ();
         return -1;
     }
 
-    // This section of the code fills the ISO URB and 
-    // submits the transfer.
-    pktsize_in = cyusb_get_max_iso_packet_size(h1, gl_ep_in);
-    printf ("\nPacket size is %d \n", pktsize_in);
-    bufsize_in = pktsize_in * num_pkts;
-    isoc_databuf = (unsigned char *)(malloc(bufsize_in));
-    
-    libusb_fill_iso_transfer(transfer, h1, gl_ep_in, isoc_databuf, bufsize_in, num_pkts, in_callback, NULL, 10000 );
-    libusb_set_iso_packet_lengths(transfer, pktsize_in);
-    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
-    libusb_submit_transfer(transfer);
-
-    //This section of code waits till all the transfer 
-    //have been completed //TODO
-    tv.tv_sec = 0;
-    tv.tv_usec = 500;
-    for ( int i = 0; i < 1000; ++i ) {
-        libusb_handle_events_timeout(NULL,&tv);
+    rStatus = cyusb_iso_stream_start(stream);
+    if (rStatus != 0){
+        cyusb_error (rStatus);
+        cyusb_iso_stream_destroy (stream);
+        cyusb_close ();
+        return -1;
     }
-    cyusb_free_config_descriptor (configDesc);
+
+    gettimeofday (&start, NULL);
+    while (1) {
+        cyusb_handle_events (100);
+        gettimeofday (&tv, NULL);
+        elapsed = tv.tv_sec - start.tv_sec;
+        if (elapsed >= next_report) {
+            print_stats (stream, elapsed);
+            next_report += REPORT_INTERVAL;
+        }
+        if (elapsed >= duration)
+            break;
+    }
+
+    cyusb_iso_stream_stop (stream);
+    print_stats (stream, duration);
+    cyusb_iso_stream_destroy (stream);
     cyusb_close();
     return 0;
 }
-
@@ -7,11 +7,12 @@
  * Modification Notes	:												*
  * 															*
  * This program may be run as a deamon process. It obtains all device details for relevant				*
- * Cypress devices ( as listed in /etc/cyusb.conf ) and waits for two kinds of signals ( SIGUSR1 and SIGUSR2 )		*
+ * Cypress devices ( as listed in /etc/cyusb.conf ) and waits for signals ( SIGUSR1, SIGUSR2 and SIGTERM )		*
  * SIGUSR1 signal is handled when a notification arrives from the kernel whenever a usb device gets added/deleted	*
  * in which case the device list is refreshed. SIGUSR1 would be generated by a script from a persistent udev rule 	*
  *															*
- * SIGUSR2 signal is a request to free all resources and exit. 								*
+ * SIGUSR2 signal prints the libcyusb transfer statistics of every device to stdout.					*
+ * SIGTERM or SIGINT is a request to free all resources and exit.							*
 \***********************************************************************************************************************/
 
 #include <stdio.h>
@@ -68,11 +69,29 @@ extern libusb_device **list;
 
 extern struct cydev cydev[MAXDEVICES];
 
+/* Set when the device list is kept up to date by libusb hotplug events. */
+static int hotplug_enabled;
+
+/* Set by the event thread; the main loop applies the change with cyusb_hotplug_poll(). */
+static volatile sig_atomic_t hotplug_changed;
+
+static void hotplug_notify(int index, int arrived, void *user_data)
+{
+	if ( arrived )
+	   printf("Device of interest attached at index %d\n", index);
+	else printf("Device of interest at index %d detached\n", index);
+	hotplug_changed = 1;
+}
+
 static void handle_sigusr1(int signo)
 {
 	int N;
 
 	printf("Signal SIGUSR1 received !\n");
+	if ( hotplug_enabled ) {
+	   printf("Device list is maintained from hotplug events, no rescan needed\n");
+	   return;
+	}
 	cyusb_close();
 	N = cyusb_open();
 	if ( N < 0 ) {
@@ -86,8 +105,18 @@ static void handle_sigusr1(int signo)
 	else printf("No of devices of interest found = %d\n",N);
 }
 
+/* Statistics are printed from the main loop, as stdio is not safe in a signal handler. */
+static volatile sig_atomic_t dump_requested;
+
 static void handle_sigusr2(int signo)
 {
+	dump_requested = 1;
+}
+
+static void handle_sigterm(int signo)
+{
+	cyusb_event_thread_stop();
+	cyusb_hotplug_disable();
 	unlink(pidfile);
 	close(logfd);
 	cyusb_close();
@@ -156,12 +185,32 @@ int main(int argc, char **argv)
 		close(pidfd);
 	}
 
+	/* Prefer incremental updates from libusb over full rescans triggered by SIGUSR1. */
+	if ( ( cyusb_hotplug_enable(hotplug_notify, NULL) == 0 ) &&
+	     ( cyusb_event_thread_start(-1, 0) == 0 ) )
+	   hotplug_enabled = 1;
+	else cyusb_hotplug_disable();
+
+	cyusb_stats_enable(1);
+
 	signal(SIGUSR1,handle_sigusr1);  /* Signal to handle events received from the kernel			*/
-	signal(SIGUSR2,handle_sigusr2);  /* Signal to stop this daemon and exit gracefully			*/
-	signal(SIGINT, handle_sigusr2);  /* Ctrl_C will also stop this daemon and exit gracefully		*/
+	signal(SIGUSR2,handle_sigusr2);  /* Signal to print transfer statistics					*/
+	signal(SIGTERM,handle_sigterm);  /* Signal to stop this daemon and exit gracefully			*/
+	signal(SIGINT, handle_sigterm);  /* Ctrl_C will also stop this daemon and exit gracefully		*/
 
+	/* Hotplug notifications come from the event thread and do not interrupt pause(). */
 	while (1) {
-		pause();
+		if ( hotplug_enabled )
+		   sleep(1);
+		else pause();
+		if ( hotplug_changed ) {
+		   hotplug_changed = 0;
+		   cyusb_hotplug_poll();
+		}
+		if ( dump_requested ) {
+		   dump_requested = 0;
+		   cyusb_dump_stats(stdout);
+		}
 	}
 	return 0;
 }
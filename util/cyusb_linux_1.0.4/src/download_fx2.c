@@ -21,6 +21,7 @@
 #define MAX_LINE_LENGTH		(512)
 #define MAX_BYTES_PER_LINE	(256)
 #define EEPROM_WRITE_SIZE	(1024)
+#define FX2_RAM_WRITE_SIZE	(CYUSB_HEX_MAX_RUN)
 
 #define ROUND_UP(n,v)		((((n) + ((v) - 1)) / (v)) * (v))
 #define CHAR_TO_HEXVAL(c)	((((c) >= '0') && ((c) <= '9')) ? ((c) - '0') : ((((c) - 'A') & 0x0F) + 10))
@@ -365,7 +366,7 @@ read_fx2_firmware (
 	fx2_fw_fmt    fmt;
 	int           ret, i;
 	struct stat   filbuf;
-	unsigned char scratch[MAX_LINE_LENGTH], *tmp;
+	unsigned char scratch[MAX_LINE_LENGTH];
 	unsigned int  address, length;
 
 
@@ -395,39 +396,34 @@ read_fx2_firmware (
 	{
 		case FW_FORMAT_HEX:
 			{
-				fmt    = FW_FORMAT_INVALID;
-				length = 0;
+				struct cyusb_hex_image img;
+				int line;
 
-				while (fgets ((char *)scratch, MAX_LINE_LENGTH, in_file) != NULL) {
-					/* If this is the end of file record, stop reading. */
-					if ((scratch[7] == '0') && (scratch[8] == '1')) {
-						fmt = FW_FORMAT_BIN;
-						break;
-					}
-
-					/* Ignore all except data records. */
-					if ((scratch[7] != '0') || (scratch[8] != '0'))
-						continue;
-
-					tmp = &scratch[1];
-					length  = GET_HEX_BYTE (tmp);
-					tmp += 2;
-					address = GET_HEX_WORD (tmp);
+				fmt = FW_FORMAT_INVALID;
+				ret = cyusb_hex_load (filename, &img, &line);
+				if (ret != 0) {
+					if (line != 0)
+						fprintf (stderr, "Invalid hex record at line %d of %s\n", line, filename);
+					else
+						fprintf (stderr, "Failed to read hex file %s\n", filename);
+					break;
+				}
 
+				fmt = FW_FORMAT_BIN;
+				for (i = 0; i < img.num_segments; i++) {
+					address = img.segments[i].address;
+					length  = img.segments[i].length;
 					if ((address + length) > FX2_MAX_FW_SIZE) {
 						fprintf (stderr, "Firmware address out of range\n");
+						fmt = FW_FORMAT_INVALID;
 						break;
 					}
 
 					if ((address + length) > *max_addr)
 						*max_addr = address + length;
-
-					tmp += 6;
-					for (i = 0; i < length; i++) {
-						fw_buf[address + i] = GET_HEX_BYTE (tmp);
-						tmp += 2;
-					}
+					memcpy (fw_buf + address, img.segments[i].data, length);
 				}
+				cyusb_hex_free (&img);
 			}
 			break;
 
@@ -618,8 +614,8 @@ fx2_ram_download (
 	}
 
 	/* Load the internal RAM part now. */
-	for (i = 0; i < address; i += EEPROM_WRITE_SIZE) {
-		length = ((address - i) > EEPROM_WRITE_SIZE) ? EEPROM_WRITE_SIZE : (address - i);
+	for (i = 0; i < address; i += FX2_RAM_WRITE_SIZE) {
+		length = ((address - i) > FX2_RAM_WRITE_SIZE) ? FX2_RAM_WRITE_SIZE : (address - i);
 		r = cyusb_control_transfer (h, 0x40, 0xA0, i, 0x00, &fw_buf[i], length, VENDORCMD_TIMEOUT);
 		if (r != length) {
 			fprintf (stderr, "Vendor write to RAM failed\n");
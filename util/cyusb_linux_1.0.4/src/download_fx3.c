@@ -9,29 +9,54 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include <libusb-1.0/libusb.h>
 #include "../include/cyusb.h"
 
 #define FLASHPROG_VID		(0x04b4)	// USB VID for the FX3 flash programmer.
+#define BOOTLOADER_PID		(0x00f3)	// USB PID for the FX3 boot loader.
 
 #define MAX_FWIMG_SIZE		(512 * 1024)	// Maximum size of the firmware binary.
 #define MAX_WRITE_SIZE		(2 * 1024)	// Max. size of data that can be written through one vendor command.
 
 #define I2C_PAGE_SIZE		(64)		// Page size for I2C EEPROM.
 #define I2C_SLAVE_SIZE		(64 * 1024)	// Max. size of data that can fit on one EEPROM address.
+#define I2C_READ_SIZE		(4 * 1024)	// Max. size of data that can be read through one vendor command.
+#define I2C_PIPE_DEPTH		(8)		// Number of I2C vendor commands kept in flight.
 
 #define SPI_PAGE_SIZE		(256)		// Page size for SPI flash memory.
 #define SPI_SECTOR_SIZE		(64 * 1024)	// Sector size for SPI flash memory.
+#define SPI_READ_SIZE		(4 * 1024)	// Max. size of data that can be read through one vendor command.
+
+#define SPI_POLL_MIN_US		(100)		// First interval (in microseconds) between SPI status polls.
+#define SPI_POLL_MAX_US		(10000)		// Longest interval (in microseconds) between SPI status polls.
+#define SPI_ERASE_TIMEOUT	(10000)		// Timeout (in milliseconds) for a sector erase to complete.
 
 #define VENDORCMD_TIMEOUT	(5000)		// Timeout (in milliseconds) for each vendor command.
+#define DELTA_TIMEOUT		(30000)		// Timeout (in milliseconds) for delta commands, which may rewrite a flash sector.
+
+/* Delta update format, see cyfxdelta.h in the flash programmer sources. */
+#define DELTA_MAGIC		(0x44335846)	// "FX3D"
+#define DELTA_HDR_SIZE		(32)		// Size of the delta header.
+#define DELTA_OP_SIZE		(8)		// Size of an operation header.
+#define DELTA_BLOCK_SIZE	(4096)		// Data carried by a data operation.
+#define DELTA_OP_DATA		(1)
+#define DELTA_OP_COPY		(2)
 #define GETHANDLE_TIMEOUT	(5)		// Timeout (in seconds) for getting a FX3 flash programmer handle.
+#define GETHANDLE_POLL_MS	(100)		// Interval (in milliseconds) between checks for the flash programmer.
+
+#define PROVISION_RETRIES	(2)		// Default number of retries per device in provisioning mode.
+#define PROGRESS_POLL_MS	(500)		// Interval (in milliseconds) between progress updates.
 
 /* Utility macros. */
 #define ROUND_UP(n,v)	((((n) + ((v) - 1)) / (v)) * (v))	// Round n upto a multiple of v.
 #define GET_LSW(v)	((unsigned short)((v) & 0xFFFF))	// Get Least Significant Word part of an integer.
 #define GET_MSW(v)	((unsigned short)((v) >> 16))		// Get Most Significant Word part of an integer.
+#define GET_LE16(p)	((unsigned short)((p)[0] | ((p)[1] << 8)))	// Read a little endian 16-bit value.
+#define GET_LE32(p)	((unsigned int)((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((unsigned int)(p)[3] << 24)))
 
 /* Enumeration representing the FX3 firmware target. */
 typedef enum {
@@ -41,6 +66,19 @@ typedef enum {
 	FW_TARGET_SPI		// Program to SPI Flash
 } fx3_fw_target;
 
+/* Progress of a programming operation on one device. Updated by the thread doing the
+   programming and read by the thread displaying the progress. */
+typedef struct {
+	const char * volatile stage;	// Current step of the operation.
+	volatile int          done;	// Bytes written or verified so far.
+	volatile int          total;	// Bytes to be written and verified.
+	unsigned int          csum;	// Additive checksum of the data read back from the device.
+} fx3_progress;
+
+/* Update progress, if it is being tracked. */
+#define PROGRESS_STAGE(p,s)	do { if ((p) != NULL) (p)->stage = (s); } while (0)
+#define PROGRESS_ADD(p,n)	do { if ((p) != NULL) (p)->done += (n); } while (0)
+
 /* Array representing physical size of EEPROM corresponding to each size encoding. */
 const int i2c_eeprom_size[] =
 {
@@ -54,41 +92,16 @@ const int i2c_eeprom_size[] =
 	131072		// bImageCtl[2:0] = 'b111
 };
 
-static int
-fx3_ram_write (
-		cyusb_handle  *h,
-		unsigned char *buf,
-		unsigned int   ramAddress,
-		int            len)
-{
-	int r;
-	int index = 0;
-	int size;
-
-	while (len > 0) {
-		size = (len > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : len;
-		r = cyusb_control_transfer (h, 0x40, 0xA0, GET_LSW(ramAddress), GET_MSW(ramAddress),
-				&buf[index], size, VENDORCMD_TIMEOUT);
-		if (r != size) {
-			fprintf (stderr, "Error: Vendor write to FX3 RAM failed\n");
-			return -1;
-		}
-
-		ramAddress += size;
-		index      += size;
-		len        -= size;
-	}
-
-	return 0;
-}
-
-/* Read the firmware image from the file into a buffer. */
+/* Read the firmware image from the file into a buffer. Packed images (elf2img -compress) are
+   only accepted when packed_ok is set: the boot firmware expands them when booting from SPI
+   flash, but not from I2C EEPROM. */
 static int
 read_firmware_image (
 		const char    *filename,
 		unsigned char *buf,
 		int           *romsize,
-		int           *filesize)
+		int           *filesize,
+		int            packed_ok)
 {
 	int fd;
 	int nbr;
@@ -125,7 +138,13 @@ read_firmware_image (
 		*romsize = i2c_eeprom_size[(buf[0] >> 1) & 0x07];
 
 	nbr = read (fd, buf, 1);		/* Read 1 byte. bImageType	*/
-	if (!(buf[0] == 0xB0)) {
+	if ((buf[0] == 0xB4) && (!packed_ok)) {
+		fprintf (stderr, "Error: Packed image (type 0xB4) can only be programmed to SPI flash, "
+				"the I2C EEPROM and ROM boot loaders cannot expand it\n");
+		close (fd);
+		return -6;
+	}
+	if ((buf[0] != 0xB0) && (buf[0] != 0xB4)) {
 		fprintf (stderr, "Error: Not a normal FW binary with checksum\n");
 		return -6;
 	}
@@ -135,79 +154,59 @@ read_firmware_image (
 	nbr = read (fd, buf, *filesize);
 
 	close (fd);
+
+	// A packed image has no checksum over the data as stored; check its record layout instead.
+	if ((buf[3] == 0xB4) && (cyusb_check_fx3_image (buf, *filesize, NULL) != 0)) {
+		fprintf (stderr, "Error: Packed image has an invalid record layout\n");
+		return -7;
+	}
+
 	return 0;
 }
 
+/* Additive checksum over a block of data, used to report what was read back from a device. */
+static unsigned int
+fx3_data_checksum (
+		const unsigned char *buf,
+		int                  len,
+		unsigned int         csum)
+{
+	while (len-- > 0)
+		csum += *buf++;
+	return csum;
+}
+
 static int
 fx3_usbboot_download (
 		cyusb_handle *h,
 		const char   *filename)
 {
-	unsigned char *fwBuf;
-	unsigned int  *data_p;
-	unsigned int i, checksum;
-	unsigned int address, length;
-	int r, index, filesize;
-
-	fwBuf = (unsigned char *)calloc (1, MAX_FWIMG_SIZE);
-	if (fwBuf == 0) {
-		fprintf (stderr, "Error: Failed to allocate buffer to store firmware binary\n");
-		return -1;
-	}
+	int r;
 
-	// Read the firmware image into the local RAM buffer.
-	r = read_firmware_image (filename, fwBuf, NULL, &filesize);
+	// The library validates the image and pipelines the vendor requests.
+	r = cyusb_download_fx3 (h, filename);
 	if (r != 0) {
-		fprintf (stderr, "Error: Failed to read firmware file %s\n", filename);
-		free (fwBuf);
-		return -2;
-	}
-
-	// Run through each section of code, and use vendor commands to download them to RAM.
-	index    = 4;
-	checksum = 0;
-	while (index < filesize) {
-		data_p  = (unsigned int *)(fwBuf + index);
-		length  = data_p[0];
-		address = data_p[1];
-		if (length != 0) {
-			for (i = 0; i < length; i++)
-				checksum += data_p[2 + i];
-			r = fx3_ram_write (h, fwBuf + index + 8, address, length * 4);
-			if (r != 0) {
-				fprintf (stderr, "Error: Failed to download data to FX3 RAM\n");
-				free (fwBuf);
-				return -3;
-			}
-		} else {
-			if (checksum != data_p[2]) {
-				fprintf (stderr, "Error: Checksum error in firmware binary\n");
-				free (fwBuf);
-				return -4;
-			}
-
-			r = cyusb_control_transfer (h, 0x40, 0xA0, GET_LSW(address), GET_MSW(address), NULL,
-					0, VENDORCMD_TIMEOUT);
-			if (r != 0)
-				printf ("Info: Ignored error in control transfer: %d\n", r);
-			break;
-		}
-
-		index += (8 + length * 4);
+		fprintf (stderr, "Error: Failed to download %s to FX3 RAM\n", filename);
+		return -1;
 	}
 
-	free (fwBuf);
 	return 0;
 }
 
-/* Check if the current device handle corresponds to the FX3 flash programmer. */
-static int check_fx3_flashprog (cyusb_handle *handle)
+/* Check if the device is running the FX3 flash programmer, without reporting anything. */
+static int is_fx3_flashprog (cyusb_handle *handle)
 {
 	int r;
 	char local[8];
 
 	r = cyusb_control_transfer (handle, 0xC0, 0xB0, 0, 0, (unsigned char *)local, 8, VENDORCMD_TIMEOUT);
-	if ((r != 8) || (strncasecmp (local, "FX3PROG", 7) != 0)) {
+	return ((r == 8) && (strncasecmp (local, "FX3PROG", 7) == 0));
+}
+
+/* Check if the current device handle corresponds to the FX3 flash programmer. */
+static int check_fx3_flashprog (cyusb_handle *handle)
+{
+	if (!is_fx3_flashprog (handle)) {
 		printf ("Info: Current device is not the FX3 flash programmer\n");
 		return -1;
 	}
@@ -216,27 +215,17 @@ static int check_fx3_flashprog (cyusb_handle *handle)
 	return 0;
 }
 
-/* Get the handle to the FX3 flash programmer device, if found. */
-static int
-get_fx3_prog_handle (
-		cyusb_handle **h)
+/* Locate the flash programmer image. The returned path has to be freed by the caller. */
+static char *
+get_fx3_prog_filename (
+		void)
 {
 	char *progfile_p, *tmp;
-	cyusb_handle *handle;
-	int i, j, r;
 	struct stat filestat;
 
-	handle = *h;
-	r = check_fx3_flashprog (handle);
-	if (r == 0)
-		return 0;
-
-	printf ("Info: Trying to download flash programmer to RAM\n");
-
 	tmp = getenv ("CYUSB_ROOT");
 	if (tmp != NULL) {
-		i = strlen (tmp);
-		progfile_p = (char *)malloc (i + 32);
+		progfile_p = (char *)malloc (strlen (tmp) + 32);
 		strcpy (progfile_p, tmp);
 		strcat (progfile_p, "/fx3_images/cyfxflashprog.img");
 	}
@@ -245,12 +234,35 @@ get_fx3_prog_handle (
 		strcpy (progfile_p, "fx3_images/cyfxflashprog.img");
 	}
 
-	r = stat (progfile_p, &filestat);
-	if (r != 0) {
+	if (stat (progfile_p, &filestat) != 0) {
 		fprintf (stderr, "Error: Failed to find cyfxflashprog.img file\n");
-		return -1;
+		free (progfile_p);
+		return NULL;
 	}
 
+	return progfile_p;
+}
+
+/* Get the handle to the FX3 flash programmer device, if found. */
+static int
+get_fx3_prog_handle (
+		cyusb_handle **h)
+{
+	char *progfile_p;
+	cyusb_handle *handle;
+	int i, j, n, r;
+
+	handle = *h;
+	r = check_fx3_flashprog (handle);
+	if (r == 0)
+		return 0;
+
+	printf ("Info: Trying to download flash programmer to RAM\n");
+
+	progfile_p = get_fx3_prog_filename ();
+	if (progfile_p == NULL)
+		return -1;
+
 	r = fx3_usbboot_download (handle, progfile_p);
 	free (progfile_p);
 	if (r != 0) {
@@ -262,11 +274,11 @@ get_fx3_prog_handle (
 	*h = NULL;
 
 	// Now wait for the flash programmer to enumerate, and get a handle to it.
-	for (j = 0; j < GETHANDLE_TIMEOUT; j++) {
-		sleep (1);
-		r = cyusb_open ();
-		if (r > 0) {
-			for (i = 0; i < r; i++) {
+	for (j = 0; j < (GETHANDLE_TIMEOUT * 1000) / GETHANDLE_POLL_MS; j++) {
+		usleep (GETHANDLE_POLL_MS * 1000);
+		n = cyusb_open ();
+		if (n > 0) {
+			for (i = 0; i < n; i++) {
 				handle = cyusb_gethandle (i);
 				if (cyusb_getvendor (handle) == FLASHPROG_VID) {
 					r = check_fx3_flashprog (handle);
@@ -277,73 +289,347 @@ get_fx3_prog_handle (
 					}
 				}
 			}
-			cyusb_close ();
 		}
+		if (n >= 0)
+			cyusb_close ();
 	}
 
 	fprintf (stderr, "Error: Failed to get handle to flash programmer\n");
 	return -2;
 }
 
+/* Pipeline of asynchronous vendor commands to the flash programmer. All commands go to EP0, so
+   the device executes them in the order in which they were submitted; keeping several queued
+   removes the host round trip between consecutive commands. */
+struct fx3_pipe;
+
+typedef struct {
+	struct libusb_transfer *xfer;
+	struct fx3_pipe        *pipe;
+	const unsigned char    *expect;		// Data a read is expected to return, or NULL.
+	unsigned char          *copy;		// Where to store the data a read returns, or NULL.
+	volatile int           *done;		// Set once the command has completed, or NULL.
+	volatile int            busy;
+	unsigned long long      t_submit;	// Submission time, for the transfer statistics.
+} fx3_pipe_req;
+
+typedef struct fx3_pipe {
+	cyusb_handle  *h;
+	fx3_progress  *prog;
+	unsigned char *bufs;
+	volatile int   pending;		// Commands submitted and not yet completed.
+	volatile int   error;		// -1 if a command failed, -2 if read data did not match.
+	fx3_pipe_req   req[I2C_PIPE_DEPTH];
+} fx3_pipe;
+
+#define PIPE_BUF_SIZE		(LIBUSB_CONTROL_SETUP_SIZE + I2C_READ_SIZE)
+
+static void
+fx3_pipe_callback (
+		struct libusb_transfer *xfer)
+{
+	fx3_pipe_req  *req  = (fx3_pipe_req *)xfer->user_data;
+	fx3_pipe      *pipe = req->pipe;
+	unsigned char *data = libusb_control_transfer_get_data (xfer);
+	int            len  = xfer->length - LIBUSB_CONTROL_SETUP_SIZE;
+
+	cyusb_stats_completed (xfer, req->t_submit);
+	if ((xfer->status != LIBUSB_TRANSFER_COMPLETED) || (xfer->actual_length != len)) {
+		if (pipe->error == 0)
+			pipe->error = -1;
+	} else {
+		if ((req->expect != NULL) && (memcmp (data, req->expect, len) != 0)) {
+			if (pipe->error == 0)
+				pipe->error = -2;
+		} else if ((req->expect != NULL) && (pipe->prog != NULL))
+			pipe->prog->csum = fx3_data_checksum (data, len, pipe->prog->csum);
+		if (req->copy != NULL)
+			memcpy (req->copy, data, len);
+		if (req->done != NULL)
+			*req->done = 1;
+		PROGRESS_ADD (pipe->prog, len);
+	}
+
+	req->busy = 0;
+	__sync_fetch_and_sub (&pipe->pending, 1);
+}
+
 static int
-fx3_i2c_write (
-		cyusb_handle  *h,
-		unsigned char *buf,
-		int            devAddr,
-		int            start,
-		int            len)
+fx3_pipe_init (
+		fx3_pipe     *pipe,
+		cyusb_handle *h,
+		fx3_progress *prog)
 {
-	int r = 0;
-	int index = start;
-	unsigned short address = 0;
-	int size;
+	int i;
 
-	while (len > 0) {
-		size = (len > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : len;
-		r = cyusb_control_transfer (h, 0x40, 0xBA, devAddr, address, &buf[index], size, VENDORCMD_TIMEOUT);
-		if (r != size) {
-			fprintf (stderr, "Error: I2C write failed\n");
+	memset (pipe, 0, sizeof (*pipe));
+	pipe->h    = h;
+	pipe->prog = prog;
+	pipe->bufs = (unsigned char *)malloc (I2C_PIPE_DEPTH * PIPE_BUF_SIZE);
+	if (pipe->bufs == NULL)
+		return -1;
+
+	for (i = 0; i < I2C_PIPE_DEPTH; i++) {
+		pipe->req[i].pipe = pipe;
+		pipe->req[i].xfer = libusb_alloc_transfer (0);
+		if (pipe->req[i].xfer == NULL)
 			return -1;
-		}
+	}
 
-		address += size ;
-		index   += size;
-		len     -= size;
+	return 0;
+}
+
+/* Wait until the flag is set, a slot is free (slot != NULL) or all commands have completed.
+   Returns the pipeline error status. */
+static int
+fx3_pipe_wait (
+		fx3_pipe     *pipe,
+		volatile int *flag,
+		int          *slot)
+{
+	int i;
+
+	while (1) {
+		if (pipe->error != 0)
+			return pipe->error;
+		if (slot != NULL) {
+			for (i = 0; i < I2C_PIPE_DEPTH; i++) {
+				if (!pipe->req[i].busy) {
+					*slot = i;
+					return 0;
+				}
+			}
+		} else if (flag != NULL) {
+			if (*flag)
+				return 0;
+		} else if (pipe->pending == 0)
+			return 0;
+
+		cyusb_handle_events (100);
+	}
+}
+
+/* Queue a vendor command. For writes, data is copied and may be reused once this returns. */
+static int
+fx3_pipe_submit (
+		fx3_pipe            *pipe,
+		unsigned char        bmRequestType,
+		unsigned char        bRequest,
+		unsigned short       wValue,
+		unsigned short       wIndex,
+		const unsigned char *data,
+		int                  len,
+		const unsigned char *expect,
+		unsigned char       *copy,
+		volatile int        *done)
+{
+	fx3_pipe_req  *req;
+	unsigned char *buf;
+	int i, r;
+
+	r = fx3_pipe_wait (pipe, NULL, &i);
+	if (r != 0)
+		return r;
+
+	req = &pipe->req[i];
+	buf = pipe->bufs + i * PIPE_BUF_SIZE;
+	libusb_fill_control_setup (buf, bmRequestType, bRequest, wValue, wIndex, len);
+	if (data != NULL)
+		memcpy (buf + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+	libusb_fill_control_transfer (req->xfer, pipe->h, buf, fx3_pipe_callback, req, VENDORCMD_TIMEOUT);
+	req->expect = expect;
+	req->copy   = copy;
+	req->done   = done;
+	req->busy   = 1;
+
+	__sync_fetch_and_add (&pipe->pending, 1);
+	r = cyusb_stats_submit (req->xfer, &req->t_submit);
+	if (r != 0) {
+		req->busy = 0;
+		__sync_fetch_and_sub (&pipe->pending, 1);
+		pipe->error = -1;
+		return -1;
 	}
 
 	return 0;
 }
 
-/* Function to read I2C data and compare against the expected value. */
+/* Cancel whatever is still queued and wait for it to complete, so that no callback refers to
+   the caller's buffers any more. */
+static void
+fx3_pipe_drain (
+		fx3_pipe *pipe)
+{
+	int i;
+
+	for (i = 0; i < I2C_PIPE_DEPTH; i++) {
+		if (pipe->req[i].busy)
+			cyusb_cancel_transfer (pipe->req[i].xfer);
+	}
+	while (pipe->pending != 0) {
+		cyusb_handle_events (100);
+	}
+}
+
+/* Drain the pipeline and release it. */
+static void
+fx3_pipe_free (
+		fx3_pipe *pipe)
+{
+	int i;
+
+	fx3_pipe_drain (pipe);
+	for (i = 0; i < I2C_PIPE_DEPTH; i++) {
+		if (pipe->req[i].xfer != NULL)
+			libusb_free_transfer (pipe->req[i].xfer);
+	}
+	free (pipe->bufs);
+}
+
+/* Program the image to one I2C EEPROM slave address. Every chunk is read back first and only
+   the pages that differ from the image are written. The commands are queued so that the writes
+   of one chunk follow the verification of the previous one, and the read of the next chunk
+   follows the writes. Returns the number of pages written, or a negative error code. */
 static int
-fx3_i2c_read_verify (
-		cyusb_handle  *h,
-		unsigned char *expData,
+fx3_i2c_program_slave (
+		fx3_pipe      *pipe,
+		unsigned char *img,
 		int            devAddr,
 		int            len)
 {
-	int r = 0;
-	int index = 0;
-	unsigned short address = 0;
-	int size;
-	unsigned char tmpBuf[MAX_WRITE_SIZE];
+	unsigned char cur[2][I2C_READ_SIZE];
+	volatile int  got[2];
+	int nchunks = (len + I2C_READ_SIZE - 1) / I2C_READ_SIZE;
+	int c, start, size, pos, run;
+	int written = 0, dirty;
+	int r;
 
-	while (len > 0) {
-		size = (len > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : len;
-		r = cyusb_control_transfer (h, 0xC0, 0xBB, devAddr, address, tmpBuf, size, VENDORCMD_TIMEOUT);
-		if (r != size) {
-			fprintf (stderr, "Error: I2C read failed\n");
-			return -1;
+	if (pipe->prog != NULL)
+		pipe->prog->total += len;
+
+	got[0] = 0;
+	r = fx3_pipe_submit (pipe, 0xC0, 0xBB, devAddr, 0, NULL, (len > I2C_READ_SIZE) ? I2C_READ_SIZE : len,
+			NULL, cur[0], &got[0]);
+
+	for (c = 0; (c < nchunks) && (r == 0); c++) {
+		start = c * I2C_READ_SIZE;
+		size  = ((len - start) > I2C_READ_SIZE) ? I2C_READ_SIZE : (len - start);
+
+		// Wait for the current contents of this chunk.
+		r = fx3_pipe_wait (pipe, &got[c & 1], NULL);
+		if (r != 0)
+			break;
+
+		// Write runs of consecutive pages that differ from the image.
+		dirty = 0;
+		for (pos = 0; (pos < size) && (r == 0); pos += run) {
+			run = I2C_PAGE_SIZE;
+			if (memcmp (cur[c & 1] + pos, img + start + pos, I2C_PAGE_SIZE) == 0)
+				continue;
+
+			while (((pos + run) < size) && (run < MAX_WRITE_SIZE) &&
+					(memcmp (cur[c & 1] + pos + run, img + start + pos + run, I2C_PAGE_SIZE) != 0))
+				run += I2C_PAGE_SIZE;
+
+			if (pipe->prog != NULL)
+				pipe->prog->total += run;
+			r = fx3_pipe_submit (pipe, 0x40, 0xBA, devAddr, start + pos, img + start + pos, run,
+					NULL, NULL, NULL);
+			dirty += run / I2C_PAGE_SIZE;
+		}
+		if (r != 0)
+			break;
+		written += dirty;
+
+		if (dirty == 0 && pipe->prog != NULL)
+			pipe->prog->csum = fx3_data_checksum (cur[c & 1], size, pipe->prog->csum);
+
+		// Read the next chunk ahead, so that its writes can be queued behind this verification.
+		if ((c + 1) < nchunks) {
+			got[(c + 1) & 1] = 0;
+			r = fx3_pipe_submit (pipe, 0xC0, 0xBB, devAddr, start + size, NULL,
+					((len - start - size) > I2C_READ_SIZE) ? I2C_READ_SIZE : (len - start - size),
+					NULL, cur[(c + 1) & 1], &got[(c + 1) & 1]);
 		}
 
-		if (memcmp (expData + index, tmpBuf, size) != 0) {
-			fprintf (stderr, "Error: Failed to read expected data from I2C EEPROM\n");
-			return -2;
+		if ((r == 0) && (dirty != 0)) {
+			if (pipe->prog != NULL)
+				pipe->prog->total += size;
+			r = fx3_pipe_submit (pipe, 0xC0, 0xBB, devAddr, start, NULL, size, img + start, NULL, NULL);
+		}
+	}
+
+	if (r == 0)
+		r = fx3_pipe_wait (pipe, NULL, NULL);
+
+	// Reads still queued after an error would complete into cur and got once this returns.
+	if (r != 0)
+		fx3_pipe_drain (pipe);
+
+	if (r == -2)
+		fprintf (stderr, "Error: Failed to read expected data from I2C EEPROM\n");
+	else if (r != 0)
+		fprintf (stderr, "Error: I2C transfer failed\n");
+
+	return (r == 0) ? written : r;
+}
+
+/* Write the firmware image to the I2C EEPROM(s), skipping pages that already match, and verify
+   what was written. Images larger than one slave address are split across consecutive ones. */
+static int
+fx3_i2c_program (
+		cyusb_handle  *h,
+		unsigned char *fwBuf,
+		int            romsize,
+		int            filesize,
+		fx3_progress  *prog)
+{
+	struct timeval start, end;
+	fx3_pipe pipe;
+	int size, part, len;
+	int address = 0, offset = 0;
+	int r = 0;
+
+	if (fx3_pipe_init (&pipe, h, prog) != 0) {
+		fprintf (stderr, "Error: Failed to allocate I2C transfers\n");
+		fx3_pipe_free (&pipe);
+		return -2;
+	}
+
+	filesize = ROUND_UP(filesize, I2C_PAGE_SIZE);
+	if (prog != NULL)
+		prog->total = 0;
+	PROGRESS_STAGE (prog, "write");
+
+	while ((filesize != 0) && (r >= 0)) {
+
+		size = (filesize <= romsize) ? filesize : romsize;
+
+		/* Devices larger than I2C_SLAVE_SIZE respond to a second slave address for the upper part. */
+		for (part = 0; (part < size) && (r >= 0); part += I2C_SLAVE_SIZE) {
+			len = ((size - part) > I2C_SLAVE_SIZE) ? I2C_SLAVE_SIZE : (size - part);
+
+			gettimeofday (&start, NULL);
+			r = fx3_i2c_program_slave (&pipe, fwBuf + offset + part,
+					address + (part / I2C_SLAVE_SIZE) * 4, len);
+			gettimeofday (&end, NULL);
+
+			if ((r >= 0) && (prog == NULL))
+				printf ("Info: I2C slave %d: wrote %d of %d pages in %ld ms\n",
+						address + (part / I2C_SLAVE_SIZE) * 4, r, len / I2C_PAGE_SIZE,
+						(end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000);
 		}
 
-		address += size ;
-		index   += size;
-		len     -= size;
+		/* Move to the next slave address. */
+		offset += size;
+		filesize -= size;
+		address++;
+	}
+
+	fx3_pipe_free (&pipe);
+	if (r < 0) {
+		fprintf (stderr, "Error: Write to I2C EEPROM failed\n");
+		return (r == -2) ? -3 : -4;
 	}
 
 	return 0;
@@ -354,8 +640,7 @@ fx3_i2cboot_download (
 		cyusb_handle *h,
 		const char   *filename)
 {
-	int romsize, size;
-	int address = 0, offset = 0;
+	int romsize;
 	int r, filesize;
 	unsigned char *fwBuf = 0;
 
@@ -369,7 +654,7 @@ fx3_i2cboot_download (
 	// Allocate memory for holding the firmware binary.
 	fwBuf = (unsigned char *)calloc (1, MAX_FWIMG_SIZE);
 
-	if (read_firmware_image (filename, fwBuf, &romsize, &filesize)) {
+	if (read_firmware_image (filename, fwBuf, &romsize, &filesize, 0)) {
 		fprintf (stderr, "Error: File %s does not contain valid FX3 firmware image\n", filename);
 		free (fwBuf);
 		return -2;
@@ -377,70 +662,28 @@ fx3_i2cboot_download (
 
         printf ("Info: Writing firmware image to I2C EEPROM\n");
 
-	filesize = ROUND_UP(filesize, I2C_PAGE_SIZE);
-	while (filesize != 0) {
-
-		size = (filesize <= romsize) ? filesize : romsize;
-		if (size > I2C_SLAVE_SIZE) {
-			r = fx3_i2c_write (h, fwBuf, address, offset, I2C_SLAVE_SIZE);
-			if (r == 0) {
-				r = fx3_i2c_read_verify (h, fwBuf + offset, address, I2C_SLAVE_SIZE);
-				if (r != 0) {
-					fprintf (stderr, "Error: Read-verify from I2C EEPROM failed\n");
-					free (fwBuf);
-					return -3;
-				}
-
-				r = fx3_i2c_write (h, fwBuf, address + 4, offset + I2C_SLAVE_SIZE, size - I2C_SLAVE_SIZE);
-				if (r == 0) {
-					r = fx3_i2c_read_verify (h, fwBuf + offset + I2C_SLAVE_SIZE,
-							address + 4, size - I2C_SLAVE_SIZE);
-					if (r != 0) {
-						fprintf (stderr, "Error: Read-verify from I2C EEPROM failed\n");
-						free (fwBuf);
-						return -3;
-					}
-				}
-			}
-		} else {
-			r = fx3_i2c_write (h, fwBuf, address, offset, size);
-			if (r == 0) {
-				r = fx3_i2c_read_verify (h, fwBuf + offset, address, size);
-				if (r != 0) {
-					fprintf (stderr, "Error: Read-verify from I2C EEPROM failed\n");
-					free (fwBuf);
-					return -3;
-				}
-			}
-		}
-
-		if (r != 0) {
-			fprintf (stderr, "Error: Write to I2C EEPROM failed\n");
-			free (fwBuf);
-			return -4;
-		}
-
-		/* Move to the next slave address. */
-		offset += size;
-		filesize -= size;
-		address++;
-	}
-
+	r = fx3_i2c_program (h, fwBuf, romsize, filesize, NULL);
 	free (fwBuf);
+	if (r != 0)
+		return r;
+
         printf ("Info: I2C programming completed\n");
 	return 0;
 }
 
+/* Write len bytes to SPI flash, starting at the page aligned byte offset. */
 static int
 fx3_spi_write (
 		cyusb_handle  *h,
 		unsigned char *buf,
-		int            len)
+		int            offset,
+		int            len,
+		fx3_progress  *prog)
 {
 	int r = 0;
 	int index = 0;
 	int size;
-	unsigned short page_address = 0;
+	unsigned short page_address = offset / SPI_PAGE_SIZE;
 
 	while (len > 0) {
 		size = (len > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : len;
@@ -449,6 +692,7 @@ fx3_spi_write (
 			fprintf (stderr, "Error: Write to SPI flash failed\n");
 			return -1;
 		}
+		PROGRESS_ADD (prog, size);
 		index += size;
 		len   -= size;
 		page_address += (size / SPI_PAGE_SIZE);
@@ -457,13 +701,108 @@ fx3_spi_write (
 	return 0;
 }
 
+/* Read len bytes from SPI flash, starting at the page aligned byte offset. */
+static int
+fx3_spi_read (
+		cyusb_handle  *h,
+		unsigned char *buf,
+		int            offset,
+		int            len,
+		fx3_progress  *prog)
+{
+	int r = 0;
+	int index = 0;
+	int size;
+	unsigned short page_address = offset / SPI_PAGE_SIZE;
+
+	while (len > 0) {
+		size = (len > SPI_READ_SIZE) ? SPI_READ_SIZE : len;
+		r = cyusb_control_transfer (h, 0xC0, 0xC3, 0, page_address, &buf[index], size, VENDORCMD_TIMEOUT);
+		if (r != size) {
+			fprintf (stderr, "Error: SPI read failed\n");
+			return -1;
+		}
+		PROGRESS_ADD (prog, size);
+		index += size;
+		len   -= size;
+		page_address += (size / SPI_PAGE_SIZE);
+	}
+
+	return 0;
+}
+
+/* Function to read SPI flash data and compare against the expected value. */
+static int
+fx3_spi_read_verify (
+		cyusb_handle  *h,
+		unsigned char *expData,
+		int            len,
+		fx3_progress  *prog)
+{
+	int r = 0;
+	int index = 0;
+	int size;
+	unsigned char tmpBuf[SPI_READ_SIZE];
+
+	while (len > 0) {
+		size = (len > SPI_READ_SIZE) ? SPI_READ_SIZE : len;
+		r = fx3_spi_read (h, tmpBuf, index, size, prog);
+		if (r != 0)
+			return -1;
+
+		if (memcmp (expData + index, tmpBuf, size) != 0) {
+			fprintf (stderr, "Error: Failed to read expected data from SPI flash\n");
+			return -2;
+		}
+
+		if (prog != NULL)
+			prog->csum = fx3_data_checksum (tmpBuf, size, prog->csum);
+		index += size;
+		len   -= size;
+	}
+
+	return 0;
+}
+
+/* Wait for the write in progress bit of the SPI flash to clear. The status is polled with an
+   interval that starts well below a millisecond and backs off exponentially, so that short
+   operations are not held up by a coarse sleep. */
+static int
+fx3_spi_wait_ready (
+		cyusb_handle *h,
+		int           timeout_ms)
+{
+	unsigned char stat;
+	long          waited = 0;
+	int           delay = SPI_POLL_MIN_US;
+	int r;
+
+	while (1) {
+		r = cyusb_control_transfer (h, 0xC0, 0xC4, 0, 0, &stat, 1, VENDORCMD_TIMEOUT);
+		if (r != 1) {
+			fprintf (stderr, "Error: SPI status read failed\n");
+			return -2;
+		}
+		if (stat == 0)
+			return 0;
+
+		if (waited >= (long)timeout_ms * 1000) {
+			fprintf (stderr, "Error: Timed out on SPI status read\n");
+			return -3;
+		}
+
+		usleep (delay);
+		waited += delay;
+		delay   = ((delay * 2) > SPI_POLL_MAX_US) ? SPI_POLL_MAX_US : (delay * 2);
+	}
+}
+
 static int
 fx3_spi_erase_sector (
 		cyusb_handle   *h,
-		unsigned short  nsector)
+		unsigned short  nsector,
+		fx3_progress   *prog)
 {
-	unsigned char stat;
-	int           timeout = 10;
 	int r;
 
 	r = cyusb_control_transfer (h, 0x40, 0xC4, 1, nsector, NULL, 0, VENDORCMD_TIMEOUT);
@@ -473,32 +812,107 @@ fx3_spi_erase_sector (
 	}
 
 	// Wait for the SPI flash to become ready again.
-	do {
-		r = cyusb_control_transfer (h, 0xC0, 0xC4, 0, 0, &stat, 1, VENDORCMD_TIMEOUT);
-		if (r != 1) {
-			fprintf (stderr, "Error: SPI status read failed\n");
+	r = fx3_spi_wait_ready (h, SPI_ERASE_TIMEOUT);
+	if (r != 0)
+		return r;
+
+	if (prog == NULL)
+		printf ("Info: Erased sector %d of SPI flash\n", nsector);
+	return 0;
+}
+
+/* Erase and write the firmware image to SPI flash. In differential mode every sector is read
+   back first, and only sectors whose contents differ from the image are erased and rewritten.
+   The image can optionally be read back for verification once it has been written. */
+static int
+fx3_spi_program (
+		cyusb_handle  *h,
+		unsigned char *fwBuf,
+		int            filesize,
+		int            diff,
+		int            verify,
+		fx3_progress  *prog)
+{
+	unsigned char *flashBuf = NULL;
+	int nsectors, changed = 0;
+	int r, i, start, len;
+
+	filesize = ROUND_UP(filesize, SPI_PAGE_SIZE);
+	nsectors = (filesize + SPI_SECTOR_SIZE - 1) / SPI_SECTOR_SIZE;
+	if (prog != NULL)
+		prog->total = ((diff) ? filesize : 0) + ((verify) ? filesize : 0);
+
+	if (diff) {
+		flashBuf = (unsigned char *)malloc (SPI_SECTOR_SIZE);
+		if (flashBuf == NULL) {
+			fprintf (stderr, "Error: Failed to allocate buffer for SPI flash contents\n");
 			return -2;
 		}
-		sleep (1);
-		timeout--;
-	} while ((stat != 0) && (timeout > 0));
+	}
 
-	if (stat != 0) {
-		fprintf (stderr, "Error: Timed out on SPI status read\n");
-		return -3;
+	for (i = 0; i < nsectors; i++) {
+		start = i * SPI_SECTOR_SIZE;
+		len   = ((filesize - start) > SPI_SECTOR_SIZE) ? SPI_SECTOR_SIZE : (filesize - start);
+
+		if (diff) {
+			PROGRESS_STAGE (prog, "compare");
+			r = fx3_spi_read (h, flashBuf, start, len, prog);
+			if (r != 0) {
+				free (flashBuf);
+				return -6;
+			}
+			if (memcmp (flashBuf, fwBuf + start, len) == 0)
+				continue;
+		}
+
+		changed++;
+		if (prog != NULL)
+			prog->total += len;
+
+		PROGRESS_STAGE (prog, "erase");
+		r = fx3_spi_erase_sector (h, i, prog);
+		if (r != 0) {
+			fprintf (stderr, "Error: Failed to erase SPI flash\n");
+			free (flashBuf);
+			return -4;
+		}
+
+		PROGRESS_STAGE (prog, "write");
+		r = fx3_spi_write (h, fwBuf + start, start, len, prog);
+		if (r != 0) {
+			fprintf (stderr, "Error: SPI write failed\n");
+			free (flashBuf);
+			return r;
+		}
+	}
+	free (flashBuf);
+
+	if ((diff) && (prog == NULL))
+		printf ("Info: %d of %d SPI flash sectors changed\n", changed, nsectors);
+
+	if (verify) {
+		PROGRESS_STAGE (prog, "verify");
+		r = fx3_spi_read_verify (h, fwBuf, filesize, prog);
+		if (r != 0) {
+			fprintf (stderr, "Error: Read-verify from SPI flash failed\n");
+			return -5;
+		}
+		if (prog == NULL)
+			printf ("Info: SPI flash contents verified\n");
 	}
 
-	printf ("Info: Erased sector %d of SPI flash\n", nsector);
 	return 0;
 }
 
 int
 fx3_spiboot_download (
 		cyusb_handle *h,
-		const char   *filename)
+		const char   *filename,
+		int           diff,
+		int           verify)
 {
 	unsigned char *fwBuf;
-	int r, i, filesize;
+	int r, filesize;
 
 	// Check if we have a handle to the FX3 flash programmer.
 	r = get_fx3_prog_handle (&h);
@@ -514,35 +928,431 @@ fx3_spiboot_download (
 		return -2;
 	}
 
-	if (read_firmware_image (filename, fwBuf, NULL, &filesize)) {
+	if (read_firmware_image (filename, fwBuf, NULL, &filesize, 1)) {
 		fprintf (stderr, "Error: File %s does not contain valid FX3 firmware image\n", filename);
 		free (fwBuf);
 		return -3;
 	}
 
-	filesize = ROUND_UP(filesize, SPI_PAGE_SIZE);
+	r = fx3_spi_program (h, fwBuf, filesize, diff, verify, NULL);
+	if (r == 0)
+		printf ("Info: SPI flash programming completed\n");
 
-	// Erase as many SPI sectors as are required to hold the firmware binary.
-	for (i = 0; i < ((filesize + SPI_SECTOR_SIZE - 1) / SPI_SECTOR_SIZE); i++) {
-		r = fx3_spi_erase_sector (h, i);
-		if (r != 0) {
-			fprintf (stderr, "Error: Failed to erase SPI flash\n");
-			free (fwBuf);
+	free (fwBuf);
+	return r;
+}
+
+/* Apply a delta produced by imgdelta to the image on SPI flash. The flash programmer checks that
+   the flash holds the base image of the delta, rewrites the sectors that change and returns the
+   CRC of the updated image, which is compared with the one recorded in the delta. */
+static int
+fx3_spi_apply_delta (
+		cyusb_handle  *h,
+		unsigned char *delta,
+		int            len)
+{
+	unsigned char  res[8];
+	unsigned int   nops, newcrc, crc;
+	unsigned short type, block;
+	int r, i, pos, size;
+
+	if ((len < DELTA_HDR_SIZE) || (GET_LE32 (delta) != DELTA_MAGIC)) {
+		fprintf (stderr, "Error: Not a delta file\n");
+		return -2;
+	}
+	newcrc = GET_LE32 (delta + 20);
+	nops   = GET_LE32 (delta + 24);
+
+	printf ("Info: Checking the image on SPI flash\n");
+	r = cyusb_control_transfer (h, 0x40, 0xC5, 0, 0, delta, DELTA_HDR_SIZE, DELTA_TIMEOUT);
+	if (r != DELTA_HDR_SIZE) {
+		fprintf (stderr, "Error: Delta rejected; the SPI flash does not hold its base image, or the\n");
+		fprintf (stderr, "       flash programmer does not support delta updates\n");
+		return -3;
+	}
+
+	pos = DELTA_HDR_SIZE;
+	for (i = 0; i < (int)nops; i++) {
+		if ((pos + DELTA_OP_SIZE) > len) {
+			fprintf (stderr, "Error: Delta file is truncated\n");
+			return -2;
+		}
+		type  = GET_LE16 (delta + pos);
+		block = GET_LE16 (delta + pos + 2);
+
+		// A data operation carries its block after the header, a copy sends its source block index.
+		if (type == DELTA_OP_DATA) {
+			size = DELTA_BLOCK_SIZE;
+			pos += DELTA_OP_SIZE;
+		} else {
+			size = 4;
+			pos += 4;
+		}
+		if ((pos + size) > len) {
+			fprintf (stderr, "Error: Delta file is truncated\n");
+			return -2;
+		}
+
+		r = cyusb_control_transfer (h, 0x40, 0xC6, type, block, delta + pos, size, DELTA_TIMEOUT);
+		if (r != size) {
+			fprintf (stderr, "Error: Failed to apply delta to block %d; the SPI flash has to be\n", block);
+			fprintf (stderr, "       programmed with the complete image\n");
 			return -4;
 		}
+		pos += size;
+	}
+
+	r = cyusb_control_transfer (h, 0xC0, 0xC7, 0, 0, res, 8, DELTA_TIMEOUT);
+	if (r != 8) {
+		fprintf (stderr, "Error: Failed to complete the delta update\n");
+		return -4;
+	}
+	crc = GET_LE32 (res);
+	if (crc != newcrc) {
+		fprintf (stderr, "Error: Updated image CRC is 0x%08x, expected 0x%08x\n", crc, newcrc);
+		return -5;
 	}
 
-	r = fx3_spi_write (h, fwBuf, filesize);
+	printf ("Info: Applied %d delta operations, image CRC 0x%08x verified\n", nops, crc);
+	return 0;
+}
+
+int
+fx3_spiboot_update (
+		cyusb_handle *h,
+		const char   *filename)
+{
+	unsigned char *delta;
+	struct stat filestat;
+	int fd, r, len;
+
+	// Check if we have a handle to the FX3 flash programmer.
+	r = get_fx3_prog_handle (&h);
 	if (r != 0) {
-		fprintf (stderr, "Error: SPI write failed\n");
-	} else {
-		printf ("Info: SPI flash programming completed\n");
+		fprintf (stderr, "Error: FX3 flash programmer not found\n");
+		return -1;
 	}
 
-	free (fwBuf);
+	if (stat (filename, &filestat) != 0) {
+		fprintf (stderr, "Error: Failed to stat file %s\n", filename);
+		return -2;
+	}
+	len   = filestat.st_size;
+	delta = (unsigned char *)malloc (len + 1);
+	fd    = open (filename, O_RDONLY);
+	if ((delta == NULL) || (fd < 0) || (read (fd, delta, len) != len)) {
+		fprintf (stderr, "Error: Failed to read delta file %s\n", filename);
+		if (fd >= 0)
+			close (fd);
+		free (delta);
+		return -2;
+	}
+	close (fd);
+
+	r = fx3_spi_apply_delta (h, delta, len);
+	if (r == 0)
+		printf ("Info: SPI flash update completed\n");
+
+	free (delta);
 	return r;
 }
 
+/* Provisioning job shared by all the per-device threads. */
+typedef struct {
+	fx3_fw_target  tgt;		// Final programming target.
+	const char    *ramfile;		// Image downloaded to boot loader devices: firmware or flash programmer.
+	unsigned char *fwBuf;		// Firmware image to be written to I2C EEPROM or SPI flash.
+	int            romsize;
+	int            filesize;
+	int            retries;		// Retries per device after the first failed attempt.
+	int            diff;		// Only rewrite SPI flash sectors that differ from the image.
+} fx3_prov_job;
+
+/* State of one device in provisioning mode. */
+typedef struct {
+	const fx3_prov_job *job;
+	cyusb_handle       *h;
+	int                 busnum;
+	int                 devaddr;
+	int                 attempts;
+	int                 status;	// Result of the last attempt: 0 on success.
+	volatile int        finished;
+	fx3_progress        prog;
+	pthread_t           thread;
+} fx3_prov_dev;
+
+/* Download an image to FX3 RAM through the boot loader, retrying on failure. */
+static void *
+fx3_prov_ram_worker (
+		void *arg)
+{
+	fx3_prov_dev *dev = (fx3_prov_dev *)arg;
+	int r;
+
+	dev->prog.total = 1;
+	do {
+		dev->attempts++;
+		dev->prog.stage = "download";
+		r = cyusb_download_fx3 (dev->h, dev->job->ramfile);
+	} while ((r != 0) && (dev->attempts <= dev->job->retries));
+
+	if (r == 0)
+		dev->prog.done = 1;
+	dev->prog.stage = (r == 0) ? "done" : "failed";
+	dev->status     = r;
+	dev->finished   = 1;
+	return NULL;
+}
+
+/* Write the firmware image to I2C EEPROM or SPI flash through the flash programmer, retrying on failure. */
+static void *
+fx3_prov_flash_worker (
+		void *arg)
+{
+	fx3_prov_dev *dev = (fx3_prov_dev *)arg;
+	const fx3_prov_job *job = dev->job;
+	int r;
+
+	do {
+		dev->attempts++;
+		dev->prog.done = 0;
+		dev->prog.csum = 0;
+		if (job->tgt == FW_TARGET_I2C)
+			r = fx3_i2c_program (dev->h, job->fwBuf, job->romsize, job->filesize, &dev->prog);
+		else
+			r = fx3_spi_program (dev->h, job->fwBuf, job->filesize, job->diff, 1, &dev->prog);
+	} while ((r != 0) && (dev->attempts <= job->retries));
+
+	dev->prog.stage = (r == 0) ? "done" : "failed";
+	dev->status     = r;
+	dev->finished   = 1;
+	return NULL;
+}
+
+/* Print one progress line per device. When redrawing, the previous lines are overwritten. */
+static void
+fx3_prov_show (
+		fx3_prov_dev *devs,
+		int           count,
+		int           redraw)
+{
+	int i, pct;
+
+	if (redraw)
+		printf ("\033[%dA", count);
+	for (i = 0; i < count; i++) {
+		pct = (devs[i].prog.total > 0) ? (int)((100LL * devs[i].prog.done) / devs[i].prog.total) : 0;
+		printf ("  %03d:%03d  %-8s %3d%%  attempt %d\033[K\n", devs[i].busnum, devs[i].devaddr,
+				(devs[i].prog.stage != NULL) ? devs[i].prog.stage : "-", pct, devs[i].attempts);
+	}
+	fflush (stdout);
+}
+
+/* Run worker on every device concurrently and wait for all of them to finish. Returns the
+   number of devices that failed. */
+static int
+fx3_prov_run (
+		fx3_prov_dev  *devs,
+		int            count,
+		void        *(*worker) (void *))
+{
+	int i, busy, failed = 0;
+	int tty = isatty (STDOUT_FILENO);
+
+	for (i = 0; i < count; i++) {
+		if (pthread_create (&devs[i].thread, NULL, worker, &devs[i]) != 0) {
+			fprintf (stderr, "Error: Failed to create thread for device %03d:%03d\n",
+					devs[i].busnum, devs[i].devaddr);
+			devs[i].prog.stage = "failed";
+			devs[i].status     = -ENOMEM;
+			devs[i].finished   = 1;
+			devs[i].thread     = 0;
+		}
+	}
+
+	if (tty)
+		fx3_prov_show (devs, count, 0);
+	do {
+		usleep (PROGRESS_POLL_MS * 1000);
+		busy = 0;
+		for (i = 0; i < count; i++)
+			busy += !devs[i].finished;
+		if (tty)
+			fx3_prov_show (devs, count, 1);
+	} while (busy);
+
+	for (i = 0; i < count; i++) {
+		if (devs[i].thread != 0)
+			pthread_join (devs[i].thread, NULL);
+		if (devs[i].status != 0)
+			failed++;
+	}
+
+	return failed;
+}
+
+/* Set up the provisioning state for a device. */
+static void
+fx3_prov_init (
+		fx3_prov_dev       *dev,
+		const fx3_prov_job *job,
+		cyusb_handle       *h)
+{
+	memset (dev, 0, sizeof (*dev));
+	dev->job     = job;
+	dev->h       = h;
+	dev->busnum  = cyusb_get_busnumber (h);
+	dev->devaddr = cyusb_get_devaddr (h);
+}
+
+/* Program all FX3 devices found: boot loader devices get the firmware (or the flash programmer
+   for I2C and SPI targets) downloaded concurrently, and all flash programmers then write and
+   verify the firmware concurrently. The library is expected to be open with ndev devices. */
+static int
+fx3_provision_all (
+		fx3_fw_target  tgt,
+		const char    *filename,
+		int            retries,
+		int            diff,
+		int            ndev)
+{
+	fx3_prov_job  job;
+	fx3_prov_dev *boot = NULL, *prog = NULL;
+	cyusb_handle *handle;
+	char         *progfile_p = NULL;
+	unsigned int  csum;
+	int nboot = 0, nprog = 0, nexpect, failed = 0;
+	int i, j, n;
+
+	memset (&job, 0, sizeof (job));
+	job.tgt     = tgt;
+	job.retries = retries;
+	job.diff    = diff;
+
+	// Validate the image once, before any device is touched.
+	job.fwBuf = (unsigned char *)calloc (1, MAX_FWIMG_SIZE);
+	if (job.fwBuf == 0) {
+		fprintf (stderr, "Error: Failed to allocate buffer to store firmware binary\n");
+		return -ENOMEM;
+	}
+	if (read_firmware_image (filename, job.fwBuf, &job.romsize, &job.filesize, (tgt == FW_TARGET_SPI))) {
+		fprintf (stderr, "Error: File %s does not contain valid FX3 firmware image\n", filename);
+		free (job.fwBuf);
+		return -EINVAL;
+	}
+	csum = fx3_data_checksum (job.fwBuf, job.filesize, 0);
+
+	if (tgt == FW_TARGET_RAM)
+		job.ramfile = filename;
+	else {
+		progfile_p = get_fx3_prog_filename ();
+		if (progfile_p == NULL) {
+			free (job.fwBuf);
+			return -ENOENT;
+		}
+		job.ramfile = progfile_p;
+	}
+
+	boot = (fx3_prov_dev *)calloc (ndev, sizeof (fx3_prov_dev));
+	prog = (fx3_prov_dev *)calloc (MAXDEVICES, sizeof (fx3_prov_dev));
+	if ((boot == NULL) || (prog == NULL)) {
+		fprintf (stderr, "Error: Out of memory\n");
+		failed = -ENOMEM;
+		goto out;
+	}
+
+	// Sort the devices into boot loaders and flash programmers that are already running.
+	for (i = 0; i < ndev; i++) {
+		handle = cyusb_gethandle (i);
+		if (handle == NULL)
+			continue;
+		if ((cyusb_getvendor (handle) == FLASHPROG_VID) && (cyusb_getproduct (handle) == BOOTLOADER_PID))
+			fx3_prov_init (&boot[nboot++], &job, handle);
+		else if ((tgt != FW_TARGET_RAM) && (is_fx3_flashprog (handle)))
+			nprog++;
+	}
+	if ((nboot + nprog) == 0) {
+		fprintf (stderr, "Error: No FX3 device in boot loader mode found\n");
+		failed = -ENODEV;
+		goto out;
+	}
+
+	if (nboot != 0) {
+		printf ("Info: Downloading %s to %d device(s)\n", job.ramfile, nboot);
+		failed = fx3_prov_run (boot, nboot, fx3_prov_ram_worker);
+	}
+
+	if (tgt != FW_TARGET_RAM) {
+		// Wait once for all the flash programmers to enumerate.
+		nexpect = nprog + nboot - failed;
+		nprog   = 0;
+		cyusb_close ();
+		for (j = 0; j < (GETHANDLE_TIMEOUT * 1000) / GETHANDLE_POLL_MS; j++) {
+			usleep (GETHANDLE_POLL_MS * 1000);
+			n = cyusb_open ();
+			if (n < 0)
+				continue;
+			nprog = 0;
+			for (i = 0; i < n; i++) {
+				handle = cyusb_gethandle (i);
+				if ((handle != NULL) && (cyusb_getvendor (handle) == FLASHPROG_VID) &&
+						(cyusb_getproduct (handle) != BOOTLOADER_PID) && (is_fx3_flashprog (handle)))
+					fx3_prov_init (&prog[nprog++], &job, handle);
+			}
+			if (nprog >= nexpect)
+				break;
+			cyusb_close ();
+			nprog = 0;
+		}
+
+		if (nprog < nexpect) {
+			fprintf (stderr, "Error: Only %d of %d flash programmers enumerated\n", nprog, nexpect);
+			failed += nexpect - nprog;
+			n = cyusb_open ();
+			for (i = 0; i < n; i++) {
+				handle = cyusb_gethandle (i);
+				if ((handle != NULL) && (cyusb_getvendor (handle) == FLASHPROG_VID) &&
+						(cyusb_getproduct (handle) != BOOTLOADER_PID) && (is_fx3_flashprog (handle)))
+					fx3_prov_init (&prog[nprog++], &job, handle);
+			}
+		}
+
+		if (nprog != 0) {
+			printf ("Info: Writing firmware image to %s on %d device(s)\n",
+					(tgt == FW_TARGET_I2C) ? "I2C EEPROM" : "SPI flash", nprog);
+			failed += fx3_prov_run (prog, nprog, fx3_prov_flash_worker);
+		}
+	}
+
+	// Report the outcome for every device.
+	printf ("\n  Device   Result  Attempts  Checksum\n");
+	for (i = 0; i < nboot; i++) {
+		if ((tgt == FW_TARGET_RAM) || (boot[i].status != 0))
+			printf ("  %03d:%03d  %-6s  %8d  %s\n", boot[i].busnum, boot[i].devaddr,
+					(boot[i].status == 0) ? "OK" : "FAILED", boot[i].attempts,
+					(tgt == FW_TARGET_RAM) ? "n/a" : "boot failed");
+	}
+	for (i = 0; i < nprog; i++) {
+		if (prog[i].status == 0)
+			printf ("  %03d:%03d  %-6s  %8d  0x%08x %s\n", prog[i].busnum, prog[i].devaddr, "OK",
+					prog[i].attempts, prog[i].prog.csum,
+					(prog[i].prog.csum == csum) ? "ok" : "MISMATCH");
+		else
+			printf ("  %03d:%03d  %-6s  %8d  -\n", prog[i].busnum, prog[i].devaddr, "FAILED",
+					prog[i].attempts);
+	}
+	printf ("  Image checksum 0x%08x, %d device(s) failed\n", csum, failed);
+
+	failed = (failed != 0) ? -EIO : 0;
+
+out:
+	free (boot);
+	free (prog);
+	free (progfile_p);
+	free (job.fwBuf);
+	return failed;
+}
+
 void
 print_usage_info (
 		const char *arg0)
@@ -556,6 +1366,14 @@ print_usage_info (
 	printf ("\t\t\t\t\"RAM\": Program to FX3 RAM\n");
 	printf ("\t\t\t\t\"I2C\": Program to I2C EEPROM\n");
 	printf ("\t\t\t\t\"SPI\": Program to SPI FLASH\n");
+	printf ("\t\tOptions for the SPI target:\n");
+	printf ("\t\t\t-d: Only erase and rewrite sectors whose contents differ from the image\n");
+	printf ("\t\t\t-v: Read the flash back and verify it after programming\n");
+	printf ("\t%s -t SPI -u <delta filename>: Update the image on SPI flash with a delta\n", arg0);
+	printf ("\t\tcomputed by imgdelta\n");
+	printf ("\t%s -a -t <target> -i <img filename> [-r <retries>]: Program all FX3 devices\n", arg0);
+	printf ("\t\tin boot loader mode concurrently, retrying each device up to <retries> times\n");
+	printf ("\t\t(default %d)\n", PROVISION_RETRIES);
 	printf ("\n\n");
 }
 
@@ -566,7 +1384,11 @@ int main (
 	cyusb_handle *h;
 	char         *filename = NULL;
 	char         *tgt_str  = NULL;
+	char         *deltafile = NULL;
 	fx3_fw_target tgt = FW_TARGET_NONE;
+	int           all = 0;
+	int           retries = PROVISION_RETRIES;
+	int           diff = 0, verify = 0;
 	int r, i;
 
 	/* Parse command line arguments. */
@@ -596,6 +1418,20 @@ int main (
 					if (argc > (i + 1))
 						filename = argv[i + 1];
 					i++;
+				} else if ((strcmp (argv[i], "-u") == 0) || (strcmp (argv[i], "--update") == 0)) {
+					if (argc > (i + 1))
+						deltafile = argv[i + 1];
+					i++;
+				} else if ((strcmp (argv[i], "-d") == 0) || (strcmp (argv[i], "--diff") == 0)) {
+					diff = 1;
+				} else if ((strcmp (argv[i], "-v") == 0) || (strcmp (argv[i], "--verify") == 0)) {
+					verify = 1;
+				} else if ((strcmp (argv[i], "-a") == 0) || (strcmp (argv[i], "--all") == 0)) {
+					all = 1;
+				} else if ((strcmp (argv[i], "-r") == 0) || (strcmp (argv[i], "--retries") == 0)) {
+					if (argc > (i + 1))
+						retries = atoi (argv[i + 1]);
+					i++;
 				} else {
 					fprintf (stderr, "Error: Unknown parameter %s\n", argv[i]);
 					print_usage_info (argv[0]);
@@ -604,11 +1440,16 @@ int main (
 			}
 		}
 	}
-	if ((filename == NULL) || (tgt == FW_TARGET_NONE)) {
+	if (((filename == NULL) && (deltafile == NULL)) || (tgt == FW_TARGET_NONE)) {
 		fprintf (stderr, "Error: Firmware binary or target not specified\n");
 		print_usage_info (argv[0]);
 		return -EINVAL;
 	}
+	if ((deltafile != NULL) && ((tgt != FW_TARGET_SPI) || (filename != NULL) || (all))) {
+		fprintf (stderr, "Error: A delta can only be applied to SPI flash, on its own\n");
+		print_usage_info (argv[0]);
+		return -EINVAL;
+	}
 
 	r = cyusb_open ();
 	if (r < 0) {
@@ -619,7 +1460,14 @@ int main (
 	        fprintf (stderr, "Error: No FX3 device found\n");
 		return -ENODEV;
 	}
-	else if (r > 1) {
+
+	if (all) {
+		r = fx3_provision_all (tgt, filename, retries, diff, r);
+		cyusb_close ();
+		return r;
+	}
+
+	if (r > 1) {
 		fprintf (stderr, "Error: More than one Cypress device found\n");
 		return -EINVAL;
 	}
@@ -634,7 +1482,10 @@ int main (
 			r = fx3_i2cboot_download (h, filename);
 			break;
 		case FW_TARGET_SPI:
-			r = fx3_spiboot_download (h, filename);
+			if (deltafile != NULL)
+				r = fx3_spiboot_update (h, deltafile);
+			else
+				r = fx3_spiboot_download (h, filename, diff, verify);
 			break;
 		default:
 			break;
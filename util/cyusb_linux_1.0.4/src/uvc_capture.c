@@ -0,0 +1,273 @@
+/*
+ * Filename             : uvc_capture.c
+ * Description          : Captures video from an FX3 or CX3 UVC camera design through libcyusb,
+ *                        without the kernel video driver. Negotiates the format, reassembles
+ *                        frames from a bulk or isochronous endpoint and reports the frame rate,
+ *                        frame interval jitter and every truncated or dropped frame. Frames can
+ *                        be saved back to back to a file.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+#define DEFAULT_VS_INTERFACE	(1)		// VideoStreaming interface of the FX3 and CX3 examples.
+#define DEFAULT_EP_VIDEO	(0x81)		// Bulk video endpoint of the FX3 and CX3 examples.
+#define DEFAULT_NUM_FRAMES	(4)		// Frame buffers.
+#define DEFAULT_NUM_XFERS	(8)		// Transfers kept queued on the endpoint.
+#define GET_TIMEOUT		(1000)		// Time to wait for a frame.
+
+static volatile int stop_requested;
+
+static void
+stop_handler (
+		int sig)
+{
+	stop_requested = 1;
+}
+
+static void
+print_usage_info (
+		const char *arg0)
+{
+	printf ("%s: Capture frames from a UVC camera\n\n", arg0);
+	printf ("Usage:\n");
+	printf ("\t%s [options]\n\n", arg0);
+	printf ("\t-i <intf>   : VideoStreaming interface (default %d)\n", DEFAULT_VS_INTERFACE);
+	printf ("\t-a <alt>    : Alternate setting carrying the endpoint, for iso cameras (default 0)\n");
+	printf ("\t-e <ep>     : Video endpoint (default 0x%02x)\n", DEFAULT_EP_VIDEO);
+	printf ("\t-f <index>  : Format index to request (default: device default)\n");
+	printf ("\t-r <index>  : Frame index to request (default: device default)\n");
+	printf ("\t-I <fps>    : Frame rate to request (default: device default)\n");
+	printf ("\t-n <count>  : Frame buffers, up to %d (default %d)\n", CYUSB_UVC_MAX_FRAMES,
+			DEFAULT_NUM_FRAMES);
+	printf ("\t-q <depth>  : Transfers kept queued, up to %d (default %d)\n", CYUSB_STREAM_MAX_XFERS,
+			DEFAULT_NUM_XFERS);
+	printf ("\t-P <bytes>  : Bulk payload size, if the firmware sends less than it reports\n");
+	printf ("\t-p <count>  : Packets per iso transfer (default 32)\n");
+	printf ("\t-F          : Frames have a fixed size (uncompressed formats)\n");
+	printf ("\t-o <file>   : Save complete frames to <file>\n");
+	printf ("\t-c <count>  : Stop after <count> frames\n");
+	printf ("\t-t <secs>   : Stop after <secs> seconds (default: run until interrupted)\n");
+	printf ("\t-h          : Print this help message\n");
+	printf ("\n");
+}
+
+int main (
+		int    argc,
+		char **argv)
+{
+	struct cyusb_uvc_config  cfg;
+	struct cyusb_uvc_probe   probe;
+	struct cyusb_uvc_stats   st, prev;
+	struct cyusb_uvc_frame  *frame;
+	struct cyusb_uvc        *uvc;
+	struct sigaction         sa;
+	struct timespec          ts;
+	cyusb_handle *h;
+	const char   *outfile = NULL;
+	FILE         *fp = NULL;
+	unsigned long long count = 0, saved = 0;
+	unsigned long long t0, now, last_report;
+	double fps = 0;
+	int duration = 0;
+	int r, opt;
+
+	memset (&cfg, 0, sizeof (cfg));
+	cfg.interface  = DEFAULT_VS_INTERFACE;
+	cfg.endpoint   = DEFAULT_EP_VIDEO;
+	cfg.num_frames = DEFAULT_NUM_FRAMES;
+	cfg.num_xfers  = DEFAULT_NUM_XFERS;
+
+	while ((opt = getopt (argc, argv, "hi:a:e:f:r:I:n:q:P:p:Fo:c:t:")) != -1) {
+		switch (opt) {
+			case 'i':
+				cfg.interface = atoi (optarg);
+				break;
+			case 'a':
+				cfg.alt_setting = atoi (optarg);
+				break;
+			case 'e':
+				cfg.endpoint = (unsigned char)strtoul (optarg, NULL, 0);
+				break;
+			case 'f':
+				cfg.format_index = (unsigned char)atoi (optarg);
+				break;
+			case 'r':
+				cfg.frame_index = (unsigned char)atoi (optarg);
+				break;
+			case 'I':
+				fps = atof (optarg);
+				break;
+			case 'n':
+				cfg.num_frames = atoi (optarg);
+				break;
+			case 'q':
+				cfg.num_xfers = atoi (optarg);
+				break;
+			case 'P':
+				cfg.payload_size = atoi (optarg);
+				break;
+			case 'p':
+				cfg.iso_packets = atoi (optarg);
+				break;
+			case 'F':
+				cfg.flags |= CYUSB_UVC_FIXED_SIZE;
+				break;
+			case 'o':
+				outfile = optarg;
+				break;
+			case 'c':
+				count = strtoull (optarg, NULL, 0);
+				break;
+			case 't':
+				duration = atoi (optarg);
+				break;
+			case 'h':
+				print_usage_info (argv[0]);
+				return 0;
+			default:
+				print_usage_info (argv[0]);
+				return -EINVAL;
+		}
+	}
+	if (fps > 0)
+		cfg.frame_interval = (unsigned int)(1e7 / fps + 0.5);
+
+	if (outfile) {
+		fp = fopen (outfile, "wb");
+		if (fp == NULL) {
+			fprintf (stderr, "Error: Failed to create %s\n", outfile);
+			return -ENOENT;
+		}
+	}
+
+	r = cyusb_open ();
+	if (r < 0) {
+		fprintf (stderr, "Error opening library\n");
+		return -ENODEV;
+	}
+	else if (r == 0) {
+		fprintf (stderr, "Error: No device found\n");
+		return -ENODEV;
+	}
+
+	// The kernel video driver owns both the control and the streaming interface.
+	h = cyusb_gethandle (0);
+	if (cyusb_kernel_driver_active (h, 0) == 1)
+		cyusb_detach_kernel_driver (h, 0);
+	if (cyusb_kernel_driver_active (h, cfg.interface) == 1)
+		cyusb_detach_kernel_driver (h, cfg.interface);
+	r = cyusb_claim_interface (h, cfg.interface);
+	if (r != 0) {
+		fprintf (stderr, "Error: Failed to claim interface %d\n", cfg.interface);
+		cyusb_error (r);
+		cyusb_close ();
+		return r;
+	}
+
+	uvc = cyusb_uvc_create (h, &cfg);
+	if (uvc == NULL) {
+		fprintf (stderr, "Error: Failed to set up the video stream; check the settings\n");
+		cyusb_release_interface (h, cfg.interface);
+		cyusb_close ();
+		return -EINVAL;
+	}
+
+	cyusb_uvc_get_probe (uvc, &probe);
+	printf ("Format %d, frame %d, %.2f fps, max. frame %u bytes, max. payload %u bytes\n",
+			probe.bFormatIndex, probe.bFrameIndex,
+			(probe.dwFrameInterval) ? 1e7 / probe.dwFrameInterval : 0.0,
+			probe.dwMaxVideoFrameSize, probe.dwMaxPayloadTransferSize);
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = stop_handler;
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	r = cyusb_uvc_start (uvc);
+	if (r != 0) {
+		fprintf (stderr, "Error: Failed to start the video stream\n");
+		cyusb_error (r);
+		cyusb_uvc_destroy (uvc);
+		cyusb_release_interface (h, cfg.interface);
+		cyusb_close ();
+		return r;
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	t0 = last_report = ts.tv_sec;
+	memset (&prev, 0, sizeof (prev));
+	while (!stop_requested) {
+		r = cyusb_uvc_get_frame (uvc, &frame, GET_TIMEOUT);
+		if ((r != 0) && (r != LIBUSB_ERROR_TIMEOUT)) {
+			fprintf (stderr, "\nError: Video stream failed\n");
+			cyusb_error (r);
+			break;
+		}
+		if (r == 0) {
+			if (frame->flags)
+				fprintf (stderr, "\nWarning: Frame %llu truncated (%u bytes,%s%s%s)\n",
+						frame->sequence, frame->length,
+						(frame->flags & CYUSB_UVC_FRAME_ERROR) ? " error bit" : "",
+						(frame->flags & CYUSB_UVC_FRAME_INCOMPLETE) ? " data lost" : "",
+						(frame->flags & CYUSB_UVC_FRAME_OVERFLOW) ? " overflow" : "");
+			else if (fp) {
+				if (fwrite (frame->data, 1, frame->length, fp) != frame->length) {
+					fprintf (stderr, "\nError: Failed to write %s\n", outfile);
+					cyusb_uvc_put_frame (uvc, frame);
+					break;
+				}
+				saved++;
+			}
+			cyusb_uvc_put_frame (uvc, frame);
+		}
+
+		cyusb_uvc_get_stats (uvc, &st);
+		if (st.frames_dropped != prev.frames_dropped)
+			fprintf (stderr, "\nWarning: %llu frame(s) dropped, no free buffer\n",
+					st.frames_dropped - prev.frames_dropped);
+		prev = st;
+
+		clock_gettime (CLOCK_MONOTONIC, &ts);
+		now = ts.tv_sec;
+		if (now != last_report) {
+			fprintf (stderr, "\rFrames %llu  %6.2f fps  Jitter %8.1f us  Truncated %llu  Dropped %llu  ",
+					st.frames, st.fps, st.jitter_us, st.frames_truncated, st.frames_dropped);
+			last_report = now;
+		}
+		if ((count) && (st.frames >= count))
+			break;
+		if ((duration) && (now - t0 >= (unsigned long long)duration))
+			break;
+	}
+	fprintf (stderr, "\n");
+
+	cyusb_uvc_stop (uvc);
+	cyusb_uvc_get_stats (uvc, &st);
+
+	printf ("Frames         : %llu (%llu bytes)\n", st.frames, st.bytes);
+	printf ("Frame rate     : %.2f fps\n", st.fps);
+	printf ("Frame interval : mean %.1f us, max. %.1f us, jitter %.1f us\n", st.interval_us,
+			st.interval_max_us, st.jitter_us);
+	printf ("Truncated      : %llu\n", st.frames_truncated);
+	printf ("Dropped        : %llu\n", st.frames_dropped);
+	printf ("Payloads       : %llu, %llu error(s)\n", st.payloads, st.payload_errors);
+	if (fp) {
+		printf ("Saved          : %llu frames to %s\n", saved, outfile);
+		fclose (fp);
+	}
+
+	cyusb_uvc_destroy (uvc);
+	cyusb_release_interface (h, cfg.interface);
+	cyusb_close ();
+
+	return ((st.frames_truncated) || (st.frames_dropped)) ? 1 : 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Filename             : uvc_bulk_test.c
+ * Description          : Captures from the software model of the cyfxuvcinmem_bulk camera
+ *                        (CYUSB_BACKEND=mock, CYUSB_MOCK_STATE=uvc), whose bulk endpoint bursts
+ *                        16 packets and whose payloads are 4096 bytes of whole packets, so that
+ *                        only the payload size marks where one payload ends and the next header
+ *                        starts. Every frame must come back complete, with no header bytes in
+ *                        the image data. Build and run with "make check".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+#define UVC_VID			(0x04b4)
+#define UVC_PID			(0x4722)	// cyfxuvcinmem_bulk
+#define UVC_VS_INTERFACE	(1)
+#define UVC_EP_VIDEO		(0x81)
+#define UVC_PAYLOAD		(4096)		// CY_FX_UVC_STREAM_BUF_SIZE
+#define UVC_FRAME_SIZE		(4 * (UVC_PAYLOAD - 12))	// Frame size of the model
+#define NUM_FRAMES		(64)		// Frames to check
+
+static int failures = 0;
+
+#define CHECK(cond, ...)						\
+{									\
+	if ( !(cond) ) {						\
+	   fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);	\
+	   fprintf(stderr, __VA_ARGS__);				\
+	   fprintf(stderr, "\n");					\
+	   failures++;							\
+	}								\
+}
+
+/* Return the offset of the first byte of a frame that differs from the model's pattern, or -1. */
+static int check_pattern(const struct cyusb_uvc_frame *f)
+{
+	unsigned int i;
+
+	for ( i = 0; i < f->length; ++i ) {
+		if ( f->data[i] != (unsigned char)i )
+		   return i;
+	}
+	return -1;
+}
+
+int main(void)
+{
+	struct cyusb_uvc_config cfg;
+	struct cyusb_uvc_probe probe;
+	struct cyusb_uvc_stats st;
+	struct cyusb_uvc_frame *f;
+	struct cyusb_uvc *uvc;
+	cyusb_handle *h;
+	int i, r, bad;
+
+	setenv("CYUSB_BACKEND", "mock", 1);
+	setenv("CYUSB_MOCK_STATE", "uvc", 1);
+	if ( cyusb_open(UVC_VID, UVC_PID) != 1 ) {
+	   fprintf(stderr, "FAIL: mock UVC camera not found\n");
+	   return 1;
+	}
+	h = cyusb_gethandle(0);
+	r = cyusb_claim_interface(h, UVC_VS_INTERFACE);
+	CHECK(r == 0, "claim interface: %d", r);
+
+	/* The camera reports a larger dwMaxPayloadTransferSize than it sends, as the firmware does. */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.interface    = UVC_VS_INTERFACE;
+	cfg.endpoint     = UVC_EP_VIDEO;
+	cfg.num_frames   = 4;
+	cfg.num_xfers    = 8;
+	cfg.payload_size = UVC_PAYLOAD;
+	cfg.flags        = CYUSB_UVC_FIXED_SIZE;
+	uvc = cyusb_uvc_create(h, &cfg);
+	if ( uvc == NULL ) {
+	   fprintf(stderr, "FAIL: cyusb_uvc_create\n");
+	   cyusb_close();
+	   return 1;
+	}
+	cyusb_uvc_get_probe(uvc, &probe);
+	CHECK(probe.dwMaxVideoFrameSize == UVC_FRAME_SIZE, "dwMaxVideoFrameSize %u",
+			probe.dwMaxVideoFrameSize);
+
+	r = cyusb_uvc_start(uvc);
+	CHECK(r == 0, "cyusb_uvc_start: %d", r);
+	for ( i = 0; ( r == 0 ) && ( i < NUM_FRAMES ); ++i ) {
+		r = cyusb_uvc_get_frame(uvc, &f, 1000);
+		CHECK(r == 0, "cyusb_uvc_get_frame: %d", r);
+		if ( r )
+		   break;
+		CHECK(f->flags == 0, "frame %llu: flags 0x%x", f->sequence, f->flags);
+		CHECK(f->length == UVC_FRAME_SIZE, "frame %llu: %u bytes", f->sequence, f->length);
+		bad = check_pattern(f);
+		CHECK(bad < 0, "frame %llu: wrong data at offset %d", f->sequence, bad);
+		r = cyusb_uvc_put_frame(uvc, f);
+		CHECK(r == 0, "cyusb_uvc_put_frame: %d", r);
+	}
+	cyusb_uvc_stop(uvc);
+
+	cyusb_uvc_get_stats(uvc, &st);
+	CHECK(st.frames_truncated == 0, "%llu truncated frames", st.frames_truncated);
+	CHECK(st.payload_errors == 0, "%llu payload errors", st.payload_errors);
+	CHECK(st.payloads >= NUM_FRAMES * 4, "%llu payloads for %d frames", st.payloads, NUM_FRAMES);
+
+	cyusb_uvc_destroy(uvc);
+	cyusb_release_interface(h, UVC_VS_INTERFACE);
+	cyusb_close();
+
+	if ( failures ) {
+	   printf("uvc_bulk_test: %d failures\n", failures);
+	   return 1;
+	}
+	printf("uvc_bulk_test: passed\n");
+	return 0;
+}
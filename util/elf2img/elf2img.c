@@ -34,6 +34,20 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <assert.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* The packed image format and its decoder are shared with the boot firmware, so that every
+   record written here is checked with the code that will expand it on the device. */
+#include "../../firmware/boot_fw/src/img_unpack.h"
+#include "../../firmware/boot_fw/src/img_unpack.c"
+
+/* The LZ4 encoder is built the same way, and is also linked into the decoder's host test. */
+#include "lz4_pack.h"
+#include "lz4_pack.c"
 
 #define CY_INTVECTOR_AREA_SIZE  (0x100)
 
@@ -69,6 +83,25 @@ typedef struct ProgramHeader
 
 #define PT_LOAD         (1)
 
+/* Zero runs shorter than this many words stay in the surrounding data record. A zero-fill
+   record costs a header, and usually splits the data around it into two records. */
+#define ZERO_RUN_MIN    (16)
+
+/* Boot sources of the load time estimates. These are rough figures, meant for comparing images
+   rather than predicting boot times. */
+#define BOOT_USB        (0)
+#define BOOT_SPI        (1)
+#define BOOT_I2C        (2)
+#define BOOT_SOURCES    (3)
+
+#define USB_CHUNK       (4096)          /* Largest write per vendor request. */
+#define USB_REQ_US      (125.0)         /* Setup and status stages of a vendor request. */
+#define USB_BYTES_US    (8.0)           /* Control endpoint data rate at high speed. */
+#define SPI_REC_US      (10.0)          /* New read command and DMA setup per record. */
+#define I2C_REC_BYTES   (4.0)           /* Start, device and memory address per record. */
+
+#define MAX_REGIONS     (64)            /* Loadable segments handled by -optimize. */
+
 #define ERREXIT(...)                                    \
 {                                                       \
     fprintf (stderr, __VA_ARGS__);                      \
@@ -91,6 +124,37 @@ int          verbose        = 0;
 unsigned int checksum       = 0;
 unsigned int i2cDevSize     = 0x4000;  /* 64 KB by default. */
 int          loadIntVectors = 0;
+int          packImage      = 0;
+
+/* 4 KB scratch buffers of the boot firmware (SPI/USB DMA buffer on 256 KB and 512 KB parts).
+   LZ4 records are expanded from these, so they must not be loaded into them. */
+const unsigned int ScratchAreas[2] = { 0x40037000, 0x40077000 };
+const char * const ScratchParts[2] = { "256 KB", "512 KB" };
+#define SCRATCH_SIZE    (0x1000)
+
+/* The USB boot firmware does not overwrite its interrupt vectors below this address, so it
+   cannot expand LZ4 records that start there. */
+#define VECTOR_AREA_END (0xFF)
+
+/* Statistics of the image, for the summary and the load time report. */
+unsigned int imgRecords  = 0;   /* Records, not counting the end record. */
+unsigned int imgBytes    = 0;   /* Size of the records, headers included. */
+unsigned int usbRequests = 0;   /* Vendor requests needed to load them over USB. */
+unsigned int loadBytes   = 0;   /* Memory written by the records. */
+
+/* SPI and I2C clocks in MHz, by bits 5:4 of the EEPROM control byte. */
+const double SpiClocks[4] = { 10.0, 20.0, 30.0, 30.0 };
+const double I2cClocks[4] = { 0.1, 0.4, 1.0, 1.0 };
+const char  *BootSourceNames[BOOT_SOURCES] = { "usb", "spi", "i2c" };
+
+/* A loadable segment, after removal of the interrupt vector area. Sizes are in bytes. */
+typedef struct LoadRegion
+{
+    unsigned int addr;
+    unsigned int memsize;
+    unsigned int filesize;
+    unsigned int offset;
+} LoadRegion;
 
 int
 CheckElfHeader (
@@ -144,6 +208,248 @@ CheckElfHeader (
     return (0);
 }
 
+/* Write one record of a packed image. */
+void
+WritePackedRecord (
+        FILE                *fpImg,
+        unsigned int         type,
+        unsigned int         addr,
+        unsigned int         words,
+        const unsigned char *payload,
+        unsigned int         payloadLen)
+{
+    unsigned int hdr[3];
+    unsigned int pad = 0;
+
+    hdr[0] = words;
+    hdr[1] = addr;
+    hdr[2] = IMG_REC_CODING (type, payloadLen);
+
+    if (verbose)
+    {
+        fprintf (stderr, "\tRecord type %d: Addr=0x%08x Size(words)=0x%08x Payload=0x%08x\n",
+                type, addr, words, payloadLen);
+    }
+
+    fwrite (hdr, 4, 3, fpImg);
+    if (payloadLen)
+    {
+        fwrite (payload, 1, payloadLen, fpImg);
+        fwrite (&pad, 1, IMG_REC_PADDED (payloadLen) - payloadLen, fpImg);
+    }
+
+    imgRecords++;
+    imgBytes    += IMG_REC_HDR_SIZE + IMG_REC_PADDED (payloadLen);
+    usbRequests += (type == IMG_REC_RAW) ? (payloadLen + USB_CHUNK - 1) / USB_CHUNK : 1;
+}
+
+/* Whether the range [addr, addr + len) overlaps a boot firmware scratch buffer. */
+int
+InScratchArea (
+        unsigned int addr,
+        unsigned int len)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        if ((addr < ScratchAreas[i] + SCRATCH_SIZE) && (addr + len > ScratchAreas[i]))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Warn about data loaded into a boot firmware scratch buffer. The second stage boot firmware
+   passes USB data, ITCM data and LZ4 blocks through it, which can overwrite data loaded there
+   earlier. */
+void
+CheckScratchArea (
+        unsigned int addr,
+        unsigned int len)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        if ((addr < ScratchAreas[i] + SCRATCH_SIZE) && (addr + len > ScratchAreas[i]))
+        {
+            printf ("Warning: The section starting at address 0x%08x overlaps the boot firmware scratch\n", addr);
+            printf ("         buffer at 0x%08x on %s parts. It may not load correctly through\n",
+                    ScratchAreas[i], ScratchParts[i]);
+            printf ("         the second stage boot firmware.\n");
+        }
+    }
+}
+
+/* Write words of data that contain no long zero runs: LZ4 blocks where they pay for their
+   header, raw records split at i2cDevSize otherwise. */
+int
+WritePackedData (
+        FILE         *fpImg,
+        unsigned int *data,
+        unsigned int  addr,
+        unsigned int  words)
+{
+    unsigned char packed[IMG_LZ4_BLOCK_SIZE];
+    unsigned char check[IMG_LZ4_BLOCK_SIZE];
+    unsigned int  rawStart = 0, rawWords = 0;
+    unsigned int  pos, blk;
+    int           n;
+
+    for (pos = 0; pos < words; pos += blk)
+    {
+        blk = words - pos;
+        if (blk > IMG_LZ4_BLOCK_SIZE / 4)
+            blk = IMG_LZ4_BLOCK_SIZE / 4;
+
+        n = -1;
+        if ((addr + pos * 4 >= VECTOR_AREA_END) && !InScratchArea (addr + pos * 4, blk * 4))
+            n = Lz4Compress ((unsigned char *)(data + pos), blk * 4, packed,
+                    blk * 4 - IMG_REC_HDR_SIZE - 4);
+
+        if (n > 0)
+        {
+            if (imgUnpackLz4 (packed, n, check, sizeof (check)) != (int)(blk * 4) ||
+                    memcmp (check, data + pos, blk * 4) != 0)
+                ERREXIT ("Internal error: LZ4 block at 0x%08x does not expand back\n", addr + pos * 4);
+
+            if (rawWords)
+                WritePackedRecord (fpImg, IMG_REC_RAW, addr + rawStart * 4, rawWords,
+                        (unsigned char *)(data + rawStart), rawWords * 4);
+            rawWords = 0;
+            WritePackedRecord (fpImg, IMG_REC_LZ4, addr + pos * 4, blk, packed, n);
+            continue;
+        }
+
+        /* Extend the pending raw record, flushing it when it reaches the maximum size. */
+        if (rawWords == 0)
+            rawStart = pos;
+        rawWords += blk;
+        while (rawWords >= i2cDevSize)
+        {
+            WritePackedRecord (fpImg, IMG_REC_RAW, addr + rawStart * 4, i2cDevSize,
+                    (unsigned char *)(data + rawStart), i2cDevSize * 4);
+            rawStart += i2cDevSize;
+            rawWords -= i2cDevSize;
+        }
+    }
+
+    if (rawWords)
+        WritePackedRecord (fpImg, IMG_REC_RAW, addr + rawStart * 4, rawWords,
+                (unsigned char *)(data + rawStart), rawWords * 4);
+
+    return 0;
+}
+
+/* Write memSz words of data to be loaded at secStart as packed image records. */
+int
+WritePackedBuffer (
+        FILE         *fpImg,
+        unsigned int *data,
+        unsigned int  secStart,
+        unsigned int  memSz)
+{
+    unsigned int pos, end, run;
+
+    for (pos = 0; pos < memSz; pos = end)
+    {
+        /* Long zero runs become zero-fill records. */
+        for (run = 0; (pos + run < memSz) && (data[pos + run] == 0); run++)
+            ;
+        if (run >= ZERO_RUN_MIN)
+        {
+            WritePackedRecord (fpImg, IMG_REC_ZERO, secStart + pos * 4, run, NULL, 0);
+            end = pos + run;
+            continue;
+        }
+
+        /* Everything else up to the next long zero run is data. */
+        for (end = pos + run; end < memSz; end += run)
+        {
+            for (run = 0; (end + run < memSz) && (data[end + run] == 0); run++)
+                ;
+            if (run >= ZERO_RUN_MIN)
+                break;
+            if (run == 0)
+                run = 1;
+        }
+
+        if (WritePackedData (fpImg, data + pos, secStart + pos * 4, end - pos) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Write a loadable segment of memSz words, the first fileSz of which are at offset in the ELF
+   file, as packed image records. */
+int
+WritePackedSegment (
+        FILE         *fpElf,
+        FILE         *fpImg,
+        unsigned int  secStart,
+        unsigned int  memSz,
+        unsigned int  fileSz,
+        unsigned int  offset)
+{
+    unsigned int *data;
+    unsigned int  i;
+    int           stat;
+
+    data = (unsigned int *)calloc (memSz, 4);
+    if (data == NULL)
+        ERREXIT ("Out of memory\n");
+
+    fseek (fpElf, offset, SEEK_SET);
+    if (fread (data, 4, fileSz, fpElf) != fileSz)
+    {
+        free (data);
+        ERREXIT ("Failed to read segment at 0x%08x\n", secStart);
+    }
+    for (i = 0; i < fileSz; i++)
+        checksum += data[i];
+    loadBytes += memSz * 4;
+
+    stat = WritePackedBuffer (fpImg, data, secStart, memSz);
+    free (data);
+    return stat;
+}
+
+/* Write memSz words of data to be loaded at secStart as normal image records, split at the
+   EEPROM device size. */
+void
+WriteRawBuffer (
+        FILE         *fpImg,
+        unsigned int *data,
+        unsigned int  secStart,
+        unsigned int  memSz)
+{
+    unsigned int loadSz;
+
+    while (memSz)
+    {
+        loadSz = (memSz > i2cDevSize) ? i2cDevSize : memSz;
+
+        if (verbose)
+        {
+            fprintf (stderr, "\tRecord: Addr=0x%08x Size(words)=0x%08x\n", secStart, loadSz);
+        }
+
+        fwrite (&loadSz,   4, 1, fpImg);
+        fwrite (&secStart, 4, 1, fpImg);
+        fwrite (data, 4, loadSz, fpImg);
+
+        imgRecords++;
+        imgBytes    += 8 + loadSz * 4;
+        usbRequests += (loadSz * 4 + USB_CHUNK - 1) / USB_CHUNK;
+
+        data     += loadSz;
+        secStart += loadSz * 4;
+        memSz    -= loadSz;
+    }
+}
+
 int
 ProcessProgHeader (
         FILE          *fpElf,
@@ -191,7 +497,12 @@ ProcessProgHeader (
                 }
             }
 
+            CheckScratchArea (secStart, memSz * 4);
+
             offset = progHdr->offset;
+            if (packImage)
+                return WritePackedSegment (fpElf, fpImg, secStart, memSz, fileSz, offset);
+
             fseek (fpElf, offset, SEEK_SET);
 
             while (memSz)
@@ -208,7 +519,11 @@ ProcessProgHeader (
                 }
 
                 if (loadSz > fileSz)
+                {
+                    /* The rest of the segment is zero-filled (.bss). */
                     validSz = fileSz;
+                    fileSz  = 0;
+                }
                 else
                 {
                     validSz = loadSz;
@@ -227,6 +542,11 @@ ProcessProgHeader (
                 secStart += (loadSz * 4);
                 offset   += (loadSz * 4);
 
+                imgRecords++;
+                imgBytes    += 8 + loadSz * 4;
+                usbRequests += (loadSz * 4 + USB_CHUNK - 1) / USB_CHUNK;
+                loadBytes   += loadSz * 4;
+
                 /* Read and copy the segment contents. */
                 while (loadSz)
                 {
@@ -268,6 +588,270 @@ ProcessProgHeader (
     return 0;
 }
 
+/* Map the whole input file into memory. The file is read into a buffer where mmap is not
+   available. */
+unsigned char *
+MapElfFile (
+        const char   *filename,
+        unsigned int *size)
+{
+    unsigned char *image;
+#ifndef _WIN32
+    struct stat st;
+    int         fd;
+
+    fd = open (filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if ((fstat (fd, &st) != 0) || (st.st_size == 0))
+    {
+        close (fd);
+        return NULL;
+    }
+
+    image = (unsigned char *)mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (image == (unsigned char *)MAP_FAILED)
+        return NULL;
+    *size = (unsigned int)st.st_size;
+#else
+    FILE *fp;
+    long  len;
+
+    fp = fopen (filename, "rb");
+    if (fp == NULL)
+        return NULL;
+    fseek (fp, 0, SEEK_END);
+    len = ftell (fp);
+    fseek (fp, 0, SEEK_SET);
+
+    image = (len > 0) ? (unsigned char *)malloc (len) : NULL;
+    if ((image != NULL) && (fread (image, 1, len, fp) != (size_t)len))
+    {
+        free (image);
+        image = NULL;
+    }
+    fclose (fp);
+    *size = (unsigned int)len;
+#endif
+
+    return image;
+}
+
+void
+UnmapElfFile (
+        unsigned char *image,
+        unsigned int   size)
+{
+#ifndef _WIN32
+    munmap (image, size);
+#else
+    free (image);
+#endif
+}
+
+int
+CompareRegions (
+        const void *a,
+        const void *b)
+{
+    const LoadRegion *ra = (const LoadRegion *)a;
+    const LoadRegion *rb = (const LoadRegion *)b;
+
+    if (ra->addr == rb->addr)
+        return 0;
+    return (ra->addr < rb->addr) ? -1 : 1;
+}
+
+/* Data rate of a boot source in bytes per microsecond. */
+double
+BootSourceRate (
+        int           bootSrc,
+        unsigned char i2cConf)
+{
+    switch (bootSrc)
+    {
+        case BOOT_USB:
+            return USB_BYTES_US;
+        case BOOT_SPI:
+            return SpiClocks[(i2cConf >> 4) & 3] / 8;
+        default:
+            return I2cClocks[(i2cConf >> 4) & 3] / 9;
+    }
+}
+
+/* Time in microseconds that a boot source spends on each record, besides reading its data. */
+double
+RecordOverhead (
+        int           bootSrc,
+        unsigned char i2cConf)
+{
+    switch (bootSrc)
+    {
+        case BOOT_USB:
+            return USB_REQ_US;
+        case BOOT_SPI:
+            return SPI_REC_US;
+        default:
+            return I2C_REC_BYTES / BootSourceRate (BOOT_I2C, i2cConf);
+    }
+}
+
+/* Largest gap in bytes that is cheaper to load as padding than to skip with a new record. */
+unsigned int
+MergeThreshold (
+        int           bootSrc,
+        unsigned char i2cConf)
+{
+    return (unsigned int)(RecordOverhead (bootSrc, i2cConf) * BootSourceRate (bootSrc, i2cConf)) + 8;
+}
+
+/* Estimated load time of the image written so far, in microseconds. */
+double
+EstimateLoadTime (
+        int           bootSrc,
+        unsigned char i2cConf)
+{
+    double rate = BootSourceRate (bootSrc, i2cConf);
+
+    if (bootSrc == BOOT_USB)
+        return usbRequests * USB_REQ_US + imgBytes / rate;
+
+    return imgRecords * RecordOverhead (bootSrc, i2cConf) + (imgBytes + 16) / rate;
+}
+
+void
+PrintLoadReport (
+        int           bootSrc,
+        unsigned char i2cConf)
+{
+    int i;
+
+    printf ("Image: %d records, %d bytes for %d bytes of memory\n", imgRecords, imgBytes + 16, loadBytes);
+    printf ("Estimated load time:\n");
+    for (i = 0; i < BOOT_SOURCES; i++)
+    {
+        printf ("    %s %-8s %4d %-9s %10.1f ms\n", (i == bootSrc) ? "*" : " ", BootSourceNames[i],
+                (i == BOOT_USB) ? usbRequests : imgRecords, (i == BOOT_USB) ? "requests" : "records",
+                EstimateLoadTime (i, i2cConf) / 1000);
+    }
+}
+
+/* Write the loadable segments of a memory mapped ELF file, merging segments that are separated by
+   gaps cheaper to load than a new record on the selected boot source. */
+int
+WriteOptimizedImage (
+        unsigned char *image,
+        unsigned int   imageSize,
+        ElfHeader     *elfHdr,
+        FILE          *fpImg,
+        int            bootSrc,
+        unsigned char  i2cConf)
+{
+    LoadRegion     regions[MAX_REGIONS];
+    ProgramHeader *progHdr;
+    unsigned int  *data;
+    unsigned int   count = 0, threshold, start, end, skip, i, j, k;
+    int            stat = 0;
+
+    /* Collect the loadable segments, less the interrupt vector area. */
+    for (i = 0; i < elfHdr->phnum; i++)
+    {
+        if ((elfHdr->phoff + (i + 1) * elfHdr->phentsize) > imageSize)
+            ERREXIT ("Program header %d is outside the file\n", i);
+
+        progHdr = (ProgramHeader *)(image + elfHdr->phoff + i * elfHdr->phentsize);
+        if (progHdr->type != PT_LOAD)
+        {
+            if (verbose)
+                fprintf (stderr, "Skipping program header with type %d\n", progHdr->type);
+            continue;
+        }
+        if (progHdr->memsize == 0)
+            continue;
+
+        if (((progHdr->memsize & 0x03) != 0) || ((progHdr->filesize & 0x03) != 0) || ((progHdr->vaddr & 0x03) != 0))
+        {
+            printf ("Warning: Size of the section starting at address 0x%08x is a non-multiple of 4 bytes.\n",
+                    progHdr->vaddr);
+            printf ("         Please verify the settings in your linker script.\n");
+        }
+        if (count == MAX_REGIONS)
+            ERREXIT ("Too many loadable segments\n");
+        if ((progHdr->filesize > imageSize) || (progHdr->offset > imageSize - progHdr->filesize))
+            ERREXIT ("Segment at 0x%08x is outside the file\n", progHdr->vaddr);
+
+        regions[count].addr     = progHdr->vaddr;
+        regions[count].memsize  = (progHdr->memsize + 3) & ~3;
+        regions[count].filesize = progHdr->filesize;
+        regions[count].offset   = progHdr->offset;
+
+        if ((regions[count].addr < CY_INTVECTOR_AREA_SIZE) && (loadIntVectors == 0))
+        {
+            skip = CY_INTVECTOR_AREA_SIZE - regions[count].addr;
+            printf ("Note: %d bytes of interrupt vector code have been removed from the image.\n", skip);
+            printf ("      Use the \"-vectorload yes\" option to retain this code.\n\n");
+
+            /* As in ProcessProgHeader, a segment without data past the vectors is dropped. */
+            if (((regions[count].filesize + 3) & ~3) <= skip)
+                continue;
+
+            regions[count].addr      = CY_INTVECTOR_AREA_SIZE;
+            regions[count].memsize  -= skip;
+            regions[count].filesize -= skip;
+            regions[count].offset   += skip;
+        }
+        CheckScratchArea (regions[count].addr, regions[count].memsize);
+        count++;
+    }
+
+    qsort (regions, count, sizeof (LoadRegion), CompareRegions);
+    threshold = MergeThreshold (bootSrc, i2cConf);
+
+    for (i = 0; i < count; i = j)
+    {
+        /* Extend the record over the following segments while the gaps are small enough. */
+        start = regions[i].addr;
+        end   = start + regions[i].memsize;
+        for (j = i + 1; j < count; j++)
+        {
+            if ((regions[j].addr < end) || ((regions[j].addr - end) > threshold))
+                break;
+
+            if (verbose)
+            {
+                fprintf (stderr, "Merging segment at 0x%08x into record at 0x%08x (%d byte gap)\n",
+                        regions[j].addr, start, regions[j].addr - end);
+            }
+            end = regions[j].addr + regions[j].memsize;
+        }
+
+        data = (unsigned int *)calloc ((end - start) / 4, 4);
+        if (data == NULL)
+            ERREXIT ("Out of memory\n");
+
+        for (k = i; k < j; k++)
+        {
+            memcpy ((unsigned char *)data + (regions[k].addr - start), image + regions[k].offset,
+                    regions[k].filesize);
+        }
+        for (k = 0; k < (end - start) / 4; k++)
+            checksum += data[k];
+        loadBytes += end - start;
+
+        if (packImage)
+            stat = WritePackedBuffer (fpImg, data, start, (end - start) / 4);
+        else
+            WriteRawBuffer (fpImg, data, start, (end - start) / 4);
+
+        free (data);
+        if (stat)
+            return stat;
+    }
+
+    return 0;
+}
+
 /* Function to retrieve parameter values from command line arguments. */
 int
 GetParameter (
@@ -302,13 +886,17 @@ PrintUsageInfo (
 {
     printf ("Usage:\n______\n");
     printf ("%s -i <elf filename> -o <image filename> [-i2cconf <eeprom control>]\n", progName);
-    printf ("        [-imgtype <image type>] [-vectorload <vecload>] [-v] [-h]\n");
+    printf ("        [-imgtype <image type>] [-vectorload <vecload>] [-compress]\n");
+    printf ("        [-optimize] [-bootsrc <boot source>] [-v] [-h]\n");
     printf ("    where\n");
     printf ("    <elf filename> is the input ELF file name with path\n");
     printf ("    <image filename> is the output file name with path\n");
     printf ("    <eeprom control> is the I2C/SPI EEPROM control word in hexadecimal form\n");
     printf ("    <image type> is the image type byte in hexadecimal\n");
     printf ("    <vecload> can be set to \"yes\" to force the interrupt vectors to be exported into the image\n");
+    printf ("    -compress writes a packed image with zero-fill and LZ4 records, for the boot firmware\n");
+    printf ("    -optimize merges nearby segments and prints the estimated load time of the image\n");
+    printf ("    <boot source> is usb, spi or i2c, the boot source -optimize tunes the image for (default spi)\n");
     printf ("    -v is used for verbose logs during the conversion process\n");
     printf ("    -h is used to print this help information\n");
 }
@@ -327,8 +915,12 @@ main (
     unsigned char i2cConf = 0x1C;        /* Default value of I2C config: 64 KB+ Atmel EEPROM at 400 KHz. */
     unsigned char imgType = 0xB0;        /* Default value of image type: Binary. */
 
+    unsigned char *image;
+    unsigned int   imageSize;
+
     unsigned int val, entryAddr;
     int i, stat = 0;
+    int optimize = 0, bootSrc = BOOT_SPI;
 
     /* Parse and check the command line arguments. */
     GetParameter (argc, argv, "-i", &inFilename);
@@ -346,6 +938,23 @@ main (
     }
     if (GetParameter (argc, argv, "-v", 0) == 0)
         verbose = 1;
+    if (GetParameter (argc, argv, "-compress", 0) == 0)
+    {
+        packImage = 1;
+        imgType   = IMG_TYPE_PACKED;
+    }
+    if (GetParameter (argc, argv, "-optimize", 0) == 0)
+        optimize = 1;
+    if (GetParameter (argc, argv, "-bootsrc", &tmp) == 0)
+    {
+        for (bootSrc = 0; bootSrc < BOOT_SOURCES; bootSrc++)
+        {
+            if (strcmp (tmp, BootSourceNames[bootSrc]) == 0)
+                break;
+        }
+        if (bootSrc == BOOT_SOURCES)
+            ERREXIT ("Unknown boot source %s\n", tmp);
+    }
     if (GetParameter (argc, argv, "-vectorload", &tmp) == 0)
     {
         if (strcmp (tmp, "yes") == 0)
@@ -387,15 +996,30 @@ main (
     /* Write the image header to the output file. */
     fprintf (fpOut, "CY%c%c", i2cConf, imgType);
 
-    /* Read each program header and process. */
-    for (i = 0; i < elfHdr.phnum; i++)
+    if (optimize)
     {
-        fseek (fpIn, (elfHdr.phoff + i * elfHdr.phentsize), SEEK_SET);
-        if (fread (&progHdr, sizeof (ProgramHeader), 1, fpIn) == 1)
+        /* Work on the mapped file, so that segments can be merged without reading them twice. */
+        image = MapElfFile (inFilename, &imageSize);
+        if (image == NULL)
+            ERREXIT ("Failed to map file %s\n", inFilename);
+
+        stat = WriteOptimizedImage (image, imageSize, &elfHdr, fpOut, bootSrc, i2cConf);
+        UnmapElfFile (image, imageSize);
+        if (stat)
+            ERREXIT ("Failed in WriteOptimizedImage\n");
+    }
+    else
+    {
+        /* Read each program header and process. */
+        for (i = 0; i < elfHdr.phnum; i++)
         {
-            stat = ProcessProgHeader (fpIn, &progHdr, fpOut);
-            if (stat)
-                ERREXIT ("Failed in ProcessProgHeader\n");
+            fseek (fpIn, (elfHdr.phoff + i * elfHdr.phentsize), SEEK_SET);
+            if (fread (&progHdr, sizeof (ProgramHeader), 1, fpIn) == 1)
+            {
+                stat = ProcessProgHeader (fpIn, &progHdr, fpOut);
+                if (stat)
+                    ERREXIT ("Failed in ProcessProgHeader\n");
+            }
         }
     }
 
@@ -408,6 +1032,14 @@ main (
     fwrite (&entryAddr, 4, 1, fpOut);
     fwrite (&checksum,  4, 1, fpOut);
 
+    if (optimize)
+        PrintLoadReport (bootSrc, i2cConf);
+    else if (packImage)
+    {
+        printf ("Packed image: %d records, %d bytes for %d bytes of memory\n",
+                imgRecords, imgBytes + 16, loadBytes);
+    }
+
     fclose (fpOut);
     fclose (fpIn);
 
@@ -0,0 +1,127 @@
+/*
+## ===========================
+##
+##  Copyright Cypress Semiconductor Corporation, 2010-2011,
+##  All Rights Reserved
+##  UNPUBLISHED, LICENSED SOFTWARE.
+##
+##  CONFIDENTIAL AND PROPRIETARY INFORMATION
+##  WHICH IS THE PROPERTY OF CYPRESS.
+##
+##  Use of this file is governed
+##  by the license agreement included in the file
+##
+##     <install>/license/license.txt
+##
+##  where <install> is the Cypress software
+##  installation root directory path.
+##
+## ===========================
+ */
+
+/* Summary
+   LZ4 block encoder for packed boot images. See lz4_pack.h.
+ */
+
+#include <string.h>
+
+#include "lz4_pack.h"
+
+/* LZ4 match finder parameters. */
+#define LZ4_HASH_BITS   (12)
+#define LZ4_MIN_MATCH   (4)
+#define LZ4_MAX_OFFSET  (65535)
+#define LZ4_LAST_LITS   (5)             /* The last 5 bytes of a block are always literals. */
+#define LZ4_MF_LIMIT    (12)            /* No match starts in the last 12 bytes of a block. */
+
+/* Compress len bytes of src as a single LZ4 block. Returns the compressed size, or -1 if it
+   does not fit in dstCap bytes. */
+int
+Lz4Compress (
+        const unsigned char *src,
+        int                  len,
+        unsigned char       *dst,
+        int                  dstCap)
+{
+    int table[1 << LZ4_HASH_BITS];
+    int ip = 0, anchor = 0, ref, mlen, n, op = 0;
+    unsigned int seq, h;
+    unsigned char *token;
+
+    for (n = 0; n < (1 << LZ4_HASH_BITS); n++)
+        table[n] = -1;
+
+    while (ip < len - LZ4_MF_LIMIT)
+    {
+        memcpy (&seq, src + ip, 4);
+        h        = (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+        ref      = table[h];
+        table[h] = ip;
+
+        if ((ref < 0) || (ip - ref > LZ4_MAX_OFFSET) || (memcmp (src + ref, src + ip, 4) != 0))
+        {
+            ip++;
+            continue;
+        }
+
+        mlen = LZ4_MIN_MATCH;
+        while ((ip + mlen < len - LZ4_LAST_LITS) && (src[ref + mlen] == src[ip + mlen]))
+            mlen++;
+
+        /* Token, literal length, literals, offset and match length; worst case size. */
+        n = ip - anchor;
+        if (op + 1 + n / 255 + 1 + n + 2 + (mlen - LZ4_MIN_MATCH) / 255 + 1 > dstCap)
+            return -1;
+
+        token = dst + op++;
+        if (n >= 15)
+        {
+            *token = 15 << 4;
+            for (n -= 15; n >= 255; n -= 255)
+                dst[op++] = 255;
+            dst[op++] = n;
+        }
+        else
+            *token = n << 4;
+        memcpy (dst + op, src + anchor, ip - anchor);
+        op += ip - anchor;
+
+        dst[op++] = (ip - ref) & 0xFF;
+        dst[op++] = (ip - ref) >> 8;
+
+        n = mlen - LZ4_MIN_MATCH;
+        if (n >= 15)
+        {
+            *token |= 15;
+            for (n -= 15; n >= 255; n -= 255)
+                dst[op++] = 255;
+            dst[op++] = n;
+        }
+        else
+            *token |= n;
+
+        ip    += mlen;
+        anchor = ip;
+    }
+
+    /* The block ends with a sequence of literals only. */
+    n = len - anchor;
+    if (op + 1 + n / 255 + 1 + n > dstCap)
+        return -1;
+    token = dst + op++;
+    if (n >= 15)
+    {
+        *token = 15 << 4;
+        for (n -= 15; n >= 255; n -= 255)
+            dst[op++] = 255;
+        dst[op++] = n;
+    }
+    else
+        *token = n << 4;
+    memcpy (dst + op, src + anchor, len - anchor);
+    op += len - anchor;
+
+    return op;
+}
+
+/*[]*/
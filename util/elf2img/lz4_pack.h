@@ -0,0 +1,46 @@
+/*
+## ===========================
+##
+##  Copyright Cypress Semiconductor Corporation, 2010-2011,
+##  All Rights Reserved
+##  UNPUBLISHED, LICENSED SOFTWARE.
+##
+##  CONFIDENTIAL AND PROPRIETARY INFORMATION
+##  WHICH IS THE PROPERTY OF CYPRESS.
+##
+##  Use of this file is governed
+##  by the license agreement included in the file
+##
+##     <install>/license/license.txt
+##
+##  where <install> is the Cypress software
+##  installation root directory path.
+##
+## ===========================
+ */
+
+#ifndef _INCLUDED_LZ4_PACK_H_
+#define _INCLUDED_LZ4_PACK_H_
+
+/* Summary
+   LZ4 block encoder used by elf2img for the LZ4 records of packed images.
+
+   Description
+   The encoder is kept apart from elf2img.c so that the host test of the boot firmware
+   decoder (firmware/boot_fw/test/img_unpack_test.c) checks the data this utility writes.
+   Blocks follow the end of block rules of the LZ4 format: the last five bytes are literals
+   and no match starts in the last 12 bytes.
+ */
+
+/* Compress len bytes of src as a single LZ4 block. Returns the compressed size, or -1 if it
+   does not fit in dstCap bytes. */
+extern int
+Lz4Compress (
+        const unsigned char *src,
+        int                  len,
+        unsigned char       *dst,
+        int                  dstCap);
+
+#endif /* _INCLUDED_LZ4_PACK_H_ */
+
+/*[]*/
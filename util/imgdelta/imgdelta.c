@@ -0,0 +1,300 @@
+/*
+## ===========================
+##
+##  Copyright Cypress Semiconductor Corporation, 2010-2011,
+##  All Rights Reserved
+##  UNPUBLISHED, LICENSED SOFTWARE.
+##
+##  CONFIDENTIAL AND PROPRIETARY INFORMATION
+##  WHICH IS THE PROPERTY OF CYPRESS.
+##
+##  Use of this file is governed
+##  by the license agreement included in the file
+##
+##     <install>/license/license.txt
+##
+##  where <install> is the Cypress software
+##  installation root directory path.
+##
+## ===========================
+ */
+
+/* Summary
+   Program to compute a block level delta between two boot images, to be applied to the SPI
+   flash by the USB flash programmer (cyfxflashprog).
+   Invoke "imgdelta -h" for usage syntax.
+
+   Note
+   This program currently works only on little endian architectures.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The delta format is shared with the flash programmer that applies it. */
+#include "../../firmware/basic_examples/cyfxflashprog/cyfxdelta.h"
+
+#define ERREXIT(...)                                    \
+{                                                       \
+    fprintf (stderr, __VA_ARGS__);                      \
+    return (-1);                                        \
+}
+
+/* Global variables. */
+int verbose = 0;
+
+/* CRC-32 as used by zlib. Computed the same way as in the flash programmer. */
+unsigned int
+Crc32 (
+        unsigned int         crc,
+        const unsigned char *buffer,
+        unsigned int         length)
+{
+    unsigned int i;
+
+    crc = ~crc;
+    while (length--)
+    {
+        crc ^= *buffer++;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+
+    return ~crc;
+}
+
+/* Read a whole boot image into memory. */
+unsigned char *
+ReadImage (
+        const char   *filename,
+        unsigned int *length)
+{
+    unsigned char *image;
+    FILE          *fp;
+    long           len;
+
+    fp = fopen (filename, "rb");
+    if (fp == NULL)
+    {
+        fprintf (stderr, "Failed to open file %s\n", filename);
+        return NULL;
+    }
+
+    fseek (fp, 0, SEEK_END);
+    len = ftell (fp);
+    fseek (fp, 0, SEEK_SET);
+
+    image = (len > 4) ? (unsigned char *)malloc (len) : NULL;
+    if ((image == NULL) || (fread (image, 1, len, fp) != (size_t)len))
+    {
+        fprintf (stderr, "Failed to read file %s\n", filename);
+        free (image);
+        fclose (fp);
+        return NULL;
+    }
+    fclose (fp);
+
+    if ((image[0] != 'C') || (image[1] != 'Y'))
+        printf ("Warning: %s does not start with 'CY' and may not be a boot image.\n", filename);
+
+    *length = (unsigned int)len;
+    return image;
+}
+
+/* Find an old block holding the first length bytes of data. Blocks in sectors before the one
+   being written cannot be used, as they have already been rewritten when the copy is done.
+   Returns the block index, or -1 if there is none. */
+int
+FindOldBlock (
+        const unsigned char *oldImg,
+        unsigned int         oldLen,
+        const unsigned int  *oldCrcs,
+        const unsigned char *data,
+        unsigned int         length,
+        unsigned int         minBlock)
+{
+    unsigned int crc = Crc32 (0, data, length);
+    unsigned int j;
+
+    for (j = minBlock; (j + 1) * CY_FX_DELTA_BLOCK_SIZE <= oldLen; j++)
+    {
+        if ((length == CY_FX_DELTA_BLOCK_SIZE) && (oldCrcs[j] != crc))
+            continue;
+        if (memcmp (oldImg + j * CY_FX_DELTA_BLOCK_SIZE, data, length) == 0)
+            return (int)j;
+    }
+
+    return -1;
+}
+
+/* Function to retrieve parameter values from command line arguments. */
+int
+GetParameter (
+        int    argc,
+        char  *argv[],
+        char  *option,
+        char **parameter)
+{
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp (argv[i], option) == 0)
+        {
+            if (parameter)
+            {
+                if ((argc > (i + 1)) && (*argv[i + 1] != '-'))
+                    *parameter = argv[i + 1];
+                else
+                    return -1;
+            }
+            return 0;   /* Option found. Parameter is returned alongside. */
+        }
+    }
+
+    return -1;          /* Option not found. */
+}
+
+void
+PrintUsageInfo (
+        char *progName)
+{
+    printf ("Usage:\n______\n");
+    printf ("%s -old <image filename> -new <image filename> -o <delta filename> [-v] [-h]\n", progName);
+    printf ("    where\n");
+    printf ("    -old gives the image currently programmed on the SPI flash\n");
+    printf ("    -new gives the image to update the SPI flash to\n");
+    printf ("    <delta filename> is the output file name with path\n");
+    printf ("    -v is used for verbose logs\n");
+    printf ("    -h is used to print this help information\n");
+}
+
+int
+main (
+        int   argc,
+        char *argv[])
+{
+    char *oldFilename = NULL, *newFilename = NULL, *outFilename = NULL;
+    FILE *fpOut;
+
+    unsigned char     *oldImg, *newImg;
+    unsigned char      block[CY_FX_DELTA_BLOCK_SIZE];
+    unsigned int      *oldCrcs;
+    unsigned int       oldLen, newLen, nBlocks, len, i;
+    unsigned int       dataOps = 0, copyOps = 0, deltaBytes;
+    CyFxDeltaHeader_t  hdr;
+    CyFxDeltaOp_t      op;
+    int                src;
+
+    /* Parse and check the command line arguments. */
+    GetParameter (argc, argv, "-old", &oldFilename);
+    GetParameter (argc, argv, "-new", &newFilename);
+    GetParameter (argc, argv, "-o", &outFilename);
+    if (GetParameter (argc, argv, "-v", 0) == 0)
+        verbose = 1;
+    if (GetParameter (argc, argv, "-h", 0) == 0)
+    {
+        PrintUsageInfo (argv[0]);
+        return (0);
+    }
+
+    if ((oldFilename == NULL) || (newFilename == NULL) || (outFilename == NULL))
+    {
+        PrintUsageInfo (argv[0]);
+        ERREXIT ("Input or output file not specified\n");
+    }
+
+    oldImg = ReadImage (oldFilename, &oldLen);
+    newImg = ReadImage (newFilename, &newLen);
+    if ((oldImg == NULL) || (newImg == NULL))
+        return (-1);
+
+    nBlocks = (newLen + CY_FX_DELTA_BLOCK_SIZE - 1) / CY_FX_DELTA_BLOCK_SIZE;
+    if (nBlocks > 0x10000)
+        ERREXIT ("Image %s is too large\n", newFilename);
+
+    oldCrcs = (unsigned int *)malloc ((oldLen / CY_FX_DELTA_BLOCK_SIZE + 1) * sizeof (unsigned int));
+    if (oldCrcs == NULL)
+        ERREXIT ("Out of memory\n");
+    for (i = 0; (i + 1) * CY_FX_DELTA_BLOCK_SIZE <= oldLen; i++)
+        oldCrcs[i] = Crc32 (0, oldImg + i * CY_FX_DELTA_BLOCK_SIZE, CY_FX_DELTA_BLOCK_SIZE);
+
+    fpOut = fopen (outFilename, "wb");
+    if (fpOut == NULL)
+        ERREXIT ("Failed to open output file %s\n", outFilename);
+
+    memset (&hdr, 0, sizeof (hdr));
+    hdr.magic     = CY_FX_DELTA_MAGIC;
+    hdr.version   = CY_FX_DELTA_VERSION;
+    hdr.blockSize = CY_FX_DELTA_BLOCK_SIZE;
+    hdr.oldLen    = oldLen;
+    hdr.oldCrc    = Crc32 (0, oldImg, oldLen);
+    hdr.newLen    = newLen;
+    hdr.newCrc    = Crc32 (0, newImg, newLen);
+
+    /* The header is written again once the operations have been counted. */
+    fwrite (&hdr, sizeof (hdr), 1, fpOut);
+
+    for (i = 0; i < nBlocks; i++)
+    {
+        len = newLen - i * CY_FX_DELTA_BLOCK_SIZE;
+        if (len > CY_FX_DELTA_BLOCK_SIZE)
+            len = CY_FX_DELTA_BLOCK_SIZE;
+
+        /* Only the bytes that belong to the image matter, the rest of the block is erased flash. */
+        memset (block, 0xFF, sizeof (block));
+        memcpy (block, newImg + i * CY_FX_DELTA_BLOCK_SIZE, len);
+
+        if (((i * CY_FX_DELTA_BLOCK_SIZE + len) <= oldLen) &&
+                (memcmp (oldImg + i * CY_FX_DELTA_BLOCK_SIZE, block, len) == 0))
+            continue;
+
+        op.block  = (unsigned short)i;
+        op.source = 0;
+        src = FindOldBlock (oldImg, oldLen, oldCrcs, block, len,
+                (i * CY_FX_DELTA_BLOCK_SIZE / CY_FX_DELTA_SECTOR_SIZE) *
+                (CY_FX_DELTA_SECTOR_SIZE / CY_FX_DELTA_BLOCK_SIZE));
+        if (src >= 0)
+        {
+            op.type   = CY_FX_DELTA_OP_COPY;
+            op.source = (unsigned int)src;
+            fwrite (&op, sizeof (op), 1, fpOut);
+            copyOps++;
+        }
+        else
+        {
+            op.type = CY_FX_DELTA_OP_DATA;
+            fwrite (&op, sizeof (op), 1, fpOut);
+            fwrite (block, 1, CY_FX_DELTA_BLOCK_SIZE, fpOut);
+            dataOps++;
+        }
+
+        if (verbose)
+        {
+            if (op.type == CY_FX_DELTA_OP_COPY)
+                fprintf (stderr, "\tBlock %4d: copy from block %d\n", i, op.source);
+            else
+                fprintf (stderr, "\tBlock %4d: data\n", i);
+        }
+    }
+
+    hdr.opCount = dataOps + copyOps;
+    fseek (fpOut, 0, SEEK_SET);
+    fwrite (&hdr, sizeof (hdr), 1, fpOut);
+    fclose (fpOut);
+
+    deltaBytes = sizeof (hdr) + hdr.opCount * sizeof (op) + dataOps * CY_FX_DELTA_BLOCK_SIZE;
+    printf ("Delta: %d of %d blocks changed (%d written, %d copied), %d bytes for a %d byte image\n",
+            hdr.opCount, nBlocks, dataOps, copyOps, deltaBytes, newLen);
+    printf ("Old image CRC 0x%08x, new image CRC 0x%08x\n", hdr.oldCrc, hdr.newCrc);
+
+    free (oldCrcs);
+    free (oldImg);
+    free (newImg);
+
+    return (0);
+}
+
+/*[]*/
+